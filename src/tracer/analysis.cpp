@@ -0,0 +1,444 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  analysis
+ *
+ *      The main use of this stuff is finding out which step of a build is the
+ *      one burning all of the CPU. The kernel gives us rusage for every one of
+ *      our tracees when they end (see Tracer::handle_wait_notification), but
+ *      those numbers include all of the children that the process reaped. So
+ *      a `make` at the top of the tree would look like the most expensive one
+ *      even though it barely did anything itself. We fix that up by taking off
+ *      the usage of every child that a process reaped.
+ */
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <stdexcept>
+#include <fmt/core.h>
+
+#include "analysis.hpp"
+#include "process.hpp"
+#include "util.hpp"
+#include "terminal.hpp"
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::map;
+using std::unordered_map;
+using std::pair;
+using fmt::format;
+
+Cost parse_cost(string_view str)
+{
+    if (str == "cpu")
+    {
+        return Cost::CPU;
+    }
+    else if (str == "rss")
+    {
+        return Cost::RSS;
+    }
+    else if (str == "io")
+    {
+        return Cost::IO;
+    }
+    else if (str == "csw")
+    {
+        return Cost::SWITCHES;
+    }
+    throw std::runtime_error(
+        format("Expected cpu, rss, io or csw, got \"{}\".", str));
+}
+
+/* Subtracts b from a, but stops at zero. The numbers given back by the kernel
+ * are sampled at slightly different times, so we could end up with a child
+ * that "used" a tiny bit more than its parent. */
+template<typename T>
+static T minus(T a, T b)
+{
+    return a > b ? a - b : 0;
+}
+
+ResourceUsage self_usage(const Process& process)
+{
+    ResourceUsage self = *process.usage();
+    for (size_t i = 0; i < process.event_count(); ++i)
+    {
+        auto reap = dynamic_cast<const ReapEvent*>(&process.event(i));
+        if (!reap || !reap->child->usage().has_value())
+        {
+            continue;
+        }
+        const ResourceUsage& child = *reap->child->usage();
+        self.userTime = minus(self.userTime, child.userTime);
+        self.systemTime = minus(self.systemTime, child.systemTime);
+        self.voluntarySwitches = minus(self.voluntarySwitches, 
+                                       child.voluntarySwitches);
+        self.involuntarySwitches = minus(self.involuntarySwitches, 
+                                         child.involuntarySwitches);
+        self.blocksIn = minus(self.blocksIn, child.blocksIn);
+        self.blocksOut = minus(self.blocksOut, child.blocksOut);
+    }
+    return self;
+}
+
+static uint64_t get_cost(const ResourceUsage& usage, Cost cost)
+{
+    switch (cost)
+    {
+        case Cost::CPU:         return usage.cpu_time();
+        case Cost::RSS:         return usage.maxRss;
+        case Cost::IO:          return usage.blocksIn + usage.blocksOut;
+        case Cost::SWITCHES:    return usage.voluntarySwitches 
+                                    + usage.involuntarySwitches;
+    }
+    assert(!"Unreachable");
+    return 0;
+}
+
+/* A row in one of the tables printed by print_top. For a process, `id` is the
+ * PID. For a program, it's the number of processes that ran the program. */
+struct Row
+{
+    long id;
+    string name;
+    ResourceUsage usage;
+};
+
+static void print_table(std::ostream& os,
+                        string_view title, 
+                        string_view idHeading,
+                        vector<Row>& rows, 
+                        Cost cost, 
+                        size_t count)
+{
+    std::stable_sort(rows.begin(), rows.end(), 
+        [cost](const Row& a, const Row& b) {
+            return get_cost(a.usage, cost) > get_cost(b.usage, cost);
+        }
+    );
+    os << colour(Colour::BOLD, format("{}:\n", title));
+    os << format("{:>7} {:>9} {:>9} {:>9} {:>8} {:>7} {:>7} {:>7} "
+        "{:>7}  {}\n", idHeading, "CPU", "USER", "SYS", "MAX RSS", "VCSW", 
+        "ICSW", "BLK IN", "BLK OUT", "COMMAND");
+    for (size_t i = 0; i < rows.size() && i < count; ++i)
+    {
+        const ResourceUsage& usage = rows[i].usage;
+        os << format("{:>7} {:>9} {:>9} {:>9} {:>8} {:>7} {:>7} {:>7} "
+            "{:>7}  {}\n", rows[i].id, format_duration(usage.cpu_time()),
+            format_duration(usage.userTime), 
+            format_duration(usage.systemTime),
+            format_kilobytes(usage.maxRss), usage.voluntarySwitches,
+            usage.involuntarySwitches, usage.blocksIn, usage.blocksOut,
+            rows[i].name);
+    }
+}
+
+void print_top(std::ostream& os, 
+               const vector<const Process*>& leaders, 
+               Cost cost, 
+               size_t count)
+{
+    vector<Row> processes;
+    map<string_view, Row> programs;
+    size_t unknown = 0;
+    Timestamp total = 0;
+
+    // Just a plain old depth-first search (with our own stack since some
+    // builds can end up with some pretty deep process trees).
+    vector<const Process*> stack(leaders.rbegin(), leaders.rend());
+    while (!stack.empty())
+    {
+        const Process& process = *stack.back();
+        stack.pop_back();
+        for (size_t i = process.event_count(); i-- > 0; )
+        {
+            auto fork = dynamic_cast<const ForkEvent*>(&process.event(i));
+            if (fork)
+            {
+                stack.push_back(fork->child.get());
+            }
+        }
+        if (!process.usage().has_value())
+        {
+            unknown++;
+            continue;
+        }
+
+        ResourceUsage usage = self_usage(process);
+        total += usage.cpu_time();
+        processes.push_back({process.pid(), process.command_line(), usage});
+
+        string_view program = get_base_name(process.program());
+        auto [it, inserted] = programs.try_emplace(
+            program, Row{0, string(program), ResourceUsage()});
+        Row& row = it->second;
+        row.id++;
+        row.usage.userTime += usage.userTime;
+        row.usage.systemTime += usage.systemTime;
+        row.usage.maxRss = std::max(row.usage.maxRss, usage.maxRss);
+        row.usage.voluntarySwitches += usage.voluntarySwitches;
+        row.usage.involuntarySwitches += usage.involuntarySwitches;
+        row.usage.blocksIn += usage.blocksIn;
+        row.usage.blocksOut += usage.blocksOut;
+    }
+
+    if (processes.empty())
+    {
+        os << "No processes have ended yet.\n";
+        return;
+    }
+    os << format("{} CPU used by {} processes", 
+        format_duration(total), processes.size());
+    if (unknown > 0)
+    {
+        os << format(" ({} still running or unknown)", unknown);
+    }
+    os << ".\n";
+
+    print_table(os, "Processes", "PID", processes, cost, count);
+    vector<Row> rows;
+    for (auto& [name, row] : programs)
+    {
+        rows.push_back(std::move(row));
+    }
+    print_table(os, "Programs", "COUNT", rows, cost, count);
+}
+
+/* Finds the index of the event where `parent` forked `child`, searching back
+ * from (and including) `index`. Returns -1 if it couldn't be found. */
+static int find_fork(const Process& parent, const Process& child, int index)
+{
+    for (int i = index; i >= 0; --i)
+    {
+        auto fork = dynamic_cast<const ForkEvent*>(&parent.event(i));
+        if (fork && fork->child.get() == &child)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Walks backwards through the events of the leader from its last one, and
+ * adds the steps of the critical path to `steps` (in reverse order). Whenever
+ * a process was waiting on a child that hadn't yet died, the child is what
+ * held things up, so we dive into it and then resume from the point where the
+ * child was forked. Fork chains can get really deep (e.g., a shell script
+ * that runs itself), so the processes that we're in the middle of go on our
+ * own stack rather than recursing. */
+static void walk_back(const Process& leader, 
+                      Timestamp until,
+                      vector<CriticalStep>& steps)
+{
+    /* A process that we're walking back through. `index` is the next event
+     * to look at, and `to` is when its current step ends. Once it's done,
+     * `slack` gets put on its first step (at index `first`). */
+    struct Frame
+    {
+        const Process* process;
+        int index;
+        Timestamp to;
+        size_t first;
+        Timestamp slack;
+        bool lost; // couldn't find where its parent forked it
+    };
+    vector<Frame> stack;
+    stack.push_back({&leader, int(leader.event_count()) - 1, until, 0, 0, 
+        false});
+    while (!stack.empty())
+    {
+        Frame& frame = stack.back();
+        const Process& process = *frame.process;
+        int i = frame.index;
+        const ReapEvent* reap = nullptr;
+        Timestamp died = 0;
+        for (; i >= 0 && !frame.lost; --i)
+        {
+            reap = dynamic_cast<const ReapEvent*>(&process.event(i));
+            if (!reap || reap->time > frame.to)
+            {
+                continue;
+            }
+            died = reap->child->death_event().time;
+            if (died > reap->wait->time && !reap->wait->nohang)
+            {
+                break; // we had to wait on it (it wasn't already dead)
+            }
+        }
+
+        if (i >= 0 && !frame.lost)
+        {
+            // Dive into the child, and come back here when it's done
+            if (frame.to > reap->time)
+            {
+                steps.push_back({&process, reap->time, frame.to, 0});
+            }
+            frame.index = i;
+            const Process& child = *reap->child.get();
+            stack.push_back({&child, int(child.event_count()) - 1, died,
+                steps.size(), reap->time - std::min(died, reap->time), 
+                false});
+            continue;
+        }
+
+        if (!frame.lost)
+        {
+            steps.push_back({&process, process.start_time(), frame.to, 0});
+        }
+        Frame done = frame;
+        stack.pop_back();
+        if (stack.empty())
+        {
+            break;
+        }
+        if (done.first < steps.size())
+        {
+            steps[done.first].slack = done.slack;
+        }
+        Frame& parent = stack.back();
+        parent.index = find_fork(*parent.process, *done.process, 
+            parent.index);
+        // (that shouldn't fail, since only a parent can reap its child)
+        parent.lost = parent.index < 0;
+        parent.to = std::min(parent.to, done.process->start_time());
+    }
+}
+
+vector<CriticalStep> find_critical_path(const Process& leader)
+{
+    Timestamp end = leader.start_time();
+    if (leader.event_count() > 0)
+    {
+        end = std::max(end, leader.event(leader.event_count() - 1).time);
+    }
+    vector<CriticalStep> steps;
+    walk_back(leader, end, steps);
+    std::reverse(steps.begin(), steps.end());
+    return steps;
+}
+
+/* Works out how much later each of the reaped processes in the tree could have
+ * ended without delaying the leader (going by the critical path). For a child
+ * of a process on the critical path, that's how long until its parent next
+ * needed to make progress on the critical path. For anything else, it's the
+ * parent's slack plus however long the parent took to reap the child. */
+static vector<pair<const Process*, Timestamp>> find_slack(
+    const Process& leader, const vector<CriticalStep>& path)
+{
+    unordered_map<const Process*, vector<pair<Timestamp, Timestamp>>> onPath;
+    for (const CriticalStep& step : path)
+    {
+        onPath[step.process].emplace_back(step.from, step.to);
+    }
+
+    vector<pair<const Process*, Timestamp>> result;
+    vector<pair<const Process*, Timestamp>> stack { {&leader, 0} };
+    while (!stack.empty())
+    {
+        auto [process, slack] = stack.back();
+        stack.pop_back();
+        auto segments = onPath.find(process);
+
+        for (size_t i = 0; i < process->event_count(); ++i)
+        {
+            auto reap = dynamic_cast<const ReapEvent*>(&process->event(i));
+            if (!reap)
+            {
+                continue;
+            }
+            const Process* child = reap->child.get();
+            Timestamp died = std::min(child->death_event().time, reap->time);
+            Timestamp childSlack;
+            if (onPath.count(child))
+            {
+                childSlack = 0; 
+            }
+            else if (segments != onPath.end())
+            {
+                // The parent is on the critical path, so find when it next
+                // had to get going again (the start of the next segment), or
+                // now if it's in the middle of a segment.
+                Timestamp bound = reap->time;
+                Timestamp next = ~Timestamp(0);
+                bool inside = false;
+                for (auto [from, to] : segments->second)
+                {
+                    inside |= from <= reap->time && reap->time <= to;
+                    if (from > reap->time)
+                    {
+                        next = std::min(next, from);
+                    }
+                }
+                if (!inside && next != ~Timestamp(0))
+                {
+                    bound = next;
+                }
+                childSlack = bound - died;
+            }
+            else
+            {
+                childSlack = slack + (reap->time - died);
+            }
+            if (!onPath.count(child))
+            {
+                result.emplace_back(child, childSlack);
+            }
+            stack.emplace_back(child, childSlack);
+        }
+    }
+    std::stable_sort(result.begin(), result.end(), 
+        [](auto& a, auto& b) { return a.second < b.second; });
+    return result;
+}
+
+void print_critical_path(std::ostream& os,
+                         const Process& leader, 
+                         const vector<CriticalStep>& path, 
+                         size_t count)
+{
+    if (path.empty())
+    {
+        return;
+    }
+    Timestamp start = leader.start_time();
+    Timestamp total = path.back().to - path.front().from;
+    if (!leader.dead())
+    {
+        os << "The leader hasn't ended yet, so this is only the "
+            "critical path so far.\n";
+    }
+    os << colour(Colour::BOLD, format("Critical path ({}):\n", 
+        format_duration(total)));
+    os << format("{:>10} {:>10} {:>10} {:>7}  {}\n", 
+        "START", "TIME", "SLACK", "PID", "COMMAND");
+    for (const CriticalStep& step : path)
+    {
+        os << format("{:>10} {:>10} {:>10} {:>7}  {}\n", 
+            "+" + format_duration(step.from - std::min(step.from, start)), 
+            format_duration(step.to - step.from), 
+            format_duration(step.slack), step.process->pid(), 
+            step.process->command_line());
+    }
+
+    auto slack = find_slack(leader, path);
+    if (slack.empty())
+    {
+        return;
+    }
+    os << colour(Colour::BOLD, "Off the critical path:\n");
+    os << format("{:>10} {:>7}  {}\n", "SLACK", "PID", "COMMAND");
+    for (size_t i = 0; i < slack.size() && i < count; ++i)
+    {
+        auto [process, time] = slack[i];
+        os << format("{:>10} {:>7}  {}\n", format_duration(time), 
+            process->pid(), process->command_line());
+    }
+    if (slack.size() > count)
+    {
+        os << format("(and {} more)\n", slack.size() - count);
+    }
+}
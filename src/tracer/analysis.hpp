@@ -0,0 +1,75 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  analysis
+ *
+ *      Number crunching over process trees, for when you want to know more
+ *      than just what happened (e.g., which process hogged all the CPU).
+ */
+#ifndef FORKTRACE_ANALYSIS_HPP
+#define FORKTRACE_ANALYSIS_HPP
+
+#include <vector>
+#include <string_view>
+#include <iostream>
+
+#include "system.hpp"
+
+class Process; // defined in process.hpp
+struct ResourceUsage; // defined in process.hpp
+
+/* The different things that print_top can rank processes by. */
+enum class Cost
+{
+    CPU,      // user + system CPU time
+    RSS,      // peak resident set size
+    IO,       // blocks read + blocks written
+    SWITCHES, // voluntary + involuntary context switches
+};
+
+/* Parses one of "cpu", "rss", "io" or "csw" into a Cost. Throws a
+ * runtime_error if the string is none of those. */
+Cost parse_cost(std::string_view str);
+
+/* Takes the usage of all of the children reaped by the process off of its own
+ * usage. The process must have a usage. Can't do anything about maxRss. */
+ResourceUsage self_usage(const Process& process);
+
+/* Prints out the `count` most expensive processes in the given trees,
+ * followed by the `count` most expensive programs (i.e., all of the processes
+ * running the same program lumped together). A process is only charged for
+ * its own usage, and not the usage of the children that it reaped. Processes
+ * that haven't ended yet get left out since we don't know their usage. */
+void print_top(std::ostream& os,
+               const std::vector<const Process*>& leaders, 
+               Cost cost, 
+               size_t count = 10);
+
+/* A stretch of time on the critical path during which `process` was the one
+ * holding everything up (i.e., it was running rather than waiting on one of
+ * its children). `slack` is how long the step's result sat around before its
+ * parent got to it, which is only ever non-zero for the last step of a child
+ * (the gap between it dying and the parent reaping it). */
+struct CriticalStep
+{
+    const Process* process;
+    Timestamp from;
+    Timestamp to;
+    Timestamp slack;
+};
+
+/* Finds the longest chain of dependencies (in wall-clock time) that ended with
+ * the leader ending, following the links between a parent and the children it
+ * forked and then waited on. The steps are returned in chronological order.
+ * If the leader is still alive, then this finds the path up until its most
+ * recent event. */
+std::vector<CriticalStep> find_critical_path(const Process& leader);
+
+/* Prints out the critical path found by find_critical_path, followed
+ * by the `count` processes off of the critical path with the least slack, i.e,
+ * the ones that would be the first to hold up the tree if they were slower. */
+void print_critical_path(std::ostream& os,
+                         const Process& leader, 
+                         const std::vector<CriticalStep>& path,
+                         size_t count = 10);
+
+#endif /* FORKTRACE_ANALYSIS_HPP */
@@ -7,6 +7,7 @@
 #include <signal.h>
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
 #include <unistd.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -34,6 +35,47 @@ static void read_line_sigint_handler(int sig)
     rl_redisplay();
 }
 
+/* See set_read_line_idle */
+static function<bool()> gIdlePoll;
+static function<void()> gIdleRun;
+
+/* Readline calls this (as rl_event_hook) every so often while it's waiting
+ * for a key to be pressed. */
+static int read_line_idle()
+{
+    if (!gIdlePoll || !gIdlePoll())
+    {
+        return 0;
+    }
+    // Clear the prompt's line, so that whatever gets printed goes there
+    // instead, and then put the prompt (and what was typed) back after it.
+    string typed(rl_line_buffer, rl_end);
+    int point = rl_point;
+    rl_save_prompt();
+    rl_replace_line("", 0);
+    rl_redisplay();
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    gIdleRun();
+    flush_log();
+    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+
+    rl_restore_prompt();
+    rl_replace_line(typed.c_str(), 0);
+    rl_point = point;
+    rl_forced_update_display();
+    return 0;
+}
+
+void set_read_line_idle(function<bool()> poll, function<void()> run)
+{
+    gIdlePoll = std::move(poll);
+    gIdleRun = std::move(run);
+}
+
 bool read_line(string_view prompt, string& line, bool complete)
 {
     if (complete)
@@ -59,6 +101,14 @@ bool read_line(string_view prompt, string& line, bool complete)
     sigaddset(&set, SIGINT);
     pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
 
+    // Get all the log messages out before the prompt goes up
+    flush_log();
+
+    // Readline never notices the end of a pipe once it has an event hook (it
+    // just keeps calling it), so the idle callbacks only work on a terminal
+    bool idle = gIdlePoll && isatty(STDIN_FILENO);
+    rl_event_hook = idle ? read_line_idle : nullptr;
+
     string promptStr(prompt);
     char* input = readline(promptStr.c_str()); // grrr c strings
 
@@ -81,7 +131,7 @@ bool read_line(string_view prompt, string& line, bool complete)
     return true;
 }
 
-CommandParser::CommandParser()
+CommandParser::CommandParser() : _out(&std::cout), _err(&std::cerr)
 {
     start_new_group("");
     add("help", "[COMMAND]", 
@@ -126,7 +176,7 @@ void CommandParser::print_help(const CommandParser::Group& group) const
 {
     if (!group.name.empty())
     {
-        std::cerr << '\n' << group.name << '\n';
+        err() << '\n' << group.name << '\n';
     }
 
     // Calculate the largest width of command name + argments so that we know
@@ -153,12 +203,12 @@ void CommandParser::print_help(const CommandParser::Group& group) const
 
         if (width == 0 || line.size() + command.help.size() > width)
         {
-            std::cerr << line << '\n';
-            std::cerr << wrap_text(command.help, width, 8);
+            err() << line << '\n';
+            err() << wrap_text(command.help, width, 8);
         }
         else
         {
-            std::cerr << line << command.help << '\n';
+            err() << line << command.help << '\n';
         }
     }
 }
@@ -178,16 +228,16 @@ void CommandParser::help_handler(vector<string> args) const
             return; // find_command prints an error for us
         }
         string cmd = colour(Colour::BOLD, command->name);
-        std::cerr << format("{} {}\n", cmd, command->params);
-        std::cerr << wrap_text_to_screen(command->help, false, 0);
+        err() << format("{} {}\n", cmd, command->params);
+        err() << wrap_text_to_screen(command->help, false, 0);
         return;
     }
-    std::cerr << '\n';
+    err() << '\n';
     for (const Group& group : _groups)
     {
         print_help(group);
     }
-    std::cerr << '\n';
+    err() << '\n';
 }
 
 static bool is_valid_name(string_view name)
@@ -210,8 +260,8 @@ void CommandParser::add(string_view name,
     auto wrapper = [=](vector<string> args) {
         if (!args.empty())
         {
-            error("The '{}' command expects no arguments.", name);
-            return;
+            throw std::runtime_error(
+                format("The '{}' command expects no arguments.", name));
         }
         action();
     };
@@ -227,8 +277,8 @@ void CommandParser::add(string_view name,
     auto wrapper = [=](vector<string> args) {
         if (args.size() != 1)
         {
-            error("The '{}' command expects a single argument.", name);
-            return;
+            throw std::runtime_error(
+                format("The '{}' command expects a single argument.", name));
         }
         action(std::move(args[0]));
     };
@@ -459,32 +509,83 @@ bool CommandParser::do_command(string_view thePrompt)
     }
     _autoRepeatCommand.clear();
 
+    vector<string> args;
+    const Command* cmd = parse(line, args); // prints errors for us
+    if (!cmd)
+    {
+        return true;
+    }
+    execute(*cmd, std::move(args)); // do the thing
+    
+    if (cmd->autoRepeat)
+    {
+        _autoRepeatCommand = std::move(line);
+    }
+    return true;
+}
+
+const CommandParser::Command* 
+CommandParser::parse(string_view line, vector<string>& args) const
+{
     vector<string> tokens = tokenise(line);
     debug("tokens = [{}]", join(tokens, ','));
 
     if (tokens.empty())
     {
-        return true;
+        return nullptr;
     }
     const Command* cmd = find_command(tokens[0]); // prints errors for us
-    if (!cmd)
+    if (cmd)
     {
-        return true;
+        tokens.erase(tokens.begin()); // remove command name
+        args = std::move(tokens);
     }
-    tokens.erase(tokens.begin()); // remove command name
+    return cmd;
+}
 
+bool CommandParser::execute(const Command& command, vector<string> args) const
+{
     try 
     {
-        cmd->action(std::move(tokens)); // do the thing
+        command.action(std::move(args));
+        return true;
     }
     catch (const std::exception& e)
     {
         error("The command threw an error: {}", e.what());
+        return false;
     }
-    
-    if (cmd->autoRepeat)
+}
+
+bool CommandParser::run(string_view line, 
+                        const function<bool(string_view)>& allow,
+                        std::ostream* os)
+{
+    vector<string> args;
+    const Command* cmd = parse(line, args); // prints errors for us
+    if (!cmd || (allow && !allow(cmd->name)))
     {
-        _autoRepeatCommand = std::move(line);
+        return false;
     }
-    return true;
+    if (!os)
+    {
+        return execute(*cmd, std::move(args));
+    }
+    std::ostream* out = _out;
+    std::ostream* err = _err;
+    _out = _err = os;
+    bool ok;
+    try
+    {
+        ok = execute(*cmd, std::move(args));
+    }
+    catch (...)
+    {
+        _out = out;
+        _err = err;
+        throw;
+    }
+    _out = out;
+    _err = err;
+    return ok;
 }
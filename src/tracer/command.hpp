@@ -12,6 +12,7 @@
 #include <functional>
 #include <vector>
 #include <optional>
+#include <iostream>
 
 /* Uses GNU readline to read a line of input from the user with the provided
  * prompt. Returns false on EOF, otherwise the line is stored in `line`. If
@@ -22,6 +23,14 @@ bool read_line(std::string_view prompt,
                std::string& line, 
                bool complete = false);
 
+/* Lets something else get done while read_line waits for the user to type
+ * (as long as stdin is a terminal). Every so often `poll` gets called, and if
+ * it returns true, then the prompt (and whatever has been typed so far) gets
+ * put aside while `run` is called, so that anything that gets printed doesn't
+ * end up in the middle of it. Pass in nulls to stop. SIGINT is blocked while
+ * `run` runs, like it is outside of read_line. */
+void set_read_line_idle(std::function<bool()> poll, std::function<void()> run);
+
 /* Uses GNU readline internally which has global state. */
 class CommandParser 
 {
@@ -47,6 +56,10 @@ private:
      * here so that we know to repeat it if we get an empty line afterwards. */
     std::string _autoRepeatCommand;
 
+    /* Where the commands print to (see out() and err()) */
+    std::ostream* _out;
+    std::ostream* _err;
+
     /* Searches for a command that using the following procedure:
      *
      *      (1) If 'prefix' matches a command name exactly, pick that.
@@ -55,6 +68,16 @@ private:
      * Otherwise, an error is printed and null is returned. */
     const Command* find_command(std::string_view prefix) const;
 
+    /* Splits up a line and finds the command that it's for, leaving the rest
+     * of the line in `args`. Returns null if the line is empty, or else (after
+     * printing an error) if there's something wrong with it. */
+    const Command* parse(std::string_view line, 
+                         std::vector<std::string>& args) const;
+
+    /* Runs the command, printing whatever exception it throws. Returns false
+     * if it threw one. */
+    bool execute(const Command& command, std::vector<std::string> args) const;
+
     /* The internal functions for the built-in help command */
     void help_handler(std::vector<std::string> args) const;
     void print_help(const Group& group) const;
@@ -90,6 +113,23 @@ public:
      * it, or prints errors if the command was invalid. Returns false on EOF.
      * Catches any std::exception's thrown by the command and prints them. */
     bool do_command(std::string_view prompt);
+
+    /* Runs a line as if it had been typed in at the prompt (apart from empty
+     * lines not repeating anything), printing any errors in the same way. If
+     * `allow` is given, then it gets passed the full name of the command, and
+     * the command only gets run if it returns true (so it should print out
+     * why not). If `os` is given, then everything that the command prints
+     * (with out() and err()) goes there instead. Returns false if the command
+     * wasn't run or if it threw. */
+    bool run(std::string_view line, 
+             const std::function<bool(std::string_view)>& allow = nullptr,
+             std::ostream* os = nullptr);
+
+    /* The streams that commands should print their output and everything
+     * else to, instead of std::cout and std::cerr (which is what these are,
+     * apart from while run is sending a command's output somewhere else). */
+    std::ostream& out() const { return *_out; }
+    std::ostream& err() const { return *_err; }
 };
 
 #endif /* FORKTRACE_COMMAND_HPP */
@@ -0,0 +1,952 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  control
+ *
+ *      The server's thread polls the listening socket and every client at
+ *      once, plus a pipe that gets written to when it has to wake up: when
+ *      stop() wants it to finish up, or when the main thread has posted some
+ *      of a reply for it to send. Clients are non-blocking, and replies get
+ *      sent as the clients are ready for them, so a client that stops reading
+ *      halfway through a big export only holds up itself. Streamed exports
+ *      get written by a thread of their own, which waits whenever too much
+ *      of the export is waiting to be sent, so a slow client doesn't make us
+ *      hold the whole thing in memory either.
+ *
+ *      Commands that have to be run by the main thread get put on a queue,
+ *      and the server's thread carries on with everyone else (but not with
+ *      the rest of that client's requests) until the main thread has run
+ *      the command. While the main thread is running one, it hands the
+ *      command a stream onto the client's reply to print to (see
+ *      CommandParser::run), and points its log messages there too.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <regex>
+#include <stdexcept>
+#include <fmt/core.h>
+
+#include "control.hpp"
+#include "tracer.hpp"
+#include "process.hpp"
+#include "exporter.hpp"
+#include "system.hpp"
+#include "parse.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::shared_ptr;
+using std::runtime_error;
+using fmt::format;
+
+/* A request line longer than this gets the client hung up on. */
+constexpr size_t MAX_LINE_SIZE = 64 * 1024;
+
+/* How much of a reply gets built up before it's posted (see Reply). */
+constexpr size_t REPLY_BUFFER_SIZE = 64 * 1024;
+
+/* An export stops and waits for the client once this much of it is waiting
+ * to be sent (see Client::wait_for_room). */
+constexpr size_t OUTPUT_HIGH_WATER_MARK = 4 * REPLY_BUFFER_SIZE;
+
+/* A client that doesn't read any of an export for this long gets hung up on,
+ * rather than being left to hold up the export (and its EpochPin) forever. */
+constexpr std::chrono::seconds EXPORT_STALL_TIMEOUT(30);
+
+/* Wakes up the server's thread (to stop, or to send what's been posted). If
+ * the pipe is full, then it's going to wake up anyway. */
+static void wake(int fd)
+{
+    char byte = 0;
+    if (write(fd, &byte, 1) == -1 && errno != EAGAIN)
+    {
+        error("Couldn't wake up the control socket: write: {}",
+            strerror_s(errno));
+    }
+}
+
+/* The server's thread owns `fd`, `input`, `closing` and `exporter`. Replies
+ * get posted to `output` from other threads too (so that's behind the lock),
+ * but only the server's thread sends them. A Request holds on to its client
+ * until the main thread has finished with it, even if the client has hung up
+ * (in which case `gone` gets set, and whatever gets posted is thrown away). */
+struct ControlServer::Client
+{
+    int fd;
+    string input; // what's been read but not answered yet
+    bool closing; // hang up once everything's been answered and sent?
+    std::thread exporter; // see stream_export (joined once it isn't busy)
+
+    std::mutex lock;
+    std::condition_variable drained; // notified as the output gets sent
+    std::deque<string> output; // the chunks of replies waiting to be sent
+    size_t sent; // how much of the first chunk has been sent already
+    size_t waiting; // how many bytes of the output haven't been sent yet
+    bool busy; // waiting for the main thread or for an export to finish?
+    bool gone;
+
+    Client(int fd)
+        : fd(fd), closing(false), sent(0), waiting(0), busy(false),
+        gone(false) { }
+
+    /* Adds a chunk of a reply to the output. If `last`, then the command
+     * that the client was waiting for is done. */
+    void post(string chunk, bool last)
+    {
+        std::scoped_lock<std::mutex> guard(lock);
+        if (!gone && !chunk.empty())
+        {
+            waiting += chunk.size();
+            output.push_back(std::move(chunk));
+        }
+        if (last)
+        {
+            busy = false;
+        }
+    }
+
+    /* Sends as much of the output as the socket will take without blocking.
+     * Returns false if the client has gone away. */
+    bool flush();
+
+    /* Waits until less than OUTPUT_HIGH_WATER_MARK of the output is waiting
+     * to be sent. Only an export's own thread can wait for a client like
+     * this (the main thread and the server's thread can't be held up by
+     * one). Returns false if the client has gone away, or if it stopped
+     * reading for so long that we gave up on it. */
+    bool wait_for_room();
+
+    bool is_busy()
+    {
+        std::scoped_lock<std::mutex> guard(lock);
+        return busy;
+    }
+
+    bool has_output()
+    {
+        std::scoped_lock<std::mutex> guard(lock);
+        return !output.empty();
+    }
+
+    /* Returns true if there's nothing left to answer or send. */
+    bool idle()
+    {
+        std::scoped_lock<std::mutex> guard(lock);
+        return !busy && output.empty();
+    }
+
+    void hang_up()
+    {
+        close(fd);
+        std::scoped_lock<std::mutex> guard(lock);
+        gone = true;
+        output.clear();
+        waiting = 0;
+        drained.notify_all();
+    }
+};
+
+bool ControlServer::Client::flush()
+{
+    std::scoped_lock<std::mutex> guard(lock);
+    while (!gone && !output.empty())
+    {
+        const string& chunk = output.front();
+        ssize_t n = ::send(fd, chunk.data() + sent, chunk.size() - sent,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n >= 0)
+        {
+            sent += n;
+            waiting -= n;
+            if (sent == chunk.size())
+            {
+                output.pop_front();
+                sent = 0;
+            }
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break; // we'll poll for when it has caught up
+        }
+        verbose("Control client went away: {}", strerror_s(errno));
+        gone = true;
+        output.clear();
+        waiting = 0;
+    }
+    drained.notify_all();
+    return !gone;
+}
+
+bool ControlServer::Client::wait_for_room()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (!gone && waiting >= OUTPUT_HIGH_WATER_MARK)
+    {
+        // Carry on waiting for as long as the client keeps reading something
+        size_t before = waiting;
+        bool moved = drained.wait_for(guard, EXPORT_STALL_TIMEOUT, [&] {
+            return gone || waiting != before;
+        });
+        if (!moved)
+        {
+            gone = true; // the server's thread will hang up on it
+            output.clear();
+            waiting = 0;
+            guard.unlock();
+            warning("Gave up on a control client that stopped reading its "
+                "export.");
+            return false;
+        }
+    }
+    return !gone;
+}
+
+/* The answer to one request, which gets posted to the client a line at a time
+ * (or rather, a buffer full of lines at a time). In RAW mode, lines are sent
+ * as they are, since they're JSON already. In OUTPUT mode, each line gets
+ * wrapped up as {"output": LINE}, without any colour escapes. Other threads
+ * wake up the server's thread to send each buffer full, whereas the server's
+ * thread sends what it can straight away. A blocking reply (see
+ * set_blocking) waits for the client to catch up after each buffer full, and
+ * stops taking anything once the client has gone (so whatever is writing to
+ * it sees the stream fail). */
+class Reply : public std::streambuf
+{
+public:
+    enum Mode
+    {
+        RAW,
+        OUTPUT,
+    };
+
+private:
+    ControlServer::Client& _client;
+    int _wake; // the write end of ControlServer::_wake (or -1, see above)
+    Mode _mode;
+    bool _blocking;
+    bool _gone; // has a blocking reply found that the client has gone?
+    string _line; // the line that's being written (if unfinished)
+    string _buffer; // finished lines waiting to be posted
+
+    void write(const char* data, size_t size);
+    void end_line();
+    void post(bool last);
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* data, std::streamsize size) override;
+
+public:
+    /* `wake` should be -1 on the server's own thread. */
+    Reply(ControlServer::Client& client, int wake)
+        : _client(client), _wake(wake), _mode(OUTPUT), _blocking(false),
+        _gone(false) { }
+
+    void set_mode(Mode mode) { _mode = mode; }
+
+    /* Only for threads that can be held up by the client (see
+     * Client::wait_for_room). */
+    void set_blocking(bool blocking) { _blocking = blocking; }
+
+    /* Adds a line of JSON to the reply, no matter what mode we're in. */
+    void send(string_view json);
+
+    /* Ends the reply with the "done" line, and posts whatever is left. */
+    void finish(bool ok, string_view error);
+};
+
+void Reply::write(const char* data, size_t size)
+{
+    const char* end = data + size;
+    while (data < end)
+    {
+        const char* newline = std::find(data, end, '\n');
+        _line.append(data, newline);
+        if (newline == end)
+        {
+            break;
+        }
+        end_line();
+        data = newline + 1;
+    }
+}
+
+void Reply::end_line()
+{
+    if (_mode == RAW)
+    {
+        _buffer += _line;
+        _buffer += '\n';
+    }
+    else
+    {
+        static const std::regex escapes("\033\\[[;0-9]*[A-Za-z]");
+        _buffer += format("{{\"output\":{}}}\n",
+            json_string(std::regex_replace(_line, escapes, "")));
+    }
+    _line.clear();
+    if (_buffer.size() >= REPLY_BUFFER_SIZE)
+    {
+        post(false);
+    }
+}
+
+void Reply::post(bool last)
+{
+    _client.post(std::move(_buffer), last);
+    _buffer.clear();
+    if (_wake != -1)
+    {
+        wake(_wake);
+    }
+    else
+    {
+        _client.flush();
+    }
+    if (_blocking && !last)
+    {
+        _gone = !_client.wait_for_room();
+    }
+}
+
+Reply::int_type Reply::overflow(int_type ch)
+{
+    if (_gone)
+    {
+        return traits_type::eof();
+    }
+    if (ch != traits_type::eof())
+    {
+        char c = traits_type::to_char_type(ch);
+        write(&c, 1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize Reply::xsputn(const char* data, std::streamsize size)
+{
+    if (_gone)
+    {
+        return 0;
+    }
+    write(data, size);
+    return size;
+}
+
+void Reply::send(string_view json)
+{
+    if (!_line.empty())
+    {
+        end_line();
+    }
+    _buffer += json;
+    _buffer += '\n';
+}
+
+void Reply::finish(bool ok, string_view error)
+{
+    if (ok)
+    {
+        send("{\"done\":true,\"ok\":true}");
+    }
+    else if (error.empty())
+    {
+        send("{\"done\":true,\"ok\":false}");
+    }
+    else
+    {
+        send(format("{{\"done\":true,\"ok\":false,\"error\":{}}}",
+            json_string(error)));
+    }
+    post(true);
+}
+
+/* A stream onto a reply for a command to print to, which the calling
+ * thread's log messages get sent to as well, for as long as it's around. */
+class Capture
+{
+private:
+    std::ostream _stream;
+
+public:
+    Capture(Reply& reply) : _stream(&reply)
+    {
+        redirect_messages(&_stream);
+    }
+
+    ~Capture()
+    {
+        redirect_messages(nullptr);
+    }
+
+    std::ostream& stream() { return _stream; }
+
+    Capture(const Capture&) = delete;
+    Capture(Capture&&) = delete;
+};
+
+/* Binds the socket to the address. If there's a socket there already that
+ * nobody is listening on (left behind by a forktrace that crashed), then that
+ * gets replaced, but anything else that's in the way gets left alone. Returns
+ * false (with errno set) if it couldn't be bound. */
+static bool bind_socket(int fd, const sockaddr_un& addr)
+{
+    auto address = reinterpret_cast<const sockaddr*>(&addr);
+    if (bind(fd, address, sizeof(addr)) == 0)
+    {
+        return true;
+    }
+    struct stat info;
+    if (errno != EADDRINUSE || lstat(addr.sun_path, &info) == -1
+        || !S_ISSOCK(info.st_mode))
+    {
+        errno = EADDRINUSE;
+        return false;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe == -1)
+    {
+        return false;
+    }
+    bool abandoned = connect(probe, address, sizeof(addr)) == -1
+        && errno == ECONNREFUSED;
+    close(probe);
+    if (!abandoned)
+    {
+        errno = EADDRINUSE;
+        return false;
+    }
+    verbose("Replacing the abandoned socket at {}", addr.sun_path);
+    return unlink(addr.sun_path) == 0 && bind(fd, address, sizeof(addr)) == 0;
+}
+
+void ControlServer::start(const string& path)
+{
+    stop();
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+    {
+        throw runtime_error(format("Socket paths have to be between 1 and {} "
+            "characters long.", sizeof(addr.sun_path) - 1));
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        throw SystemError(errno, "socket");
+    }
+    if (!bind_socket(fd, addr))
+    {
+        int err = errno;
+        close(fd);
+        throw SystemError(err, format("bind({})", path));
+    }
+    // Nobody can connect until we listen, so nobody gets in before the chmod
+    const char* cause = nullptr;
+    if (chmod(path.c_str(), S_IRUSR | S_IWUSR) == -1)
+    {
+        cause = "chmod";
+    }
+    else if (listen(fd, SOMAXCONN) == -1)
+    {
+        cause = "listen";
+    }
+    else if (pipe2(_wake, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        cause = "pipe2";
+    }
+    if (cause)
+    {
+        int err = errno;
+        close(fd);
+        unlink(path.c_str());
+        throw SystemError(err, cause);
+    }
+
+    _path = path;
+    _listener = fd;
+    {
+        std::scoped_lock<std::mutex> guard(_lock);
+        _quit = false;
+    }
+    _thread = std::thread(&ControlServer::serve, this);
+    log("Listening for commands on {}", path);
+}
+
+void ControlServer::stop()
+{
+    if (_path.empty())
+    {
+        return;
+    }
+    {
+        // We're the main thread, so we're not going to get to these
+        std::scoped_lock<std::mutex> guard(_lock);
+        _quit = true;
+        for (Request& request : _requests)
+        {
+            Reply reply(*request.client, _wake[1]);
+            reply.finish(false, "The control socket was shut down before the "
+                "command could be run.");
+        }
+        _requests.clear();
+        _pending = false;
+    }
+    wake(_wake[1]);
+    _thread.join();
+
+    close(_listener);
+    close(_wake[0]);
+    close(_wake[1]);
+    unlink(_path.c_str());
+    _listener = _wake[0] = _wake[1] = -1;
+    log("Stopped listening for commands on {}", _path);
+    _path.clear();
+}
+
+void ControlServer::set_trees(const vector<shared_ptr<Process>>& trees)
+{
+    std::scoped_lock<std::mutex> guard(_treesLock);
+    _trees = trees;
+}
+
+void ControlServer::serve()
+{
+    vector<shared_ptr<Client>> clients;
+    vector<shared_ptr<Client>> leaving; // hung up on, but still exporting
+    vector<pollfd> fds;
+
+    while (true)
+    {
+        // Answer whatever we can, and send off whatever's ready to go. Go
+        // backwards so that hanging up on someone doesn't get in the way.
+        for (size_t i = clients.size(); i-- > 0; )
+        {
+            if (!serve_client(clients[i]))
+            {
+                clients[i]->hang_up();
+                if (clients[i]->exporter.joinable())
+                {
+                    leaving.push_back(std::move(clients[i]));
+                }
+                clients.erase(clients.begin() + i);
+            }
+        }
+        // (An export that's been hung up on soon notices, and wakes us up)
+        for (size_t i = leaving.size(); i-- > 0; )
+        {
+            if (!leaving[i]->is_busy())
+            {
+                leaving[i]->exporter.join();
+                leaving.erase(leaving.begin() + i);
+            }
+        }
+
+        fds.clear();
+        fds.push_back({_wake[0], POLLIN, 0});
+        fds.push_back({_listener, POLLIN, 0});
+        for (const auto& client : clients)
+        {
+            // Don't read any more while there's a whole line's worth waiting
+            // on a command (there's no point polling with nothing to poll for,
+            // since a client that has hung up would wake us up over and over)
+            short events = 0;
+            if (!client->closing && client->input.size() <= MAX_LINE_SIZE)
+            {
+                events |= POLLIN;
+            }
+            if (client->has_output())
+            {
+                events |= POLLOUT;
+            }
+            fds.push_back({events != 0 ? client->fd : -1, events, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("Control socket: poll: {}", strerror_s(errno));
+            break;
+        }
+        if (fds[0].revents != 0)
+        {
+            char buffer[64];
+            while (read(_wake[0], buffer, sizeof(buffer)) > 0) { }
+            std::scoped_lock<std::mutex> guard(_lock);
+            if (_quit)
+            {
+                break; // stop() wants us gone
+            }
+        }
+
+        for (size_t i = 0; i < clients.size(); ++i)
+        {
+            if (!(fds[i + 2].events & POLLIN) || fds[i + 2].revents == 0)
+            {
+                continue; // (POLLOUT gets dealt with by serve_client)
+            }
+            Client& client = *clients[i];
+            char buffer[4096];
+            ssize_t n = read(client.fd, buffer, sizeof(buffer));
+            if (n == -1 && (errno == EAGAIN || errno == EINTR))
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                client.closing = true; // they're done sending requests
+                continue;
+            }
+            client.input.append(buffer, n);
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            int fd = accept4(_listener, nullptr, nullptr,
+                SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd != -1)
+            {
+                verbose("A control client connected");
+                clients.push_back(std::make_shared<Client>(fd));
+            }
+            else if (errno != EAGAIN && errno != EINTR)
+            {
+                warning("Control socket: accept4: {}", strerror_s(errno));
+            }
+        }
+    }
+
+    // Send off what we can (e.g., the errors from stop()) before we go
+    for (const auto& client : clients)
+    {
+        client->flush();
+        client->hang_up();
+    }
+    clients.insert(clients.end(), leaving.begin(), leaving.end());
+    for (const auto& client : clients)
+    {
+        if (client->exporter.joinable())
+        {
+            client->exporter.join();
+        }
+    }
+}
+
+/* Answers the client's requests, up until the first one that has to wait for
+ * the main thread (the rest have to wait for that one, so that the answers
+ * come back in order). Then sends off as much of the answers as the client
+ * will take. Returns false once we're finished with the client. */
+bool ControlServer::serve_client(const shared_ptr<Client>& client)
+{
+    if (!client->is_busy())
+    {
+        if (client->exporter.joinable())
+        {
+            client->exporter.join(); // it's finished (or about to)
+        }
+        bool queued = false;
+        size_t start = 0, end;
+        while (!queued 
+            && (end = client->input.find('\n', start)) != string::npos)
+        {
+            string_view line(client->input);
+            line = line.substr(start, end - start);
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.remove_suffix(1);
+            }
+            if (line.find_first_not_of(" \t") != string_view::npos)
+            {
+                queued = answer(client, line);
+            }
+            start = end + 1;
+        }
+        client->input.erase(0, start);
+        if (!queued && client->input.size() > MAX_LINE_SIZE)
+        {
+            Reply reply(*client, -1);
+            reply.finish(false, "That line is too long.");
+            client->input.clear();
+            client->closing = true;
+        }
+    }
+    return client->flush() && !(client->closing && client->idle());
+}
+
+/* Answers one request from the client (see the header comment), or hands it
+ * to the main thread or to an export's thread, in which case this returns
+ * true. */
+bool ControlServer::answer(const shared_ptr<Client>& client, string_view line)
+{
+    verbose("Control request: {}", line);
+    Reply reply(*client, -1);
+    bool ok = true;
+    string reason;
+    try
+    {
+        vector<string_view> args = split_views(line, ' ');
+        if (!args.empty() && args[0] == "export" && args.size() >= 3
+            && args[2] == "-")
+        {
+            stream_export(*client, args);
+            return true;
+        }
+        if (!query(args, reply))
+        {
+            run_remotely(client, line);
+            return true;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        ok = false;
+        reason = e.what();
+    }
+    reply.finish(ok, reason);
+    return false;
+}
+
+/* Answers the request if it's one of the ones that we can answer ourselves,
+ * or returns false if the main thread will have to run it. */
+bool ControlServer::query(const vector<string_view>& args, Reply& reply)
+{
+    assert(!args.empty());
+    if (args.size() != 1)
+    {
+        return false;
+    }
+    if (args[0] == "list")
+    {
+        list(reply);
+    }
+    else if (args[0] == "trees")
+    {
+        list_trees(reply);
+    }
+    else if (args[0] == "stats")
+    {
+        stats(reply);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+void ControlServer::list(Reply& reply)
+{
+    vector<shared_ptr<Process>> processes = _tracer.processes();
+    std::sort(processes.begin(), processes.end(),
+        [](auto& a, auto& b) { return a->pid() < b->pid(); });
+    EpochPin pin;
+    for (const auto& process : processes)
+    {
+        const ProcessHistory& snapshot = process->snapshot();
+        reply.send(format("{{\"pid\":{},\"state\":{},\"command\":{}}}",
+            snapshot.pid(), json_string(snapshot.state()),
+            json_string(snapshot.command_line())));
+    }
+}
+
+void ControlServer::list_trees(Reply& reply)
+{
+    vector<shared_ptr<Process>> trees;
+    {
+        std::scoped_lock<std::mutex> guard(_treesLock);
+        trees = _trees;
+    }
+    EpochPin pin;
+    for (size_t i = 0; i < trees.size(); ++i)
+    {
+        const ProcessHistory& leader = trees[i]->snapshot();
+        reply.send(format("{{\"tree\":{},\"pid\":{},\"state\":{},"
+            "\"command\":{}}}", i, leader.pid(), json_string(leader.state()),
+            json_string(leader.command_line())));
+    }
+}
+
+/* Walks every tree (without recursing, like the exporter does) to count up
+ * what's in them. */
+void ControlServer::stats(Reply& reply)
+{
+    vector<shared_ptr<Process>> trees;
+    {
+        std::scoped_lock<std::mutex> guard(_treesLock);
+        trees = _trees;
+    }
+    size_t tracees = _tracer.processes().size();
+    size_t processes = 0, alive = 0, events = 0;
+    EpochPin pin;
+    vector<const ProcessHistory*> stack;
+    for (const auto& tree : trees)
+    {
+        stack.push_back(&tree->snapshot());
+    }
+    while (!stack.empty())
+    {
+        const ProcessHistory* process = stack.back();
+        stack.pop_back();
+        processes++;
+        alive += !process->dead();
+        events += process->event_count();
+        for (size_t i = 0; i < process->event_count(); ++i)
+        {
+            auto fork = dynamic_cast<const ForkEvent*>(&process->event(i));
+            if (fork)
+            {
+                stack.push_back(&fork->child->snapshot());
+            }
+        }
+    }
+    reply.send(format("{{\"trees\":{},\"processes\":{},\"alive\":{},"
+        "\"tracees\":{},\"events\":{}}}", trees.size(), processes, alive,
+        tracees, events));
+}
+
+/* Handles "export FORMAT - [TREE]", by starting up a thread to write the
+ * export to the client (see Client::exporter). The client is busy until that
+ * has finished, so its other requests wait for it. Throws a runtime_error
+ * (without starting anything) if the arguments are no good. */
+void ControlServer::stream_export(Client& client,
+                                  const vector<string_view>& args)
+{
+    if (args.size() > 4)
+    {
+        throw runtime_error("Expected a format, - and optionally a tree.");
+    }
+    ExportFormat exportFormat = parse_export_format(args[1]);
+    if (exportFormat == ExportFormat::TEXT)
+    {
+        throw runtime_error("Text exports need diagrams, which only the main "
+            "thread can draw, so they can only be exported to a file.");
+    }
+    vector<shared_ptr<Process>> trees;
+    {
+        std::scoped_lock<std::mutex> guard(_treesLock);
+        trees = _trees;
+    }
+    size_t first = 0;
+    if (args.size() == 4)
+    {
+        first = parse_number<size_t>(args[3]);
+        if (first >= trees.size())
+        {
+            throw runtime_error("Out-of-bounds process tree index.");
+        }
+        trees = {trees[first]};
+    }
+
+    {
+        std::scoped_lock<std::mutex> guard(client.lock);
+        client.busy = true;
+    }
+    // The thread holds on to the trees, and we hold on to the client until
+    // we've joined the thread.
+    client.exporter = std::thread([&client, exportFormat, first,
+                                   trees = std::move(trees), wake = _wake[1]] {
+        vector<const Process*> leaders;
+        for (const auto& tree : trees)
+        {
+            leaders.push_back(tree.get());
+        }
+        Reply reply(client, wake);
+        reply.set_mode(exportFormat == ExportFormat::JSON ? Reply::RAW
+            : Reply::OUTPUT);
+        reply.set_blocking(true);
+        bool ok = true;
+        string reason;
+        try
+        {
+            std::ostream os(&reply);
+            ::export_trees(os, exportFormat, leaders, first);
+        }
+        catch (const std::exception& e)
+        {
+            ok = false;
+            reason = e.what();
+        }
+        reply.finish(ok, reason);
+    });
+}
+
+/* Hands the line over to the main thread. The client's reply gets finished
+ * off by run_pending (or by stop, if the main thread never gets to it). */
+void ControlServer::run_remotely(const shared_ptr<Client>& client,
+                                 string_view line)
+{
+    std::scoped_lock<std::mutex> guard(_lock);
+    if (_quit)
+    {
+        throw runtime_error("The control socket is being shut down.");
+    }
+    {
+        std::scoped_lock<std::mutex> clientGuard(client->lock);
+        client->busy = true;
+    }
+    _requests.push_back({string(line), client});
+    _pending = true;
+}
+
+bool ControlServer::run_pending()
+{
+    if (!_pending || _running)
+    {
+        return false;
+    }
+    _running = true;
+    while (true)
+    {
+        Request request;
+        {
+            std::scoped_lock<std::mutex> guard(_lock);
+            if (_requests.empty())
+            {
+                _pending = false;
+                break;
+            }
+            request = std::move(_requests.front());
+            _requests.pop_front();
+        }
+
+        Reply reply(*request.client, _wake[1]);
+        bool ok = false;
+        try
+        {
+            Capture capture(reply);
+            ok = _runner(request.line, capture.stream());
+        }
+        catch (...)
+        {
+            // Don't leave the client waiting forever
+            reply.finish(false, "");
+            _running = false;
+            throw;
+        }
+        reply.finish(ok, "");
+    }
+    _running = false;
+    return true;
+}
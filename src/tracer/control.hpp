@@ -0,0 +1,153 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  control
+ *
+ *      A Unix domain socket that scripts can connect to, so that a trace can
+ *      be looked at and controlled while it's running (e.g., on a build
+ *      server, where nobody is sitting at the terminal to press Ctrl+C).
+ */
+#ifndef FORKTRACE_CONTROL_HPP
+#define FORKTRACE_CONTROL_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <iostream>
+
+class Tracer; // defined in tracer.hpp
+class Process; // defined in process.hpp
+class Reply; // defined in control.cpp
+
+/* Listens on a socket for commands (one per line, written the same way as at
+ * the prompt), and answers each one with lines of JSON (one object per line).
+ * The last line of every answer has "done" set, and "ok" says whether it
+ * worked (with an "error" if there's anything more to say about why not).
+ *
+ * These get answered by the server's own thread straight away, from snapshots
+ * of the processes (see Process::snapshot), so they never hold up the tracer:
+ *
+ *      list                    a {"pid", "state", "command"} for each tracee
+ *      trees                   a {"tree", "pid", "state", "command"} for each
+ *                              tree (the tree numbers are the usual ones)
+ *      stats                   one object with how many trees, processes,
+ *                              live processes, tracees and events there are
+ *      export FORMAT - [TREE]  streams the export (see exporter.hpp) back,
+ *                              as is for json, and as "output" lines (see
+ *                              below) for dot and chrome
+ *
+ * (Exports get written by a thread of their own, which keeps up with how fast
+ * the client reads them, so that the others don't have to wait.)
+ *
+ * Anything else gets handed to the main thread, which runs it as a command
+ * (see CommandParser) the next time that it comes around to it: in between
+ * steps of "go" (and friends), or while it waits at the prompt (if that's on
+ * a terminal). Whatever the command prints comes back as {"output": LINE}
+ * lines (minus the colour). The main thread is the only one that can step the
+ * tracees, so this can take a while if it's waiting for tracees that are busy
+ * doing their own thing. Each client's requests get answered in order, so a
+ * command only holds up the requests that the same client sent after it (the
+ * other clients' queries still get answered straight away).
+ *
+ * Replies get buffered up, and only the server's thread sends them, so the
+ * main thread never has to wait for a client that's slow to read. */
+class ControlServer
+{
+public:
+    /* Runs a line as a command on the main thread (see run_pending), with
+     * everything that it prints going to `os`. Returns false if it didn't
+     * work (after printing out why). */
+    using Runner = std::function<bool(std::string_view line, 
+                                      std::ostream& os)>;
+
+private:
+    /* A connected client, which its replies get written to (see control.cpp) */
+    struct Client;
+    friend class Reply;
+
+    /* A command waiting for run_pending */
+    struct Request
+    {
+        std::string line;
+        std::shared_ptr<Client> client;
+    };
+
+    Tracer& _tracer;
+    Runner _runner;
+    std::string _path; // where we're listening (empty if we aren't)
+    int _listener;
+    int _wake[2]; // a pipe that gets written to to wake the thread up
+    std::thread _thread;
+
+    /* Our copy of the list of trees, since the main thread owns the real one
+     * (see set_trees) */
+    std::mutex _treesLock;
+    std::vector<std::shared_ptr<Process>> _trees;
+
+    /* Commands for the main thread. _pending is set while there are any, so
+     * that run_pending doesn't need to take the lock to find that out. */
+    std::mutex _lock; // protects _requests and _quit
+    std::deque<Request> _requests;
+    std::atomic<bool> _pending;
+    bool _quit;
+    bool _running; // is run_pending running? (only used by the main thread)
+
+    /* Private functions, see source file */
+    void serve();
+    bool serve_client(const std::shared_ptr<Client>& client);
+    bool answer(const std::shared_ptr<Client>& client, std::string_view line);
+    bool query(const std::vector<std::string_view>& args, Reply& reply);
+    void list(Reply& reply);
+    void list_trees(Reply& reply);
+    void stats(Reply& reply);
+    void stream_export(Client& client,
+                       const std::vector<std::string_view>& args);
+    void run_remotely(const std::shared_ptr<Client>& client,
+                      std::string_view line);
+
+public:
+    ControlServer(Tracer& tracer, Runner runner)
+        : _tracer(tracer), _runner(std::move(runner)), _listener(-1),
+        _wake{-1, -1}, _pending(false), _quit(false), _running(false) { }
+    ~ControlServer() { stop(); }
+
+    ControlServer(const ControlServer&) = delete;
+    ControlServer(ControlServer&&) = delete;
+
+    /* Starts listening on a socket at `path` (after stopping listening on the
+     * old one, if there was one). The socket can only be used by our user.
+     * If there's a socket at `path` already that nobody is listening on (left
+     * behind by a forktrace that crashed), then it gets replaced. Throws a
+     * SystemError or runtime_error if it can't listen there. */
+    void start(const std::string& path);
+
+    /* Stops listening and hangs up on everyone (and removes the socket). Any
+     * commands that were waiting for the main thread get an error instead
+     * (if the clients will take it without us having to wait). */
+    void stop();
+
+    /* Where we're listening, or an empty string if we aren't. */
+    const std::string& path() const { return _path; }
+
+    /* The main thread has to call this every time that it changes its list
+     * of trees (i.e., when it starts a tree, or the pruner gets rid of one),
+     * since the server answers queries from its own copy of the list. */
+    void set_trees(const std::vector<std::shared_ptr<Process>>& trees);
+
+    /* Returns true if there are commands waiting for run_pending. */
+    bool pending() const { return _pending; }
+
+    /* Runs every command that's waiting (with the runner), and hands what
+     * they print to the server's thread to send back. Only the main thread
+     * can call this, and it's cheap to call when there aren't any (it does
+     * nothing if it's called from one of the commands that it's running,
+     * too). Returns true if it ran any. */
+    bool run_pending();
+};
+
+#endif /* FORKTRACE_CONTROL_HPP */
@@ -5,17 +5,19 @@
  *      TODO
  */
 #include <cassert>
+#include <algorithm>
+#include <cstdint>
 #include <fmt/core.h>
 
 #include "terminal.hpp"
 #include "diagram.hpp"
 #include "process.hpp"
 #include "event.hpp"
+#include "thread-pool.hpp"
 
 using std::string;
 using std::string_view;
 using std::vector;
-using std::unique_ptr;
 using fmt::format;
 
 /* The starting column for the diagram. Normally we want to give the diagram a
@@ -24,26 +26,59 @@ using fmt::format;
  * draw backwards into the previous lane. */
 constexpr auto LSHIFT = 1;
 
+/* The fewest lines that we'll bother handing to a thread of our own when
+ * drawing a diagram in bands (see Diagram::draw_lines). */
+constexpr size_t MIN_BAND_LINES = 256;
+
+/* How many rows of the diagram stream() renders at a time (per thread). */
+constexpr size_t STREAM_ROWS = 64;
+
+/* Colour used for parts of paths that have been highlighted. */
+constexpr auto HIGHLIGHT_COLOUR = Colour::CYAN | Colour::BOLD;
+
+/* Colour used for the labels of collapsed runs and folded subtrees. */
+constexpr auto FOLD_COLOUR = Colour::YELLOW | Colour::BOLD;
+
+/* The narrowest that a lane gets with COMPACT_LANES. Any narrower and links
+ * between paths in neighbouring lanes wouldn't have any dashes in them. */
+constexpr size_t MIN_LANE_WIDTH = 2;
+
+/* Draws the diagram (or part of it) onto a Window. The coordinates that the
+ * Drawer works with are for the diagram as a whole, and the Window is placed
+ * somewhere over the top of it (with its top-left corner at `left`, `top`).
+ * Anything that falls outside of the Window just gets dropped, so we can use
+ * the same drawing code to render a small piece of a huge diagram. With no
+ * Window at all, nothing is drawn, but we still find out if it's truncated. */
 class Drawer : public IEventRenderer 
 {
 private:
-    size_t _laneWidth; // columns per each lane
+    const Diagram& _diagram; // the diagram being drawn
+    const vector<size_t>& _laneX; // see Diagram::_laneX
+    size_t _width; // columns in the whole diagram
     size_t _xExtent; // smallest index that can be drawn to without truncating
     size_t _x; // current x index (indexed from the left, from 0)
     size_t _y; // current y index (indexed from the top, from 0)
+    size_t _gap; // rows of continuation below the current line
+    bool _squashed; // draw the continuation rows dotted (see TimeScale)
     bool _truncated; // set to true if lane width was too small
-    unique_ptr<Window> _win; // What we're drawing to
+    Window* _win; // What we're drawing to (or null if we're not drawing)
+    size_t _left; // diagram column of the Window's first column
+    size_t _top; // diagram row of the Window's first row
+
+    void put(Colour c, size_t x, size_t y, char ch, size_t count = 1);
+    void put(Colour c, size_t x, size_t y, string_view str);
 
 public:
-    Drawer(size_t lane_width) : _laneWidth(lane_width), _xExtent(0), _x(0), 
-        _y(0), _truncated(false) { }
+    Drawer(const Diagram& diagram, const vector<size_t>& laneX, Window* win,
+        size_t left = 0, size_t top = 0) : _diagram(diagram), _laneX(laneX),
+        _width(laneX.back()), _xExtent(0), _x(0), _y(0), _gap(1),
+        _squashed(false), _truncated(false), _win(win), _left(left),
+        _top(top) { }
 
-    void start(size_t numLanes, size_t numLines);
     void start_lane(size_t lane);
-    void start_line(size_t line);
+    void start_line(size_t row, size_t gap, bool squashed);
     bool truncated() const { return _truncated; }
-    size_t lane_width() const { return _laneWidth; }
-    const Window& result() const; // MUST call start first!!
+    bool beyond(size_t lane) const;
 
     void draw_link(const LinkEvent& event);
     void draw_continuation(size_t lane, Colour c, char ch);
@@ -52,46 +87,207 @@ public:
     virtual void backtrack(size_t steps);
     virtual void draw_char(Colour c, char ch, size_t count = 1);
     virtual void draw_string(Colour c, std::string_view str);
+    virtual const ProcessHistory& history(const Process& process) const
+    {
+        return _diagram.history(process);
+    }
+};
+
+/* Goes through the motions of drawing events (or labels), but just keeps track
+ * of how far they go to either side of where they started. This is how we
+ * find out how wide each lane needs to be (see Diagram::measure_lanes). */
+class Measurer : public IEventRenderer
+{
+private:
+    const Diagram& _diagram; // the diagram being measured
+    long _x; // relative to where we started
+    long _min; // leftmost column drawn to (or backtracked to)
+    long _max; // one past the rightmost column drawn to
+
+public:
+    Measurer(const Diagram& diagram) : _diagram(diagram), _x(0), _min(0),
+        _max(0) { }
+
+    size_t lead() const { return -_min; } // columns used before the start
+    size_t extent() const { return _max; } // columns used from the start on
+
+    virtual void backtrack(size_t steps) 
+    {
+        _x -= steps;
+        _min = std::min(_min, _x);
+    }
+    virtual void draw_char(Colour, char, size_t count = 1)
+    {
+        _x += count;
+        _max = std::max(_max, _x);
+    }
+    virtual void draw_string(Colour, std::string_view str)
+    {
+        _x += str.size();
+        _max = std::max(_max, _x);
+    }
+    virtual const ProcessHistory& history(const Process& process) const
+    {
+        return _diagram.history(process);
+    }
+};
+
+/* Keeps track of how high the lanes are stacked up on each line of the diagram
+ * (i.e., one more than the highest lane in use on that line) as paths are put
+ * into lanes. It's a segment tree over the lines, where each node holds the
+ * height of the tallest line underneath it, so that raising a range of lines
+ * and finding the tallest line in a range both take O(log lines). */
+class Skyline
+{
+private:
+    struct Node
+    {
+        size_t top; // the tallest line anywhere in this node's range
+        size_t floor; // every line in this node's range is at least this tall
+    };
+    size_t _lines;
+    vector<Node> _tree;
+
+    size_t height(size_t node, size_t lo, size_t hi, size_t from, size_t to)
+        const;
+    void raise(size_t node, size_t lo, size_t hi, size_t from, size_t to,
+        size_t height);
+
+public:
+    Skyline(size_t lines) : _lines(lines), _tree(4 * std::max<size_t>(lines, 1),
+        Node{0, 0}) { }
+
+    /* Returns the height of the tallest line in [from, to] (inclusive). */
+    size_t height(size_t from, size_t to) const;
+
+    /* Makes all of the lines in [from, to] at least `height` tall. */
+    void raise(size_t from, size_t to, size_t height);
 };
 
-bool Diagram::Node::zombie() const 
+size_t Skyline::height(size_t from, size_t to) const
+{
+    assert(from <= to && to < _lines);
+    return height(1, 0, _lines - 1, from, to);
+}
+
+void Skyline::raise(size_t from, size_t to, size_t height)
+{
+    assert(from <= to && to < _lines);
+    raise(1, 0, _lines - 1, from, to, height);
+}
+
+size_t Skyline::height(size_t node, 
+                       size_t lo, 
+                       size_t hi, 
+                       size_t from, 
+                       size_t to) const
+{
+    if (from <= lo && hi <= to)
+    {
+        return _tree[node].top;
+    }
+    size_t mid = (lo + hi) / 2;
+    size_t result = _tree[node].floor;
+    if (from <= mid)
+    {
+        result = std::max(result, height(node * 2, lo, mid, from, to));
+    }
+    if (to > mid)
+    {
+        result = std::max(result, height(node * 2 + 1, mid + 1, hi, from, to));
+    }
+    return result;
+}
+
+void Skyline::raise(size_t node, 
+                    size_t lo, 
+                    size_t hi, 
+                    size_t from, 
+                    size_t to, 
+                    size_t height)
+{
+    _tree[node].top = std::max(_tree[node].top, height);
+    if (from <= lo && hi <= to)
+    {
+        _tree[node].floor = std::max(_tree[node].floor, height);
+        return;
+    }
+    size_t mid = (lo + hi) / 2;
+    if (from <= mid)
+    {
+        raise(node * 2, lo, mid, from, to, height);
+    }
+    if (to > mid)
+    {
+        raise(node * 2 + 1, mid + 1, hi, from, to, height);
+    }
+}
+
+const ProcessHistory& Diagram::history(const Process& process) const
+{
+    return _tree ? _tree->at(process) : process;
+}
+
+/* These two are the same as the process's own functions, except that they
+ * look at the history that we're drawing. Only a Process keeps the answers
+ * to next_event (see Process::next_event), so a snapshot has to work them
+ * out each time. */
+int Diagram::next_event(const Process& process, 
+                        size_t start, 
+                        uint8_t hidden) const
+{
+    return _tree ? history(process).next_event(start, hidden) 
+        : process.next_event(start, hidden);
+}
+
+uint8_t Diagram::event_kinds(const Process& process, size_t i) const
+{
+    return _tree ? history(process).event(i).kinds() 
+        : process.event_kinds(i);
+}
+
+/* Does this node correspond to a zombie process? */
+bool Diagram::zombie(const Node& node) const 
 {
-    return process.reaped() && next == -1;
+    return history(node.process).reaped() && node.next == -1;
 }
 
-bool Diagram::Node::end_of_path() const 
+/* Are successors permitted after this node? */
+bool Diagram::end_of_path(const Node& node) const 
 {
-    return !process.reaped() && next == -1;
+    return !history(node.process).reaped() && node.next == -1;
 }
 
-const Event* const Diagram::Node::next_event() const 
+/* The event that's next on the node's path (or null if there isn't one). */
+const Event* Diagram::pending_event(const Node& node) const 
 {
-    if (next == -1) 
+    if (node.next == -1) 
     {
         return nullptr;
     }
-    return &process.event(next);
+    return &history(node.process).event(node.next);
 }
 
-void Diagram::Node::print(Indent indent) const 
+void Diagram::print(const Node& node, Indent indent) const 
 {
-    std::cerr << format("{}my id: {}\n", indent, process.pid())
-        << format("{}events pending? = {}\n", indent, next_event() != nullptr)
-        << format("{}end of path? = {}\n", indent, end_of_path());
+    const Event* next = pending_event(node);
+    std::cerr << format("{}my id: {}\n", indent, node.process.pid())
+        << format("{}events pending? = {}\n", indent, next != nullptr)
+        << format("{}end of path? = {}\n", indent, end_of_path(node));
 
-    if (event) 
+    if (node.event) 
     {
-        std::cerr << format("{}my event: {}\n", indent, event->to_string());
+        std::cerr << format("{}my event: {}\n", indent, 
+            node.event->to_string());
     } 
     else 
     {
         std::cerr << format("{}my event: None\n", indent);
     }
 
-    if (next_event()) 
+    if (next) 
     {
-        std::cerr << format("{}next event: {}\n", 
-            indent, next_event()->to_string());
+        std::cerr << format("{}next event: {}\n", indent, next->to_string());
     } 
     else 
     {
@@ -99,39 +295,69 @@ void Diagram::Node::print(Indent indent) const
     }
 }
 
-Diagram::Path::Path(int startLine) 
-    : startLine(startLine), endLine(-1), lane(-1), killPartner(nullptr) 
+Diagram::Path::Path(const Process& process, int startLine) 
+    : process(&process), startLine(startLine), endLine(-1), lane(-1),
+    killPartner(nullptr), endSetBy(-1), revision(0), settled(0), position(-1)
 {
     assert(startLine >= 0);
 }
 
-void Drawer::start(size_t numLanes, size_t numLines) 
+/* Draws `count` copies of `ch` at (x, y) in diagram coordinates, leaving out
+ * whatever doesn't land on the Window. */
+void Drawer::put(Colour c, size_t x, size_t y, char ch, size_t count)
+{
+    if (!_win || y < _top || y >= _top + _win->height())
+    {
+        return;
+    }
+    size_t from = std::max(x, _left);
+    size_t to = std::min(x + count, _left + _win->width());
+    if (from < to)
+    {
+        _win->draw_char(from - _left, y - _top, c, ch, to - from);
+    }
+}
+
+void Drawer::put(Colour c, size_t x, size_t y, string_view str)
+{
+    if (!_win || y < _top || y >= _top + _win->height())
+    {
+        return;
+    }
+    size_t from = std::max(x, _left);
+    size_t to = std::min(x + str.size(), _left + _win->width());
+    if (from < to)
+    {
+        _win->draw_string(from - _left, y - _top, c,
+            str.substr(from - x, to - from));
+    }
+}
+
+/* Returns true if nothing drawn in this lane (or any lane to the right of it)
+ * could show up on the Window. Events can backtrack into the lane before. */
+bool Drawer::beyond(size_t lane) const
 {
-    size_t width = numLanes * _laneWidth + LSHIFT;
-    size_t height = numLines * 2;
-    _win = std::make_unique<Window>(width, height);
+    return _win && lane > 0 && _laneX[lane - 1] >= _left + _win->width();
 }
 
 void Drawer::start_lane(size_t lane) 
 {
-    _x = lane * _laneWidth + LSHIFT;
+    _x = _laneX[lane];
     if (_x < _xExtent) 
     {
         _truncated = true;
     }
 }
 
-void Drawer::start_line(size_t line) 
+/* `row` is the y coordinate of the line and `gap` is the number of rows that
+ * the paths need to be continued down by before the next line starts. */
+void Drawer::start_line(size_t row, size_t gap, bool squashed) 
 {
     _xExtent = 0;
     _x = 0;
-    _y = line * 2;
-}
-
-const Window& Drawer::result() const 
-{
-    assert(_win);
-    return *_win.get();
+    _y = row;
+    _gap = gap;
+    _squashed = squashed;
 }
 
 /* Pads out the current position with link chars up to the lane width. Will
@@ -139,11 +365,11 @@ const Window& Drawer::result() const
  * top of this won't trigger the _truncated flag). */
 void Drawer::draw_link(const LinkEvent& event) 
 {
-    Colour c = _win->set_colour(event.link_colour());
-    size_t laneStart = (_x - LSHIFT) / _laneWidth * _laneWidth + LSHIFT;
-    size_t padding = laneStart + _laneWidth - _x;
-    _win->draw_char(_x, _y, event.link_char(), padding);
-    _win->set_colour(c);
+    // Find the lane that we're up to (we could have spilled into the next)
+    auto laneEnd = std::upper_bound(_laneX.begin(), _laneX.end(), _x);
+    size_t padding = laneEnd == _laneX.end() ? 0 : *laneEnd - _x;
+    const ProcessHistory& partner = history(event.linked_path());
+    put(event.link_colour(partner), _x, _y, event.link_char(partner), padding);
     _x += padding;
 }
 
@@ -152,9 +378,14 @@ void Drawer::draw_link(const LinkEvent& event)
  * the main lines that contain the events. */
 void Drawer::draw_continuation(size_t lane, Colour c, char ch) 
 {
-    c = _win->set_colour(c);
-    _win->draw_char(lane * _laneWidth + LSHIFT, _y + 1, ch);
-    _win->set_colour(c);
+    if (_squashed && ch == '|')
+    {
+        ch = ':';
+    }
+    for (size_t i = 1; i <= _gap; ++i)
+    {
+        put(c, _laneX[lane], _y + i, ch);
+    }
 }
 
 void Drawer::backtrack(size_t steps) 
@@ -168,27 +399,23 @@ void Drawer::backtrack(size_t steps)
 
 void Drawer::draw_char(Colour c, char ch, size_t count) 
 {
-    if (_x >= _win->width())
+    if (_x >= _width)
     {
         _truncated = true;
         return;
     }
-    c = _win->set_colour(c);
-    _win->draw_char(_x, _y, ch, count);
-    _win->set_colour(c);
+    put(c, _x, _y, ch, count);
     _x = _xExtent = _x + count;
 }
 
 void Drawer::draw_string(Colour c, string_view str) 
 {
-    c = _win->set_colour(c);
-    if (_x + str.size() > _win->width())
+    if (_x + str.size() > _width)
     {
         _truncated = true;
-        str.remove_suffix(_x + str.size() - _win->width());
+        str.remove_suffix(_x + str.size() - _width);
     }
-    _win->draw_string(_x, _y, str);
-    _win->set_colour(c);
+    put(c, _x, _y, str);
     _x = _xExtent = _x + str.size();
 }
 
@@ -198,42 +425,39 @@ void Drawer::draw_string(Colour c, string_view str)
  * could be found (i.e., end of event list was reached). If the next event
  * in the path is a KillEvent, then this will update the killPartner field
  * for that path (see above). */
-int Diagram::get_next_event(const Process& process, size_t start) 
+int Diagram::get_next_event(Path& path, size_t start) 
 {
-    for (size_t i = start; i < process.event_count(); ++i) 
+    uint8_t hidden = 0;
+    if ((_options & SHOW_EXECS) == 0) 
     {
-        const Event& event = process.event(i);
+        hidden |= EXEC_EVENT;
+    }
+    if ((_options & SHOW_FAILED_EXECS) == 0) 
+    {
+        hidden |= FAILED_EXEC_EVENT;
+    }
+    if ((_options & SHOW_NON_FATAL_SIGNALS) == 0) 
+    {
+        hidden |= NON_FATAL_SIGNAL_EVENT;
+    }
+    if ((_options & SHOW_SIGNAL_SENDS) == 0) 
+    {
+        hidden |= SIGNAL_SEND_EVENT;
+    }
 
-        if ((_options & SHOW_EXECS) == 0) 
-        {
-            if (dynamic_cast<const ExecEvent*>(&event)) 
-            {
-                continue;
-            }
-        }
-        if ((_options & SHOW_FAILED_EXECS) == 0) 
-        {
-            auto exec = dynamic_cast<const ExecEvent*>(&event);
-            if (exec && !exec->succeeded()) 
-            {
-                continue;
-            }
-        }
-        if ((_options & SHOW_NON_FATAL_SIGNALS) == 0) 
-        {
-            auto signal = dynamic_cast<const SignalEvent*>(&event);
-            if (signal && !signal->killed) 
-            {
-                continue;
-            }
-        }
-        if ((_options & SHOW_SIGNAL_SENDS) == 0) 
+    const Process& process = *path.process;
+    const ProcessHistory& events = history(process);
+    for (int i = next_event(process, start, hidden); i != -1; 
+        i = next_event(process, i + 1, hidden)) 
+    {
+        const Event& event = events.event(i);
+        uint8_t kinds = event_kinds(process, i);
+
+        if (!_hidden.empty() && (kinds & LINK_EVENT)) 
         {
-            if (dynamic_cast<const KillEvent*>(&event)) 
-            {
-                continue;
-            }
-            if (dynamic_cast<const RaiseEvent*>(&event)) 
+            // Don't link up with processes that have been folded away
+            auto& link = static_cast<const LinkEvent&>(event);
+            if (_hidden.count(&link.linked_path())) 
             {
                 continue;
             }
@@ -241,12 +465,11 @@ int Diagram::get_next_event(const Process& process, size_t start)
 
         // Okay, we've found an event. If it's a KillEvent, then we'll signal
         // that it's in our path so that our partner knows about it.
-        if (auto killEvent = dynamic_cast<const KillEvent*>(&event)) 
+        if (kinds & KILL_EVENT) 
         {
-            auto path = _paths.find(&process);
-            assert(path != _paths.end());
-            assert(!path->second.killPartner);
-            path->second.killPartner = &killEvent->linked_path();
+            assert(!path.killPartner);
+            auto& killEvent = static_cast<const KillEvent&>(event);
+            path.killPartner = &killEvent.linked_path();
         }
 
         return i;
@@ -254,6 +477,15 @@ int Diagram::get_next_event(const Process& process, size_t start)
     return -1;
 }
 
+/* Same as get_next_event, but also notes down the result in the process's
+ * path for the line currently being built (see Path::nexts). */
+int Diagram::find_next(int path, size_t start)
+{
+    int next = get_next_event(_paths[path], start);
+    _paths[path].nexts.push_back({int(_lines.size()), int(start), next});
+    return next;
+}
+
 /* Helper functions to create nodes. startPath returns the first node in
  * a path. continue_path returns a node that continues the path of prevNode
  * but otherwise does nothing. getSuccessor returns a node after prevNode
@@ -264,104 +496,119 @@ Diagram::Node Diagram::get_successor(const Diagram::Node& prev)
     const Process& process = prev.process;
     if (prev.next == -1) 
     {
-        return Node(process, nullptr, -1);
+        return Node(process, nullptr, -1, prev.path);
     }
-    return Node(process, &process.event(prev.next), 
-        get_next_event(process, prev.next + 1));
+    return Node(process, &history(process).event(prev.next), 
+        find_next(prev.path, prev.next + 1), prev.path);
 }
 
 Diagram::Node Diagram::continue_path(const Diagram::Node& prev) 
 {
-    return Node(prev.process, nullptr, prev.next);
+    return Node(prev.process, nullptr, prev.next, prev.path);
+}
+
+Diagram::Node Diagram::start_path(int path) 
+{
+    return Node(*_paths[path].process, nullptr, find_next(path, 0), path);
+}
+
+/* Gives the process a new path starting on `startLine`, and returns its index
+ * in _paths. Note that this invalidates references to any other paths. */
+int Diagram::add_path(const Process& process, int startLine)
+{
+    assert(_slots.find(&process) == _slots.end());
+    int path = _paths.size();
+    _paths.emplace_back(process, startLine);
+    _slots[&process] = path;
+    return path;
 }
 
-Diagram::Node Diagram::start_path(const Process& process) 
+/* Puts the path into a lane (updating its `lane` field), given the lanes of
+ * all of the paths placed before it. We want children to 'fall on top' (so
+ * they appear to the right). This works basically like tetris: the path drops
+ * down from above and lands just above the highest lane that has something in
+ * its way, or in lane 0 if there's nothing in its way. */
+void Diagram::place_path(Skyline& skyline, Path& path)
 {
-    return Node(process, nullptr, get_next_event(process, 0));
+    assert(path.startLine >= 0 && path.endLine >= path.startLine);
+    path.lane = skyline.height(path.startLine, path.endLine);
+    skyline.raise(path.startLine, path.endLine, path.lane + 1);
 }
 
-/* Uses a recursive algorithm to allocate all of the processes in the tree
- * into a specific lane (and updates the `lane` field in each of the Path
- * objects). `lanes` should store the array of lanes so far, and `process`
- * should be the process currently being allocated. To start this function
- * off, just pass in a vector containing an empty lane, as well as the 
- * leader process. */
-// TODO really sus to have pointers into a C++ container (it relies on the
-// container not being modified during the lifetime of the pointers). I'll
-// restructure this at some point I think.
-void Diagram::allocate_process_to_lane(vector<vector<Path*>>& lanes, 
-                                       const Process& process)
+/* Allocates all of the paths in the tree to a lane. A process is placed before
+ * its children, and the children go in the reverse order that they were forked
+ * in (which gets us the correct behaviour so that we avoid overlapping lines).
+ * Paths that are placed in the same order and with the same extent as last
+ * time end up in the same lane as last time, so we only redo the placement
+ * from the first path that's different. Returns the first line on which a
+ * path changed lanes (or SIZE_MAX if none did). */
+size_t Diagram::allocate_lanes()
 {
-    assert(_paths.find(&process) != _paths.end());
-    assert(lanes.size() > 0);
-    Path& myPath = _paths[&process]; 
-    // Try to find what lane  we can plonk the path in. We iterate in reverse
-    // order since we want children to 'fall on top' (so they appear to the
-    // right). This method of lane allocation basically works like tetris.
-    bool collision = false;
-    for (long i = lanes.size() - 1; i >= 0; --i) 
+    vector<int> order;
+    vector<const Process*> stack = { &_leader };
+    while (!stack.empty())
     {
-        // Check if `process` overlaps with anything in this lane
-        for (const Path* path : lanes.at(i)) 
+        const Process* process = stack.back();
+        stack.pop_back();
+        order.push_back(_slots.at(process));
+        const ProcessHistory& events = history(*process);
+        for (size_t i = 0; i < events.event_count(); ++i)
         {
-            if (myPath.endLine >= path->startLine 
-                && myPath.startLine <= path->endLine) 
+            auto fork = dynamic_cast<const ForkEvent*>(&events.event(i));
+            if (fork && !_hidden.count(fork->child.get()))
             {
-                collision = true;
-                break;
+                stack.push_back(fork->child.get());
             }
         }
-        if (collision) 
-        {
-            if (size_t(i + 1) < lanes.size()) 
-            {
-                // We've landed on something, so put it down in the above lane.
-                myPath.lane = i + 1;
-            } 
-            else 
-            {
-                // We've landed on something, but there's no lane above us, so
-                // we have to create a new lane for it.
-                lanes.emplace_back();
-                myPath.lane = lanes.size() - 1;
-            }
-            lanes.at(myPath.lane).push_back(&myPath);
-            break;
-        }
     }
 
-    if (!collision) 
+    Skyline skyline(_lines.size());
+    size_t i = 0;
+    for (; i < order.size() && i < _placed.size(); ++i)
     {
-        // We didn't hit anything, which means we can fit it on the bottom
-        myPath.lane = 0;
-        lanes.at(0).push_back(&myPath);
+        const Placement& placed = _placed[i];
+        Path& path = _paths[order[i]];
+        if (placed.process != path.process || placed.startLine != path.startLine
+            || placed.endLine != path.endLine)
+        {
+            break;
+        }
+        // Paths that were thrown away by rewind() come back without a lane
+        path.lane = placed.lane;
+        skyline.raise(path.startLine, path.endLine, path.lane + 1);
     }
+    _placed.resize(i);
 
-    // Now plonk down each of the children. We have to iterate backwards to
-    // get the correct behaviour so that we can avoid overlapping lines.
-    for (long i = process.event_count() - 1; i >= 0; --i) 
+    size_t firstMoved = SIZE_MAX;
+    for (; i < order.size(); ++i)
     {
-        const Event* e = &process.event(i);
-        if (auto forkEvent = dynamic_cast<const ForkEvent*>(e)) 
+        Path& path = _paths[order[i]];
+        int oldLane = path.lane;
+        place_path(skyline, path);
+        if (path.lane != oldLane)
         {
-            allocate_process_to_lane(lanes, *forkEvent->child.get());
+            firstMoved = std::min<size_t>(firstMoved, path.startLine);
         }
+        _placed.push_back({path.process, path.startLine, path.endLine,
+            path.lane});
     }
+    _laneCount = std::max<size_t>(skyline.height(0, _lines.size() - 1), 1);
+    return firstMoved;
 }
 
-/* Checks if the path for this process is ready to terminate on this line
- * (based on what happened on the previous line). */
-bool Diagram::path_ready_to_end(const vector<Node>& prevLine, 
-                                const Process& process) const
+/* Checks if the path is ready to terminate on this line (based on what
+ * happened on the previous line). The path's position is left over from the
+ * last line that it was on, which might not be the previous line (in which
+ * case the node there will belong to some other path). */
+bool Diagram::path_ready_to_end(const vector<Node>& prevLine, int path) const
 {
-    for (const Node& node : prevLine) 
+    int pos = _paths[path].position;
+    if (pos < 0 || size_t(pos) >= prevLine.size() 
+        || prevLine[pos].path != path)
     {
-        if (&node.process == &process) 
-        {
-            return node.next_event() == nullptr;
-        }
+        return false; // If it isn't on the previous line, then it isn't ready
     }
-    return false; // If it hasn't been created yet, then it isn't ready
+    return pending_event(prevLine[pos]) == nullptr;
 }
 
 /* Helper function for buildNextLine. Called when the next event along a
@@ -373,7 +620,6 @@ bool Diagram::path_ready_to_end(const vector<Node>& prevLine,
  * previous line). */
 const Process* Diagram::do_link_event(vector<Node>& curLine, 
                                       int lineNum, 
-                                      Path& path, 
                                       const Node& prevNode, 
                                       const LinkEvent& event) 
 {
@@ -383,47 +629,48 @@ const Process* Diagram::do_link_event(vector<Node>& curLine,
     if (dynamic_cast<const ForkEvent*>(&event)) 
     {
         // This event will generate a new path
-        assert(_paths.find(&other) == _paths.end());
-        _paths[&other] = Path(lineNum);
-        assert(_paths.find(&other) != _paths.end());
+        int child = add_path(other, lineNum);
         curLine.push_back(get_successor(prevNode));
-        curLine.push_back(start_path(other));
+        curLine.push_back(start_path(child));
         return nullptr;
     }
 
     if (dynamic_cast<const ReapEvent*>(&event)) 
     {
         // This event will remove an existing path from this line
-        assert(_paths.find(&other) != _paths.end());
-        if (!path_ready_to_end(prevLine, other)) 
+        int child = _slots.at(&other);
+        if (!path_ready_to_end(prevLine, child)) 
         {
             curLine.push_back(continue_path(prevNode));
             return nullptr;
         }
-        _paths[&other].endLine = lineNum;
+        _paths[child].endLine = lineNum;
+        _paths[child].endSetBy = lineNum;
         curLine.push_back(get_successor(prevNode));
         return &other;
     }
 
     if (dynamic_cast<const KillEvent*>(&event)) 
     {
-        auto partner = _paths.find(&other);
-        if (partner == _paths.end()) 
+        Path& path = _paths[prevNode.path];
+        auto slot = _slots.find(&other);
+        if (slot == _slots.end()) 
         {
             // Our partner's path does not exist yet, so we wait
             curLine.push_back(continue_path(prevNode));
             return nullptr;
         }
+        Path& partner = _paths[slot->second];
         if (!path.killPartner) 
         {
             // Our partner has already seen us and reset killPartner
             // back to null, which means we're both ready (they would
             // have to be to our left in the diagram).
-            assert(!partner->second.killPartner);
+            assert(!partner.killPartner);
             curLine.push_back(get_successor(prevNode));
             return nullptr;
         }
-        if (partner->second.killPartner != &prevNode.process) 
+        if (partner.killPartner != &prevNode.process) 
         {
             // The partner path isn't ready to connect with us yet
             curLine.push_back(continue_path(prevNode));
@@ -432,7 +679,7 @@ const Process* Diagram::do_link_event(vector<Node>& curLine,
         // Okay, both paths are ready to link up. We'll set both paths'
         // killPartners back to null, since neither are looking for a
         // connection any more at this point.
-        partner->second.killPartner = path.killPartner = nullptr;
+        partner.killPartner = path.killPartner = nullptr;
         curLine.push_back(get_successor(prevNode));
         return &other;
     }
@@ -463,18 +710,18 @@ bool Diagram::build_next_line()
     // finished, and then arrange for that to happen.
     for (const Node& prevNode : _lines.back()) 
     {
-        const Event* const event = prevNode.next_event(); 
-        assert(_paths.find(&prevNode.process) != _paths.end());
-        Path& path = _paths[&prevNode.process];
+        const Event* const event = pending_event(prevNode); 
+        Path& path = _paths[prevNode.path];
 
         // If the process has been orphaned or this is then parent and it has
         // nothing left to do, then we should end it on this line. We only want
         // to set the finishing line if it hasn't already finished (otherwise
         // it would never end and we'd be in an infinite loop).
         if (((&prevNode.process == &_leader && event == nullptr) 
-            || prevNode.end_of_path()) && path.endLine == -1) 
+            || end_of_path(prevNode)) && path.endLine == -1) 
         {
             path.endLine = std::max(lineNum - 1, path.startLine);
+            path.endSetBy = lineNum;
         }
 
         // If we've reached the end of a dashed line, then indicate that.
@@ -504,7 +751,8 @@ bool Diagram::build_next_line()
                 curLine.push_back(continue_path(prevNode));
                 continue;
             }
-            eventEnd = do_link_event(curLine, lineNum, path, prevNode, *link);
+            // (`path` can't be used after this, since a fork adds a path)
+            eventEnd = do_link_event(curLine, lineNum, prevNode, *link);
             continue;
         }
         curLine.push_back(get_successor(prevNode));
@@ -515,156 +763,1132 @@ bool Diagram::build_next_line()
         return false;
     }
     _lines.push_back(move(curLine));
+    note_positions();
     return true;
 }
 
-/* Draw a single line of the diagram. `lineNum` is indexed from 0. */
-void Diagram::draw_line(const vector<Node>& line, size_t lineNum) 
+/* Records where each node on the last line is (see Path::position). */
+void Diagram::note_positions()
 {
-    _renderer->start_line(lineNum);
-    // If we're currently in the middle of drawing a dashed line to another
-    // lane for an event (e.g., forking or reaping), then we use this to keep
-    // track of what that event currently is.
-    const LinkEvent* curEvent = nullptr;
-    // True if the current child event is 'reversed', which means it's going
-    // backwards. In this case, we draw the termination on the left hand side
-    // and the event on the right hand side.
-    bool reversed = false;
-    // The most recent lane index that we've looped through.
-    size_t prevLane = 0;
+    const vector<Node>& line = _lines.back();
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+        _paths[line[i].path].position = i;
+    }
+}
 
-    for (const Node& node : line) 
+/* Throws away every line after `lineNum`, and puts the paths back the way
+ * that they were right after `lineNum` was built, so that build_next_line can
+ * carry on from there. The next event of each node on `lineNum` is looked up
+ * again, since the process could have had events added or changed since. */
+void Diagram::rewind(size_t lineNum)
+{
+    assert(lineNum < _lines.size());
+    _lines.resize(lineNum + 1);
+    while (_paths.back().startLine > int(lineNum))
     {
-        auto pair = _paths.find(&node.process);
-        assert(pair != _paths.end());
-        Path path = pair->second;
-        assert(path.lane >= 0 && (size_t)path.lane >= prevLane);
+        _slots.erase(_paths.back().process);
+        _paths.pop_back();
+    }
+    for (Path& path : _paths)
+    {
+        if (path.endSetBy > int(lineNum))
+        {
+            path.endLine = path.endSetBy = -1;
+        }
+        while (path.nexts.back().line > int(lineNum))
+        {
+            path.nexts.pop_back();
+        }
+        path.killPartner = nullptr; // get_next_event sets this again below
+    }
 
-        if (curEvent) 
+    vector<Node> line;
+    for (const Node& node : _lines.back())
+    {
+        Path& path = _paths[node.path];
+        Path::Next& last = path.nexts.back();
+        int next = get_next_event(path, last.from);
+        if (next != node.next)
         {
-            // Loop through the skipped lanes and draw the linking characters
-            for (size_t i = prevLane + 1; i < (size_t)path.lane; ++i) 
-            {
-                _renderer->start_lane(i);
-                _renderer->draw_link(*curEvent);
-            }
+            // update() rewinds to the first line where this could happen
+            assert(last.line == int(_lines.size() - 1));
+            last.next = next;
         }
-        _renderer->start_lane(path.lane);
-        prevLane = path.lane;
+        line.emplace_back(node.process, node.event, next, node.path);
+    }
+    _lines.back() = std::move(line);
+    note_positions();
+}
 
-        char pathChar = node.zombie() ? '.' : '|';
-        Colour pathColour = Colour::WHITE;
+/* Notes down the state of each process that the diagram is now up to date
+ * with (see update). */
+void Diagram::remember_revisions()
+{
+    for (Path& path : _paths)
+    {
+        const ProcessHistory& events = history(*path.process);
+        path.revision = events.revision();
+        path.settled = events.settled_events();
+    }
+}
 
-        if (curEvent && (&curEvent->linked_path() == &node.process)) 
+/* Describes the sequence of events that the process went through, using the
+ * shape IDs (see refold) of its children for its forks. Returns an empty
+ * string if the process (or any of its descendants) isn't settled yet, since
+ * its shape could still change. */
+static string describe_shape(
+    const ProcessHistory& process, 
+    const std::unordered_map<const Process*, long>& shapes)
+{
+    if (!process.settled())
+    {
+        return "";
+    }
+    string shape = "P";
+    for (size_t i = 0; i < process.event_count(); ++i)
+    {
+        const Event& event = process.event(i);
+        if (auto fork = dynamic_cast<const ForkEvent*>(&event))
         {
-            // We've reached the end of a dashed line across lanes.
-            if (reversed) 
-            {
-                curEvent->draw(*_renderer.get());
-            } 
-            else 
+            auto it = shapes.find(fork->child.get());
+            if (it == shapes.end())
             {
-                _renderer->draw_char(Colour::WHITE, '+');
+                return ""; // the child hasn't settled yet
             }
-            reversed = false;
-            curEvent = nullptr;
-        } 
-        else if (node.event) 
+            shape += format("F{};", it->second);
+        }
+        else if (auto exec = dynamic_cast<const ExecEvent*>(&event))
         {
-            if (auto linkEv = dynamic_cast<const LinkEvent*>(node.event)) 
-            {
-                // This is the start of a dashed line across lanes.
-                assert(!curEvent);
-                curEvent = linkEv;
-                // If this is a kill event, the 'dashed line' could possibly
-                // be going backwards, in which case we'll draw it in reverse.
-                if (auto killEv = dynamic_cast<const KillEvent*>(linkEv)) 
-                {
-                    reversed = !killEv->sender;
-                }
-                if (reversed) 
-                {
-                    _renderer->draw_char(Colour::WHITE, '+');
-                } 
-                else 
-                {
-                    curEvent->draw(*_renderer.get());
-                }
-            }
-            else 
+            shape += format("E{}", exec->succeeded());
+            for (const string& arg : exec->args)
             {
-                // Just a normal event.
-                node.event->draw(*_renderer.get());
+                shape += arg;
+                shape += '\0';
             }
-        } 
-        else 
+            shape += ';';
+        }
+        else if (auto exit = dynamic_cast<const ExitEvent*>(&event))
         {
-            _renderer->draw_char(pathColour, pathChar); // continue the path
+            shape += format("X{};", exit->status);
         }
-
-        if (curEvent) 
+        else if (auto signal = dynamic_cast<const SignalEvent*>(&event))
         {
-            _renderer->draw_link(*curEvent); // TODO needed?
+            shape += format("S{},{};", signal->signal, signal->killed);
         }
-
-        // Was this the last node in the path?
-        assert(path.endLine >= 0);
-        if ((size_t)path.endLine > lineNum) 
+        else if (auto kill = dynamic_cast<const KillEvent*>(&event))
         {
-            _renderer->draw_continuation(path.lane, pathColour, pathChar);
+            shape += format("K{},{};", kill->info->signal, kill->sender);
+        }
+        else if (auto raise = dynamic_cast<const RaiseEvent*>(&event))
+        {
+            shape += format("A{};", raise->signal);
+        }
+        else if (dynamic_cast<const ReapEvent*>(&event))
+        {
+            shape += "R;";
+        }
+        else
+        {
+            shape += "W;";
         }
     }
+    return shape;
 }
 
-/* Draw the entire diagram. Call this only after all of the lines have been
- * built and all of the lanes have been allocated. */
-void Diagram::draw() 
+/* Sets the size of the run of siblings that's been collapsed into the path of
+ * the process (1 if there isn't one), and has its label drawn again if that
+ * changes it. */
+void Diagram::set_repeats(const Process& process, size_t count)
 {
-    for (size_t i = 0; i < _lines.size(); ++i) 
+    auto it = _repeats.find(&process);
+    if ((it == _repeats.end() ? 1 : it->second) == count)
+    {
+        return;
+    }
+    if (count > 1)
     {
-        draw_line(_lines.at(i), i);
+        _repeats[&process] = count;
+    }
+    else
+    {
+        _repeats.erase(it);
+    }
+    auto slot = _slots.find(&process);
+    if (slot != _slots.end())
+    {
+        _relabelLine = std::min<size_t>(_relabelLine, 
+            _paths[slot->second].startLine);
     }
 }
 
-Diagram::Diagram(const Process& leader, size_t laneWidth, int opts) 
-    : _leader(leader), _options(opts)
-{
-    _renderer = std::make_unique<Drawer>(laneWidth);
-    redraw();
-}
-
-Diagram::~Diagram()
+/* Hides the process and all of its descendants, adding the ones that weren't
+ * hidden already to `toggled`. */
+void Diagram::hide_subtree(const Process& root, vector<const Process*>& toggled)
 {
-    // Needed here (specifically here) to stop unique_ptr from getting angry
+    vector<const Process*> stack = { &root };
+    while (!stack.empty())
+    {
+        const Process* process = stack.back();
+        stack.pop_back();
+        if (_hidden.insert(process).second)
+        {
+            toggled.push_back(process);
+        }
+        set_repeats(*process, 1); // only shown processes have runs
+        const ProcessHistory& events = history(*process);
+        for (size_t i = 0; i < events.event_count(); ++i)
+        {
+            auto e = dynamic_cast<const ForkEvent*>(&events.event(i));
+            if (e)
+            {
+                stack.push_back(e->child.get());
+            }
+        }
+    }
 }
 
-const Window& Diagram::result() const
+/* Works out which of the children of a shown process should be hidden: all
+ * of them if it's folded, or else every one after the first in a run of
+ * children with the same shape (unless the run has been expanded). Children
+ * that get shown again are pushed onto `stack` (as are all of the shown ones
+ * if _refoldAll is set), since their own children have to be worked out
+ * again too. See refold for `toggled` and `changed`. */
+void Diagram::refold_children(
+    const Process& process,
+    vector<const Process*>& stack,
+    vector<const Process*>& toggled,
+    std::unordered_map<const Process*, size_t>& changed)
 {
-    return _renderer->result();
-}
-
-void Diagram::redraw()
+    bool folded = _folded.count(&process);
+    const Process* runStart = nullptr;
+    long runShape = -1;
+    size_t runCount = 0;
+    bool collapsing = false;
+    const ProcessHistory& events = history(process);
+    for (size_t i = 0; i < events.event_count(); ++i)
+    {
+        auto fork = dynamic_cast<const ForkEvent*>(&events.event(i));
+        if (!fork)
+        {
+            continue;
+        }
+        const Process* child = fork->child.get();
+        auto shapeIt = _shapes.find(child);
+        long shape = shapeIt == _shapes.end() ? -1 : shapeIt->second;
+        bool hide = folded;
+        if (!folded && shape >= 0 && shape == runShape)
+        {
+            if (collapsing)
+            {
+                hide = true;
+                runCount++;
+            }
+            else
+            {
+                set_repeats(*child, 1); // in an expanded run
+            }
+        }
+        else
+        {
+            if (runStart)
+            {
+                set_repeats(*runStart, runCount);
+            }
+            runStart = child;
+            runShape = shape;
+            runCount = 1;
+            collapsing = shape >= 0 && !_expanded.count(child);
+        }
+
+        bool hidden = _hidden.count(child);
+        if (hide != hidden)
+        {
+            auto it = changed.emplace(&process, i).first;
+            it->second = std::min(it->second, i);
+        }
+        if (hide)
+        {
+            if (!hidden)
+            {
+                hide_subtree(*child, toggled);
+            }
+        }
+        else
+        {
+            if (hidden)
+            {
+                _hidden.erase(child);
+                toggled.push_back(child);
+            }
+            if (hidden || _refoldAll)
+            {
+                stack.push_back(child);
+            }
+        }
+    }
+    if (runStart)
+    {
+        set_repeats(*runStart, runCount);
+    }
+}
+
+/* Works out which processes should be hidden and which runs of siblings get
+ * collapsed (see toggle_fold), keeping _hidden and _repeats up to date. For
+ * each of the processes that are still shown but have had some of their
+ * events hidden or shown again, `changed` gets the index of the first of
+ * those events (so that update() can figure out which lines need to be built
+ * again). Only the processes that have changed (and the ones above them) get
+ * looked at again, unless _refoldAll is set. */
+void Diagram::refold(std::unordered_map<const Process*, size_t>& changed)
+{
+    if (!(_options & COLLAPSE_REPEATS) && _folded.empty() && _hidden.empty())
+    {
+        return; // nothing is (or was) folded
+    }
+
+    // Look through the new events of the processes that could still change,
+    // for new children (which might have to be hidden). The new children go
+    // on the end, so they get looked through too.
+    for (size_t i = 0; i < _unsettled.size(); ++i)
+    {
+        const Process* process = _unsettled[i].process;
+        const ProcessHistory& events = history(*process);
+        size_t scanned = _unsettled[i].scanned;
+        for (; scanned < events.event_count(); ++scanned)
+        {
+            auto e = dynamic_cast<const ForkEvent*>(&events.event(scanned));
+            if (e)
+            {
+                _unsettled.push_back({e->child.get(), process, 0});
+                _refold.insert(process);
+            }
+        }
+        _unsettled[i].scanned = scanned;
+    }
+
+    // Give each subtree that has settled an ID for its shape, such that two
+    // subtrees have the same ID if they went through the same events. The
+    // children come after their parents in _unsettled, so going backwards
+    // gives them their IDs before their parents need them. Once a subtree
+    // has an ID, it's never going to change again, so we can stop looking at
+    // it (but its parent might be able to collapse it into a run now).
+    for (size_t i = _unsettled.size(); i-- > 0; )
+    {
+        Unsettled& entry = _unsettled[i];
+        if (!history(*entry.process).settled())
+        {
+            continue;
+        }
+        if (_options & COLLAPSE_REPEATS)
+        {
+            string shape = describe_shape(history(*entry.process), _shapes);
+            if (shape.empty())
+            {
+                continue;
+            }
+            _shapes[entry.process] = _shapeIds.emplace(std::move(shape), 
+                _shapeIds.size()).first->second;
+            if (entry.parent)
+            {
+                _refold.insert(entry.parent);
+            }
+        }
+        entry.process = nullptr;
+    }
+    _unsettled.erase(std::remove_if(_unsettled.begin(), _unsettled.end(),
+        [](const Unsettled& entry) { return !entry.process; }), 
+        _unsettled.end());
+
+    // Now work out the children of each process that might have changed (or
+    // of every shown process, going down from the leader). A hidden process
+    // has all of its children hidden along with it, apart from any new ones.
+    vector<const Process*> stack(_refold.begin(), _refold.end());
+    if (_refoldAll)
+    {
+        stack.push_back(&_leader);
+    }
+    _refold.clear();
+    vector<const Process*> toggled; // the processes hidden or shown again
+    while (!stack.empty())
+    {
+        const Process* process = stack.back();
+        stack.pop_back();
+        if (!_hidden.count(process))
+        {
+            refold_children(*process, stack, toggled, changed);
+            continue;
+        }
+        const ProcessHistory& events = history(*process);
+        for (size_t i = 0; i < events.event_count(); ++i)
+        {
+            auto e = dynamic_cast<const ForkEvent*>(&events.event(i));
+            if (e && !_hidden.count(e->child.get()))
+            {
+                hide_subtree(*e->child, toggled);
+            }
+        }
+    }
+    _refoldAll = false;
+
+    // A kill between a process that has been hidden (or shown again) and one
+    // that's still shown changes what's shown on the latter's path too.
+    for (const Process* process : toggled)
+    {
+        const ProcessHistory& events = history(*process);
+        for (size_t i = 0; i < events.event_count(); ++i)
+        {
+            auto kill = dynamic_cast<const KillEvent*>(&events.event(i));
+            if (!kill || _hidden.count(&kill->linked_path()))
+            {
+                continue;
+            }
+            const ProcessHistory& partner = history(kill->linked_path());
+            for (size_t j = 0; j < partner.event_count(); ++j)
+            {
+                auto other = dynamic_cast<const KillEvent*>(&partner.event(j));
+                if (other && other->info == kill->info)
+                {
+                    auto it = changed.emplace(&kill->linked_path(), j).first;
+                    it->second = std::min(it->second, j);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Labels the top of the path of a process that has had a run of its siblings
+ * collapsed into it, or that has been folded up (see toggle_fold). */
+void Diagram::draw_label(IEventRenderer& renderer, 
+                         const Process& process) const
+{
+    auto it = _repeats.find(&process);
+    if (it != _repeats.end())
+    {
+        renderer.draw_string(FOLD_COLOUR, format("x{}", it->second));
+    }
+    if (_folded.count(&process))
+    {
+        renderer.draw_string(FOLD_COLOUR, "..");
+    }
+}
+
+/* Returns true if any of the lanes that are in both layouts (see _laneX)
+ * start or end in different places. New lanes on the right don't count. */
+static bool lanes_moved(const vector<size_t>& before, 
+                        const vector<size_t>& after)
+{
+    size_t n = std::min(before.size(), after.size());
+    return !std::equal(before.begin(), before.begin() + n, after.begin());
+}
+
+/* Works out where each lane starts (see _laneX), measuring the lines from
+ * `from` onwards if we're using COMPACT_LANES. The measurements only ever
+ * grow (until a redraw), so the lines before `from` don't need measuring
+ * again - even if some of them were measured in the lane that a path was in
+ * before it moved, that only makes a lane wider than it has to be. Returns
+ * true if any of the lanes have moved since last time. */
+bool Diagram::measure_lanes(size_t from)
+{
+    vector<size_t> laneX(_laneCount + 1);
+    if (!(_options & COMPACT_LANES))
+    {
+        for (size_t i = 0; i <= _laneCount; ++i)
+        {
+            laneX[i] = i * _laneWidth + LSHIFT;
+        }
+        std::swap(laneX, _laneX);
+        return lanes_moved(laneX, _laneX);
+    }
+
+    _laneLead.resize(_laneCount, 0);
+    _laneExtent.resize(_laneCount, 1);
+    auto measured = [&](size_t lane, const Measurer& measurer) {
+        _laneLead[lane] = std::max(_laneLead[lane], measurer.lead());
+        _laneExtent[lane] = std::max(_laneExtent[lane], measurer.extent());
+    };
+    for (size_t i = from; i < _lines.size(); ++i)
+    {
+        for (const Node& node : _lines[i])
+        {
+            const Path& path = _paths[node.path];
+            Measurer measurer(*this);
+            if (node.event)
+            {
+                node.event->draw(measurer);
+            }
+            if (i == size_t(path.startLine)
+                && (!_repeats.empty() || !_folded.empty()))
+            {
+                draw_label(measurer, node.process);
+            }
+            measured(path.lane, measurer);
+
+            // A KillEvent going backwards gets drawn at the other end
+            auto kill = dynamic_cast<const KillEvent*>(node.event);
+            auto partner = kill ? _slots.find(&kill->linked_path()) 
+                : _slots.end();
+            if (partner != _slots.end() && _paths[partner->second].lane >= 0)
+            {
+                Measurer measurer(*this);
+                kill->draw(measurer);
+                measured(_paths[partner->second].lane, measurer);
+            }
+        }
+    }
+
+    // Leave a column free between the widest thing in a lane and whatever
+    // reaches back into it from the next lane.
+    laneX[0] = LSHIFT;
+    for (size_t i = 0; i < _laneCount; ++i)
+    {
+        size_t width = _laneExtent[i] + 1;
+        if (i + 1 < _laneCount)
+        {
+            width += _laneLead[i + 1];
+        }
+        laneX[i + 1] = laneX[i] + std::max(width, MIN_LANE_WIDTH);
+    }
+    std::swap(laneX, _laneX);
+    return lanes_moved(laneX, _laneX);
+}
+
+/* Draw a single line of the diagram. `lineNum` is indexed from 0. */
+void Diagram::draw_line(Drawer& drawer, 
+                        const vector<Node>& line, 
+                        size_t lineNum) const
+{
+    size_t gap = _rows.at(lineNum + 1) - _rows.at(lineNum) - 1;
+    drawer.start_line(_rows.at(lineNum), gap, _squashed.at(lineNum));
+    // If we're currently in the middle of drawing a dashed line to another
+    // lane for an event (e.g., forking or reaping), then we use this to keep
+    // track of what that event currently is.
+    const LinkEvent* curEvent = nullptr;
+    // True if the current child event is 'reversed', which means it's going
+    // backwards. In this case, we draw the termination on the left hand side
+    // and the event on the right hand side.
+    bool reversed = false;
+    // The most recent lane index that we've looped through.
+    size_t prevLane = 0;
+
+    for (const Node& node : line) 
+    {
+        const Path& path = _paths[node.path];
+        assert(path.lane >= 0 && (size_t)path.lane >= prevLane);
+
+        if (curEvent) 
+        {
+            // Loop through the skipped lanes and draw the linking characters
+            for (size_t i = prevLane + 1; i < (size_t)path.lane; ++i) 
+            {
+                if (drawer.beyond(i))
+                {
+                    break;
+                }
+                drawer.start_lane(i);
+                drawer.draw_link(*curEvent);
+            }
+        }
+        if (drawer.beyond(path.lane))
+        {
+            break; // the rest of the line is off to the right of the Window
+        }
+        drawer.start_lane(path.lane);
+        prevLane = path.lane;
+
+        char pathChar = zombie(node) ? '.' : '|';
+        Colour pathColour = Colour::WHITE;
+        if (highlighted(node.process, lineNum))
+        {
+            pathColour = HIGHLIGHT_COLOUR;
+        }
+
+        if (curEvent && (&curEvent->linked_path() == &node.process)) 
+        {
+            // We've reached the end of a dashed line across lanes.
+            if (reversed) 
+            {
+                curEvent->draw(drawer);
+            } 
+            else 
+            {
+                drawer.draw_char(Colour::WHITE, '+');
+            }
+            reversed = false;
+            curEvent = nullptr;
+        } 
+        else if (node.event) 
+        {
+            if (auto linkEv = dynamic_cast<const LinkEvent*>(node.event)) 
+            {
+                // This is the start of a dashed line across lanes.
+                assert(!curEvent);
+                curEvent = linkEv;
+                // If this is a kill event, the 'dashed line' could possibly
+                // be going backwards, in which case we'll draw it in reverse.
+                if (auto killEv = dynamic_cast<const KillEvent*>(linkEv)) 
+                {
+                    reversed = !killEv->sender;
+                }
+                if (reversed) 
+                {
+                    drawer.draw_char(Colour::WHITE, '+');
+                } 
+                else 
+                {
+                    curEvent->draw(drawer);
+                }
+            }
+            else 
+            {
+                // Just a normal event.
+                node.event->draw(drawer);
+            }
+        } 
+        else 
+        {
+            drawer.draw_char(pathColour, pathChar); // continue the path
+        }
+
+        if (lineNum == size_t(path.startLine) 
+            && (!_repeats.empty() || !_folded.empty()))
+        {
+            draw_label(drawer, node.process);
+        }
+
+        if (curEvent) 
+        {
+            drawer.draw_link(*curEvent); // TODO needed?
+        }
+
+        // Was this the last node in the path?
+        assert(path.endLine >= 0);
+        if ((size_t)path.endLine > lineNum) 
+        {
+            drawer.draw_continuation(path.lane, pathColour, pathChar);
+        }
+    }
+}
+
+/* Returns the time of the latest event that appears on the line, or 0 if
+ * there aren't any events on the line. */
+Timestamp Diagram::line_time(const vector<Node>& line) const
+{
+    Timestamp time = 0;
+    for (const Node& node : line)
+    {
+        if (node.event)
+        {
+            time = std::max(time, node.event->time);
+        }
+    }
+    return time;
+}
+
+/* Figures out which row each line of the diagram goes on (fills in _rows and
+ * _squashed) for the lines from `from` onwards. Call this after all of the
+ * lines have been built. */
+void Diagram::compute_rows(size_t from)
+{
+    // Lines without any events on them just carry on from the time of the
+    // line before (so they take up as little room as usual when scaled).
+    _times.resize(from);
+    Timestamp prevTime = from > 0 ? _times.back() : _leader.start_time();
+    for (size_t i = from; i < _lines.size(); ++i)
+    {
+        prevTime = std::max(prevTime, line_time(_lines[i]));
+        _times.push_back(prevTime);
+    }
+
+    _rows.resize(from + 1);
+    _squashed.resize(_lines.size());
+    for (size_t i = from; i < _lines.size(); ++i)
+    {
+        _squashed[i] = false;
+        size_t gap = 1;
+        if ((_options & TIME_SCALED) && i + 1 < _lines.size())
+        {
+            Timestamp elapsed = _times[i + 1] - _times[i];
+            gap = 1 + elapsed / std::max<Timestamp>(_scale.rowTime, 1);
+            if (gap > _scale.maxGap)
+            {
+                gap = std::max<size_t>(_scale.maxGap, 1);
+                _squashed[i] = true;
+            }
+        }
+        _rows.push_back(_rows.back() + 1 + gap);
+    }
+}
+
+/* Returns true if the process's path on the specified line (and the gap that
+ * follows the line) should be drawn with HIGHLIGHT_COLOUR. */
+bool Diagram::highlighted(const Process& process, size_t lineNum) const
+{
+    auto it = _highlights.find(&process);
+    if (it == _highlights.end())
+    {
+        return false;
+    }
+    Timestamp time = _times.at(lineNum);
+    Timestamp next = time;
+    if (lineNum + 1 < _times.size())
+    {
+        next = _times[lineNum + 1];
+    }
+    for (auto [from, to] : it->second)
+    {
+        if (from <= time && next <= to)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Notes that the lines from `from` onwards have changed, so they'll need to
+ * be drawn again (and checked for truncation) before anyone looks at them. */
+void Diagram::invalidate(size_t from)
+{
+    _staleLine = std::min(_staleLine, from);
+    _uncheckedLine = std::min(_uncheckedLine, from);
+    _overview.line = std::min(_overview.line, from);
+}
+
+Diagram::Diagram(const Process& leader, size_t laneWidth, int opts)
+    : Diagram(leader, laneWidth, opts, TimeScale())
+{
+}
+
+Diagram::Diagram(const Process& leader, 
+                 size_t laneWidth, 
+                 int opts, 
+                 TimeScale scale) 
+    : _leader(leader), _laneWidth(laneWidth), _options(opts), _scale(scale),
+    _staleLine(0), _uncheckedLine(0), _truncated(false), _pool(nullptr),
+    _relabelLine(SIZE_MAX), _refoldAll(true)
+{
+    redraw();
+}
+
+Diagram::Diagram(std::shared_ptr<const TreeSnapshot> tree,
+                 size_t laneWidth,
+                 int opts,
+                 TimeScale scale)
+    : _leader(tree->leader()), _tree(std::move(tree)), _laneWidth(laneWidth),
+    _options(opts), _scale(scale), _staleLine(0), _uncheckedLine(0),
+    _truncated(false), _pool(nullptr), _relabelLine(SIZE_MAX),
+    _refoldAll(true)
+{
+    redraw();
+}
+
+Diagram::~Diagram()
+{
+    // Needed here (specifically here) to stop unique_ptr from getting angry
+}
+
+/* Draws the lines from `from` onwards onto `win` (or nowhere if it's null),
+ * and returns true if any of them were truncated. Each line only draws on its
+ * own rows, so with a thread pool, we split the lines into a band for each
+ * thread and draw the bands at the same time. */
+bool Diagram::draw_lines(Window* win, size_t from) const
+{
+    size_t count = from < _lines.size() ? _lines.size() - from : 0;
+    size_t bands = 1;
+    if (_pool)
+    {
+        bands = std::min(_pool->size(), count / MIN_BAND_LINES);
+        bands = std::max<size_t>(bands, 1);
+    }
+    vector<char> truncated(bands, false); // not vector<bool>, it isn't safe
+    auto drawBand = [&](size_t band) {
+        Drawer drawer(*this, _laneX, win);
+        size_t end = from + count * (band + 1) / bands;
+        for (size_t i = from + count * band / bands; i < end; ++i)
+        {
+            draw_line(drawer, _lines[i], i);
+        }
+        truncated[band] = drawer.truncated();
+    };
+    if (bands == 1)
+    {
+        drawBand(0);
+    }
+    else
+    {
+        _pool->run(bands, drawBand);
+    }
+    return std::find(truncated.begin(), truncated.end(), true) 
+        != truncated.end();
+}
+
+const Window& Diagram::result() const
+{
+    if (!_image || _image->width() > width())
+    {
+        _image = std::make_unique<Window>(width(), height());
+        _staleLine = 0;
+    }
+    if (_staleLine < _lines.size())
+    {
+        // The lanes on the left stay where they were when the diagram gets
+        // wider, so the lines above the stale one are still good.
+        _image->resize(width(), height());
+        _image->clear_rows(_rows.at(_staleLine));
+        bool truncated = draw_lines(_image.get(), _staleLine);
+        if (_staleLine <= _uncheckedLine)
+        {
+            _truncated = _truncated || truncated;
+            _uncheckedLine = _lines.size();
+        }
+        _staleLine = _lines.size();
+    }
+    return *_image;
+}
+
+void Diagram::render(Window& dest, size_t x, size_t y) const
+{
+    dest.clear_rows(0);
+    // Each line takes up the rows from its own row down to the next line's
+    // row, so start with the last line that starts at or above y.
+    size_t i = std::upper_bound(_rows.begin(), _rows.end() - 1, y) 
+        - _rows.begin();
+    i = i > 0 ? i - 1 : 0;
+    Drawer drawer(*this, _laneX, &dest, x, y);
+    for (; i < _lines.size() && _rows[i] < y + dest.height(); ++i)
+    {
+        draw_line(drawer, _lines[i], i);
+    }
+}
+
+void Diagram::stream(std::ostream& dest, bool colour, size_t maxWidth) const
+{
+    size_t columns = std::min(width(), maxWidth);
+    size_t rows = height();
+    size_t threads = _pool ? _pool->size() : 1;
+    vector<std::unique_ptr<Window>> bands;
+    for (size_t y = 0; y < rows; y += threads * STREAM_ROWS)
+    {
+        size_t count = std::min(threads, 
+            (rows - y + STREAM_ROWS - 1) / STREAM_ROWS);
+        while (bands.size() < count)
+        {
+            bands.push_back(std::make_unique<Window>(columns, STREAM_ROWS));
+        }
+        auto renderBand = [&](size_t i) {
+            render(*bands[i], 0, y + i * STREAM_ROWS);
+        };
+        if (_pool)
+        {
+            _pool->run(count, renderBand);
+        }
+        else
+        {
+            renderBand(0);
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t top = y + i * STREAM_ROWS;
+            bands[i]->print_rows(dest, 0, std::min(STREAM_ROWS, rows - top),
+                columns, colour);
+        }
+    }
+    dest.flush();
+}
+
+size_t Diagram::width() const
+{
+    return _laneX.back();
+}
+
+/* Adds the nodes of a line to the cells of the overview that they're in. A
+ * node counts in every block of rows that its part of the path goes through
+ * (down to the next line), so long gaps don't leave holes in the overview.
+ * Only the bands of blocks from `fromBand` down get added to. */
+void Diagram::add_to_overview(size_t lineNum, size_t fromBand) const
+{
+    Overview& overview = _overview;
+    size_t firstBand = _rows[lineNum] / overview.scaleY;
+    size_t lastBand = (_rows[lineNum + 1] - 1) / overview.scaleY;
+    for (const Node& node : _lines[lineNum])
+    {
+        size_t column = _laneX[_paths[node.path].lane] / overview.scaleX;
+        uint8_t flags = 0;
+        if (node.event)
+        {
+            uint8_t kinds = node.event->kinds();
+            auto exit = dynamic_cast<const ExitEvent*>(node.event);
+            auto signal = dynamic_cast<const SignalEvent*>(node.event);
+            if (kinds & EXEC_EVENT)
+            {
+                flags |= OVERVIEW_EXEC;
+            }
+            if ((kinds & FAILED_EXEC_EVENT) || (exit && exit->status != 0))
+            {
+                flags |= OVERVIEW_FAILED;
+            }
+            if (signal && signal->killed)
+            {
+                flags |= OVERVIEW_KILLED;
+            }
+        }
+        if (firstBand < fromBand)
+        {
+            flags = 0; // the event's band has been added up already
+        }
+        for (size_t band = std::max(firstBand, fromBand); band <= lastBand;
+            ++band)
+        {
+            OverviewCell& cell = 
+                overview.cells[band * overview.columns + column];
+            cell.nodes++;
+            cell.flags |= flags;
+            flags = 0; // the event is only in the first band
+        }
+    }
+}
+
+void Diagram::overview(Window& dest, size_t scaleX, size_t scaleY) const
+{
+    assert(scaleX > 0 && scaleY > 0);
+    Overview& overview = _overview;
+    size_t columns = (width() + scaleX - 1) / scaleX;
+    size_t rows = (height() + scaleY - 1) / scaleY;
+    if (overview.scaleX != scaleX || overview.scaleY != scaleY
+        || overview.columns != columns)
+    {
+        overview.scaleX = scaleX;
+        overview.scaleY = scaleY;
+        overview.columns = columns;
+        overview.cells.clear();
+        overview.line = 0;
+    }
+
+    // The band of cells that the first changed line starts in has got bits
+    // of lines from before it in it too (any line whose part of the path
+    // reaches down into the band, even if the line starts further up), so
+    // those bits get added up again with the rest. _rows[i] is where line
+    // i - 1 ends, so look for the first line that ends past the band's top.
+    if (overview.line < _lines.size())
+    {
+        size_t band = _rows[overview.line] / scaleY;
+        auto end = std::partition_point(_rows.begin() + 1, 
+            _rows.begin() + overview.line + 1, 
+            [&](size_t row) { return row <= band * scaleY; });
+        overview.cells.resize(band * columns);
+        overview.cells.resize(rows * columns);
+        for (size_t i = end - _rows.begin() - 1; i < _lines.size(); ++i)
+        {
+            add_to_overview(i, band);
+        }
+        overview.line = _lines.size();
+    }
+    overview.cells.resize(rows * columns);
+
+    // Busier blocks get darker characters (compared to the busiest block)
+    static constexpr std::string_view SHADES = ".:-=+*#%@";
+    uint32_t busiest = 1;
+    for (const OverviewCell& cell : overview.cells)
+    {
+        busiest = std::max(busiest, cell.nodes);
+    }
+    dest.clear_rows(0);
+    for (size_t y = 0; y < std::min(rows, dest.height()); ++y)
+    {
+        for (size_t x = 0; x < std::min(columns, dest.width()); ++x)
+        {
+            const OverviewCell& cell = overview.cells[y * columns + x];
+            if (cell.nodes == 0)
+            {
+                continue;
+            }
+            Colour colour = Colour::DEFAULT;
+            if (cell.flags & OVERVIEW_KILLED)
+            {
+                colour = KILLED_COLOUR;
+            }
+            else if (cell.flags & OVERVIEW_FAILED)
+            {
+                colour = BAD_EXEC_COLOUR;
+            }
+            else if (cell.flags & OVERVIEW_EXEC)
+            {
+                colour = EXEC_COLOUR;
+            }
+            size_t shade = (cell.nodes - 1) * SHADES.size() / busiest;
+            dest.draw_char(x, y, colour, SHADES[shade]);
+        }
+    }
+}
+
+void Diagram::redraw()
 {
     _paths.clear();
+    _slots.clear();
     _lines.clear();
-    _paths[&_leader] = Path(0);
-    _lines.push_back({ start_path(_leader) });
+    _placed.clear();
+
+    // Fold everything up from scratch too (the tree might have been pruned)
+    _hidden.clear();
+    _repeats.clear();
+    _shapeIds.clear();
+    _shapes.clear();
+    _unsettled = { Unsettled{&_leader, nullptr, 0} };
+    _refold.clear();
+    _refoldAll = true;
+    std::unordered_map<const Process*, size_t> changed; // (don't care)
+    refold(changed);
+    _relabelLine = SIZE_MAX;
+    _lines.push_back({ start_path(add_path(_leader, 0)) });
+    note_positions();
     
     // Figure out what nodes go in each line of the diagram
     while (build_next_line()) { } 
 
-    // Recursively allocates all the paths to a lane
-    vector<vector<Path*>> lanes { vector<Path*>() };
-    allocate_process_to_lane(lanes, _leader);
+    allocate_lanes();
+    _laneLead.clear();
+    _laneExtent.clear();
+    measure_lanes(0);
+    compute_rows(0);
+    _staleLine = _uncheckedLine = _overview.line = 0;
+    _truncated = false;
+    _index.reset();
+    remember_revisions();
+}
+
+void Diagram::update()
+{
+    // Find the first line that a change to any of the processes could show up
+    // on. Everything before it was built from events that haven't changed.
+    // Folding can hide or show events too (as can the tree growing, since
+    // the subtrees in a run of identical siblings have to be settled).
+    std::unordered_map<const Process*, size_t> changed;
+    refold(changed);
+    size_t lineNum = _lines.size();
+    for (const Path& path : _paths)
+    {
+        size_t settled = path.settled;
+        auto folded = changed.find(path.process);
+        if (folded != changed.end())
+        {
+            settled = std::min(settled, folded->second);
+        }
+        else if (history(*path.process).revision() == path.revision)
+        {
+            continue;
+        }
+        // The first node on the path whose next event might have changed
+        auto it = std::partition_point(path.nexts.begin(), path.nexts.end(),
+            [&](const Path::Next& n) {
+                return n.next != -1 && size_t(n.next) < settled;
+            }
+        );
+        if (it == path.nexts.end())
+        {
+            --it;
+        }
+        lineNum = std::min<size_t>(lineNum, it->line);
+    }
+    invalidate(_relabelLine);
+    if (lineNum == _lines.size())
+    {
+        // Nothing has happened, but labels could have got wider
+        if (measure_lanes(_relabelLine))
+        {
+            invalidate(0);
+        }
+        _relabelLine = SIZE_MAX;
+        return;
+    }
+
+    _index.reset();
+    rewind(lineNum);
+    while (build_next_line()) { }
+    size_t firstMoved = allocate_lanes();
+    invalidate(std::min(lineNum, firstMoved));
+    size_t measureFrom = std::min(lineNum, _relabelLine);
+    if (firstMoved != SIZE_MAX)
+    {
+        // Start measuring again, since the lanes have been shuffled about
+        _laneLead.clear();
+        _laneExtent.clear();
+        measureFrom = 0;
+    }
+    if (measure_lanes(measureFrom))
+    {
+        invalidate(0); // everything to the right of the lane has moved over
+    }
+    _relabelLine = SIZE_MAX;
+    compute_rows(lineNum);
+    remember_revisions();
+}
+
+void Diagram::update(std::shared_ptr<const TreeSnapshot> tree)
+{
+    assert(_tree && &tree->leader() == &_leader);
+    _tree = std::move(tree);
+    update();
+}
+
+bool Diagram::toggle_fold(const Process& process)
+{
+    if (_folded.erase(&process) == 0)
+    {
+        bool forked = false;
+        const ProcessHistory& events = history(process);
+        for (size_t i = 0; i < events.event_count() && !forked; ++i)
+        {
+            forked = dynamic_cast<const ForkEvent*>(&events.event(i));
+        }
+        if (_repeats.count(&process))
+        {
+            _expanded.insert(&process);
+        }
+        else if (forked)
+        {
+            _folded.insert(&process);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    _refoldAll = true;
+    auto slot = _slots.find(&process);
+    if (slot != _slots.end())
+    {
+        _relabelLine = std::min<size_t>(_relabelLine, 
+            _paths[slot->second].startLine);
+    }
+    return true;
+}
+
+size_t Diagram::repeats(const Process& process) const
+{
+    auto it = _repeats.find(&process);
+    return it == _repeats.end() ? 1 : it->second;
+}
+
+bool Diagram::folded(const Process& process) const
+{
+    return _folded.count(&process);
+}
 
-    _renderer->start(lanes.size(), _lines.size());
-    _laneCount = lanes.size();
-    draw(); 
+void Diagram::highlight(const Process& process, Timestamp from, Timestamp to)
+{
+    _highlights[&process].emplace_back(from, to);
 }
 
 bool Diagram::truncated() const
 {
-    return _renderer->truncated();
+    if (_uncheckedLine < _lines.size())
+    {
+        // Go through the motions of drawing the lines without a Window
+        _truncated = draw_lines(nullptr, _uncheckedLine) || _truncated;
+        _uncheckedLine = _lines.size();
+    }
+    return _truncated;
 }
 
 // TODO refactor so that it returns process instead and stores event?
@@ -677,17 +1901,23 @@ const Event* Diagram::find(size_t lane,
     {
         return nullptr;
     }
-    for (const Node& node : _lines.at(line)) 
+    // The nodes on a line are in lane order, so we can binary search for it
+    const vector<Node>& nodes = _lines[line];
+    auto it = std::partition_point(nodes.begin(), nodes.end(),
+        [&](const Node& node) {
+            assert(_paths[node.path].lane >= 0);
+            return size_t(_paths[node.path].lane) < lane;
+        }
+    );
+    if (it != nodes.end()) 
     {
-        auto it = _paths.find(&node.process);
-        assert(it != _paths.end());
-        assert(it->second.lane >= 0);
-        if ((size_t)it->second.lane == lane) 
+        const Node& node = *it;
+        if (size_t(_paths[node.path].lane) == lane) 
         {
             if (node.next == -1) 
             {
                 // Will go to -1 if there are no events (this is desired)
-                eventIndex = (int)node.process.event_count() - 1;
+                eventIndex = (int)history(node.process).event_count() - 1;
             } 
             else 
             {
@@ -702,17 +1932,68 @@ const Event* Diagram::find(size_t lane,
     return nullptr;
 }
 
+const SearchIndex& Diagram::search_index() const
+{
+    if (_index)
+    {
+        return *_index;
+    }
+    // Paths are numbered in the order that they start, and the nodes of each
+    // line are in lane order, so everything goes in in order.
+    _index = std::make_unique<SearchIndex>();
+    for (const Path& path : _paths)
+    {
+        _index->add_path(*path.process, {size_t(path.startLine),
+            size_t(path.lane)});
+    }
+    for (size_t line = 0; line < _lines.size(); ++line)
+    {
+        for (const Node& node : _lines[line])
+        {
+            if (node.event)
+            {
+                _index->add_event(*node.event, {line,
+                    size_t(_paths[node.path].lane)});
+            }
+        }
+    }
+    return *_index;
+}
+
 void Diagram::get_coords(size_t lane, size_t line, size_t& x, size_t& y) const
 {
-    x = lane * _renderer->lane_width() + LSHIFT;
-    y = line * 2;
+    x = _laneX.at(std::min(lane, _laneCount - 1));
+    if (line < _lines.size())
+    {
+        y = _rows.at(line);
+    }
+    else
+    {
+        y = _rows.back() + (line - _lines.size()) * 2; // out of bounds anyway
+    }
+}
+
+void Diagram::get_lane_line(size_t x, size_t y, size_t& lane, 
+                            size_t& line) const
+{
+    // _laneX and _rows both go up, so find the last one that's <= x (or y)
+    auto laneIt = std::upper_bound(_laneX.begin(), _laneX.end() - 1, x);
+    lane = std::max<size_t>(laneIt - _laneX.begin(), 1) - 1;
+    auto lineIt = std::upper_bound(_rows.begin(), _rows.end() - 1, y);
+    line = std::max<size_t>(lineIt - _rows.begin(), 1) - 1;
 }
 
 size_t Diagram::locate(const Process& process) const
 {
-    auto it = _paths.find(&process);
-    assert(it != _paths.end());
-    return it->second.lane;
+    auto it = _slots.find(&process);
+    assert(it != _slots.end());
+    return _paths[it->second].lane;
+}
+
+bool Diagram::shows(const Process& process) const
+{
+    auto it = _slots.find(&process);
+    return it != _slots.end() && _paths[it->second].lane >= 0;
 }
 
 void Diagram::print() const 
@@ -723,16 +2004,16 @@ void Diagram::print() const
         std::cerr << format("{}Line {}\n", Indent(1), i);
         for (const Node& node : _lines.at(i)) 
         {
-            auto pair = _paths.find(&node.process);
-            assert(pair != _paths.end());
-            std::cerr << format("{}Lane {}\n", Indent(2), pair->second.lane);
-            node.print(3);
+            std::cerr << format("{}Lane {}\n", Indent(2), 
+                _paths[node.path].lane);
+            print(node, 3);
         }
     }
     std::cerr << "PATHS\n";
-    for (auto& [process, path] : _paths) 
+    for (const Path& path : _paths) 
     {
         std::cerr << format("{}pid={} startLine={} endLine={} lane={}\n",
-            Indent(1), process->pid(), path.startLine, path.endLine, path.lane);
+            Indent(1), path.process->pid(), path.startLine, path.endLine, 
+            path.lane);
     }
 }
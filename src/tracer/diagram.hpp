@@ -8,19 +8,34 @@
 #define FORKTRACE_DIAGRAM_HPP
 
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <memory>
+#include <iostream>
+#include <cstdint>
 
 #include "event.hpp"
+#include "search-index.hpp"
 
 class Window; // defined in terminal.hpp
 class Process; // defined in process.hpp
+class ProcessHistory; // defined in process.hpp
+class TreeSnapshot; // defined in process.hpp
 class Drawer; // defined in diagram.cpp
+class Skyline; // defined in diagram.cpp
+class ThreadPool; // defined in thread-pool.hpp
 
 /* This class allows you to build and draw diagrams produced by process trees.
  * This object does not take ownership (whether unique or shared) of each of
  * the Process/Event objects that constitute the process tree. Thus, while this
- * object exists, the process tree should not be modified or destroyed. */
+ * object exists, the process tree should not be destroyed. It's fine for the
+ * tree to grow (call update() to catch up with it), but it mustn't be pruned
+ * (see pruner.hpp) since that rewrites history that we've already drawn.
+ *
+ * A diagram can also be made from a TreeSnapshot instead, in which case it
+ * only ever reads the snapshots (and keeps hold of them), so it can be laid
+ * out and drawn on another thread while the tracer carries on. It's brought
+ * up to date by handing it a newer snapshot of the same tree. */
 class Diagram 
 {
 public:
@@ -31,14 +46,30 @@ public:
         SHOW_NON_FATAL_SIGNALS  = 1 << 2,
         SHOW_SIGNAL_SENDS       = 1 << 3,
         MERGE_EXECS             = 1 << 4, // TODO!!!!!
+        TIME_SCALED             = 1 << 5, // see TimeScale below
+        COLLAPSE_REPEATS        = 1 << 6, // see toggle_fold() below
+        COMPACT_LANES           = 1 << 7, // see _laneX below
     };
     static constexpr int DEFAULT_OPTS = 
         SHOW_EXECS | MERGE_EXECS | SHOW_SIGNAL_SENDS;
 
+    /* Only used with the TIME_SCALED option. Normally each line of events is
+     * followed by a single row that continues the paths down to the next line.
+     * With TIME_SCALED, we add one of those rows for every `rowTime` that went
+     * by between the two lines, so slow parts of the tree stand out as long
+     * stretches of path. A gap of more than `maxGap` rows gets squashed down
+     * to `maxGap` rows and is drawn dotted (':') to show it was cut short. */
+    struct TimeScale
+    {
+        Timestamp rowTime = 10000000; // 10ms
+        size_t maxGap = 8;
+    };
+
 private:
     /* Represents the location of a Process as viewed on the diagram. */
     struct Path 
     {
+        const Process* process;
         int startLine;
         int endLine; // -1 if not sure yet
         int lane; // -1 if not sure yet
@@ -49,8 +80,43 @@ private:
          * event so that the other path knows they're ready to dance ;-) */
         const Process* killPartner;
 
-        Path(int startLine);
-        Path() : startLine(-1), endLine(-1), lane(-1), killPartner(nullptr) { }
+        /* The line that was being built when endLine was set. */
+        int endSetBy;
+
+        /* Each time that a node on this path gets a new `next` event, we note
+         * down the line it was on, and the event index that the search for it
+         * started from. These are in line order, and `next` only goes up
+         * (until it's -1), which lets update() find where a change to the
+         * process's events first shows up on the diagram. */
+        struct Next
+        {
+            int line;
+            int from;
+            int next;
+        };
+        std::vector<Next> nexts;
+
+        /* The process's revision() and settled_events() as of the last time
+         * that the diagram was brought up to date. */
+        uint64_t revision;
+        size_t settled;
+
+        /* The index of this path's node within the last line that it was on
+         * (or -1 if it isn't on any yet). See path_ready_to_end. */
+        int position;
+
+        Path(const Process& process, int startLine);
+    };
+
+    /* Records where a path was put by allocate_lanes, so that the next time
+     * around it can skip all of the paths up until the first one that was
+     * changed (since those will all go in the same places again). */
+    struct Placement
+    {
+        const Process* process;
+        int startLine;
+        int endLine;
+        int lane;
     };
 
     /* This class represents a point in a process's lifecycle which occurs on
@@ -61,28 +127,69 @@ private:
         const Process& process;
         const Event* const event;
         const int next; // index of pending event, or -1 if none
+        const int path; // index of the process's path in _paths
         
-        Node(const Process& process, const Event* event, int next)
-            : process(process), event(event), next(next) { }
-
-        bool zombie() const; // does this node correspond to a zombie process
-        bool end_of_path() const; // are successors permitted after this?
-        const Event* const next_event() const; // return null if no next event
-        void print(Indent indent = 0) const;
+        Node(const Process& process, const Event* event, int next, int path)
+            : process(process), event(event), next(next), path(path) { }
     };
 
-    /* The _renderer is a pointer just so that we don't have to define the
-     * Drawer class in this header file (to avoid an incomplete type). */
     const Process& _leader; // the root of the process tree
-    std::unique_ptr<Drawer> _renderer; // the object that renders the diagram
+    std::shared_ptr<const TreeSnapshot> _tree; // null if drawing the processes
     size_t _laneCount;  // index of rightmost lane + 1
+    size_t _laneWidth; // columns per each lane
     int _options; // rendering config (TODO why no implicit int? compiler bug?)
+    TimeScale _scale; // only used with TIME_SCALED
+
+    /* The column that each lane starts on, plus one more element on the end
+     * for the width of the whole diagram. Normally every lane is _laneWidth
+     * columns wide, but with COMPACT_LANES each lane is only as wide as the
+     * widest thing drawn in it needs (and _laneWidth is ignored). _laneLead
+     * and _laneExtent hold how far things in each lane were measured to go
+     * to the left and to the right of the start of the lane. */
+    std::vector<size_t> _laneX;
+    std::vector<size_t> _laneLead;
+    std::vector<size_t> _laneExtent;
+
+    /* The whole diagram drawn out, which only gets made if someone asks for
+     * it with result() (the scroll view just renders the parts that are on
+     * the screen instead, since a big tree can take up gigabytes). Lines from
+     * _staleLine onwards need to be drawn again before it can be used, and
+     * the same goes for checking whether any of them are truncated. */
+    mutable std::unique_ptr<Window> _image;
+    mutable size_t _staleLine;
+    mutable size_t _uncheckedLine;
+    mutable bool _truncated;
+    ThreadPool* _pool; // for drawing big diagrams in bands (can be null)
+
+    /* The row (y coordinate) of each line on the result() Window. There is an
+     * extra element at the end which holds the total number of rows. Without
+     * TIME_SCALED, line i is always on row i * 2. _squashed[i] is true if the
+     * gap after line i was longer than _scale.maxGap rows. */
+    std::vector<size_t> _rows;
+    std::vector<bool> _squashed;
+
+    /* The time of each line (i.e., the time of the latest event on it, or the
+     * time of the line before if it has no events). Filled by compute_rows. */
+    std::vector<Timestamp> _times;
+
+    /* Stretches of time during which a process's path should be highlighted
+     * (see highlight()). Paths of processes not in here are drawn normally. */
+    std::unordered_map<const Process*, 
+        std::vector<std::pair<Timestamp, Timestamp>>> _highlights;
 
     /* Stores the location/information about the path occupied by each process
      * on the diagram. I could store that information inside the Process class
      * but I'd rather not squeeze diagram information into process tree data
-     * structures (and doing that has caused problems for me in the past). */
-    std::unordered_map<const Process*, Path> _paths;
+     * structures (and doing that has caused problems for me in the past).
+     *
+     * Paths are numbered in the order that they were started (so every path
+     * that starts after a given line comes after every path that doesn't),
+     * and each Node holds the number of its path, so that going from a node
+     * to its path is just an index into _paths. _slots is only needed to go
+     * the other way, from a process to its path, which happens once per fork,
+     * reap or kill rather than once per node. */
+    std::vector<Path> _paths;
+    std::unordered_map<const Process*, int> _slots;
 
     /* The Nodes in this vector are organized so that their lane numbers are
      * in ascending order (however the index isn't necessarily equal to the
@@ -92,36 +199,212 @@ private:
      * vector (they'll be invalidated if vector resized etc.). */
     std::vector<std::vector<Node>> _lines;
 
+    /* The paths in the order that allocate_lanes last placed them. */
+    std::vector<Placement> _placed;
+
+    /* Processes that have been folded up by toggle_fold(), and the first
+     * processes of runs that toggle_fold() has expanded again. */
+    std::unordered_set<const Process*> _folded;
+    std::unordered_set<const Process*> _expanded;
+
+    /* Worked out from the above by refold(). Processes in _hidden don't get a
+     * path, and neither do any events that link to them. _repeats holds the
+     * size of each run of identical siblings that was collapsed into the path
+     * of the first one. _relabelLine is the first line with a path whose
+     * label (see draw_label) has changed since it was last drawn. */
+    std::unordered_set<const Process*> _hidden;
+    std::unordered_map<const Process*, size_t> _repeats;
+    size_t _relabelLine;
+
+    /* What refold() has worked out so far, so that each update only has to
+     * look at what's changed since. _shapes has the shape ID of every subtree
+     * that has settled (which never changes after that), and _shapeIds has
+     * the shape that each ID stands for. _unsettled has the processes whose
+     * shapes could still change, parents first, along with their parents and
+     * how many of their events have been looked through for forks. _refold
+     * has the processes whose children might have to be hidden or shown
+     * again, and _refoldAll is set if that could be any of them. */
+    struct Unsettled
+    {
+        const Process* process;
+        const Process* parent; // null for the leader
+        size_t scanned;
+    };
+    std::unordered_map<std::string, long> _shapeIds;
+    std::unordered_map<const Process*, long> _shapes;
+    std::vector<Unsettled> _unsettled;
+    std::unordered_set<const Process*> _refold;
+    bool _refoldAll;
+
+    /* Built by search_index() the first time that it's needed after the
+     * diagram changes (it's thrown away by redraw() and update()). */
+    mutable std::unique_ptr<SearchIndex> _index;
+
+    /* The running totals behind overview(), for a block of scaleX columns by
+     * scaleY rows each. The lines before `line` have been added up already,
+     * and invalidate() moves it back to the first line that's changed. */
+    enum OverviewFlags : uint8_t
+    {
+        OVERVIEW_EXEC   = 1 << 0, // something execed
+        OVERVIEW_FAILED = 1 << 1, // a failed exec or a non-zero exit
+        OVERVIEW_KILLED = 1 << 2, // something was killed by a signal
+    };
+    struct OverviewCell
+    {
+        uint32_t nodes = 0; // nodes of paths that go through the block
+        uint8_t flags = 0;
+    };
+    struct Overview
+    {
+        size_t scaleX = 0;
+        size_t scaleY = 0;
+        size_t columns = 0; // cells in each row of `cells`
+        std::vector<OverviewCell> cells;
+        size_t line = 0;
+    };
+    mutable Overview _overview;
+
     /* Private functions, see source file. */
-    int get_next_event(const Process& process, size_t start);
+    int next_event(const Process& process, size_t start, uint8_t hidden) const;
+    uint8_t event_kinds(const Process& process, size_t i) const;
+    bool zombie(const Node& node) const;
+    bool end_of_path(const Node& node) const;
+    const Event* pending_event(const Node& node) const;
+    void print(const Node& node, Indent indent) const;
+    int get_next_event(Path& path, size_t start);
+    int find_next(int path, size_t start);
     Node get_successor(const Node& prevNode);
     Node continue_path(const Node& prevNode);
-    Node start_path(const Process& process);
-    void allocate_process_to_lane(std::vector<std::vector<Path*>>& lanes, 
-            const Process& process);
-    bool path_ready_to_end(const std::vector<Node>& prevLine,
-            const Process& process) const;
+    Node start_path(int path);
+    int add_path(const Process& process, int startLine);
+    void place_path(Skyline& skyline, Path& path);
+    size_t allocate_lanes();
+    bool path_ready_to_end(const std::vector<Node>& prevLine, int path) const;
     const Process* do_link_event(std::vector<Node>& curLine, int lineNum, 
-            Path& path, const Node& prevNode, const LinkEvent& event);
+            const Node& prevNode, const LinkEvent& event);
     bool build_next_line();
-    void draw_line(const std::vector<Node>& line, size_t lineNum);
-    void draw();
+    void note_positions();
+    void rewind(size_t lineNum);
+    void remember_revisions();
+    void refold(std::unordered_map<const Process*, size_t>& changed);
+    void refold_children(const Process& process,
+                         std::vector<const Process*>& stack,
+                         std::vector<const Process*>& toggled,
+                         std::unordered_map<const Process*, size_t>& changed);
+    void hide_subtree(const Process& root,
+                      std::vector<const Process*>& toggled);
+    void set_repeats(const Process& process, size_t count);
+    void draw_label(IEventRenderer& renderer, const Process& process) const;
+    bool measure_lanes(size_t from);
+    Timestamp line_time(const std::vector<Node>& line) const;
+    void compute_rows(size_t from);
+    bool highlighted(const Process& process, size_t lineNum) const;
+    void draw_line(Drawer& drawer, const std::vector<Node>& line, 
+            size_t lineNum) const;
+    bool draw_lines(Window* win, size_t from) const;
+    void invalidate(size_t from);
+    void add_to_overview(size_t lineNum, size_t fromBand) const;
 
 public:
     /* This will build the diagram. Once this constructor returns, the diagram
      * will be accessible via the get_window() function. The `laneWidth` param
-     * determines the number of columns used by each lane of the diagram. */
+     * determines the number of columns used by each lane of the diagram. The
+     * `scale` is ignored unless the TIME_SCALED option is given. */
     Diagram(const Process& leader, size_t laneWidth, int opts = DEFAULT_OPTS);
+    Diagram(const Process& leader, 
+            size_t laneWidth, 
+            int opts,
+            TimeScale scale);
+
+    /* Same as above, but draws the snapshot of a tree (see the top). */
+    Diagram(std::shared_ptr<const TreeSnapshot> tree,
+            size_t laneWidth,
+            int opts,
+            TimeScale scale);
 
     /* Needed to not make std::unique_ptr angry for some reason... */
     ~Diagram();
 
-    /* Return the diagram drawn onto a curses pad. */
+    /* Return the whole diagram drawn onto a Window. The Window only gets
+     * drawn (or brought up to date) when this is called, and it can be very
+     * big, so use render() if you only need to show part of the diagram. */
     const Window& result() const;
 
-    /* Request the diagram to redraw (e.g. if tree is updated). */
+    /* Draws the part of the diagram whose top-left corner is at (x, y) onto
+     * `dest`, filling the whole of `dest` (anything past the edges of the
+     * diagram is left blank). This only looks at the lines that end up on
+     * `dest`, so it doesn't matter how big the rest of the diagram is. */
+    void render(Window& dest, size_t x, size_t y) const;
+
+    /* Writes the diagram out to `dest` a band of rows at a time (rendering
+     * them with render()), so the whole thing is never drawn out in memory
+     * at once. Only the first `maxWidth` columns are written. With a thread
+     * pool, the next few bands get rendered at the same time. */
+    void stream(std::ostream& dest, bool colour = true, 
+                size_t maxWidth = SIZE_MAX) const;
+
+    /* Lets result() and truncated() split the lines up into bands that get
+     * drawn by the threads of the pool at the same time. */
+    void set_thread_pool(ThreadPool* pool) { _pool = pool; }
+
+    /* Get the size (in columns/rows) of the diagram when drawn out. */
+    size_t width() const;
+    size_t height() const { return _rows.back(); }
+
+    /* Draws a zoomed-out picture of the whole diagram onto `dest`, with each
+     * cell summing up a block of `scaleX` columns by `scaleY` rows: how busy
+     * it is (how many paths go through it), and whether anything exec'd,
+     * failed or got killed in it (in the colours of those events). It's
+     * added up from the lines rather than by drawing them, and only the
+     * lines that have changed since the last call (with the same scale) get
+     * looked at again. */
+    void overview(Window& dest, size_t scaleX, size_t scaleY) const;
+
+    /* Request the diagram to redraw from scratch. */
     void redraw();
 
+    /* Brings the diagram up to date with whatever has happened to the tree
+     * since it was built (or last updated). Only the lines that could have
+     * been affected by the new events get rebuilt and redrawn, along with
+     * any paths that had to move to a different lane, so this is a lot
+     * cheaper than redraw() when stepping through a big tree. */
+    void update();
+
+    /* Same as update(), but for a diagram of a snapshot: catches up with a
+     * newer snapshot of the same tree (taken since the last one). */
+    void update(std::shared_ptr<const TreeSnapshot> tree);
+
+    /* Returns the history of the process that the diagram is drawing: its
+     * snapshot, or the process itself if we aren't drawing a snapshot. Use
+     * this rather than the process when looking at what's on the diagram. */
+    const ProcessHistory& history(const Process& process) const;
+
+    /* Folds up the process's subtree so that its descendants aren't shown.
+     * Call update() afterwards to lay out the diagram again. If the process
+     * is already folded, then it gets unfolded. If it's the first process in
+     * a run of identical siblings that has been collapsed into its path (with
+     * the COLLAPSE_REPEATS option), then the run is expanded again instead.
+     *
+     * Siblings are identical if their subtrees are all settled (i.e., they're
+     * all over with and reaped) and they went through the same sequence of
+     * events (the same execs, exits, signals and so on, and the same for each
+     * of their children, all the way down). A run is a bunch of identical
+     * siblings that were forked one after the other. Collapsed runs and folded
+     * processes get labelled at the top of their paths ("x12" and ".."). 
+     * Returns false if there was nothing to fold. */
+    bool toggle_fold(const Process& process);
+
+    /* Returns the size of the run that's been collapsed into the process's
+     * path (1 if it isn't one), and whether the process is folded. */
+    size_t repeats(const Process& process) const;
+    bool folded(const Process& process) const;
+
+    /* Highlights the path of the process between the two times (inclusive),
+     * e.g., to show the critical path through the tree. A line is highlighted
+     * if it (and the gap below it) falls inside the stretch of time. You need
+     * to call redraw() afterwards for this to show up. */
+    void highlight(const Process& process, Timestamp from, Timestamp to);
+
     /* Returns true if parts of the diagram had to be truncated to fit them on
      * the diagram (this means that the lane width should be increased). */
     bool truncated() const;
@@ -139,23 +422,46 @@ public:
                       const Process*& process,
                       int& eventIndex) const;
 
+    /* Returns an index of where every process, program and kind of event is
+     * on the diagram (see SearchIndex). It gets built the first time that
+     * it's asked for after the diagram changes, and stays valid until the
+     * next call to redraw() or update(). */
+    const SearchIndex& search_index() const;
+
     /* Given the specified lane/line coordinates, convert them into the x/y
      * coordinates for the result() Window that we drew on to. If `lane` or
      * `line` are out of bounds, then the resulting coordinates will also be
      * out of bounds. */
     void get_coords(size_t lane, size_t line, size_t& x, size_t& y) const;
 
+    /* The opposite of get_coords: finds the lane and the line that the x/y
+     * coordinates on the result() Window fall into. */
+    void get_lane_line(size_t x, size_t y, size_t& lane, size_t& line) const;
+
     /* Determines what lane the specified process appears in. An assertion will
      * fail if the process couldn't be found in any lane. */
     size_t locate(const Process& process) const;
 
+    /* Returns true if the process has a lane of its own on the diagram (as
+     * opposed to being hidden in a folded subtree or a collapsed run). */
+    bool shows(const Process& process) const;
+
     /* Get the number of lanes/lines on the diagram. */
     size_t line_count() const { return _lines.size(); }
     size_t lane_count() const { return _laneCount; }
 
+    /* Get the time of the specified line (the time of the latest event on it,
+     * or of the line before it if it has no events of its own). */
+    Timestamp line_time(size_t line) const { return _times.at(line); }
+
     /* Get the leader process of this diagram. */
     const Process& leader() const { return _leader; }
 
+    /* Get the options/lane width that this diagram was built with. */
+    int options() const { return _options; }
+    size_t lane_width() const { return _laneWidth; }
+    const TimeScale& time_scale() const { return _scale; }
+
     /* For debugging. Prints internal structures to log. */
     void print() const;
 };
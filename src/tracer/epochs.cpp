@@ -0,0 +1,118 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  epochs
+ *
+ *      There's a global epoch counter that gets bumped each time we collect,
+ *      and a table of pins holding the epoch that each reader started in (0
+ *      for a free slot). Retired things get stamped with the epoch they were
+ *      retired in. Since they were already out of sight by then, a reader
+ *      that pinned a later epoch can't have found them, so they can be freed
+ *      once they're older than every pin in the table.
+ */
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "epochs.hpp"
+
+using std::shared_ptr;
+
+/* How many readers can be pinned at once (the rest wait for a free slot) */
+constexpr size_t MAX_PINS = 64;
+
+/* How many things get retired in between collections */
+constexpr size_t COLLECT_INTERVAL = 256;
+
+static std::atomic<uint64_t> gEpoch(1);
+static std::atomic<uint64_t> gPins[MAX_PINS]; // zero means the slot is free
+
+static std::mutex gRetiredLock; // protects everything below
+static std::deque<std::pair<uint64_t, shared_ptr<const void>>> gRetired;
+static size_t gSinceCollect = 0; // retired since the last collection
+
+static thread_local size_t t_pins = 0; // EpochPins held by this thread
+
+EpochPin::EpochPin()
+{
+    // Find a free slot and put the current epoch in it
+    for (size_t i = 0; ; i = (i + 1) % MAX_PINS)
+    {
+        uint64_t free = 0;
+        if (gPins[i].compare_exchange_strong(free, gEpoch.load()))
+        {
+            _slot = i;
+            break;
+        }
+        if (i == MAX_PINS - 1)
+        {
+            std::this_thread::yield(); // they're all taken, so wait a bit
+        }
+    }
+    // If the epoch moved on before our pin went in, then a collection might
+    // not have seen it, so pin the new epoch instead (everything that the
+    // collection freed was out of sight before the epoch moved on).
+    uint64_t pinned = gPins[_slot].load();
+    for (uint64_t now; (now = gEpoch.load()) != pinned; pinned = now)
+    {
+        gPins[_slot].store(now);
+    }
+    t_pins++;
+}
+
+EpochPin::~EpochPin()
+{
+    gPins[_slot].store(0);
+    t_pins--;
+}
+
+void retire(shared_ptr<const void> garbage)
+{
+    bool collect;
+    {
+        std::scoped_lock<std::mutex> guard(gRetiredLock);
+        gRetired.emplace_back(gEpoch.load(), std::move(garbage));
+        collect = ++gSinceCollect >= COLLECT_INTERVAL;
+    }
+    if (collect)
+    {
+        collect_retired();
+    }
+}
+
+size_t collect_retired()
+{
+    // The garbage gets dropped after unlocking, since freeing something
+    // could end up retiring more stuff.
+    std::vector<shared_ptr<const void>> garbage;
+    size_t remaining;
+    {
+        std::scoped_lock<std::mutex> guard(gRetiredLock);
+        gSinceCollect = 0;
+        uint64_t oldest = gEpoch.fetch_add(1) + 1;
+        for (const auto& pin : gPins)
+        {
+            uint64_t epoch = pin.load();
+            if (epoch != 0)
+            {
+                oldest = std::min(oldest, epoch);
+            }
+        }
+        while (!gRetired.empty() && gRetired.front().first < oldest)
+        {
+            garbage.push_back(std::move(gRetired.front().second));
+            gRetired.pop_front();
+        }
+        remaining = gRetired.size();
+    }
+    return remaining;
+}
+
+bool is_epoch_pinned()
+{
+    return t_pins > 0;
+}
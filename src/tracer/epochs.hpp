@@ -0,0 +1,46 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  epochs
+ *
+ *      Epoch-based reclamation, for stuff that the tracer swaps out while
+ *      other threads might still be reading the old copy (see
+ *      Process::snapshot). Readers pin the epoch that they start in, and
+ *      whatever gets retired only gets freed once nobody is pinned to an
+ *      epoch from before it was retired.
+ */
+#ifndef FORKTRACE_EPOCHS_HPP
+#define FORKTRACE_EPOCHS_HPP
+
+#include <cstddef>
+#include <memory>
+
+/* While one of these exists, nothing that's retired from now on will get
+ * freed. Taking one is cheap (an atomic or two), so take one per query rather
+ * than holding on to one forever - everything retired in the meantime piles
+ * up until it's gone. A thread can have more than one at once. */
+class EpochPin
+{
+private:
+    size_t _slot; // which slot in the table of pins is ours
+
+public:
+    EpochPin();
+    ~EpochPin();
+
+    EpochPin(const EpochPin&) = delete;
+    EpochPin(EpochPin&&) = delete;
+};
+
+/* Hands over something that readers might still be looking at, to be freed
+ * (i.e., dropped) once every EpochPin taken before this call is gone. This is
+ * thread-safe, and every so often it runs collect_retired by itself. */
+void retire(std::shared_ptr<const void> garbage);
+
+/* Frees everything that has been retired that nobody can still be looking at.
+ * Returns how many things are still waiting around for readers to finish. */
+size_t collect_retired();
+
+/* Returns true if the calling thread has an EpochPin. */
+bool is_epoch_pinned();
+
+#endif /* FORKTRACE_EPOCHS_HPP */
@@ -0,0 +1,100 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  event-list
+ *
+ *      Item i lives in the bottom node that you get to by taking BITS bits
+ *      of i at a time as slot numbers, starting from the top. The tree only
+ *      ever gets deeper at the root (when it's full), so every bottom node is
+ *      at the same depth.
+ */
+#include <cassert>
+#include <stdexcept>
+#include <fmt/core.h>
+
+#include "event-list.hpp"
+
+using std::shared_ptr;
+using std::make_shared;
+
+const shared_ptr<void>& PersistentSlots::slot(size_t i) const
+{
+    assert(i < _size);
+    const Node* node = _root.get();
+    for (unsigned shift = _shift; shift > 0; shift -= BITS)
+    {
+        node = static_cast<const Node*>(node->slots[(i >> shift) & MASK].get());
+    }
+    return node->slots[i & MASK];
+}
+
+size_t PersistentSlots::node_count() const
+{
+    if (!_root)
+    {
+        return 0;
+    }
+    // Each level has a node for every WIDTH nodes (or items) below it
+    size_t count = 0;
+    size_t level = _size;
+    for (unsigned shift = 0; shift <= _shift; shift += BITS)
+    {
+        level = (level + MASK) / WIDTH;
+        count += level;
+    }
+    return count;
+}
+
+void PersistentSlots::check(size_t i) const
+{
+    if (i >= _size)
+    {
+        throw std::out_of_range(
+            fmt::format("PersistentList::at({}) with size {}", i, _size));
+    }
+}
+
+void PersistentSlots::append(shared_ptr<void> item)
+{
+    if (!_root)
+    {
+        _root = make_shared<Node>();
+    }
+    else if (_size == (WIDTH << _shift))
+    {
+        // Full up, so the old root becomes the first child of a new one
+        auto root = make_shared<Node>();
+        root->slots[0] = std::move(_root);
+        _root = std::move(root);
+        _shift += BITS;
+    }
+    // Any nodes missing on the way down are past the end of every copy of us,
+    // so nobody else can be looking at the slots that we fill in.
+    Node* node = _root.get();
+    for (unsigned shift = _shift; shift > 0; shift -= BITS)
+    {
+        shared_ptr<void>& child = node->slots[(_size >> shift) & MASK];
+        if (!child)
+        {
+            child = make_shared<Node>();
+        }
+        node = static_cast<Node*>(child.get());
+    }
+    node->slots[_size & MASK] = std::move(item);
+    _size++;
+}
+
+void PersistentSlots::set_slot(size_t i, shared_ptr<void> item)
+{
+    assert(i < _size);
+    // Copy every node on the way down, since other lists might share them
+    _root = make_shared<Node>(*_root);
+    Node* node = _root.get();
+    for (unsigned shift = _shift; shift > 0; shift -= BITS)
+    {
+        shared_ptr<void>& child = node->slots[(i >> shift) & MASK];
+        auto copy = make_shared<Node>(*static_cast<const Node*>(child.get()));
+        node = copy.get();
+        child = std::move(copy);
+    }
+    node->slots[i & MASK] = std::move(item);
+}
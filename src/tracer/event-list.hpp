@@ -0,0 +1,120 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  event-list
+ *
+ *      The list of events that each process keeps, made so that copying it
+ *      is O(1) - that way the tracer can hand out a copy of a process's
+ *      history after every event, and readers on other threads can hang on
+ *      to it while the tracer carries on adding to the original. (Processes
+ *      keep their list of execs in one of these too.)
+ */
+#ifndef FORKTRACE_EVENT_LIST_HPP
+#define FORKTRACE_EVENT_LIST_HPP
+
+#include <cstddef>
+#include <memory>
+#include <functional>
+
+struct Event; // defined in event.hpp
+
+/* The part of PersistentList (see below) that doesn't care what's in it. The
+ * items are stored in a tree of small fixed-size nodes, with the items in the
+ * bottom ones (like Clojure's vectors). Copies share all of their nodes. */
+class PersistentSlots
+{
+private:
+    static constexpr unsigned BITS = 5;
+    static constexpr size_t WIDTH = 1 << BITS;
+    static constexpr size_t MASK = WIDTH - 1;
+
+    /* The slots hold the items in the bottom nodes and more nodes in all of
+     * the others, so they're type-erased to let one struct do both. */
+    struct Node
+    {
+        std::shared_ptr<void> slots[WIDTH];
+    };
+
+    std::shared_ptr<Node> _root;
+    size_t _size = 0;
+    unsigned _shift = 0; // BITS times the number of levels below the root
+
+protected:
+    const std::shared_ptr<void>& slot(size_t i) const;
+    void check(size_t i) const; // throws std::out_of_range if out of range
+    void append(std::shared_ptr<void> item);
+    void set_slot(size_t i, std::shared_ptr<void> item);
+
+public:
+    /* How big each node is (not counting the items in it). */
+    static constexpr size_t NODE_SIZE = sizeof(Node);
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    /* The number of nodes in the tree (as far as we can see - most of them
+     * are usually shared with other copies). */
+    size_t node_count() const;
+};
+
+/* A persistent list of shared items (see PersistentSlots). Replacing an item
+ * copies the nodes on the way down to it, so the other copies don't see the
+ * change, but adding to the end writes straight into the shared nodes - the
+ * other copies are shorter, so they never look at those slots. That means
+ * only the newest copy of a list should ever be added to (the others are only
+ * for reading). Indexing is O(log n), but with 32 slots per node, that's only
+ * one hop for most processes. */
+template <class T>
+class PersistentList : public PersistentSlots
+{
+public:
+    /* Returns the item at index `i`, which must be in range. */
+    const T& operator[](size_t i) const
+    {
+        return *static_cast<const T*>(slot(i).get());
+    }
+
+    /* Same as above, but throws a std::out_of_range if it's out of range. */
+    const T& at(size_t i) const { check(i); return (*this)[i]; }
+
+    const T& back() const { return (*this)[size() - 1]; }
+
+    /* Returns a handle to the item at index `i` (which must be in range) for
+     * putting into this or another list. */
+    std::shared_ptr<const T> share(size_t i) const
+    {
+        return std::static_pointer_cast<const T>(slot(i));
+    }
+
+    /* Adds an item to the end. Only do this to the newest copy! */
+    void push_back(std::shared_ptr<const T> item)
+    {
+        append(std::const_pointer_cast<T>(std::move(item)));
+    }
+
+    /* Replaces the item at index `i` (which must be in range). */
+    void set(size_t i, std::shared_ptr<const T> item)
+    {
+        set_slot(i, std::const_pointer_cast<T>(std::move(item)));
+    }
+
+    /* Takes out every item that `remove` returns true for, and returns the
+     * number of items taken out. Unlike the rest, this is O(n). */
+    size_t remove_if(const std::function<bool(const T&)>& remove)
+    {
+        PersistentList kept;
+        for (size_t i = 0; i < size(); ++i)
+        {
+            if (!remove((*this)[i]))
+            {
+                kept.append(slot(i));
+            }
+        }
+        size_t removed = size() - kept.size();
+        *this = std::move(kept);
+        return removed;
+    }
+};
+
+using EventList = PersistentList<Event>;
+
+#endif /* FORKTRACE_EVENT_LIST_HPP */
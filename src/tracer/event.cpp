@@ -30,9 +30,14 @@ bool ExecEvent::succeeded() const
     return calls.back().errcode == 0;
 }
 
-void Event::print_tree(Indent indent) const 
+uint8_t ExecEvent::kinds() const
 {
-    std::cerr << format("{}{}\n", indent, to_string());
+    return succeeded() ? EXEC_EVENT : EXEC_EVENT | FAILED_EXEC_EVENT;
+}
+
+void Event::print_tree(Indent indent, std::ostream& os) const 
+{
+    os << format("{}{}\n", indent, to_string());
 }
 
 string ForkEvent::to_string() const 
@@ -40,15 +45,15 @@ string ForkEvent::to_string() const
     return format("{} forked {}", owner.pid(), child->pid());
 }
 
-void ForkEvent::print_tree(Indent indent) const 
+void ForkEvent::print_tree(Indent indent, std::ostream& os) const 
 {
-    Event::print_tree(indent);
-    child->print_tree(indent + 1);
+    Event::print_tree(indent, os);
+    child->print_tree(indent + 1, os);
 }
 
 void ForkEvent::draw(IEventRenderer& renderer) const 
 {
-    renderer.draw_char(link_colour(), '+');
+    renderer.draw_char(link_colour(renderer.history(*child)), '+');
 }
 
 string get_wait_target_string(pid_t waitedId) 
@@ -120,17 +125,22 @@ ReapEvent::ReapEvent(Process& owner,
 }
 
 string ReapEvent::to_string() const 
+{
+    return to_string(*child);
+}
+
+string ReapEvent::to_string(const ProcessHistory& child) const
 {
     string target = get_wait_target_string(wait->waitedId);
     if (wait->nohang)
     {
         return format("{} reaped {} {{waited for {} (WNOHANG)}}", 
-            owner.pid(), child->death_event().to_string(), target);
+            owner.pid(), child.death_event().to_string(), target);
     }
     else
     {
         return format("{} reaped {} {{waited for {}}}",
-            owner.pid(), child->death_event().to_string(), target);
+            owner.pid(), child.death_event().to_string(), target);
     }
 }
 
@@ -149,17 +159,17 @@ void ReapEvent::draw(IEventRenderer& renderer) const
     {
         c = 'g';
     }
-    renderer.draw_char(link_colour(), c);
+    renderer.draw_char(link_colour(renderer.history(*child)), c);
 }
 
-char ReapEvent::link_char() const 
+char ReapEvent::link_char(const ProcessHistory& partner) const 
 {
-    return child->killed() ? '~' : '-';
+    return partner.killed() ? '~' : '-';
 }
 
-Colour ReapEvent::link_colour() const 
+Colour ReapEvent::link_colour(const ProcessHistory& partner) const 
 {
-    return child->killed() ? KILLED_COLOUR : EXITED_COLOUR;
+    return partner.killed() ? KILLED_COLOUR : EXITED_COLOUR;
 }
 
 string RaiseEvent::to_string() const 
@@ -253,12 +263,13 @@ void SignalEvent::draw(IEventRenderer& renderer) const
         return;
     }
 
-    if (owner.orphaned()) 
+    const ProcessHistory& history = renderer.history(owner);
+    if (history.orphaned()) 
     {
         renderer.backtrack();
         renderer.draw_char(Colour::DEFAULT, '[');
     } 
-    else if (!owner.reaped()) 
+    else if (!history.reaped()) 
     {
         renderer.backtrack();
         renderer.draw_char(KILLED_COLOUR, '~');
@@ -266,7 +277,7 @@ void SignalEvent::draw(IEventRenderer& renderer) const
 
     renderer.draw_string(KILLED_COLOUR, std::to_string(signal));
 
-    if (owner.orphaned()) 
+    if (history.orphaned()) 
     {
         renderer.draw_char(Colour::DEFAULT, ']');
     }
@@ -279,7 +290,8 @@ string ExitEvent::to_string() const
 
 void ExitEvent::draw(IEventRenderer& renderer) const 
 {
-    if (owner.orphaned()) 
+    const ProcessHistory& history = renderer.history(owner);
+    if (history.orphaned()) 
     {
         renderer.backtrack();
         renderer.draw_char(Colour::DEFAULT, '(');
@@ -287,7 +299,7 @@ void ExitEvent::draw(IEventRenderer& renderer) const
 
     renderer.draw_string(EXITED_COLOUR, std::to_string(status));
 
-    if (owner.orphaned()) 
+    if (history.orphaned()) 
     {
         renderer.draw_char(Colour::DEFAULT, ')');
     }
@@ -329,11 +341,11 @@ const ExecCall& ExecEvent::call() const
     return calls.back();
 }
 
-void ExecEvent::print_tree(Indent indent) const 
+void ExecEvent::print_tree(Indent indent, std::ostream& os) const 
 {
     for (auto& call : calls) 
     {
-        std::cerr << format("{}{}\n", indent, call.to_string(*this));
+        os << format("{}{}\n", indent, call.to_string(*this));
     }
 }
 
@@ -11,11 +11,14 @@
 #include <string>
 #include <vector>
 #include <optional>
+#include <iostream>
 
 #include "terminal.hpp"
 #include "log.hpp"
+#include "system.hpp"
 
 class Process; // defined in process.h
+class ProcessHistory; // defined in process.h
 struct ExecEvent; // defined in this file
 
 constexpr auto EXITED_COLOUR = Colour::GREEN | Colour::BOLD;
@@ -43,6 +46,11 @@ public:
 
     /* Draws a string with the specified colour. */
     virtual void draw_string(Colour c, std::string_view str) = 0;
+
+    /* Returns the history of the process as of what's being drawn: either the
+     * process itself, or a snapshot of it (see TreeSnapshot). Events have to
+     * look at the state of processes through this, not directly. */
+    virtual const ProcessHistory& history(const Process& process) const = 0;
 };
 
 struct SourceLocation 
@@ -54,17 +62,40 @@ struct SourceLocation
     std::string to_string() const;
 };
 
+/* Flags saying what sort of thing an event is, so that diagrams can filter
+ * events out without having to dynamic_cast every one of them every time (see
+ * Process::next_event). An event can be more than one of these at once. */
+enum EventKind : uint8_t
+{
+    EXEC_EVENT              = 1 << 0,
+    FAILED_EXEC_EVENT       = 1 << 1,
+    NON_FATAL_SIGNAL_EVENT  = 1 << 2,
+    SIGNAL_SEND_EVENT       = 1 << 3, // a KillEvent or a RaiseEvent
+    LINK_EVENT              = 1 << 4,
+    KILL_EVENT              = 1 << 5,
+};
+
 struct Event 
 {
     Process& owner;
     std::optional<SourceLocation> location;
 
-    Event(Process& owner) : owner(owner) { }
+    /* When the tracer found out about this event (see Process::update_time).
+     * For a ReapEvent this is when the wait returned - the time at which the
+     * wait started is still available from the WaitEvent stored inside it. */
+    Timestamp time;
+
+    Event(Process& owner) : owner(owner), time(0) { }
     virtual ~Event() { }
 
     virtual std::string to_string() const = 0;
-    virtual void print_tree(Indent indent = 0) const;
+    virtual void print_tree(Indent indent = 0,
+                            std::ostream& os = std::cerr) const;
     virtual void draw(IEventRenderer& renderer) const = 0; 
+
+    /* Returns some EventKind flags OR'd together. This can change for the
+     * last few events of a process (e.g., a signal that turns out to kill). */
+    virtual uint8_t kinds() const { return 0; }
 };
 
 /* An event that causes a horizontal line to be drawn, connecting the event
@@ -74,9 +105,15 @@ struct LinkEvent : Event
 {
     LinkEvent(Process& owner) : Event(owner) { }
 
-    virtual const Process& linked_path() const = 0; // return the partner
-    virtual char link_char() const = 0; // character used to draw the path
-    virtual Colour link_colour() const { return Colour::DEFAULT; }
+    /* Returns the partner, and the character and colour used to draw the
+     * path to it (given the partner's history, see IEventRenderer). */
+    virtual const Process& linked_path() const = 0;
+    virtual char link_char(const ProcessHistory& partner) const = 0;
+    virtual Colour link_colour(const ProcessHistory&) const
+    {
+        return Colour::DEFAULT;
+    }
+    virtual uint8_t kinds() const { return LINK_EVENT; }
 };
 
 /* An event that generates a child who sends SIGCHLD to the parent */
@@ -88,10 +125,10 @@ struct ForkEvent : LinkEvent
         : LinkEvent(owner), child(std::move(child)) { }
 
     virtual std::string to_string() const;
-    virtual void print_tree(Indent indent) const;
+    virtual void print_tree(Indent indent, std::ostream& os) const;
     virtual void draw(IEventRenderer& renderer) const;
     virtual const Process& linked_path() const { return *child.get(); }
-    virtual char link_char() const { return '-'; }
+    virtual char link_char(const ProcessHistory&) const { return '-'; }
 };
 
 /* Represents a wait call that hasn't yet resulted in a child getting reaped
@@ -136,10 +173,14 @@ struct ReapEvent : LinkEvent
               std::shared_ptr<Process> child);
 
     virtual std::string to_string() const;
+
+    /* Same as to_string, but takes the child's death event from the given
+     * history of it (e.g., its snapshot) rather than from the live child. */
+    std::string to_string(const ProcessHistory& child) const;
     virtual void draw(IEventRenderer& renderer) const;
     virtual const Process& linked_path() const { return *child.get(); }
-    virtual char link_char() const;
-    virtual Colour link_colour() const;
+    virtual char link_char(const ProcessHistory& partner) const;
+    virtual Colour link_colour(const ProcessHistory& partner) const;
 };
 
 /* A process sends a signal to either itself, a process group, or it sends it
@@ -156,6 +197,7 @@ struct RaiseEvent : Event
 
     virtual std::string to_string() const;
     virtual void draw(IEventRenderer& renderer) const;
+    virtual uint8_t kinds() const { return SIGNAL_SEND_EVENT; }
 };
 
 /* The shared information held by the source and destination processes of a 
@@ -195,7 +237,15 @@ struct KillEvent : LinkEvent
      * want it drawing ">>>>" as it goes left-to-right towards the receiver.
      * On the other hand, if it encounters the receiver first, then we want it
      * drawing "<<<<" as it goes left-to-right towards the sender. */
-    virtual char link_char() const { return sender ? '>' : '<'; }
+    virtual char link_char(const ProcessHistory&) const
+    {
+        return sender ? '>' : '<';
+    }
+
+    virtual uint8_t kinds() const
+    {
+        return LINK_EVENT | KILL_EVENT | SIGNAL_SEND_EVENT;
+    }
 };
 
 /* A process receives a signal, which may or may not kill it. */
@@ -213,6 +263,10 @@ struct SignalEvent : Event
 
     virtual std::string to_string() const;
     virtual void draw(IEventRenderer& renderer) const;
+    virtual uint8_t kinds() const
+    {
+        return killed ? 0 : NON_FATAL_SIGNAL_EVENT;
+    }
 };
 
 /* A process exits, causing it to terminate. */
@@ -258,8 +312,9 @@ struct ExecEvent : Event
         args(std::move(args)) { }
 
     virtual std::string to_string() const;
-    virtual void print_tree(Indent indent) const;
+    virtual void print_tree(Indent indent, std::ostream& os) const;
     virtual void draw(IEventRenderer& renderer) const;
+    virtual uint8_t kinds() const;
 
     /* Gets the most recent exec call. An assertion fails if no events (this
      * should not happen since the struct is constructed with at least one). */
@@ -0,0 +1,554 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  exporter
+ *
+ *      Each format has a writer that gets handed the processes one at a time
+ *      (in the same order as print_tree) and writes each one out straight
+ *      away. The only thing that the writers remember is a number for each
+ *      process that they've come across - PIDs get reused on long traces, so
+ *      they can't be used to tell processes apart in the output.
+ *
+ *      The writers only ever look at snapshots of the processes, so a tree
+ *      can be exported from another thread while it's still being traced.
+ */
+#include <cassert>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <fmt/core.h>
+
+#include "exporter.hpp"
+#include "process.hpp"
+#include "epochs.hpp"
+#include "sampler.hpp"
+#include "util.hpp"
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::unordered_map;
+using std::unordered_set;
+using fmt::format;
+
+ExportFormat parse_export_format(string_view str)
+{
+    if (str == "text")
+    {
+        return ExportFormat::TEXT;
+    }
+    else if (str == "json")
+    {
+        return ExportFormat::JSON;
+    }
+    else if (str == "dot")
+    {
+        return ExportFormat::DOT;
+    }
+    else if (str == "chrome")
+    {
+        return ExportFormat::CHROME;
+    }
+    throw std::runtime_error(
+        format("Expected text, json, dot or chrome, got \"{}\".", str));
+}
+
+/* Turns nanoseconds into the microseconds that trace events are stamped in
+ * (keeping the nanoseconds as a fraction so that nothing gets rounded off). */
+static string microseconds(Timestamp ns)
+{
+    return format("{}.{:03}", ns / 1000, ns % 1000);
+}
+
+/* When the process ended, or `now` if it hasn't yet. */
+static Timestamp end_time(const ProcessHistory& process, Timestamp now)
+{
+    return process.dead() ? process.death_event().time : now;
+}
+
+/* Same as event.to_string(), except that it never looks at the live state of
+ * another process: a reap's text includes how the child died, so that comes
+ * from the child's snapshot instead. The rest only use the event's own fields
+ * and PIDs (which never change). */
+static string describe(const Event& event)
+{
+    if (auto reap = dynamic_cast<const ReapEvent*>(&event))
+    {
+        return reap->to_string(reap->child->snapshot());
+    }
+    return event.to_string();
+}
+
+/* The base class of the writers for each format. */
+class TreeWriter
+{
+private:
+    unordered_map<const Process*, size_t> _ids;
+
+protected:
+    std::ostream& _os;
+    Timestamp _base; // times in the output are relative to this
+    Timestamp _now; // used as the end time of processes that are still alive
+
+    /* Returns the number that the process goes by in the output. */
+    size_t id(const Process& process)
+    {
+        return _ids.try_emplace(&process, _ids.size() + 1).first->second;
+    }
+
+    size_t id(const ProcessHistory& history)
+    {
+        return id(history.process());
+    }
+
+    Timestamp since_base(Timestamp time) const
+    {
+        return time > _base ? time - _base : 0;
+    }
+
+public:
+    TreeWriter(std::ostream& os, Timestamp base)
+        : _os(os), _base(base), _now(get_monotonic_time()) { }
+    virtual ~TreeWriter() { }
+
+    virtual void begin() { }
+    virtual void begin_tree(const ProcessHistory& leader, size_t index) { }
+    virtual void write_process(const ProcessHistory& process,
+                               size_t tree) = 0;
+    virtual void end_tree() { }
+    virtual void end() { }
+
+    /* Hands the snapshot of every process in the tree to write_process,
+     * parents first and children in the order that they were forked (without
+     * recursing, since a chain of forks can get really deep). The calling
+     * thread has to have an EpochPin. */
+    void write_tree(const Process& leader, size_t index)
+    {
+        begin_tree(leader.snapshot(), index);
+        vector<const ProcessHistory*> stack = {&leader.snapshot()};
+        vector<const ProcessHistory*> children;
+        while (!stack.empty())
+        {
+            const ProcessHistory* process = stack.back();
+            stack.pop_back();
+            write_process(*process, index);
+            children.clear();
+            for (size_t i = 0; i < process->event_count(); ++i)
+            {
+                auto fork = dynamic_cast<const ForkEvent*>(&process->event(i));
+                if (fork)
+                {
+                    children.push_back(&fork->child->snapshot());
+                }
+            }
+            stack.insert(stack.end(), children.rbegin(), children.rend());
+        }
+        end_tree();
+    }
+};
+
+/* Writes a line for each process (when we first come to it), followed by a
+ * line for each of its events and then one for each sample of its CPU and
+ * memory use (see Sampler). The lines aren't in time order across the
+ * processes, but they all have times so they can be sorted afterwards. */
+class JsonWriter : public TreeWriter
+{
+private:
+    void write_event(const ProcessHistory& process, const Event& event);
+    void write_samples(const ProcessHistory& process);
+
+public:
+    using TreeWriter::TreeWriter;
+    void write_process(const ProcessHistory& process, size_t tree);
+};
+
+void JsonWriter::write_process(const ProcessHistory& process, size_t tree)
+{
+    _os << format("{{\"type\":\"process\",\"tree\":{},\"process\":{},"
+        "\"pid\":{},\"start\":{},\"state\":{},\"command\":{}}}\n", tree,
+        id(process), process.pid(), since_base(process.start_time()),
+        json_string(process.state()), json_string(process.command_line(0)));
+    for (size_t i = 0; i < process.event_count(); ++i)
+    {
+        write_event(process, process.event(i));
+    }
+    write_samples(process);
+}
+
+void JsonWriter::write_event(const ProcessHistory& process,
+                             const Event& event)
+{
+    string fields; // the ones specific to the type of event
+    if (auto fork = dynamic_cast<const ForkEvent*>(&event))
+    {
+        fields = format("\"type\":\"fork\",\"child\":{},\"childPid\":{}",
+            id(*fork->child), fork->child->pid());
+    }
+    else if (auto reap = dynamic_cast<const ReapEvent*>(&event))
+    {
+        fields = format("\"type\":\"reap\",\"child\":{},\"childPid\":{},"
+            "\"waitedFor\":{},\"nohang\":{}", id(*reap->child),
+            reap->child->pid(), reap->wait->waitedId, reap->wait->nohang);
+    }
+    else if (auto wait = dynamic_cast<const WaitEvent*>(&event))
+    {
+        fields = format("\"type\":\"wait\",\"waitedFor\":{},\"nohang\":{},"
+            "\"error\":{}", wait->waitedId, wait->nohang, wait->error);
+    }
+    else if (auto kill = dynamic_cast<const KillEvent*>(&event))
+    {
+        const Process& from = kill->info->source;
+        const Process& to = kill->info->dest;
+        fields = format("\"type\":\"kill\",\"sender\":{},\"from\":{},"
+            "\"to\":{},\"signal\":{},\"signalName\":{},\"toThread\":{}",
+            kill->sender, id(from), id(to), kill->info->signal,
+            json_string(get_signal_name(kill->info->signal)),
+            kill->info->toThread);
+    }
+    else if (auto raise = dynamic_cast<const RaiseEvent*>(&event))
+    {
+        fields = format("\"type\":\"raise\",\"target\":{},\"signal\":{},"
+            "\"signalName\":{},\"toThread\":{}", raise->killedId,
+            raise->signal, json_string(get_signal_name(raise->signal)),
+            raise->toThread);
+    }
+    else if (auto signal = dynamic_cast<const SignalEvent*>(&event))
+    {
+        fields = format("\"type\":\"signal\",\"origin\":{},\"signal\":{},"
+            "\"signalName\":{},\"killed\":{}", signal->origin,
+            signal->signal, json_string(get_signal_name(signal->signal)),
+            signal->killed);
+    }
+    else if (auto exit = dynamic_cast<const ExitEvent*>(&event))
+    {
+        fields = format("\"type\":\"exit\",\"status\":{}", exit->status);
+    }
+    else if (auto exec = dynamic_cast<const ExecEvent*>(&event))
+    {
+        string args;
+        for (const string& arg : exec->args)
+        {
+            args += (args.empty() ? "" : ",") + json_string(arg);
+        }
+        fields = format("\"type\":\"exec\",\"file\":{},\"args\":[{}],"
+            "\"error\":{},\"attempts\":{}", json_string(exec->file()), args,
+            exec->call().errcode, exec->calls.size());
+    }
+    else
+    {
+        assert(!"Unknown event type");
+    }
+
+    _os << format("{{{},\"process\":{},\"time\":{}", fields, id(process),
+        since_base(event.time));
+    if (event.location.has_value())
+    {
+        _os << format(",\"location\":{}",
+            json_string(event.location->to_string()));
+    }
+    _os << "}\n";
+}
+
+/* The CPU use of each sample is worked out since the one before it (so the
+ * first one always says 0), and the RSS is in kilobytes. */
+void JsonWriter::write_samples(const ProcessHistory& process)
+{
+    vector<Sample> samples = process.process().samples().snapshot();
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const Sample& prev = samples[i > 0 ? i - 1 : 0];
+        _os << format("{{\"type\":\"sample\",\"process\":{},\"time\":{},"
+            "\"cpu\":{:.1f},\"rss\":{}}}\n", id(process),
+            since_base(samples[i].time), get_cpu_percent(prev, samples[i]),
+            get_rss_kilobytes(samples[i]));
+    }
+}
+
+/* Writes a node for each process and an edge for each fork, along with
+ * edges for signals sent between processes and for reaps done by someone
+ * other than the parent (i.e., after the child was orphaned). Each tree goes
+ * in its own cluster. */
+class DotWriter : public TreeWriter
+{
+private:
+    /* Edges for signals get held back until the end of the tree, since an
+     * edge to a node that we haven't seen yet would put that node inside of
+     * the current cluster (and it might belong to another tree). */
+    vector<string> _kills;
+
+public:
+    using TreeWriter::TreeWriter;
+    void begin();
+    void begin_tree(const ProcessHistory& leader, size_t index);
+    void write_process(const ProcessHistory& process, size_t tree);
+    void end_tree();
+    void end();
+};
+
+void DotWriter::begin()
+{
+    _os << "digraph forktrace {\n"
+           "    node [shape=box, fontname=monospace];\n";
+}
+
+void DotWriter::begin_tree(const ProcessHistory& leader, size_t index)
+{
+    _os << format("    subgraph cluster_{} {{\n", index);
+    _os << format("        label={};\n",
+        json_string(format("Process tree {}", index)));
+}
+
+void DotWriter::write_process(const ProcessHistory& process, size_t tree)
+{
+    string style;
+    if (!process.dead())
+    {
+        style = ", style=dashed";
+    }
+    else if (process.killed())
+    {
+        style = ", color=red";
+    }
+    _os << format("        p{} [label={}{}];\n", id(process),
+        json_string(format("{}\n{}", process.pid(), process.command_line())),
+        style);
+
+    unordered_set<const Process*> forked;
+    for (size_t i = 0; i < process.event_count(); ++i)
+    {
+        const Event& event = process.event(i);
+        if (auto fork = dynamic_cast<const ForkEvent*>(&event))
+        {
+            forked.insert(fork->child.get());
+            _os << format("        p{} -> p{};\n", id(process),
+                id(*fork->child));
+        }
+        else if (auto reap = dynamic_cast<const ReapEvent*>(&event))
+        {
+            if (!forked.count(reap->child.get()))
+            {
+                _os << format("        p{} -> p{} [style=dashed, "
+                    "label=\"reaped\"];\n", id(process), id(*reap->child));
+            }
+        }
+        else if (auto kill = dynamic_cast<const KillEvent*>(&event))
+        {
+            if (kill->sender)
+            {
+                _kills.push_back(format("    p{} -> p{} [color=magenta, "
+                    "label={}];\n", id(process), id(kill->linked_path()),
+                    json_string(get_signal_name(kill->info->signal))));
+            }
+        }
+    }
+}
+
+void DotWriter::end_tree()
+{
+    _os << "    }\n";
+    for (const string& edge : _kills)
+    {
+        _os << edge;
+    }
+    _kills.clear();
+}
+
+void DotWriter::end()
+{
+    _os << "}\n";
+}
+
+/* Writes out the Trace Event Format used by chrome://tracing and Perfetto.
+ * Each process gets its own track, with one slice covering its lifetime and
+ * instant events for its execs, signals and exits. Forks, reaps and signals
+ * sent between processes are drawn as flow arrows between the tracks. If the
+ * process was sampled, then its CPU and RSS get drawn as counters too. */
+class ChromeWriter : public TreeWriter
+{
+private:
+    bool _first = true; // no comma before the first trace event
+    size_t _flows = 0; // the number of flow arrows so far (used as IDs)
+
+    void write_entry(const string& entry);
+    void write_flow(string_view name,
+                    const Process& from,
+                    Timestamp fromTime,
+                    const Process& to,
+                    Timestamp toTime);
+    void write_instant(const ProcessHistory& process, const Event& event);
+    void write_counters(const ProcessHistory& process);
+
+public:
+    using TreeWriter::TreeWriter;
+    void begin();
+    void write_process(const ProcessHistory& process, size_t tree);
+    void end();
+};
+
+void ChromeWriter::begin()
+{
+    _os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+}
+
+void ChromeWriter::write_entry(const string& entry)
+{
+    if (!_first)
+    {
+        _os << ",\n";
+    }
+    _first = false;
+    _os << entry;
+}
+
+void ChromeWriter::write_flow(string_view name,
+                              const Process& from,
+                              Timestamp fromTime,
+                              const Process& to,
+                              Timestamp toTime)
+{
+    size_t flow = ++_flows;
+    write_entry(format("{{\"ph\":\"s\",\"id\":{},\"cat\":\"{}\","
+        "\"name\":\"{}\",\"pid\":{},\"tid\":{},\"ts\":{}}}", flow, name,
+        name, id(from), id(from), microseconds(since_base(fromTime))));
+    write_entry(format("{{\"ph\":\"f\",\"bp\":\"e\",\"id\":{},"
+        "\"cat\":\"{}\",\"name\":\"{}\",\"pid\":{},\"tid\":{},\"ts\":{}}}",
+        flow, name, name, id(to), id(to),
+        microseconds(since_base(std::max(fromTime, toTime)))));
+}
+
+void ChromeWriter::write_process(const ProcessHistory& process, size_t tree)
+{
+    size_t pid = id(process);
+    string name = format("{} [{}]", process.program(), process.pid());
+    write_entry(format("{{\"ph\":\"M\",\"name\":\"process_name\","
+        "\"pid\":{},\"args\":{{\"name\":{}}}}}", pid, json_string(name)));
+    write_entry(format("{{\"ph\":\"M\",\"name\":\"process_sort_index\","
+        "\"pid\":{},\"args\":{{\"sort_index\":{}}}}}", pid, pid));
+
+    Timestamp start = process.start_time();
+    Timestamp end = std::max(start, end_time(process, _now));
+    write_entry(format("{{\"ph\":\"X\",\"name\":{},\"pid\":{},\"tid\":{},"
+        "\"ts\":{},\"dur\":{},\"args\":{{\"tree\":{},\"command\":{},"
+        "\"state\":{}}}}}", json_string(process.program()), pid, pid,
+        microseconds(since_base(start)), microseconds(end - start), tree,
+        json_string(process.command_line()), json_string(process.state())));
+
+    for (size_t i = 0; i < process.event_count(); ++i)
+    {
+        const Event& event = process.event(i);
+        if (auto fork = dynamic_cast<const ForkEvent*>(&event))
+        {
+            write_flow("fork", process.process(), event.time,
+                *fork->child, fork->child->start_time());
+        }
+        else if (auto reap = dynamic_cast<const ReapEvent*>(&event))
+        {
+            const Process& child = *reap->child;
+            write_flow("reap", child, end_time(child.snapshot(), _now),
+                process.process(), event.time);
+        }
+        else if (auto kill = dynamic_cast<const KillEvent*>(&event))
+        {
+            if (kill->sender)
+            {
+                write_flow(get_signal_name(kill->info->signal),
+                    process.process(), event.time, kill->linked_path(),
+                    event.time);
+            }
+        }
+        else
+        {
+            write_instant(process, event);
+        }
+    }
+    write_counters(process);
+}
+
+void ChromeWriter::write_instant(const ProcessHistory& process,
+                                 const Event& event)
+{
+    string name;
+    if (auto exec = dynamic_cast<const ExecEvent*>(&event))
+    {
+        name = format("{} {}", exec->succeeded() ? "exec" : "failed exec",
+            get_base_name(exec->file()));
+    }
+    else if (auto signal = dynamic_cast<const SignalEvent*>(&event))
+    {
+        name = string(get_signal_name(signal->signal));
+    }
+    else if (auto raise = dynamic_cast<const RaiseEvent*>(&event))
+    {
+        name = format("raise {}", get_signal_name(raise->signal));
+    }
+    else if (auto exit = dynamic_cast<const ExitEvent*>(&event))
+    {
+        name = format("exit {}", exit->status);
+    }
+    else
+    {
+        name = "wait";
+    }
+    write_entry(format("{{\"ph\":\"i\",\"s\":\"t\",\"name\":{},\"pid\":{},"
+        "\"tid\":{},\"ts\":{},\"args\":{{\"detail\":{}}}}}", json_string(name),
+        id(process), id(process), microseconds(since_base(event.time)),
+        json_string(describe(event))));
+}
+
+void ChromeWriter::write_counters(const ProcessHistory& process)
+{
+    vector<Sample> samples = process.process().samples().snapshot();
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const Sample& prev = samples[i > 0 ? i - 1 : 0];
+        string ts = microseconds(since_base(samples[i].time));
+        write_entry(format("{{\"ph\":\"C\",\"name\":\"CPU %\",\"pid\":{},"
+            "\"ts\":{},\"args\":{{\"cpu\":{:.1f}}}}}", id(process), ts,
+            get_cpu_percent(prev, samples[i])));
+        write_entry(format("{{\"ph\":\"C\",\"name\":\"RSS (KB)\","
+            "\"pid\":{},\"ts\":{},\"args\":{{\"rss\":{}}}}}", id(process),
+            ts, get_rss_kilobytes(samples[i])));
+    }
+}
+
+void ChromeWriter::end()
+{
+    _os << "\n]}\n";
+}
+
+void export_trees(std::ostream& os,
+                  ExportFormat format,
+                  const vector<const Process*>& leaders,
+                  size_t firstIndex)
+{
+    EpochPin pin; // keeps the snapshots around until we're done
+    Timestamp base = UINT64_MAX;
+    for (const Process* leader : leaders)
+    {
+        base = std::min(base, leader->start_time());
+    }
+
+    std::unique_ptr<TreeWriter> writer;
+    switch (format)
+    {
+        case ExportFormat::JSON:
+            writer = std::make_unique<JsonWriter>(os, base);
+            break;
+        case ExportFormat::DOT:
+            writer = std::make_unique<DotWriter>(os, base);
+            break;
+        case ExportFormat::CHROME:
+            writer = std::make_unique<ChromeWriter>(os, base);
+            break;
+        case ExportFormat::TEXT:
+            assert(!"TEXT can't be exported without a diagram");
+            return;
+    }
+
+    writer->begin();
+    for (size_t i = 0; i < leaders.size(); ++i)
+    {
+        writer->write_tree(*leaders[i], firstIndex + i);
+    }
+    writer->end();
+}
@@ -0,0 +1,43 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  exporter
+ *
+ *      Writes process trees out in formats that other tools understand, for
+ *      when a trace is too big (or too interesting) to just look at in the
+ *      terminal.
+ */
+#ifndef FORKTRACE_EXPORTER_HPP
+#define FORKTRACE_EXPORTER_HPP
+
+#include <vector>
+#include <string_view>
+#include <iostream>
+
+class Process; // defined in process.hpp
+
+/* The different formats that process trees can be exported in. */
+enum class ExportFormat
+{
+    TEXT,   // the diagram, as drawn by the "draw" command (minus colour)
+    JSON,   // one JSON object per line for each process, event and sample
+    DOT,    // a Graphviz graph of who forked, reaped and signalled who
+    CHROME, // Chrome/Perfetto trace events, with a track for each process
+};
+
+/* Parses one of "text", "json", "dot" or "chrome" into an ExportFormat.
+ * Throws a runtime_error if the string is none of those. */
+ExportFormat parse_export_format(std::string_view str);
+
+/* Writes the trees led by `leaders` out to `os` in the given format (which
+ * can't be TEXT, since that needs diagrams - see Diagram::stream). The trees
+ * are numbered from `firstIndex` in the output. Everything gets written out
+ * as we walk the trees, so nothing big gets built up in memory first. Only
+ * snapshots of the processes get read (see Process::snapshot), so this can be
+ * called from any thread while the trees are still being traced (as long as
+ * the leaders stay alive). */
+void export_trees(std::ostream& os,
+                  ExportFormat format,
+                  const std::vector<const Process*>& leaders,
+                  size_t firstIndex = 0);
+
+#endif /* FORKTRACE_EXPORTER_HPP */
@@ -14,10 +14,13 @@
 #include <cstdlib>
 #include <map>
 #include <iostream>
+#include <fstream>
 #include <thread>
 #include <optional>
 #include <functional>
 #include <atomic>
+#include <mutex>
+#include <utility>
 
 #include "forktrace.hpp"
 #include "system.hpp"
@@ -29,6 +32,12 @@
 #include "process.hpp"
 #include "diagram.hpp"
 #include "scroll-view.hpp"
+#include "analysis.hpp"
+#include "sampler.hpp"
+#include "pruner.hpp"
+#include "thread-pool.hpp"
+#include "exporter.hpp"
+#include "control.hpp"
 
 using std::string;
 using std::string_view;
@@ -242,12 +251,13 @@ static void do_tree(Forktrace& ft, vector<string> args)
     {
         if (ft.trees.empty())
         {
-            std::cerr << "There are no process trees yet.\n";
+            ft.parser.err() << "There are no process trees yet.\n";
         }
         for (size_t i = 0; i < ft.trees.size(); ++i)
         {
-            std::cerr << colour(Colour::BOLD, format("Process tree {}:\n", i));
-            ft.trees[i]->print_tree();
+            ft.parser.err() << colour(Colour::BOLD, 
+                format("Process tree {}:\n", i));
+            ft.trees[i]->print_tree(0, ft.parser.err());
         }
     }
     else
@@ -257,7 +267,7 @@ static void do_tree(Forktrace& ft, vector<string> args)
         {
             throw runtime_error("Out-of-bounds process tree index.");
         }
-        ft.trees[i]->print_tree();
+        ft.trees[i]->print_tree(0, ft.parser.err());
     }
 }
 
@@ -265,49 +275,97 @@ static void do_trees(Forktrace& ft)
 {
     if (ft.trees.empty())
     {
-        std::cerr << "There are no process trees yet.\n";
+        ft.parser.err() << "There are no process trees yet.\n";
     }
     for (size_t i = 0; i < ft.trees.size(); ++i)
     {
-        std::cerr << format("{}: {}\n", i, ft.trees[i]->to_string());
+        ft.parser.err() << format("{}: {}\n", i, ft.trees[i]->to_string());
     }
 }
 
-/* Callback for do_draw() to draw to the terminal */
-static void draw(const Diagram& diagram)
+/* How much of an exported diagram gets buffered up before it's written out
+ * to the file (see do_export). */
+constexpr size_t EXPORT_BUFFER_SIZE = 1 << 20;
+
+/* How often the "live" command redraws the diagram (in nanoseconds). */
+constexpr Timestamp LIVE_FRAME_INTERVAL = 100'000'000;
+
+/* How often the "watch" command updates the view (in milliseconds). */
+constexpr int WATCH_FRAME_INTERVAL = 100;
+
+/* For do_draw() callbacks to draw to the terminal (or wherever the command's
+ * output is going). The diagram gets streamed out a band at a time, so even a
+ * really tall one doesn't need to be drawn out in memory all at once. */
+static void draw(const Diagram& diagram, std::ostream& os)
 {
-    if (!diagram.result().print(std::cout))
+    size_t width = SIZE_MAX, height; // ignore height
+    get_terminal_size(width, height);
+    diagram.stream(os, true, width);
+    if (width < diagram.width())
     {
         warning("Had to truncate the diagram. Try the scroll view instead.");
     }
 }
 
 /* Helper function for view(). Returns a string describing the currently 
- * selected event on the process diagram. */
-static string get_event_info(const Event* selected) 
+ * selected event on the process diagram. The time of the event is shown as
+ * an offset from the start of the diagram's leader process. */
+static string get_event_info(const Diagram& diagram, const Event* selected) 
 {
     if (!selected) 
     {
         return "";
     }
+    Timestamp start = diagram.leader().start_time();
+    string time = format_duration(std::max(selected->time, start) - start);
+    string text;
+    if (auto reap = dynamic_cast<const ReapEvent*>(selected))
+    {
+        // This includes how the child died, as of what's on the diagram
+        text = reap->to_string(diagram.history(*reap->child));
+    }
+    else
+    {
+        text = selected->to_string();
+    }
     if (!selected->location.has_value()) 
     {
-        return selected->to_string();
+        return format("[+{}] {}", time, text);
     }
-    return format("{} @ {}", 
-        selected->to_string(), selected->location->to_string());
+    return format("[+{}] {} @ {}", time, text,
+        selected->location->to_string());
 }
 
 /* Helper function for view(). Returns a string describing the currently 
- * selected process on the process diagram. */
-static string get_process_info(const Process* selected, int eventIndex) 
+ * selected process on the process diagram. If the process was sampled, then
+ * its CPU and memory use at the time of the selected line is shown too. */
+static string get_process_info(const Diagram& diagram, 
+                               const Process* selected, 
+                               int eventIndex,
+                               size_t line) 
 {
     if (!selected) 
     {
         return "";
     }
-    return format("process {} {}", selected->pid(), 
-        selected->command_line(eventIndex + 1)); // TODO explain
+    const ProcessHistory& history = diagram.history(*selected);
+    string info = format("process {} {}", selected->pid(), 
+        history.command_line(eventIndex + 1)); // TODO explain
+    if (diagram.repeats(*selected) > 1)
+    {
+        info += format(" (and {} more like it)", 
+            diagram.repeats(*selected) - 1);
+    }
+    if (diagram.folded(*selected))
+    {
+        info += " (folded)";
+    }
+    string usage = describe_samples(*selected, diagram.line_time(line));
+    if (!usage.empty())
+    {
+        info = format("[{}] {}", usage, info);
+    }
+    return info;
 }
 
 /* Take a key press and figure out the new position (in terms of line and lane
@@ -350,15 +408,79 @@ static bool update_diagram_location(const Diagram& diagram,
     return false;
 }
 
-/* Callback for do_draw() to draw with the ScrollView. */
-static void view(const Diagram& diagram)
+/* Lets view() show a tree that's still being traced (see do_watch). `refresh`
+ * gets called every so often to bring the diagram up to date. It returns null
+ * if nothing has changed, or else the diagram to show now. If that's a whole
+ * new diagram (e.g., because processes were pruned) then it sets `rebuilt`,
+ * since the processes that we had selected might not be around any more. The
+ * view closes itself if `abandoned` gets set. */
+struct Watch
+{
+    function<Diagram*(bool& rebuilt)> refresh;
+    const std::atomic<bool>* abandoned = nullptr;
+};
+
+/* Shows the diagram with the ScrollView. Pressing 'f' folds or unfolds the 
+ * subtree of the selected process (see Diagram::toggle_fold), and '/' asks
+ * for something to search for (see SearchIndex), after which 'n' and 'N' go
+ * to the next and previous places where it can be found. Pressing 'o' shows
+ * or hides an overview of the whole diagram (see Diagram::overview). If
+ * `watch` is
+ * given, then the diagram keeps getting updated while it's being shown, and
+ * the cursor stays on the same process. */
+static void run_view(Diagram& first, const Watch* watch)
 {
     log("Starting up the scroll-view...");
+    bool rebuilt = false;
+    Diagram* diagram = &first;
+    if (watch)
+    {
+        if (Diagram* latest = watch->refresh(rebuilt))
+        {
+            diagram = latest;
+        }
+    }
+
     size_t line = 0, lane = 0, x, y;
     int eventIndex;
-    const Process* process = &diagram.leader();
-    const Event* selected = diagram.find(lane, line, process, eventIndex);
-    diagram.get_coords(lane, line, x, y); // convert to x/y coords
+    const Process* process = &diagram->leader();
+    const Event* selected = diagram->find(lane, line, process, eventIndex);
+    diagram->get_coords(lane, line, x, y); // convert to x/y coords
+
+    // Shows whatever is at (lane, line) now
+    auto reselect = [&](ScrollView& view) {
+        selected = diagram->find(lane, line, process, eventIndex);
+        diagram->get_coords(lane, line, x, y);
+        view.set_line(
+            get_process_info(*diagram, process, eventIndex, line), 0);
+        view.set_line(get_event_info(*diagram, selected), 1);
+        view.set_cursor(x, y);
+    };
+
+    // Moves to the next (or previous) match for the last search, if any
+    string query;
+    auto jump = [&](ScrollView& view, bool backwards) {
+        auto matches = diagram->search_index().find(query);
+        DiagramPosition found;
+        if (!matches 
+            || !SearchIndex::next(*matches, {line, lane}, backwards, found))
+        {
+            view.beep();
+            if (!query.empty() && query.front() == ':')
+            {
+                view.set_line(format("Nothing found for {} (the kinds of "
+                    "events are: {})", query, SearchIndex::kind_names()), 1);
+            }
+            else if (!query.empty())
+            {
+                view.set_line(format("Nothing found for {}", query), 1);
+            }
+            return;
+        }
+        line = found.line;
+        lane = found.lane;
+        reselect(view);
+    };
 
     auto onKeyPress = [&](ScrollView& view, int key) {
         switch (key) {
@@ -366,15 +488,41 @@ static void view(const Diagram& diagram)
             case KEY_RIGHT:
             case KEY_UP:
             case KEY_DOWN:
-                if (!update_diagram_location(diagram, key, lane, line)) 
+                if (!update_diagram_location(*diagram, key, lane, line)) 
+                {
+                    view.beep();
+                }
+                reselect(view);
+                break;
+            case 'f':
+                if (!process || !diagram->toggle_fold(*process))
+                {
+                    view.beep();
+                    break;
+                }
+                // The process stays on the diagram, but it can change lanes
+                diagram->update();
+                lane = diagram->locate(*process);
+                line = std::min(line, diagram->line_count() - 1);
+                view.update(diagram->width(), diagram->height());
+                reselect(view);
+                break;
+            case '/':
+                if (string typed; view.prompt("/", typed))
+                {
+                    query = std::move(typed);
+                    jump(view, false);
+                }
+                break;
+            case 'n':
+            case 'N':
+                jump(view, key == 'N');
+                break;
+            case 'o':
+                if (!view.toggle_overview())
                 {
                     view.beep();
                 }
-                selected = diagram.find(lane, line, process, eventIndex);
-                diagram.get_coords(lane, line, x, y);
-                view.set_line(get_process_info(process, eventIndex), 0);
-                view.set_line(get_event_info(selected), 1);
-                view.set_cursor(x, y);
                 break;
             case 'q':
                 view.quit();
@@ -385,34 +533,88 @@ static void view(const Diagram& diagram)
         }
     };
 
-    string help = "Arrow keys to navigate, q to quit.";
+    // Keeps the cursor on the same process (if it's still there) as the
+    // diagram grows. New lines only get added at the bottom, so the line
+    // that it was on stays put.
+    auto onTick = [&](ScrollView& view) {
+        if (watch->abandoned && *watch->abandoned)
+        {
+            view.quit();
+            return;
+        }
+        bool rebuilt = false;
+        Diagram* latest = watch->refresh(rebuilt);
+        if (!latest)
+        {
+            return;
+        }
+        diagram = latest;
+        if (rebuilt)
+        {
+            lane = line = 0;
+        }
+        else if (process && diagram->shows(*process))
+        {
+            lane = diagram->locate(*process);
+        }
+        lane = std::min(lane, diagram->lane_count() - 1);
+        line = std::min(line, diagram->line_count() - 1);
+        view.update(diagram->width(), diagram->height());
+        reselect(view);
+    };
+
+    string help = "Arrow keys to navigate, / to search (for a pid, a program "
+        "or a :kind of event), n/N for next/previous, f to fold/unfold, o for "
+        "an overview (tab to move around it), q to quit.";
     // TODO disable logging?
-    ScrollView view(diagram.result(), std::move(help), onKeyPress);
-    view.set_line(get_process_info(process, eventIndex), 0);
-    view.set_line(get_event_info(selected), 1);
+    auto render = [&](Window& tile, size_t x, size_t y) {
+        diagram->render(tile, x, y);
+    };
+    ScrollView view(diagram->width(), diagram->height(), render, 
+        std::move(help), onKeyPress);
+    view.set_line(get_process_info(*diagram, process, eventIndex, line), 0);
+    view.set_line(get_event_info(*diagram, selected), 1);
     view.set_cursor(x, y); // make the cursor point to that location
+    view.set_overview(
+        [&](Window& pane, size_t scaleX, size_t scaleY) {
+            diagram->overview(pane, scaleX, scaleY);
+        },
+        [&](ScrollView& view, size_t toX, size_t toY) {
+            diagram->get_lane_line(toX, toY, lane, line);
+            reselect(view);
+        });
+    if (watch)
+    {
+        view.set_live(WATCH_FRAME_INTERVAL, onTick);
+    }
     view.run();
 }
 
+/* Callback for do_draw() to draw with the ScrollView. */
+static void view(Diagram& diagram)
+{
+    run_view(diagram, nullptr);
+}
+
 /* Callback for do_draw() to draw with either ScrollView or to the terminal
  * depending on if the diagram can fit on the terminal screen. */
-static void draw_or_view(const Diagram& diagram)
+static void draw_or_view(Diagram& diagram)
 {
     size_t width, height; // ignore height
-    if (get_terminal_size(width, height) && width < diagram.result().width())
+    if (get_terminal_size(width, height) && width < diagram.width())
     {
         log("The diagram to too big to fit, using the scroll view instead...");
         view(diagram);
     }
     else
     {
-        draw(diagram);
+        draw(diagram, std::cout);
     }
 }
 
-static void draw_tree(Forktrace& ft, 
-                      size_t treeIndex, 
-                      function<void(const Diagram&)> drawer)
+/* Works out the options (see Diagram::Options) and the time scale that the
+ * diagrams get laid out with, from what the user has set. */
+static int get_diagram_options(const Forktrace& ft, Diagram::TimeScale& scale)
 {
     int flags = 0;
     if (ft.opts.showNonFatalSignals)
@@ -435,27 +637,138 @@ static void draw_tree(Forktrace& ft,
     {
         flags |= Diagram::MERGE_EXECS;
     }
-    Diagram diagram(*ft.trees.at(treeIndex).get(), ft.opts.laneWidth, flags);
+    if (ft.opts.collapseRepeats)
+    {
+        flags |= Diagram::COLLAPSE_REPEATS;
+    }
+    if (ft.opts.compactLanes)
+    {
+        flags |= Diagram::COMPACT_LANES;
+    }
+    if (ft.opts.timeScaled)
+    {
+        flags |= Diagram::TIME_SCALED;
+        scale.rowTime = Timestamp(ft.opts.rowTimeMs) * 1000000;
+        scale.maxGap = ft.opts.maxGap;
+    }
+    return flags;
+}
+
+/* Returns true if the cached diagram was laid out with the same options (so
+ * it can be brought up to date rather than laid out all over again). */
+static bool is_reusable(const Forktrace& ft,
+                        const std::unique_ptr<Diagram>& cached,
+                        int flags,
+                        const Diagram::TimeScale& scale)
+{
+    return cached && cached->options() == flags
+        && cached->lane_width() == ft.opts.laneWidth
+        && cached->time_scale().rowTime == scale.rowTime
+        && cached->time_scale().maxGap == scale.maxGap;
+}
+
+/* Brings the cached diagram of the tree up to date, or builds a new one if
+ * there isn't one yet (or if `fresh` is true, or if it was drawn with other
+ * options). Only touches the processes in that tree, and `cached` itself, so
+ * this can be called for different trees on different threads at once. */
+static Diagram& layout_tree(const Forktrace& ft, 
+                            size_t treeIndex,
+                            std::unique_ptr<Diagram>& cached,
+                            bool fresh = false)
+{
+    Diagram::TimeScale scale;
+    int flags = get_diagram_options(ft, scale);
+    const Process& leader = *ft.trees.at(treeIndex).get();
+    if (!fresh && is_reusable(ft, cached, flags, scale))
+    {
+        cached->update();
+    }
+    else
+    {
+        cached = std::make_unique<Diagram>(leader, ft.opts.laneWidth, flags, 
+            scale);
+    }
+    cached->set_thread_pool(&ft.pool);
+    return *cached.get();
+}
+
+/* Same as layout_tree, but for a snapshot of a tree (see TreeSnapshot), so
+ * it doesn't touch the processes themselves at all. `cached` has to be null
+ * or a diagram of an earlier snapshot of the same tree. */
+static Diagram& layout_snapshot(const Forktrace& ft,
+                                shared_ptr<const TreeSnapshot> tree,
+                                std::unique_ptr<Diagram>& cached,
+                                bool fresh = false)
+{
+    Diagram::TimeScale scale;
+    int flags = get_diagram_options(ft, scale);
+    if (!fresh && is_reusable(ft, cached, flags, scale))
+    {
+        cached->update(std::move(tree));
+    }
+    else
+    {
+        cached = std::make_unique<Diagram>(std::move(tree), ft.opts.laneWidth,
+            flags, scale);
+    }
+    cached->set_thread_pool(&ft.pool);
+    return *cached.get();
+}
+
+/* If `prepare` is given, it gets a chance to tweak the diagram (e.g., add
+ * highlights) before it's redrawn and handed to the drawer. Otherwise, if the
+ * tree was drawn before with the same options, the old diagram is brought up
+ * to date instead of building a new one (which is much quicker for "next"). */
+static void draw_tree(Forktrace& ft, 
+                      size_t treeIndex, 
+                      function<void(Diagram&)> drawer,
+                      function<void(Diagram&)> prepare = nullptr)
+{
+    const Process& leader = *ft.trees.at(treeIndex).get();
+    std::unique_ptr<Diagram>& cached = ft.diagrams[&leader];
+    Diagram& diagram = layout_tree(ft, treeIndex, cached, bool(prepare));
+    if (prepare)
+    {
+        prepare(diagram);
+        diagram.redraw();
+    }
     drawer(diagram);
     if (diagram.truncated())
     {
         warning("Had to truncate some lanes. Try a larger lane width.");
     }
+    if (prepare)
+    {
+        cached.reset(); // don't want the highlights hanging around
+    }
 }
 
 static void do_draw(Forktrace& ft, 
                     vector<string> args,
-                    function<void(const Diagram&)> drawer)
+                    function<void(Diagram&)> drawer)
 {
     if (args.empty())
     {
         if (ft.trees.empty())
         {
-            std::cerr << "There are no process trees yet.\n";
+            ft.parser.err() << "There are no process trees yet.\n";
         }
+        // The trees don't have anything to do with each other, so we lay
+        // them all out at once first. Then draw_tree just finds them already
+        // up to date and gets straight to drawing them (one at a time, since
+        // they have to come out in order).
+        vector<std::unique_ptr<Diagram>*> cached;
+        for (const auto& tree : ft.trees)
+        {
+            cached.push_back(&ft.diagrams[tree.get()]);
+        }
+        ft.pool.run(ft.trees.size(), [&](size_t i) {
+            layout_tree(ft, i, *cached[i]);
+        });
         for (size_t i = 0; i < ft.trees.size(); ++i)
         {
-            std::cerr << colour(Colour::BOLD, format("Process tree {}:\n", i));
+            ft.parser.err() << colour(Colour::BOLD, 
+                format("Process tree {}:\n", i));
             draw_tree(ft, i, drawer);
         }
     }
@@ -474,6 +787,69 @@ static void do_draw(Forktrace& ft,
     }
 }
 
+/* Writes out a process tree (or all of them) to a file in one of the formats
+ * in exporter.hpp, for when the diagram is way too big to look at on a
+ * terminal or you want to look at it with some other tool. Diagrams get
+ * streamed out (see Diagram::stream) and the other formats get written as
+ * the trees are walked, so this works for traces that are millions of events
+ * long. */
+static void do_export(Forktrace& ft, vector<string> args)
+{
+    if (args.size() < 2 || args.size() > 3)
+    {
+        throw runtime_error("Expected a format, a file and optionally a tree.");
+    }
+    ExportFormat exportFormat = parse_export_format(args[0]);
+    string path = args[1];
+    vector<char> buffer(EXPORT_BUFFER_SIZE);
+    std::ofstream file;
+    file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    file.open(path, std::ios::out | std::ios::trunc);
+    if (!file)
+    {
+        throw runtime_error(format("Couldn't open {}: {}", path, 
+            strerror_s(errno)));
+    }
+
+    args.erase(args.begin(), args.begin() + 2);
+    if (exportFormat == ExportFormat::TEXT)
+    {
+        size_t tree = 0;
+        bool all = args.empty();
+        do_draw(ft, std::move(args), [&](const Diagram& diagram) {
+            if (all)
+            {
+                file << format("Process tree {}:\n", tree++);
+            }
+            diagram.stream(file, false);
+        });
+    }
+    else if (args.empty())
+    {
+        vector<const Process*> leaders;
+        for (auto& tree : ft.trees)
+        {
+            leaders.push_back(tree.get());
+        }
+        export_trees(file, exportFormat, leaders);
+    }
+    else
+    {
+        size_t i = parse_number<size_t>(args[0]);
+        if (i >= ft.trees.size())
+        {
+            throw runtime_error("Out-of-bounds process tree index.");
+        }
+        export_trees(file, exportFormat, {ft.trees[i].get()}, i);
+    }
+    file.close();
+    if (!file)
+    {
+        throw runtime_error(format("Couldn't write to {}: {}", path,
+            strerror_s(errno)));
+    }
+}
+
 static void do_start(Forktrace& ft, vector<string> args)
 {
     if (args.empty())
@@ -481,9 +857,13 @@ static void do_start(Forktrace& ft, vector<string> args)
         throw runtime_error("Expected: PROGRAM [ARGS...]");
     }
     ft.trees.push_back(ft.tracer.start(args[0], args));
+    ft.control.set_trees(ft.trees);
 }
 
-static void do_go(Forktrace& ft)
+/* Resumes the tracees until they've all ended. If `onStep` is given, then it
+ * gets called after every step. Commands from the control socket get run in
+ * between steps too. */
+static void do_go(Forktrace& ft, const function<void()>& onStep = nullptr)
 {
     while (ft.tracer.step())
     {
@@ -496,7 +876,81 @@ static void do_go(Forktrace& ft)
         {
             return;
         }
+        if (ft.pruner.maybe_prune(ft.trees))
+        {
+            ft.diagrams.clear(); // they've got pruned processes in them
+            ft.control.set_trees(ft.trees);
+        }
+        if (onStep)
+        {
+            onStep();
+        }
+        ft.control.run_pending();
+    }
+    flush_log(); // so everything's out before we print anything else
+}
+
+/* Draws the bottom of the tree's diagram (as much as fits on the terminal)
+ * with the printer, which only rewrites the rows that changed. */
+static void draw_live(Forktrace& ft, size_t treeIndex, LivePrinter& printer)
+{
+    const Process& leader = *ft.trees.at(treeIndex).get();
+    Diagram& diagram = layout_tree(ft, treeIndex, ft.diagrams[&leader]);
+    size_t width, height;
+    size_t rows = diagram.height();
+    if (get_terminal_size(width, height))
+    {
+        rows = std::min(rows, std::max<size_t>(height, 2) - 1);
+    }
+    Window window(diagram.width(), rows);
+    diagram.render(window, 0, diagram.height() - rows);
+    printer.print(window);
+}
+
+/* Same as "go", but keeps the diagram of a tree up on the terminal while the
+ * tracees run, redrawing it (in place) every so often as it grows. Log 
+ * messages are turned off in the meantime so that they don't get in the way
+ * (anything else that gets printed will just make it start again below). */
+static void do_live(Forktrace& ft, vector<string> args)
+{
+    if (args.size() > 1)
+    {
+        throw runtime_error("Expected no more than one argument.");
+    }
+    size_t i = args.empty() ? 0 : parse_number<size_t>(args[0]);
+    if (i >= ft.trees.size())
+    {
+        throw runtime_error("Out-of-bounds process tree index.");
+    }
+    if (!ft.tracer.tracees_exist())
+    {
+        ft.parser.err() << "There are no active tracees.\n";
+        return;
+    }
+
+    bool logging = is_log_enabled_for(Log::LOG);
+    set_log_category_enabled(Log::LOG, false);
+    flush_log(); // get out whatever was logged before that
+    LivePrinter printer(ft.parser.out());
+    Timestamp lastFrame = 0;
+    try
+    {
+        do_go(ft, [&] {
+            Timestamp now = get_monotonic_time();
+            if (now - lastFrame >= LIVE_FRAME_INTERVAL)
+            {
+                draw_live(ft, i, printer);
+                lastFrame = now;
+            }
+        });
+        draw_live(ft, i, printer);
     }
+    catch (...)
+    {
+        set_log_category_enabled(Log::LOG, logging);
+        throw;
+    }
+    set_log_category_enabled(Log::LOG, logging);
 }
 
 static void do_run(Forktrace& ft, vector<string> args)
@@ -509,20 +963,325 @@ static void do_march(Forktrace& ft)
 {
     if (!ft.tracer.tracees_exist())
     {
-        std::cerr << "There are no active tracees.\n";
+        ft.parser.err() << "There are no active tracees.\n";
     }
     ft.tracer.step();
+    if (ft.pruner.maybe_prune(ft.trees))
+    {
+        ft.diagrams.clear();
+        ft.control.set_trees(ft.trees);
+    }
 }
 
 static void do_next(Forktrace& ft)
 {
     if (!ft.tracer.tracees_exist())
     {
-        std::cerr << "There are no active tracees.\n";
+        ft.parser.err() << "There are no active tracees.\n";
         return;
     }
     ft.tracer.step();
-    do_draw(ft, {}, draw);
+    do_draw(ft, {}, [&](Diagram& diagram) { draw(diagram, ft.parser.out()); });
+}
+
+/* Same as "go", but shows a tree in the scroll view while the tracees run,
+ * and keeps it up to date as the tree grows. The tracees have to be stepped
+ * by this thread (since it's the one that's ptrace-attached to them), so the
+ * view runs on a thread of its own. It never looks at the processes
+ * themselves: whenever it wants to bring its diagram up to date (a few times
+ * a second), this thread takes a snapshot of the tree in between steps (see
+ * TreeSnapshot) and hands it over, and the view lays out and draws that in
+ * its own time. Quitting the view doesn't stop the tracees - this just
+ * carries on like "go" until they've all ended. */
+static void do_watch(Forktrace& ft, vector<string> args)
+{
+    if (args.size() > 1)
+    {
+        throw runtime_error("Expected no more than one argument.");
+    }
+    size_t i = args.empty() ? 0 : parse_number<size_t>(args[0]);
+    if (i >= ft.trees.size())
+    {
+        throw runtime_error("Out-of-bounds process tree index.");
+    }
+    if (!ft.tracer.tracees_exist())
+    {
+        do_draw(ft, {std::to_string(i)}, view);
+        return;
+    }
+
+    // The latest snapshot that the view hasn't picked up yet (if any), and
+    // whether anything has been pruned since the view's last one.
+    std::mutex handoffLock;
+    shared_ptr<const TreeSnapshot> latest;
+    bool pruned = false;
+    std::atomic<bool> wanted = false; // does the view want a new snapshot?
+    std::atomic<bool> abandoned = false; // set if tracing blew up
+    shared_ptr<Process> leader = ft.trees[i]; // pruning could drop it
+    auto hand_off = [&](bool prunedNow) {
+        auto tree = std::make_shared<const TreeSnapshot>(*leader);
+        std::scoped_lock<std::mutex> guard(handoffLock);
+        latest = std::move(tree);
+        pruned = pruned || prunedNow;
+    };
+
+    std::unique_ptr<Diagram> diagram;
+    Watch watch;
+    watch.abandoned = &abandoned;
+    watch.refresh = [&](bool& rebuilt) -> Diagram* {
+        shared_ptr<const TreeSnapshot> tree;
+        {
+            std::scoped_lock<std::mutex> guard(handoffLock);
+            wanted = true;
+            if (!latest)
+            {
+                return nullptr;
+            }
+            tree = std::move(latest);
+            rebuilt = std::exchange(pruned, false);
+        }
+        return &layout_snapshot(ft, std::move(tree), diagram, rebuilt);
+    };
+
+    std::exception_ptr error;
+    auto first = std::make_shared<const TreeSnapshot>(*leader);
+    std::thread viewer([&] {
+        try
+        {
+            layout_snapshot(ft, first, diagram);
+            run_view(*diagram, &watch);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+    });
+
+    // Bits of do_go, plus handing snapshots over to the view.
+    bool logging = is_log_enabled_for(Log::LOG);
+    set_log_category_enabled(Log::LOG, false);
+    try
+    {
+        while (ft.tracer.step())
+        {
+            if (!ft.opts.reaper && !ft.tracer.tracees_alive())
+            {
+                break;
+            }
+            // The view needs to start over after pruning, and whatever it
+            // starts over from mustn't have the pruned processes in it
+            if (ft.pruner.maybe_prune(ft.trees))
+            {
+                ft.control.set_trees(ft.trees);
+                hand_off(true);
+            }
+            else if (wanted.exchange(false))
+            {
+                hand_off(false);
+            }
+        }
+        hand_off(false); // so the view ends up showing how it all ended
+    }
+    catch (...)
+    {
+        abandoned = true;
+        viewer.join();
+        set_log_category_enabled(Log::LOG, logging);
+        throw;
+    }
+    viewer.join();
+    set_log_category_enabled(Log::LOG, logging);
+    ft.diagrams.clear(); // they could have pruned processes in them
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+static void do_time_scale(Forktrace& ft, string_view arg)
+{
+    if (arg == "off")
+    {
+        ft.opts.timeScaled = false;
+        return;
+    }
+    ft.opts.rowTimeMs = parse_nonzero_number<size_t>(arg);
+    ft.opts.timeScaled = true;
+}
+
+/* The arguments can be given in any order, and a number is taken to be a tree
+ * index. If no tree is specified then all of the trees are lumped together. */
+static void do_top(Forktrace& ft, vector<string> args)
+{
+    Cost cost = Cost::CPU;
+    std::optional<size_t> treeIndex;
+    for (const string& arg : args)
+    {
+        if (!arg.empty() && isdigit(arg[0]))
+        {
+            treeIndex = parse_number<size_t>(arg);
+        }
+        else
+        {
+            cost = parse_cost(arg);
+        }
+    }
+    vector<const Process*> leaders;
+    if (treeIndex.has_value())
+    {
+        if (*treeIndex >= ft.trees.size())
+        {
+            throw runtime_error("Out-of-bounds process tree index.");
+        }
+        leaders.push_back(ft.trees[*treeIndex].get());
+    }
+    else
+    {
+        for (auto& tree : ft.trees)
+        {
+            leaders.push_back(tree.get());
+        }
+    }
+    print_top(ft.parser.err(), leaders, cost);
+}
+
+static void do_critical_path(Forktrace& ft, vector<string> args)
+{
+    if (args.size() > 1)
+    {
+        throw runtime_error("Expected no more than one argument.");
+    }
+    size_t i = args.empty() ? 0 : parse_number<size_t>(args[0]);
+    if (i >= ft.trees.size())
+    {
+        throw runtime_error(ft.trees.empty() ? "There are no process trees "
+            "yet." : "Out-of-bounds process tree index.");
+    }
+    const Process& leader = *ft.trees[i].get();
+    vector<CriticalStep> path = find_critical_path(leader);
+    print_critical_path(ft.parser.err(), leader, path);
+    draw_tree(ft, i, draw_or_view, [&](Diagram& diagram) {
+        for (const CriticalStep& step : path)
+        {
+            diagram.highlight(*step.process, step.from, step.to);
+        }
+    });
+}
+
+/* Finds the process with the specified PID in any of the trees. If there's
+ * more than one (the PID got recycled), the most recently started one wins. */
+static const Process* find_process(Forktrace& ft, pid_t pid)
+{
+    const Process* found = nullptr;
+    vector<const Process*> stack;
+    for (auto& tree : ft.trees)
+    {
+        stack.push_back(tree.get());
+    }
+    while (!stack.empty())
+    {
+        const Process* process = stack.back();
+        stack.pop_back();
+        if (process->pid() == pid && (!found 
+            || process->start_time() >= found->start_time()))
+        {
+            found = process;
+        }
+        for (size_t i = 0; i < process->event_count(); ++i)
+        {
+            auto fork = dynamic_cast<const ForkEvent*>(&process->event(i));
+            if (fork)
+            {
+                stack.push_back(fork->child.get());
+            }
+        }
+    }
+    return found;
+}
+
+static void do_sample(Forktrace& ft, string_view arg)
+{
+    unsigned rate = arg == "off" ? 0 : parse_number<unsigned>(arg);
+    ft.opts.sampleRate = rate;
+    ft.sampler.set_rate(rate);
+}
+
+/* Prints out the CPU and memory timeline of a process (from the sampler). */
+static void do_samples(Forktrace& ft, string_view arg)
+{
+    const Process* process = find_process(ft, parse_number<pid_t>(arg));
+    if (!process)
+    {
+        throw runtime_error("Couldn't find a process with that PID.");
+    }
+    vector<Sample> samples = process->samples().snapshot();
+    if (samples.empty())
+    {
+        ft.parser.err() << "No samples (try turning on the sampler with "
+            "\"sample\").\n";
+        return;
+    }
+    ft.parser.err() << format("{:>10} {:>6} {:>8}\n", "TIME", "CPU", "RSS");
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const Sample& prev = samples[i > 0 ? i - 1 : 0];
+        const Sample& cur = samples[i];
+        Timestamp start = process->start_time();
+        ft.parser.err() << format("{:>10} {:>5.0f}% {:>8}\n", 
+            "+" + format_duration(cur.time - std::min(cur.time, start)),
+            get_cpu_percent(prev, cur), 
+            format_kilobytes(get_rss_kilobytes(cur)));
+    }
+}
+
+static void do_rolling(Forktrace& ft, string_view arg)
+{
+    size_t mb = arg == "off" ? 0 : parse_number<size_t>(arg);
+    ft.opts.memoryBudgetMb = mb;
+    ft.pruner.set_budget(mb * 1024 * 1024);
+}
+
+static void do_horizon(Forktrace& ft, string_view arg)
+{
+    size_t secs = parse_number<size_t>(arg);
+    ft.opts.horizonSecs = secs;
+    ft.pruner.set_horizon(secs * 1000000000);
+}
+
+static void do_spill(Forktrace& ft, string_view arg)
+{
+    string path = arg == "off" ? "" : string(arg);
+    ft.pruner.set_spill_file(path);
+    ft.opts.spillFile = path;
+}
+
+static void do_control(Forktrace& ft, string_view arg)
+{
+    if (arg == "off")
+    {
+        ft.control.stop();
+        ft.opts.controlSocket.clear();
+        return;
+    }
+    ft.control.start(string(arg));
+    ft.opts.controlSocket = arg;
+}
+
+/* The commands that can't be sent over the control socket: the ones that take
+ * over the terminal (or might), and the ones that would pull the rug out from
+ * under the control socket. */
+static bool allow_remotely(string_view name)
+{
+    static const string_view BANNED[] = {
+        "control", "critical-path", "live", "quit", "view", "watch",
+    };
+    if (std::find(std::begin(BANNED), std::end(BANNED), name) 
+        == std::end(BANNED))
+    {
+        return true;
+    }
+    error("The '{}' command can't be sent over the control socket.", name);
+    return false;
 }
 
 static void register_commands(Forktrace& ft)
@@ -551,7 +1310,7 @@ static void register_commands(Forktrace& ft)
     parser.start_new_group("Process tree");
 
     parser.add("list", "", "print a list of all tracees",
-        [&] { ft.tracer.print_list(); }
+        [&] { ft.tracer.print_list(ft.parser.err()); }
     );
     parser.add("tree", "[TREE]", 
         "debug output for a process tree, or all if none specified",
@@ -563,7 +1322,15 @@ static void register_commands(Forktrace& ft)
     parser.add("draw", "[TREE]", 
         "draw a process tree, or all if none specified",
         [&](vector<string> args) { 
-            do_draw(ft, std::move(args), draw); 
+            do_draw(ft, std::move(args), [&](Diagram& diagram) {
+                draw(diagram, ft.parser.out());
+            }); 
+        }
+    );
+    parser.add("export", "text|json|dot|chrome FILE [TREE]",
+        "write a process tree, or all if none specified, out to a file",
+        [&](vector<string> args) { 
+            do_export(ft, std::move(args)); 
         }
     );
     parser.add("view", "[TREE]",
@@ -572,6 +1339,27 @@ static void register_commands(Forktrace& ft)
             do_draw(ft, std::move(args), view); 
         }
     );
+    parser.add("top", "[cpu|rss|io|csw] [TREE]",
+        "rank the processes and programs that have ended by how much CPU, "
+        "memory, I/O or context switching they cost (defaults to cpu, and "
+        "to all trees together)",
+        [&](vector<string> args) { do_top(ft, std::move(args)); }
+    );
+    parser.add("samples", "PID",
+        "print the CPU and memory use of a process over time (see \"sample\")",
+        [&](string s) { do_samples(ft, s); }
+    );
+    parser.add("critical-path", "[TREE]",
+        "show the chain of processes that the tree had to wait on the longest "
+        "for (defaults to tree 0), and how much slack everything else had",
+        [&](vector<string> args) { do_critical_path(ft, std::move(args)); }
+    );
+
+    parser.add("pruned", "",
+        "print how much memory the trees take up and a summary of each "
+        "program that has had processes pruned (see \"rolling\")",
+        [&] { ft.pruner.print_summary(ft.parser.err(), ft.trees); }
+    );
 
     parser.start_new_group("Tracee control");
 
@@ -591,9 +1379,49 @@ static void register_commands(Forktrace& ft)
     parser.add("go", "", "resumes all tracees until until they end",
         [&] { do_go(ft); }
     );
+    parser.add("watch", "[TREE]", 
+        "same as \"go\", but shows a process tree in a scrollable window "
+        "as it grows (defaults to tree 0)",
+        [&](vector<string> args) { do_watch(ft, std::move(args)); }
+    );
+    parser.add("live", "[TREE]", 
+        "same as \"go\", but keeps a process tree drawn as it grows "
+        "(defaults to tree 0)",
+        [&](vector<string> args) { do_live(ft, std::move(args)); }
+    );
+    parser.add("sample", "HZ|off", 
+        "sample the CPU and memory use of tracees HZ times a second from "
+        "/proc (without stopping them), or stop sampling",
+        [&](string s) { do_sample(ft, s); }
+    );
+    parser.add("rolling", "MB|off",
+        "prune old subtrees that have been reaped to keep the trees under MB "
+        "megabytes (this renumbers the trees if a whole tree gets pruned)",
+        [&](string s) { do_rolling(ft, s); }
+    );
+    parser.add("horizon", "SECONDS",
+        "don't prune subtrees that ended less than SECONDS ago",
+        [&](string s) { do_horizon(ft, s); }
+    );
+    parser.add("spill", "FILE|off",
+        "write out pruned subtrees to FILE (which gets truncated)",
+        [&](string s) { do_spill(ft, s); }
+    );
+    parser.add("control", "PATH|off",
+        "listen for commands (and answer queries without stopping the "
+        "tracees) on a Unix domain socket at PATH, or stop listening",
+        [&](string s) { do_control(ft, s); }
+    );
 
     parser.start_new_group("Diagram config");
 
+    parser.add("jobs", "N", 
+        "use N threads to lay out and draw diagrams (0 means one per core)",
+        [&](string s) {
+            ft.opts.jobs = parse_number<size_t>(s);
+            ft.pool.resize(ft.opts.jobs);
+        }
+    );
     parser.add("lane-width", "WIDTH", "set the diagram lane width",
         [&](string s) { ft.opts.laneWidth = parse_number<size_t>(s); }
     );
@@ -613,6 +1441,23 @@ static void register_commands(Forktrace& ft)
         "if true, merge retried execs of the same program",
         [&](string s) { ft.opts.mergeExecs = parse_bool(s); }
     );
+    parser.add("collapse", "yes|no", 
+        "if true, collapse runs of identical sibling subtrees into one lane",
+        [&](string s) { ft.opts.collapseRepeats = parse_bool(s); }
+    );
+    parser.add("compact", "yes|no", 
+        "if true, make each lane only as wide as what's drawn in it needs",
+        [&](string s) { ft.opts.compactLanes = parse_bool(s); }
+    );
+    parser.add("time-scale", "MS|off", 
+        "space out diagram lines by one row per MS milliseconds, or turn "
+        "that off",
+        [&](string s) { do_time_scale(ft, s); }
+    );
+    parser.add("max-gap", "ROWS", 
+        "squash time-scaled gaps that are longer than ROWS rows",
+        [&](string s) { ft.opts.maxGap = parse_nonzero_number<size_t>(s); }
+    );
 }
 
 /******************************************************************************
@@ -646,6 +1491,10 @@ static bool confirm_quit(Forktrace& ft, bool dueToEOF)
 
 static void command_line(Forktrace& ft)
 {
+    // Commands from the control socket get run while we wait at the prompt
+    set_read_line_idle(
+        [&] { return ft.control.pending(); },
+        [&] { ft.control.run_pending(); });
     while (true)
     {
         try
@@ -656,26 +1505,62 @@ static void command_line(Forktrace& ft)
             }
             if (confirm_quit(ft, true))
             {
-                return;
+                break;
             }
         }
         catch (const QuitCommandLoop& e)
         {
             if (confirm_quit(ft, false))
             {
-                return;
+                break;
             }
         }
     }
+    set_read_line_idle(nullptr, nullptr);
 }
 
-static bool run(Tracer& tracer, Forktrace::Options& opts, vector<string> command)
+static bool run(Tracer& tracer, 
+                Sampler& sampler,
+                Forktrace::Options& opts, 
+                vector<string> command)
 {
     vector<shared_ptr<Process>> trees; // root of each process tree
+    std::unordered_map<const Process*, std::unique_ptr<Diagram>> diagrams;
     CommandParser cmdline;
+    Pruner pruner;
+    pruner.set_budget(opts.memoryBudgetMb * 1024 * 1024);
+    pruner.set_horizon(opts.horizonSecs * 1000000000);
+    try
+    {
+        pruner.set_spill_file(opts.spillFile);
+    }
+    catch (const std::exception& e)
+    {
+        error("{}", e.what());
+        return false;
+    }
+
+    // Commands from the control socket get run by us (see run_pending)
+    ControlServer control(tracer, [&](string_view line, std::ostream& os) {
+        return cmdline.run(line, allow_remotely, &os);
+    });
+    if (!opts.controlSocket.empty())
+    {
+        try
+        {
+            control.start(opts.controlSocket);
+        }
+        catch (const std::exception& e)
+        {
+            error("Couldn't listen for commands: {}", e.what());
+            return false;
+        }
+    }
 
     // Bundles up references to all the state so others can access it
-    Forktrace ft(opts, tracer, cmdline, trees);
+    ThreadPool pool(opts.jobs);
+    Forktrace ft(opts, tracer, sampler, pruner, pool, cmdline, control, trees,
+        diagrams);
     register_commands(ft);
 
     if (command.empty())
@@ -690,8 +1575,13 @@ static bool run(Tracer& tracer, Forktrace::Options& opts, vector<string> command
         {
             assert(!command.empty());
             trees.push_back(tracer.start(command[0], command));
+            control.set_trees(trees);
             do_go(ft);
-            if (opts.forceScrollView)
+            if (!opts.exportFile.empty())
+            {
+                do_export(ft, {opts.exportFormat, opts.exportFile});
+            }
+            else if (opts.forceScrollView)
             {
                 do_draw(ft, {}, view);
             }
@@ -731,7 +1621,7 @@ bool forktrace(vector<string> command, Forktrace::Options opts)
     /* This will fork the reaper process as the parent. When the call is done,
      * we will be running as the child!!! (We'll have a different PID!!!). We
      * also start the reaper thread, which reads from pipe onto the queue. */
-    FILE* reaperPipe;
+    FILE* reaperPipe = nullptr;
     std::optional<std::thread> reaper;
     if (opts.reaper)
     {
@@ -741,6 +1631,11 @@ bool forktrace(vector<string> command, Forktrace::Options opts)
             return false;
         }
     }
+
+    /* Messages get printed by their own thread from here on. It has to be
+     * started after the reaper's fork, since the writer (like every other
+     * thread) doesn't come along into the child. */
+    start_log_writer();
     log("Hello, I'm {}", getpid());
 
     /* Start the reaper and sigwait threads. */
@@ -751,7 +1646,13 @@ bool forktrace(vector<string> command, Forktrace::Options opts)
     }
     std::thread sigwaiter(signal_thread, std::ref(tracer), set);
 
-    bool ok = run(tracer, opts, std::move(command));
+    /* Start the sampler thread too (if asked to). This has to go after we've
+     * blocked SIGINT, like the other threads. */
+    Sampler sampler(tracer);
+    sampler.set_rate(opts.sampleRate);
+
+    bool ok = run(tracer, sampler, opts, std::move(command));
+    sampler.set_rate(0);
 
     join_sigwaiter(sigwaiter);
     if (opts.reaper)
@@ -760,5 +1661,6 @@ bool forktrace(vector<string> command, Forktrace::Options opts)
         fclose(reaperPipe);
     }
 
+    stop_log_writer();
     return ok;
 }
@@ -7,12 +7,19 @@
 #ifndef FORKTRACE_FORKTRACE_HPP
 #define FORKTRACE_FORKTRACE_HPP
 
+#include <memory>
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 class Process; // defined in process.hpp
 class Tracer; // defined in tracer.hpp
 class CommandParser; // defined in command.hpp
+class Sampler; // defined in sampler.hpp
+class Pruner; // defined in pruner.hpp
+class Diagram; // defined in diagram.hpp
+class ThreadPool; // defined in thread-pool.hpp
+class ControlServer; // defined in control.hpp
 
 /* Just contains references to state needed by some other parts of the program.
  * Ceebs encapsulating this into a class - a struct will do. References mean I
@@ -33,23 +40,72 @@ struct Forktrace
         bool showFailedExecs = false;
         bool showSignalSends = false;
         bool mergeExecs = true;
-        size_t laneWidth = 4;
+        bool collapseRepeats = false; // see Diagram::toggle_fold
+        bool compactLanes = false; // lanes as narrow as they can be
+        size_t laneWidth = 4; // ignored with compactLanes
+
+        /* If true, space the lines of the diagram out in proportion to the
+         * time between them (see Diagram::TimeScale for the other two). */
+        bool timeScaled = false;
+        size_t rowTimeMs = 10;
+        size_t maxGap = 8;
+
+        /* How many times per second to sample the CPU and memory use of each
+         * tracee from /proc (see sampler.hpp). 0 turns the sampler off. */
+        unsigned sampleRate = 0;
+
+        /* If non-zero, then old subtrees that have been reaped get pruned so
+         * that the trees fit within this many megabytes (see pruner.hpp).
+         * Only subtrees that ended more than horizonSecs ago get pruned, and
+         * if spillFile isn't empty then they get written out there first. */
+        size_t memoryBudgetMb = 0;
+        size_t horizonSecs = 60;
+        std::string spillFile;
 
         /* Normally we only show the scroll-view in non-interactive mode if the
          * diagram can't fit, but this makes it always show. */
         bool forceScrollView = false;
+
+        /* If not empty, then instead of drawing the trees at the end of
+         * instant mode, they get exported to this file (see do_export) in
+         * the given format (see exporter.hpp). */
+        std::string exportFile;
+        std::string exportFormat = "text";
+
+        /* Number of threads used to lay out and draw diagrams (see
+         * thread-pool.hpp). 0 means one per core. */
+        size_t jobs = 0;
+
+        /* If not empty, then we listen for commands on a Unix domain socket
+         * at this path (see control.hpp). */
+        std::string controlSocket;
     };
 
     Options& opts;
     Tracer& tracer;
+    Sampler& sampler;
+    Pruner& pruner;
+    ThreadPool& pool;
     CommandParser& parser;
+    ControlServer& control;
     std::vector<std::shared_ptr<Process>>& trees;
 
+    /* The diagram last drawn for each tree (by leader), which gets updated
+     * rather than rebuilt the next time that the tree is drawn. */
+    std::unordered_map<const Process*, std::unique_ptr<Diagram>>& diagrams;
+
     Forktrace(Options& opts,
               Tracer& tracer, 
+              Sampler& sampler,
+              Pruner& pruner,
+              ThreadPool& pool,
               CommandParser& parser, 
-              decltype(trees) trees) 
-        : opts(opts), tracer(tracer), parser(parser), trees(trees) { }
+              ControlServer& control,
+              decltype(trees) trees,
+              decltype(diagrams) diagrams) 
+        : opts(opts), tracer(tracer), sampler(sampler), pruner(pruner),
+        pool(pool), parser(parser), control(control), trees(trees),
+        diagrams(diagrams) { }
 };
 
 /* Runs the specified command in forktrace. If the command is empty, or if the
@@ -3,13 +3,22 @@
  *  log
  *
  *      A whole bunch of nifty logging functions plus stuff for coloured text.
+ *
+ *      The ring buffer of deferred messages is Dmitry Vyukov's bounded queue.
+ *      Each record has a sequence number next to it, which says whose turn it
+ *      is: the loggers fighting over position p (with a CAS) can have it once
+ *      its sequence is p, and the writer can have it once it's p + 1. Only
+ *      the writer ever takes records off, so that side doesn't need a CAS.
  */
 #include <iostream>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <cassert>
 #include <optional>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "log.hpp"
 #include "util.hpp"
@@ -27,6 +36,31 @@ static string gProgramName;
 /* Stores whether or not each log category is currently enabled or not... */
 static std::atomic<bool> gLogCategoryEnabled[size_t(Log::NUM_LOG_CATEGORIES)];
 
+/* The ring buffer of deferred messages (see the comment at the top) */
+constexpr size_t RING_SIZE = 1024; // must be a power of two
+static LogRecord gRecords[RING_SIZE];
+static std::atomic<size_t> gSequences[RING_SIZE];
+static std::atomic<size_t> gClaimed(0); // the next position to claim
+static size_t gTaken = 0; // the next position for the writer to take
+static std::atomic<size_t> gWritten(0); // positions that have been printed
+
+/* The writer thread, and everything it needs for sleeping and waking up. The
+ * thread is never deleted, since a child process that we fork gets a copy of
+ * it without the actual thread behind it. */
+static std::thread* gWriter = nullptr;
+static std::mutex gWriterLock;
+static std::condition_variable gWriterWake; // the writer waits on this
+static std::condition_variable gFlushed; // flush_log waits on this
+static std::atomic<bool> gWriterAsleep(false);
+static std::atomic<size_t> gFlushers(0); // threads waiting in flush_log
+static bool gStopWriter = false;
+
+/* Makes sure that separate messages don't get mixed up with each other */
+static std::mutex gOutputLock;
+
+/* Where the calling thread's messages go instead of stderr (if anywhere) */
+static thread_local std::ostream* t_redirect = nullptr;
+
 constexpr Colour PREFIX_COLOUR = Colour::GREY;
 constexpr Colour ERROR_COLOUR = Colour::RED | Colour::BOLD;
 constexpr Colour WARNING_COLOUR = Colour::PURPLE | Colour::BOLD;
@@ -64,12 +98,22 @@ void set_log_category_enabled(Log category, bool enabled)
 bool is_log_enabled_for(Log category)
 {
     assert((Log)0 <= category && category < Log::NUM_LOG_CATEGORIES);
+    if (!VERBOSE_LOGGING && (category == Log::VERB || category == Log::DBG))
+    {
+        return false;
+    }
     return gLogCategoryEnabled[size_t(category)];
 }
 
+void redirect_messages(std::ostream* os)
+{
+    t_redirect = os;
+}
+
 /* Internal helper function that does the work of message but allows you to
- * opt for no log category at all (otherwise the same as message()). */
-static void message_internal(optional<Log> logCategory, string_view message)
+ * opt for no log category at all (otherwise the same as message()). This
+ * prints straight away, so it's what the writer thread uses too. */
+static void write_message(optional<Log> logCategory, string_view message)
 {
     string prefix = format("[{}] ", getpid());
     string line;
@@ -92,31 +136,230 @@ static void message_internal(optional<Log> logCategory, string_view message)
             break;
         }
     }
-    // Now we'll print out each line of the string separately (so that we can
-    // attach our log prefix to the start of each line). Append a newline to
-    // the final line if none is present.
-    size_t pos = 0, next;
+    // Now we'll put each line of the string together separately (so that we
+    // can attach our log prefix to the start of each line), and then print
+    // the lot in one go. Append a newline to the final line if none is there.
+    size_t pos = 0, next, lineStart = 0;
     while (next = message.find('\n', pos), next != string::npos)
     {
         line.append(message.substr(pos, next - pos + 1));
-        std::cerr << line; // TODO cerr thread safe??!?!?!
         pos = next + 1;
-        line = colour(PREFIX_COLOUR, prefix); // start off the next line
+        lineStart = line.size();
+        line += colour(PREFIX_COLOUR, prefix); // start off the next line
     }
     if (pos < message.size())
     {
         line.append(message.substr(pos));
         line += '\n';
-        std::cerr << line; // TODO cerr thread safe???!?!?
+    }
+    else
+    {
+        line.resize(lineStart); // nothing to go on the last line after all
+    }
+    std::scoped_lock<std::mutex> guard(gOutputLock);
+    (t_redirect ? *t_redirect : std::cerr) << line;
+}
+
+/* Takes deferred messages off the ring buffer and prints them, until it's
+ * told to stop (and there's nothing left). */
+static void writer_thread()
+{
+    while (true)
+    {
+        size_t pos = gTaken;
+        LogRecord& record = gRecords[pos % RING_SIZE];
+        if (gSequences[pos % RING_SIZE].load() == pos + 1)
+        {
+            string text;
+            try
+            {
+                text = record.write(record.args);
+            }
+            catch (const std::exception& e)
+            {
+                text = format("(couldn't format log message: {})", e.what());
+            }
+            Log category = record.category;
+            gSequences[pos % RING_SIZE].store(pos + RING_SIZE); // free again
+            gTaken = pos + 1;
+            write_message({category}, text);
+            gWritten.store(pos + 1);
+            if (gFlushers.load() > 0)
+            {
+                std::scoped_lock<std::mutex> guard(gWriterLock);
+                gFlushed.notify_all();
+            }
+            continue;
+        }
+
+        // Nothing to do, so go to sleep. Loggers check gWriterAsleep after
+        // committing their record, and we check for records after setting
+        // it, so one of us always notices the other.
+        std::unique_lock<std::mutex> lock(gWriterLock);
+        gWriterAsleep.store(true);
+        if (gSequences[pos % RING_SIZE].load() != pos + 1)
+        {
+            if (gStopWriter && gClaimed.load() == pos)
+            {
+                gWriterAsleep.store(false);
+                return;
+            }
+            gWriterWake.wait(lock);
+        }
+        gWriterAsleep.store(false);
+    }
+}
+
+/* Resets the ring buffer (with no writer thread to empty it). */
+static void reset_log_ring()
+{
+    gClaimed.store(0);
+    gTaken = 0;
+    gWritten.store(0);
+    for (size_t i = 0; i < RING_SIZE; ++i)
+    {
+        gSequences[i].store(i);
+    }
+}
+
+/* Holding onto the locks across a fork means that the writer can't be halfway
+ * through printing something (or signalling someone) in the child's copy. */
+static void before_fork()
+{
+    gWriterLock.lock();
+    gOutputLock.lock();
+}
+
+static void after_fork_in_parent()
+{
+    gOutputLock.unlock();
+    gWriterLock.unlock();
+}
+
+/* The writer thread doesn't come with us into the child, so forget about it
+ * (and about anything that it hadn't gotten around to yet). */
+static void after_fork_in_child()
+{
+    gOutputLock.unlock();
+    gWriterLock.unlock();
+    gWriter = nullptr;
+    reset_log_ring();
+}
+
+void start_log_writer()
+{
+    if (gWriter)
+    {
+        return;
+    }
+    static bool registered = false;
+    if (!registered)
+    {
+        pthread_atfork(before_fork, after_fork_in_parent,
+                       after_fork_in_child);
+        atexit(stop_log_writer);
+        registered = true;
+    }
+    reset_log_ring();
+    gStopWriter = false;
+    gWriter = new std::thread(writer_thread);
+}
+
+void stop_log_writer()
+{
+    if (!gWriter)
+    {
+        return;
+    }
+    {
+        std::scoped_lock<std::mutex> guard(gWriterLock);
+        gStopWriter = true;
+        gWriterWake.notify_one();
+    }
+    gWriter->join();
+    delete gWriter;
+    gWriter = nullptr;
+}
+
+void flush_log()
+{
+    if (!gWriter)
+    {
+        return;
+    }
+    size_t claimed = gClaimed.load();
+    gFlushers++;
+    {
+        std::unique_lock<std::mutex> lock(gWriterLock);
+        gWriterWake.notify_one();
+        gFlushed.wait(lock, [claimed] { return gWritten.load() >= claimed; });
+    }
+    gFlushers--;
+}
+
+LogRecord* claim_log_record()
+{
+    if (!gWriter)
+    {
+        return nullptr;
+    }
+    size_t pos = gClaimed.load();
+    while (true)
+    {
+        size_t sequence = gSequences[pos % RING_SIZE].load();
+        if (sequence == pos)
+        {
+            if (gClaimed.compare_exchange_weak(pos, pos + 1))
+            {
+                return &gRecords[pos % RING_SIZE];
+            }
+            // (the failed CAS loaded the new position for us)
+        }
+        else if (sequence < pos + 1)
+        {
+            // We've lapped the writer, so give it a chance to catch up
+            std::this_thread::yield();
+            pos = gClaimed.load();
+        }
+        else
+        {
+            pos = gClaimed.load(); // someone else got in first
+        }
+    }
+}
+
+void commit_log_record(LogRecord* record)
+{
+    size_t i = record - gRecords;
+    size_t pos = gSequences[i].load(); // what it was when we claimed it
+    gSequences[i].store(pos + 1);
+    if (gWriterAsleep.load())
+    {
+        std::scoped_lock<std::mutex> guard(gWriterLock);
+        gWriterWake.notify_one();
     }
 }
 
 void print_str(string_view message)
 {
-    message_internal({}, message);
+    flush_log();
+    write_message({}, message);
+}
+
+void message_now(Log category, string_view message)
+{
+    flush_log();
+    write_message({category}, message);
 }
 
 void message_always(Log category, string_view message)
 {
-    message_internal({category}, message);
+    if (category == Log::ERROR || category == Log::WARN)
+    {
+        message_now(category, message);
+    }
+    else
+    {
+        defer_message(category, "{}", message);
+    }
 }
@@ -3,11 +3,21 @@
  *  log
  *
  *      A whole bunch of nifty logging functions plus stuff for coloured text.
+ *
+ *      Once start_log_writer has been called, log, verbose and debug messages
+ *      don't get formatted by the thread that logs them. Their arguments get
+ *      copied into a record on a ring buffer instead, and a writer thread does
+ *      the formatting and the printing. Errors and warnings (and print) still
+ *      get printed straight away, after whatever was logged before them.
  */
 #ifndef FORKTRACE_LOG_HPP
 #define FORKTRACE_LOG_HPP
 
 #include <string>
+#include <iosfwd>
+#include <tuple>
+#include <new>
+#include <cstddef>
 #include <fmt/core.h>
 #include <fmt/format.h>
 
@@ -23,6 +33,14 @@ enum class Log
     NUM_LOG_CATEGORIES, // must be the last item in the list.
 };
 
+/* Release builds (make RELEASE=1) leave out verbose and debug messages
+ * altogether, so they don't even cost a branch. */
+#ifdef FORKTRACE_RELEASE
+constexpr bool VERBOSE_LOGGING = false;
+#else
+constexpr bool VERBOSE_LOGGING = true;
+#endif
+
 /* Should call at the very start of main. Just initializes some config to 
  * defaults that's too ugly / not possible to do as a static initializer.
  * Plus initializes a global containing the program name for us to access. 
@@ -40,6 +58,28 @@ void set_log_category_enabled(Log category, bool enabled);
  * log options. Will load global state, but is thread safe (it's atomic). */
 bool is_log_enabled_for(Log category);
 
+/* Starts the thread that formats and prints deferred messages. Until this is
+ * called (and after stop_log_writer), everything gets printed straight away
+ * by whoever logged it. A process that forks is left without a writer on the
+ * child's side, so the child goes back to printing straight away too. */
+void start_log_writer();
+
+/* Prints out everything that's still waiting and then stops the writer. This
+ * gets called at exit if it hasn't been called already. */
+void stop_log_writer();
+
+/* Waits until everything that was logged before this call has been printed.
+ * Call this before writing to stderr yourself, so that things come out in
+ * the right order (print, error and warning already do this). */
+void flush_log();
+
+/* Sends whatever the calling thread prints straight away (errors, warnings
+ * and print) to `os` instead of stderr, until this is called again with null.
+ * Deferred messages still go to stderr, since the writer thread prints them.
+ * The control socket uses this to hand a command's errors back to whoever
+ * sent it (see control.hpp). */
+void redirect_messages(std::ostream* os);
+
 /* Prints out a message. Differs from logging only in that it always prints no
  * matter what and cannot be disabled. Use this when we're printing input that
  * the user asked for or for interacting with the user (i.e., not logging!). 
@@ -58,6 +98,83 @@ inline void print(std::string_view fmtStr, Args... args)
  * as "error: " or "warning: " (image the colours yourself!). */
 void message_always(Log category, std::string_view message);
 
+/* Prints the message out right now from this thread (after flush_log), no
+ * matter what its category is. Otherwise the same as message_always(). */
+void message_now(Log category, std::string_view message);
+
+/* A message that's waiting on the ring buffer for the writer thread to get to
+ * it. The arguments are stored in `args`, and `write` formats them and then
+ * destroys them. */
+struct LogRecord
+{
+    static constexpr size_t ARGS_SIZE = 192;
+
+    Log category;
+    std::string (*write)(void* args);
+    alignas(std::max_align_t) unsigned char args[ARGS_SIZE];
+};
+
+/* Returns a free record on the ring buffer (waiting for one if it's full), or
+ * null if there's no writer thread. The record has to be filled in and then
+ * handed to commit_log_record straight away. */
+LogRecord* claim_log_record();
+void commit_log_record(LogRecord* record);
+
+/* The types that arguments get kept as while they're waiting on the ring
+ * buffer. Strings that we don't own get copied, since they could be gone by
+ * the time that the writer thread gets to them. */
+template <typename T> struct LogArg { using type = T; };
+template <> struct LogArg<std::string_view> { using type = std::string; };
+template <> struct LogArg<const char*> { using type = std::string; };
+template <> struct LogArg<char*> { using type = std::string; };
+
+/* Hands a message over to the writer thread to be formatted and printed, or
+ * prints it straight away if there isn't one (or if the arguments are too big
+ * to fit in a record). The arguments are copied, so anything that can change
+ * (like a Process) has to be turned into a string first. The format string
+ * isn't copied though, so it has to be a string literal. */
+template <typename ...Args>
+void defer_message(Log category, std::string_view fmtStr, Args... args)
+{
+    using Stored = std::tuple<std::string_view, typename LogArg<Args>::type...>;
+    static_assert(alignof(Stored) <= alignof(std::max_align_t));
+    if constexpr (sizeof(Stored) <= LogRecord::ARGS_SIZE)
+    {
+        // Copy the arguments before claiming a record, so that nothing can
+        // throw while we're holding one.
+        Stored stored(fmtStr, std::move(args)...);
+        if (LogRecord* record = claim_log_record())
+        {
+            record->category = category;
+            record->write = [](void* args)
+            {
+                Stored& stored = *static_cast<Stored*>(args);
+                struct Destroy
+                {
+                    Stored& stored;
+                    ~Destroy() { stored.~Stored(); }
+                } destroy{stored};
+                return std::apply([](std::string_view fmtStr, auto&... args)
+                {
+                    return fmt::format(fmtStr, args...);
+                }, stored);
+            };
+            new (record->args) Stored(std::move(stored));
+            commit_log_record(record);
+            return;
+        }
+        message_now(category, std::apply(
+            [](std::string_view fmtStr, auto&... args)
+            {
+                return fmt::format(fmtStr, args...);
+            }, stored));
+    }
+    else
+    {
+        message_now(category, fmt::format(fmtStr, args...));
+    }
+}
+
 /* If is_log_enabled_for(level), prints out the message to stderr. Depending on
  * the log type, a different header may or may not be appended to the start of
  * the message. The message can have internal newlines. A newline will be added
@@ -80,35 +197,57 @@ inline void message(std::string_view message)
 }
 
 /* Some helper functions that just forward a list of variadic arguments to
- * libfmt's format function. Saves a lot of typing. */
+ * libfmt's format function. Saves a lot of typing. Nothing gets formatted
+ * unless the category is enabled. */
 template <typename ...Args>
 inline void log(std::string_view fmtStr, Args... args)
 {
-    message(Log::LOG, fmt::format(fmtStr, args...));
+    if (is_log_enabled_for(Log::LOG))
+    {
+        defer_message(Log::LOG, fmtStr, std::move(args)...);
+    }
 }
 
 template <typename ...Args>
 inline void warning(std::string_view fmtStr, Args... args)
 {
-    message(Log::WARN, fmt::format(fmtStr, args...));
+    if (is_log_enabled_for(Log::WARN))
+    {
+        message_always(Log::WARN, fmt::format(fmtStr, args...));
+    }
 }
 
 template <typename ...Args>
 inline void error(std::string_view fmtStr, Args... args)
 {
-    message(Log::ERROR, fmt::format(fmtStr, args...));
+    if (is_log_enabled_for(Log::ERROR))
+    {
+        message_always(Log::ERROR, fmt::format(fmtStr, args...));
+    }
 }
 
 template <typename ...Args>
 inline void verbose(std::string_view fmtStr, Args... args)
 {
-    message(Log::VERB, fmt::format(fmtStr, args...));
+    if constexpr (VERBOSE_LOGGING)
+    {
+        if (is_log_enabled_for(Log::VERB))
+        {
+            defer_message(Log::VERB, fmtStr, std::move(args)...);
+        }
+    }
 }
 
 template <typename ...Args>
 inline void debug(std::string_view fmtStr, Args... args)
 {
-    message(Log::DBG, fmt::format(fmtStr, args...));
+    if constexpr (VERBOSE_LOGGING)
+    {
+        if (is_log_enabled_for(Log::DBG))
+        {
+            defer_message(Log::DBG, fmtStr, std::move(args)...);
+        }
+    }
 }
 
 /* A wrapper around a number so that when we pass it to a libfmt format string
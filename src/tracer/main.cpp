@@ -21,6 +21,7 @@
 #include "terminal.hpp"
 #include "ptrace.hpp"
 #include "parse.hpp"
+#include "exporter.hpp"
 
 using std::string;
 using std::string_view;
@@ -741,6 +742,24 @@ static void register_options(ArgParser& parser, Forktrace::Options& opts)
     parser.add("no-reaper", "", "disables the sub-reaper process",
         [&]{ opts.reaper = false; }
     );
+    parser.add("rolling", "MB", 
+        "keep the process trees under MB megabytes by pruning old subtrees "
+        "that have been reaped (for long-running tracees like daemons)",
+        [&](string s) { opts.memoryBudgetMb = parse_number<size_t>(s); }
+    );
+    parser.add("horizon", "SECONDS", 
+        "don't prune subtrees that ended less than SECONDS ago (default 60)",
+        [&](string s) { opts.horizonSecs = parse_number<size_t>(s); }
+    );
+    parser.add("spill", "FILE", 
+        "write out pruned subtrees to FILE instead of throwing them away",
+        [&](string s) { opts.spillFile = s; }
+    );
+    parser.add("control", "PATH",
+        "listen for commands on a Unix domain socket at PATH, so that scripts "
+        "can look at and control the trace while it runs",
+        [&](string s) { opts.controlSocket = s; }
+    );
     parser.add("status", "STATUS", "diagnose a wait(2) child status",
         [&](string s) { diagnose_status(parse_number<int>(s)); parser.exit(); }
     );
@@ -770,9 +789,44 @@ static void register_options(ArgParser& parser, Forktrace::Options& opts)
         "if true, merge retried execs of the same program",
         [&](string s) { opts.mergeExecs = parse_bool(s); }
     );
+    parser.add("collapse", "yes|no", 
+        "if true, collapse runs of identical sibling subtrees into one lane",
+        [&](string s) { opts.collapseRepeats = parse_bool(s); }
+    );
+    parser.add("compact", "yes|no", 
+        "if true, make each lane only as wide as what's drawn in it needs",
+        [&](string s) { opts.compactLanes = parse_bool(s); }
+    );
+    parser.add("export", "FILE", 
+        "write the diagrams out to FILE instead of drawing them when done",
+        [&](string s) { opts.exportFile = s; }
+    );
+    parser.add("export-format", "FORMAT", 
+        "format for --export: text, json, dot or chrome (default text)",
+        [&](string s) { parse_export_format(s); opts.exportFormat = s; }
+    );
+    parser.add("jobs", "N", 
+        "use N threads to lay out and draw diagrams (0 means one per core)",
+        [&](string s) { opts.jobs = parse_number<size_t>(s); }
+    );
     parser.add("lane-width", "WIDTH", "set the diagram lane width",
         [&](string s) { opts.laneWidth = parse_number<size_t>(s); }
     );
+    parser.add("time-scale", "MS", 
+        "space out the diagram so that each row is MS milliseconds",
+        [&](string s) { 
+            opts.rowTimeMs = parse_nonzero_number<size_t>(s);
+            opts.timeScaled = true;
+        }
+    );
+    parser.add("max-gap", "ROWS", 
+        "squash time-scaled gaps that are longer than ROWS rows",
+        [&](string s) { opts.maxGap = parse_nonzero_number<size_t>(s); }
+    );
+    parser.add("sample", "HZ", 
+        "sample CPU and memory use of tracees from /proc HZ times a second",
+        [&](string s) { opts.sampleRate = parse_number<unsigned>(s); }
+    );
 
     parser.start_new_group("Logging options");
 
@@ -42,4 +42,18 @@ T parse_number(std::string_view input)
     return value;
 }
 
+/* Same as parse_number, but 0 is an error too (e.g., for time scales and
+ * sizes that wouldn't make any sense as 0). */
+template<class T>
+T parse_nonzero_number(std::string_view input)
+{
+    T value = parse_number<T>(input);
+    if (value == 0)
+    {
+        throw ParseError(fmt::format("Expected a non-zero number, not '{}'.",
+            input));
+    }
+    return value;
+}
+
 #endif /* FORKTRACE_PARSE_HPP */
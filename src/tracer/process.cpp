@@ -1,4 +1,5 @@
 #include <cassert>
+#include <algorithm>
 #include <iostream>
 #include <fmt/core.h>
 #include <unistd.h>
@@ -11,7 +12,6 @@
 using std::string;
 using std::string_view;
 using std::vector;
-using std::unique_ptr;
 using std::shared_ptr;
 using std::make_unique;
 using std::make_shared;
@@ -28,70 +28,186 @@ void process_assert(bool cond, std::string_view fmt, Args... args)
     }
 }
 
-Process::Process(pid_t pid, const shared_ptr<Process>& parent)
-    : _pid(pid), _parent(parent), _state(State::ALIVE), _killed(false)
+const Sample& SampleRing::at(size_t i) const
 {
-    const ExecEvent* lastExec = parent->most_recent_exec();
-    if (!lastExec) 
+    return _samples[(_start + i) % _samples.size()];
+}
+
+void SampleRing::push(const Sample& sample)
+{
+    std::scoped_lock<std::mutex> guard(_lock);
+    if (_samples.size() < CAPACITY)
     {
-        _initialName = parent->_initialName;
-        _initialArgs = parent->_initialArgs;
-    } 
-    else 
+        _samples.push_back(sample);
+        return;
+    }
+    _samples[_start] = sample;
+    _start = (_start + 1) % CAPACITY;
+}
+
+size_t SampleRing::size() const
+{
+    std::scoped_lock<std::mutex> guard(_lock);
+    return _samples.size();
+}
+
+vector<Sample> SampleRing::snapshot() const
+{
+    std::scoped_lock<std::mutex> guard(_lock);
+    vector<Sample> result;
+    result.reserve(_samples.size());
+    for (size_t i = 0; i < _samples.size(); ++i)
     {
-        _initialName = lastExec->file();
-        _initialArgs = lastExec->args;
+        result.push_back(at(i));
     }
+    return result;
 }
 
-/* Will do a reverse search to find the most recent successful exec event for 
- * this process, and will return null if it couldn't be found. The pointer will
- * become invalid if the event is removed from our list. If startIndex is
- * negative, then we'll search all events. Otherwise, we'll start the reverse
- * search from the event preceding the specified index. */
-const ExecEvent* Process::most_recent_exec(int startIndex) const 
+bool SampleRing::find(Timestamp time, Sample& prev, Sample& cur) const
 {
-    if (_events.empty() || startIndex == 0) 
+    std::scoped_lock<std::mutex> guard(_lock);
+    // Binary search for the first sample that was taken after `time`.
+    size_t lo = 0, hi = _samples.size();
+    while (lo < hi)
     {
-        return nullptr;
+        size_t mid = (lo + hi) / 2;
+        if (at(mid).time <= time)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
     }
-    if (startIndex < 0) 
+    if (lo == 0)
     {
-        startIndex = _events.size();
+        return false;
     }
-    startIndex--;
-    for (long i = startIndex; i >= 0; --i) 
+    cur = at(lo - 1);
+    prev = at(lo >= 2 ? lo - 2 : 0);
+    return true;
+}
+
+Process::Process(pid_t pid, const shared_ptr<Process>& parent)
+    : ProcessHistory(this, pid, parent->_time, parent->_initial),
+    _parent(parent), _time(parent->_time), _allKinds(0)
+{
+    const ExecEvent* lastExec = parent->most_recent_exec();
+    if (lastExec) 
+    {
+        _initial = make_command(lastExec->file(), lastExec->args);
+    }
+    publish();
+}
+
+shared_ptr<const ProcessHistory::Command> ProcessHistory::make_command(
+    string name, vector<string> args)
+{
+    string line = format("{} [ {} ]", name, join(args));
+    return make_shared<Command>(
+        Command{std::move(name), std::move(args), std::move(line)});
+}
+
+/* Finds the most recent successful exec that comes before the event at
+ * startIndex (or out of all of them if startIndex is negative), and returns
+ * null if there isn't one. */
+const ProcessHistory::Exec* ProcessHistory::exec_before(int startIndex) const
+{
+    // Binary search for the first exec that isn't before the end
+    size_t end = startIndex < 0 ? _events.size() : size_t(startIndex);
+    size_t lo = 0, hi = _execs.size();
+    while (lo < hi)
     {
-        if (auto exec = dynamic_cast<const ExecEvent*>(_events.at(i).get()))
+        size_t mid = (lo + hi) / 2;
+        if (_execs[mid].index < end)
         {
-            if (exec->succeeded()) 
-            {
-                return exec;
-            }
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
         }
     }
-    return nullptr;
+    return lo == 0 ? nullptr : &_execs[lo - 1];
+}
+
+/* Same as exec_before, but returns the ExecEvent itself. The pointer will
+ * become invalid if the event is removed from our list. */
+const ExecEvent* ProcessHistory::most_recent_exec(int startIndex) const 
+{
+    const Exec* exec = exec_before(startIndex);
+    return exec ? static_cast<const ExecEvent*>(&_events[exec->index]) 
+        : nullptr;
 }
 
 /* Add this event to the list and log it out. Throws ProcessTreeError if the
  * process has already ended. If `consumeLocation` is true, then the current
  * source location is **moved** into the provided event if it exists. Events
  * can only be added if the process is alive. */
-void Process::add_event(unique_ptr<Event> event, bool consumeLocation) 
+void Process::add_event(shared_ptr<Event> event, bool consumeLocation) 
 {
     process_assert(_state == State::ALIVE,
         "add_event({}) called when state != ALIVE", event->to_string());
+    event->time = _time;
+    // The event's string has to be made here (it looks at how we're doing),
+    // so don't bother making it unless it's going to be printed.
+    bool logging = is_log_enabled_for(Log::LOG);
     if (_location.has_value() && consumeLocation)
     {
-        log("{} @ {}", event->to_string(), _location->to_string());
+        if (logging)
+        {
+            log("{} @ {}", event->to_string(), _location->to_string());
+        }
         event->location = std::move(_location);
         _location.reset();
     }
-    else
+    else if (logging)
     {
         log("{}", event->to_string());
     }
+    uint8_t kinds = event->kinds();
     _events.push_back(std::move(event));
+    _revision++;
+    if ((kinds & (EXEC_EVENT | FAILED_EXEC_EVENT)) == EXEC_EVENT)
+    {
+        add_exec(_events.size() - 1);
+    }
+}
+
+/* Adds the successful exec at the given index of _events to the end of
+ * _execs. */
+void Process::add_exec(size_t index)
+{
+    auto& exec = static_cast<const ExecEvent&>(_events[index]);
+    assert(_execs.empty() || _execs.back().index < index);
+    _execs.push_back(make_shared<const Exec>(Exec{index,
+        format("{} [ {} ]", exec.call().file, join(exec.args))}));
+}
+
+/* Publishes a copy of our history for snapshot() to hand out, unless nothing
+ * has changed since the last one. Every public function that changes our
+ * history calls this on its way out (the tracer only ever calls one of them
+ * at a time, so there's no point doing it for every little change). */
+void Process::publish()
+{
+    if (_published && _published->revision() == _revision)
+    {
+        return;
+    }
+    auto history = make_shared<const ProcessHistory>(*this);
+    _snapshot.store(history.get(), std::memory_order_release);
+    if (_published)
+    {
+        retire(std::move(_published));
+    }
+    _published = std::move(history);
+}
+
+const ProcessHistory& Process::snapshot() const
+{
+    assert(is_epoch_pinned());
+    return *_snapshot.load(std::memory_order_acquire);
 }
 
 void Process::notify_waiting(pid_t waitedId, bool nohang) 
@@ -101,22 +217,30 @@ void Process::notify_waiting(pid_t waitedId, bool nohang)
     // them separately when another event appears in between them).
     if (!_events.empty()) 
     {
-        if (auto wait = dynamic_cast<WaitEvent*>(_events.back().get())) 
+        auto wait = dynamic_cast<const WaitEvent*>(&_events.back());
+        if (wait && wait->error == ERESTARTSYS) 
         {
-            if (wait->error == ERESTARTSYS) 
-            {
-                bool same = wait->waitedId == waitedId 
-                    && wait->nohang == nohang;
-                process_assert(same, "notify_waiting({}, nohang={}) called "
-                    "after interrupted wait but with different parameters ("
-                    "{}, {})", waitedId, nohang, wait->waitedId, wait->nohang);
-                debug("({}) merging event for restarted wait call", _pid);
-                wait->error = 0;
-                return;
-            }
+            bool same = wait->waitedId == waitedId && wait->nohang == nohang;
+            process_assert(same, "notify_waiting({}, nohang={}) called "
+                "after interrupted wait but with different parameters ("
+                "{}, {})", waitedId, nohang, wait->waitedId, wait->nohang);
+            debug("({}) merging event for restarted wait call", _pid);
+            // Events never change once they're in the list (snapshots might
+            // be looking at them), so swap in a copy with the error cleared.
+            auto restarted = make_shared<WaitEvent>(*wait);
+            restarted->error = 0;
+            _pendingWait = restarted.get();
+            _events.set(_events.size() - 1, std::move(restarted));
+            _revision++;
+            publish();
+            return;
         }
     }
-    add_event(make_unique<WaitEvent>(*this, waitedId, nohang), true);
+    auto wait = make_shared<WaitEvent>(*this, waitedId, nohang);
+    const WaitEvent* pending = wait.get();
+    add_event(std::move(wait), true);
+    _pendingWait = pending;
+    publish();
 }
 
 void Process::notify_failed_wait(int error) 
@@ -124,12 +248,20 @@ void Process::notify_failed_wait(int error)
     // search backwards to find the WaitEvent that started the failed wait
     for (size_t i = _events.size() - 1; i >= 0; --i) 
     {
-        if (auto wait = dynamic_cast<WaitEvent*>(_events[i].get())) 
+        if (auto wait = dynamic_cast<const WaitEvent*>(&_events[i])) 
         {
             process_assert(wait->error == 0, "notify_failed_wait(\"{}\"): "
                 "the previous WaitEvent already failed", strerror_s(error));
-            wait->error = error;
-            log("{}", wait->to_string());
+            auto failed = make_shared<WaitEvent>(*wait);
+            failed->error = error;
+            if (is_log_enabled_for(Log::LOG))
+            {
+                log("{}", failed->to_string());
+            }
+            _events.set(i, std::move(failed));
+            _pendingWait = nullptr;
+            _revision++;
+            publish();
             return;
         }
     }
@@ -142,27 +274,31 @@ void Process::notify_reaped(shared_ptr<Process> child)
     process_assert(child->_state == State::ZOMBIE,
         "notify_reaped({}) called on non-zombie process", child->to_string());
     child->_state = State::REAPED;
+    child->_revision++;
+    child->publish();
 
     // search backwards to find the WaitEvent that started this wait
     for (size_t i = _events.size() - 1; i >= 0; --i)
     {
-        if (auto wait = dynamic_cast<WaitEvent*>(_events[i].get())) 
+        if (auto wait = dynamic_cast<const WaitEvent*>(&_events[i])) 
         {
             process_assert(wait->error == 0, "notify_reaped({}) called when "
                 "the last WaitEvent failed", child->to_string());
 
-            // We'll take the successful WaitEvent off our event list and put
-            // an ReapEvent there instead (which will contain the WaitEvent).
-            // First, put the WaitEvent inside a new unique_ptr.
-            unique_ptr<WaitEvent> waitEv(wait);
-            // Important! Release the old pointer so the WaitEvent doesn't get
-            // free'd when we replace the unique_ptr that currently holds it.
-            _events[i].release();
-            // Now replace with a ReapEvent that contains the WaitEvent
-            _events[i] = make_unique<ReapEvent>(
-                *this, std::move(waitEv), std::move(child));
-
-            log("{}", _events[i]->to_string()); // log updated event
+            // We'll replace the successful WaitEvent in our event list with
+            // a ReapEvent (which will contain a copy of the WaitEvent, since
+            // snapshots could still be looking at the original).
+            auto reap = make_shared<ReapEvent>(*this,
+                make_unique<WaitEvent>(*wait), std::move(child));
+            reap->time = _time; // the wait keeps its own start time
+            if (is_log_enabled_for(Log::LOG))
+            {
+                log("{}", reap->to_string()); // log updated event
+            }
+            _events.set(i, std::move(reap));
+            _pendingWait = nullptr;
+            _revision++;
+            publish();
             return;
         }
     }
@@ -173,7 +309,8 @@ void Process::notify_reaped(shared_ptr<Process> child)
 void Process::notify_forked(shared_ptr<Process> child) 
 {
     // consumeLocation=true (forktrace.h updates source location for forks)
-    add_event(make_unique<ForkEvent>(*this, std::move(child)), true);
+    add_event(make_shared<ForkEvent>(*this, std::move(child)), true);
+    publish();
 }
 
 void Process::notify_exec(string file, vector<string> args, int errcode) 
@@ -182,27 +319,30 @@ void Process::notify_exec(string file, vector<string> args, int errcode)
     {
         // We have no exec events so far - don't have to worry about merging
         // consumeLocation=true (forktrace.h updates source location for execs)
-        add_event(make_unique<ExecEvent>(
+        add_event(make_shared<ExecEvent>(
             *this, std::move(file), std::move(args), errcode), true);
+        publish();
         return;
     }
 
-    auto event = dynamic_cast<ExecEvent*>(_events.back().get());
+    auto last = dynamic_cast<const ExecEvent*>(&_events.back());
 
-    if (!event || event->succeeded() || event->args != args) 
+    if (!last || last->succeeded() || last->args != args) 
     {
         // the last event wasn't a failed exec event, so don't merge
-        add_event(make_unique<ExecEvent>(
+        add_event(make_shared<ExecEvent>(
             *this, std::move(file), std::move(args), errcode), true);
+        publish();
         return;
     }
 
-    if (get_base_name(file) != get_base_name(event->call().file)
-        || event->args != args) 
+    if (get_base_name(file) != get_base_name(last->call().file)
+        || last->args != args) 
     {
         // the last exec was for a different program or args - don't merge
-        add_event(make_unique<ExecEvent>(
+        add_event(make_shared<ExecEvent>(
             *this, std::move(file), std::move(args), errcode), true);
+        publish();
         return;
     }
 
@@ -212,7 +352,21 @@ void Process::notify_exec(string file, vector<string> args, int errcode)
     // probably just the C library searching $PATH. (If that isn't the case,
     // then no biggie, since the user can still see the history of exec calls
     // if they want to). TODO make sure this feature is actually implemented.
-    event->calls.emplace_back(file, errcode); // update existing ExecEvent
+    // The existing ExecEvent gets updated by swapping in a copy of it (the
+    // original could still be in a snapshot).
+    auto event = make_shared<ExecEvent>(*last);
+    event->calls.emplace_back(file, errcode);
+    _events.set(_events.size() - 1, event);
+    _revision++;
+    if (event->succeeded())
+    {
+        add_exec(_events.size() - 1);
+    }
+    publish();
+    if (!is_log_enabled_for(Log::LOG))
+    {
+        return;
+    }
 
     // TODO maybe move printing of location into the event code itself? That
     // would clean some of this up.
@@ -227,18 +381,21 @@ void Process::notify_exec(string file, vector<string> args, int errcode)
     }
 }
 
-void Process::notify_ended(int status) 
+void Process::notify_ended(int status, std::optional<ResourceUsage> usage) 
 {
     // Not really a ProcessTreeError type scenario. People should only call 
     // this function if they have already checked this is the case.
     assert(WIFEXITED(status) || WIFSIGNALED(status));
+    _usage = std::move(usage);
+    _revision++;
 
     if (WIFEXITED(status)) 
     {
-        add_event(make_unique<ExitEvent>(*this, WEXITSTATUS(status)));
+        add_event(make_shared<ExitEvent>(*this, WEXITSTATUS(status)));
         // Must set this *after* calling add_event since it only allows events
         // to be added to processes that are State::ALIVE (good).
         _state = State::ZOMBIE;
+        publish();
     } 
     else 
     {
@@ -247,28 +404,36 @@ void Process::notify_ended(int status)
         // promote the old one to being a killing signal. TODO lost info?
         if (!_events.empty()) 
         {
-            auto event = dynamic_cast<SignalEvent*>(_events.back().get());
+            auto last = dynamic_cast<const SignalEvent*>(&_events.back());
 
-            if (event && event->signal == WTERMSIG(status))
+            if (last && last->signal == WTERMSIG(status))
             {
+                auto event = make_shared<SignalEvent>(*last);
                 _killed = event->killed = true;
-                log("{}", event->to_string());
+                if (is_log_enabled_for(Log::LOG))
+                {
+                    log("{}", event->to_string());
+                }
+                _events.set(_events.size() - 1, std::move(event));
                 _state = State::ZOMBIE;
+                publish();
                 return;
             }
         }
 
         // killed=True since we know this signal ended the process.
-        add_event(make_unique<SignalEvent>(*this, WTERMSIG(status), true));
+        add_event(make_shared<SignalEvent>(*this, WTERMSIG(status), true));
         _state = State::ZOMBIE; // must go after add_event
         _killed = true;
+        publish();
     }
 }
 
 void Process::notify_signaled(pid_t sender, int signal) 
 {
     // killed=False so far (we don't know if this signal killed yet)
-    add_event(make_unique<SignalEvent>(*this, sender, signal, false));
+    add_event(make_shared<SignalEvent>(*this, sender, signal, false));
+    publish();
 }
 
 /* This is a static member function */
@@ -287,33 +452,40 @@ void Process::notify_sent_signal(pid_t killedId,
         // Both processes get a handle to the shared kill information. The 
         // source process consumes their source location (since forktrace.h
         // will update location when kill/tkill/tkill is called).
-        source.add_event(make_unique<KillEvent>(source, info, true), true);
+        source.add_event(make_shared<KillEvent>(source, info, true), true);
+        source.publish();
 
         // Some signals like SIGKILL will kill the process instantly, so the 
         // death event will already be there. In that case, we want to put the 
         // kill event before it, so we'll swap them out. In both cases, we
         // add the event directly (eschewing add_event) since we don't want
         // to log the KillEvent twice (the source already did that just above).
+        // The receiving end is stamped with the sender's time since that's
+        // the only process we were notified about.
+        auto received = make_shared<KillEvent>(*dest, std::move(info), false);
+        received->time = source._time;
+        dest->_revision++;
+        EventList& events = dest->_events;
         if (dest->dead())
         {
-            assert(!dest->_events.empty());
-            unique_ptr<Event>& deathEvent = dest->_events.back();
-            dest->_events.push_back(
-                make_unique<KillEvent>(*dest, std::move(info), false));
-            swap(deathEvent, dest->_events.back());
+            assert(!events.empty());
+            auto death = events.share(events.size() - 1);
+            events.set(events.size() - 1, std::move(received));
+            events.push_back(std::move(death));
         } 
         else 
         {
-            dest->_events.push_back(
-                make_unique<KillEvent>(*dest, move(info), false));
+            events.push_back(std::move(received));
         }
+        dest->publish();
     } 
     else 
     {
         // We're not able to draw a clean line between two processes in the
         // tree, so we'll just use a RaiseEvent instead.
         source.add_event(
-            make_unique<RaiseEvent>(source, killedId, signal, toThread), true);
+            make_shared<RaiseEvent>(source, killedId, signal, toThread), true);
+        source.publish();
     }
 }
 
@@ -322,29 +494,115 @@ void Process::notify_orphaned()
     process_assert(_state == State::ZOMBIE, "notify_orphaned() called on "
         " a process that wasn't a ZOMBIE");
     _state = State::ORPHANED;
+    _revision++;
+    publish();
+}
+
+void Process::forget_child(const Process& child)
+{
+    process_assert(child.settled(), "forget_child({}) called on a process "
+        "that hasn't been reaped", child.to_string());
+
+    // Our fork event (and reap event, unless it was orphaned) for the child
+    // are the only things that hold onto it, so it'll get free'd after this.
+    // (Snapshots taken before now still have them, which is fine, since
+    // the events hold onto the child too.)
+    auto links = [&child](const Event& event)
+    {
+        if (auto fork = dynamic_cast<const ForkEvent*>(&event))
+        {
+            return fork->child.get() == &child;
+        }
+        if (auto reap = dynamic_cast<const ReapEvent*>(&event))
+        {
+            return reap->child.get() == &child;
+        }
+        return false;
+    };
+    size_t removed = _events.remove_if(links);
+    _revision++;
+    clear_caches();
+
+    // None of our execs were taken out, but the ones after the events that
+    // were have moved down, so find out where they are now
+    if (removed > 0 && !_execs.empty())
+    {
+        PersistentList<Exec> execs;
+        for (size_t i = 0; i < _events.size() && execs.size() < _execs.size();
+            ++i)
+        {
+            uint8_t kinds = _events[i].kinds();
+            if ((kinds & (EXEC_EVENT | FAILED_EXEC_EVENT)) == EXEC_EVENT)
+            {
+                execs.push_back(make_shared<const Exec>(
+                    Exec{i, _execs[execs.size()].line}));
+            }
+        }
+        _execs = std::move(execs);
+    }
+    publish();
+
+    process_assert(removed > 0, "forget_child({}) called on a process that "
+        "isn't a child of {}", child.to_string(), _pid);
+}
+
+void Process::unlink_kills(const std::unordered_set<const Process*>& gone)
+{
+    for (size_t i = 0; i < _events.size(); ++i)
+    {
+        auto kill = dynamic_cast<const KillEvent*>(&_events[i]);
+        if (!kill || !gone.count(&kill->linked_path()))
+        {
+            continue;
+        }
+
+        const KillInfo& info = *kill->info;
+        shared_ptr<Event> replacement;
+        if (kill->sender)
+        {
+            replacement = make_shared<RaiseEvent>(
+                *this, info.dest.pid(), info.signal, info.toThread);
+        }
+        else
+        {
+            // A receiving KillEvent is never the one that kills us (that's
+            // always a SignalEvent after it), so killed=false is right.
+            replacement = make_shared<SignalEvent>(
+                *this, info.source.pid(), info.signal, false);
+        }
+        replacement->location = kill->location;
+        replacement->time = kill->time;
+        _events.set(i, std::move(replacement));
+        _revision++;
+        clear_caches();
+    }
+    publish();
 }
 
 void Process::update_location(SourceLocation location) 
 {
-    debug("{} got updated location {}", _pid, location.to_string());
+    if (VERBOSE_LOGGING && is_log_enabled_for(Log::DBG))
+    {
+        debug("{} got updated location {}", _pid, location.to_string());
+    }
     _location.emplace(std::move(location));
 }
 
-string Process::to_string() const 
+string ProcessHistory::to_string() const 
 {
     return format("{} {}", _pid, command_line());
 }
 
-void Process::print_tree(Indent indent) const 
+void ProcessHistory::print_tree(Indent indent, std::ostream& os) const 
 {
-    std::cerr << format("{}process {}\n", indent, _pid);
-    for (const auto& event : _events) 
+    os << format("{}process {}\n", indent, _pid);
+    for (size_t i = 0; i < _events.size(); ++i) 
     {
-        event->print_tree(indent + 1);
+        _events[i].print_tree(indent + 1, os);
     }
 }
 
-string_view Process::state() const 
+string_view ProcessHistory::state() const 
 {
     switch (_state) 
     {
@@ -356,21 +614,176 @@ string_view Process::state() const
     assert(!"Unreachable");
 }
 
-string Process::command_line(int eventIndex) const 
+string ProcessHistory::command_line(int eventIndex) const 
+{
+    const Exec* lastExec = exec_before(eventIndex);
+    return lastExec ? lastExec->line : _initial->line;
+}
+
+string_view ProcessHistory::program(int eventIndex) const 
 {
     if (const ExecEvent* lastExec = most_recent_exec(eventIndex))
     {
-        const vector<string>& args = lastExec->args;
-        return format("{} [ {} ]", lastExec->call().file, join(args));
+        return lastExec->call().file;
     }
-    else
+    return _initial->name;
+}
+
+size_t ProcessHistory::settled_events() const
+{
+    if (_state == State::REAPED || _state == State::ORPHANED)
+    {
+        return _events.size(); // nobody can send us anything any more
+    }
+    // The last event could still be promoted to a killing signal, or have a
+    // KillEvent slipped in front of it (see notify_sent_signal).
+    size_t count = _events.empty() ? 0 : _events.size() - 1;
+    if (_pendingWait)
+    {
+        for (size_t i = count; i-- > 0; )
+        {
+            if (&_events[i] == _pendingWait)
+            {
+                return i;
+            }
+        }
+    }
+    return count;
+}
+
+int ProcessHistory::next_event(size_t start, uint8_t hidden) const
+{
+    for (size_t i = start; i < _events.size(); ++i)
+    {
+        if ((_events[i].kinds() & hidden) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Brings _kinds up to date with our settled events, and returns how many of
+ * those there are. Since settled events never change (short of pruning, which
+ * clears the caches), we only ever have to look at the new ones. The caller
+ * has to hold _cacheLock. */
+size_t Process::cache_kinds() const
+{
+    size_t settled = settled_events();
+    if (settled < _kinds.size())
+    {
+        // Shouldn't happen, but then we can't trust them
+        _kinds.clear();
+        _allKinds = 0;
+        _nexts.clear();
+    }
+    for (size_t i = _kinds.size(); i < settled; ++i)
     {
-        return format("{} [ {} ]", _initialName, join(_initialArgs));
+        _kinds.push_back(_events[i].kinds());
+        _allKinds |= _kinds.back();
     }
+    return settled;
 }
 
-const Event& Process::death_event() const 
+void Process::clear_caches()
+{
+    std::scoped_lock<std::mutex> guard(_cacheLock);
+    _kinds.clear();
+    _allKinds = 0;
+    _nexts.clear();
+}
+
+int Process::next_event(size_t start, uint8_t hidden) const
+{
+    std::scoped_lock<std::mutex> guard(_cacheLock);
+    size_t settled = cache_kinds();
+    if (start < settled)
+    {
+        if ((_allKinds & hidden) == 0)
+        {
+            return start; // nothing to skip
+        }
+        // nexts[i] is the first event at or after i that isn't hidden, or
+        // nexts.size() if there wasn't one when we worked it out.
+        vector<uint32_t>& nexts = _nexts[hidden];
+        size_t done = nexts.size();
+        if (done < settled)
+        {
+            nexts.resize(settled);
+            uint32_t next = settled;
+            for (size_t i = settled; i-- > done; )
+            {
+                if ((_kinds[i] & hidden) == 0)
+                {
+                    next = i;
+                }
+                nexts[i] = next;
+            }
+            // The hidden events just before the new ones skipped to the end
+            for (size_t i = done; i-- > 0 && nexts[i] >= done; )
+            {
+                nexts[i] = next;
+            }
+        }
+        if (nexts[start] < settled)
+        {
+            return nexts[start];
+        }
+        start = settled;
+    }
+    return ProcessHistory::next_event(start, hidden);
+}
+
+uint8_t Process::event_kinds(size_t i) const
+{
+    std::scoped_lock<std::mutex> guard(_cacheLock);
+    return i < _kinds.size() ? _kinds[i] : _events.at(i).kinds();
+}
+
+const Event& ProcessHistory::death_event() const 
 {
     assert(dead() && !_events.empty());
-    return *_events.back().get();
+    return _events.back();
+}
+
+TreeSnapshot::TreeSnapshot(const Process& leader)
+    : _leader(leader.shared_from_this())
+{
+    // Each process is forked by exactly one other, so nothing gets visited
+    // twice (the processes at the other end of kills might already be in
+    // there, but only need their own snapshots)
+    vector<const Process*> stack = { &leader };
+    while (!stack.empty())
+    {
+        const Process* process = stack.back();
+        stack.pop_back();
+        const ProcessHistory& history = *process->_published;
+        if (_histories.emplace(process, process->_published).second)
+        {
+            _processes.push_back(process->shared_from_this());
+        }
+        for (size_t i = 0; i < history.event_count(); ++i)
+        {
+            const Event& event = history.event(i);
+            if (auto fork = dynamic_cast<const ForkEvent*>(&event))
+            {
+                stack.push_back(fork->child.get());
+            }
+            else if (auto kill = dynamic_cast<const KillEvent*>(&event))
+            {
+                const Process& partner = kill->linked_path();
+                if (_histories.emplace(&partner, partner._published).second)
+                {
+                    _processes.push_back(partner.shared_from_this());
+                }
+            }
+        }
+    }
+}
+
+const ProcessHistory& TreeSnapshot::at(const Process& process) const
+{
+    auto it = _histories.find(&process);
+    assert(it != _histories.end());
+    return *it->second;
 }
@@ -12,8 +12,14 @@
 #include <memory>
 #include <string>
 #include <optional>
+#include <mutex>
+#include <unordered_set>
+#include <unordered_map>
+#include <atomic>
 
 #include "event.hpp"
+#include "event-list.hpp"
+#include "epochs.hpp"
 
 /* This is thrown by the Process class whenever operation are done on the
  * process tree that don't make sense or aren't allowed. Why make this an
@@ -29,12 +35,71 @@ public:
     const char* what() const noexcept { return _msg.c_str(); }
 };
 
-/* Describes a process in a process tree. This class has public functions that
- * allow users to update it with certain events as they are occurring to the
- * process. We can then later examine the history of events when drawing. */
-class Process 
+/* What the kernel told us about the resources a process used, taken from the
+ * rusage that wait4 hands back when the process ends. CPU times are given in
+ * nanoseconds and maxRss in kilobytes. Note that these are the totals for the
+ * process *and* all of the children that it reaped (RUSAGE_BOTH), since that's
+ * the only thing the kernel gives us. Subtract the children's usage to get the
+ * process's own usage (maxRss is a maximum though, so that can't be undone). */
+struct ResourceUsage
+{
+    Timestamp userTime = 0;
+    Timestamp systemTime = 0;
+    long maxRss = 0;
+    long voluntarySwitches = 0;
+    long involuntarySwitches = 0;
+    long blocksIn = 0;
+    long blocksOut = 0;
+
+    Timestamp cpu_time() const { return userTime + systemTime; }
+};
+
+/* A snapshot of a process's CPU and memory use, taken by the Sampler (see
+ * sampler.hpp) in between events. Kept small since there are lots of them. */
+struct Sample
+{
+    Timestamp time;
+    uint32_t cpuTicks; // total user + system time so far (in clock ticks)
+    uint32_t rssPages; // resident set size (in pages)
+};
+
+/* Holds the most recent CAPACITY samples of a process (older ones get written
+ * over). The sampler thread adds to this while other threads read from it, so
+ * all of the member functions lock. */
+class SampleRing
 {
 private:
+    mutable std::mutex _lock;
+    std::vector<Sample> _samples;
+    size_t _start = 0; // index of the oldest sample once we've wrapped around
+
+    const Sample& at(size_t i) const;
+
+public:
+    static constexpr size_t CAPACITY = 4096;
+
+    void push(const Sample& sample);
+    size_t size() const;
+
+    /* Returns a copy of all of the samples in chronological order. */
+    std::vector<Sample> snapshot() const;
+
+    /* Finds the most recent sample taken at or before `time` (stored in cur)
+     * and the one before that (stored in prev, or the same as cur if there is
+     * none). Returns false if there are no samples that early. */
+    bool find(Timestamp time, Sample& prev, Sample& cur) const;
+};
+
+class Process; // defined below
+
+/* Everything about a process that gets drawn or exported: its events and the
+ * state that it's in. A Process is one of these that the tracer keeps up to
+ * date, and each time it changes, it hands out a copy of this part of itself
+ * for other threads to read (see Process::snapshot). Copies are O(1), since
+ * the events are kept in an EventList and the rest is small. */
+class ProcessHistory
+{
+protected:
     enum class State 
     {
         ALIVE,    // process is alive
@@ -43,32 +108,185 @@ private:
         ORPHANED, // process is dead and the reaper process had to reap it
     };
 
+    /* The program that a process was running before it did any execs, and
+     * its command line already formatted (see command_line). */
+    struct Command
+    {
+        std::string name;
+        std::vector<std::string> args;
+        std::string line;
+    };
+
+    /* One of our successful execs: where it is in _events, and its command
+     * line already formatted. */
+    struct Exec
+    {
+        size_t index;
+        std::string line;
+    };
+
     /* History */
+    const Process* _process; // the process that we're the history of
     pid_t _pid;
-    std::weak_ptr<Process> _parent;
-    std::vector<std::unique_ptr<Event>> _events;
-    std::string _initialName; // process's name before any additional execs
-    std::vector<std::string> _initialArgs; // ...similar thing here
+    EventList _events;
+    std::shared_ptr<const Command> _initial; // shared by all of the copies
+
+    /* Our successful execs in order, so that finding the one that was in
+     * effect at a given event is a binary search. Like _events, the copies
+     * share it, and adding to it doesn't disturb them. */
+    PersistentList<Exec> _execs;
+    Timestamp _startTime; // when we were forked (or started by the tracer)
 
     /* State */
     State _state;
     bool _killed; // have we been killed by the delivery of a signal?
+    std::optional<ResourceUsage> _usage; // set once we've ended (if known)
+    const WaitEvent* _pendingWait; // the wait we're blocked in (if any)
+    uint64_t _revision; // bumped whenever anything above changes
+
+    ProcessHistory(const Process* process,
+                   pid_t pid,
+                   Timestamp startTime,
+                   std::shared_ptr<const Command> initial)
+        : _process(process), _pid(pid), _initial(std::move(initial)),
+        _startTime(startTime), _state(State::ALIVE), _killed(false),
+        _pendingWait(nullptr), _revision(0) { }
+
+    static std::shared_ptr<const Command> make_command(std::string name, 
+        std::vector<std::string> args);
+    const Exec* exec_before(int startIndex) const;
+    const ExecEvent* most_recent_exec(int startIndex = -1) const;
+
+public:
+    /* Returns a string describing this process. */
+    std::string to_string() const;
+
+    /* Print out this process (to std::cerr by default) in an indented tree
+     * format. */
+    void print_tree(Indent indent = 0, std::ostream& os = std::cerr) const;
+
+    /* Returns a string corresponding to the name of the current _state of the
+     * process (e.g., alive, zombie, etc.). Useful when logging things. */
+    std::string_view state() const;
+
+    /* This will have to first look through the execs that this process has
+     * done (a binary search), to find the one that was in effect. Will use
+     * this to figure out its current command line (name & args) and then
+     * return a string in the format:
+     *
+     *  name [ args... ]
+     *
+     * (Brackets included.) If eventIndex is non-negative, then the search is
+     * done starting from the event preceding the specified event index (an 
+     * assertion will fail if the index is out-of-bounds). If the event index
+     * is 0, then this means the initial command line will be returned. If the
+     * index is negative, then all events will be searched.*/
+    std::string command_line(int eventIndex = -1) const;
+
+    /* Same as command_line, but only returns the name of the program (i.e.,
+     * the file passed to the most recent exec) without the arguments. */
+    std::string_view program(int eventIndex = -1) const;
+
+    /* Returns a reference to the event that killed this process. An assertion
+     * will fail if !dead() or if this process has no events. This reference
+     * will be invalidated if non-const member functions are called. */
+    const Event& death_event() const;
+
+    bool killed() const { return _killed; }
+    bool reaped() const { return _state == State::REAPED; }
+    bool dead() const { return _state != State::ALIVE; }
+    bool orphaned() const { return _state == State::ORPHANED; }
+    bool settled() const { return reaped() || orphaned(); } // i.e., gone
+    pid_t pid() const { return _pid; }
+    size_t event_count() const { return _events.size(); }
+    Timestamp start_time() const { return _startTime; }
+
+    /* Goes up every time that our events or our state change, so you can
+     * tell if anything has happened to us since you last looked. */
+    uint64_t revision() const { return _revision; }
+
+    /* The number of events at the start of our list that will never change
+     * again (although more events may be added after them). The rest might
+     * still be modified or replaced, e.g., a wait that we're blocked in will
+     * be replaced with a ReapEvent, and a signal could be promoted to being
+     * the one that killed us. Pruning (forget_child etc.) doesn't count. */
+    size_t settled_events() const;
+
+    /* Returns the index of the first event at or after `start` that has none
+     * of the EventKind flags in `hidden`, or -1 if there isn't one. This is
+     * what diagrams use to skip the events that they've been told not to
+     * show. It looks at each of the events in between, but a Process keeps
+     * the answers for its settled events, see Process::next_event. */
+    int next_event(size_t start, uint8_t hidden) const;
+
+    /* Resource usage reported when we ended. Empty if we haven't ended yet,
+     * or if we died in a way that the tracer couldn't get the usage for. */
+    const std::optional<ResourceUsage>& usage() const { return _usage; }
+
+    /* This returns a reference that could be invalidated if any non-const
+     * member functions are called - otherwise, you'll be fine. */
+    const Event& event(size_t i) const { return _events.at(i); }
+
+    /* The process that this is the history of. Its pid, start time and
+     * samples can be looked at from any thread, but for everything else,
+     * go through its snapshot() (unless you're the tracer). */
+    const Process& process() const { return *_process; }
+
+    /* (This needs to see how big our lists are, see pruner.hpp) */
+    friend size_t estimate_memory(const Process& process);
+};
+
+/* Describes a process in a process tree. This class has public functions that
+ * allow users to update it with certain events as they are occurring to the
+ * process. We can then later examine the history of events when drawing. 
+ *
+ * Apart from snapshot() (and the samples), none of this is thread-safe: the
+ * tracer changes processes under its lock, and anything that reads them
+ * directly has to hold the lock too. Other threads can use snapshots. */
+class Process : public ProcessHistory,
+                public std::enable_shared_from_this<Process>
+{
+private:
+    /* State */
+    std::weak_ptr<Process> _parent;
     std::optional<SourceLocation> _location; // current source location
+    Timestamp _time; // time of the most recent notification (see update_time)
+    SampleRing _samples; // filled in by the sampler thread (if there is one)
+
+    /* The copy of our history that snapshot() returns. The old copies get
+     * retired (see epochs.hpp) when new ones are published. */
+    std::shared_ptr<const ProcessHistory> _published;
+    std::atomic<const ProcessHistory*> _snapshot;
+
+    /* Caches for next_event (only of our settled events). These get filled
+     * in by const functions, and diagrams call those from the thread pool,
+     * so the caches have a lock of their own.
+     * (That doesn't make it safe to read our events without the tracer's
+     * lock, though, see above.) */
+    mutable std::mutex _cacheLock;
+    mutable std::vector<uint8_t> _kinds; // Event::kinds() of each event
+    mutable uint8_t _allKinds; // everything in _kinds OR'd together
+    mutable std::unordered_map<uint8_t, std::vector<uint32_t>> _nexts;
 
     /* Private functions, described in source file */
-    void add_event(std::unique_ptr<Event> ev, bool consumeLoc = false);
-    const ExecEvent* most_recent_exec(int startIndex = -1) const;
+    void add_event(std::shared_ptr<Event> ev, bool consumeLoc = false);
+    void add_exec(size_t index);
+    void publish();
+    size_t cache_kinds() const;
+    void clear_caches();
 
 public:
     /* Call this if the process has no (traced) parent and if we don't know its
      * program arguments and name. */
-    Process(pid_t pid) : _pid(pid), _state(State::ALIVE), _killed(false) { }
+    Process(pid_t pid) : ProcessHistory(this, pid, get_monotonic_time(),
+        make_command("", {})), _time(_startTime), _allKinds(0) { publish(); }
 
     /* Call this if the process doesn't have a (traced) parent, but we do know
      * its program arguments and name. */
     Process(pid_t pid, std::string_view name, std::vector<std::string> args)
-        : _pid(pid), _initialName(name), _initialArgs(args), 
-        _state(State::ALIVE), _killed(false) { }
+        : ProcessHistory(this, pid, get_monotonic_time(), 
+        make_command(std::string(name), std::move(args))),
+        _time(_startTime), _allKinds(0) { publish(); }
 
     /* Call this if the process has a parent who forked/cloned us. */
     Process(pid_t pid, const std::shared_ptr<Process>& parent);
@@ -107,8 +325,10 @@ public:
      * is the value returned by wait/waitpid. If `status` indicates that the
      * process was killed by a signal, then this function will check if the
      * most recent event was a SignalEvent with the same signal - and if so,
-     * it will promote that to a killing event instead of adding a new event.*/
-    void notify_ended(int status);
+     * it will promote that to a killing event instead of adding a new event.
+     * `usage` should be whatever wait4 told us about the process (if known).*/
+    void notify_ended(int status, 
+                      std::optional<ResourceUsage> usage = std::nullopt);
 
     /* Update the process tree with an event to indicate that this process has
      * received a signal. If the signal turns out to kill the process, then
@@ -137,45 +357,74 @@ public:
      * namely, fork/exec/reap events. */
     void update_location(SourceLocation location);
 
-    /* Returns a string describing this process. */
-    std::string to_string() const;
+    /* Tell this Process what the time is. Every event added after this call 
+     * (until the next call) gets stamped with this time. The tracer calls it
+     * whenever it gets a wait notification for the process, which saves us
+     * from reading the clock for every single event. A child process that is
+     * forked takes the current time of its parent as its start time. */
+    void update_time(Timestamp now) { _time = now; }
 
-    /* Print out this process (to std::cerr) in an indented tree format. */
-    void print_tree(Indent indent = 0) const;
+    /* These two are used to throw away old parts of the process tree when
+     * we're short on memory (see pruner.hpp). forget_child removes the fork
+     * and reap events of one of our children, which cuts its whole subtree
+     * off from us - it throws a ProcessTreeError unless the child is settled.
+     * After cutting off some subtrees, every remaining process should have
+     * unlink_kills called with the processes that were cut off. This replaces
+     * each KillEvent pointing at one of them with a RaiseEvent/SignalEvent
+     * that doesn't point anywhere, so we aren't left with dangling links. */
+    void forget_child(const Process& child);
+    void unlink_kills(const std::unordered_set<const Process*>& gone);
 
-    /* Returns a string corresponding to the name of the current _state of the
-     * process (e.g., alive, zombie, etc.). Useful when logging things. */
-    std::string_view state() const;
+    /* Same as ProcessHistory::next_event, but the answers for our settled
+     * events are worked out once for each `hidden` mask and then kept, so
+     * this is O(1) apart from catching up on events that have settled since
+     * the last call. */
+    int next_event(size_t start, uint8_t hidden) const;
 
-    /* This will have to first search backwards through the list of events
-     * to find if this process has done any execs. Will use this information
-     * to figure out its current command line (name & args) and then return a
-     * string in the format:
-     *
-     *  name [ args... ]
-     *
-     * (Brackets included.) If eventIndex is non-negative, then the search is
-     * done starting from the event preceding the specified event index (an 
-     * assertion will fail if the index is out-of-bounds). If the event index
-     * is 0, then this means the initial command line will be returned. If the
-     * index is negative, then all events will be searched.*/
-    std::string command_line(int eventIndex = -1) const;
+    /* Same as event(i).kinds(), but cached once the event has settled. */
+    uint8_t event_kinds(size_t i) const;
 
-    /* Returns a reference to the event that killed this process. An assertion
-     * will fail if !dead() or if this process has no events. This reference
-     * will be invalidated if non-const member functions are called. */
-    const Event& death_event() const;
+    /* Samples taken of us while we were alive. Unlike everything else in this
+     * class, it's safe to add samples from another thread. */
+    void add_sample(const Sample& sample) { _samples.push(sample); }
+    const SampleRing& samples() const { return _samples; }
 
-    bool killed() const { return _killed; }
-    bool reaped() const { return _state == State::REAPED; }
-    bool dead() const { return _state != State::ALIVE; }
-    bool orphaned() const { return _state == State::ORPHANED; }
-    pid_t pid() const { return _pid; }
-    size_t event_count() const { return _events.size(); }
+    /* Returns the copy of our history that was published at the end of the
+     * last notify_ call. This can be called from any thread, but only while
+     * that thread has an EpochPin. The copy (and every process, event and copy
+     * that you can get to from it) stays put until the pin goes away, no
+     * matter what the tracer does to us in the meantime. */
+    const ProcessHistory& snapshot() const;
 
-    /* This returns a reference that could be invalidated if any non-const
-     * member functions are called - otherwise, you'll be fine. */
-    const Event& event(size_t i) const { return *_events.at(i).get(); }
+    friend class TreeSnapshot;
+};
+
+/* The snapshots of every process in a tree (and of any process outside of it
+ * that one of them sent a signal to or got one from), all as of the same
+ * moment. Process::snapshot can't promise that for more than one process,
+ * since the tracer publishes each one as it goes, so these have to be taken
+ * by the thread that steps the tracer (or with the tracer frozen, see
+ * Tracer::freeze). After that it can be read from any thread. It shares
+ * ownership of the snapshots and of the processes themselves rather than
+ * relying on an EpochPin, so it can be kept for as long as you like, even if
+ * the processes get pruned in the meantime (a diagram of it needs it for as
+ * long as the diagram is around). */
+class TreeSnapshot
+{
+private:
+    std::shared_ptr<const Process> _leader;
+    std::unordered_map<const Process*, 
+        std::shared_ptr<const ProcessHistory>> _histories;
+    std::vector<std::shared_ptr<const Process>> _processes; // keeps them
+
+public:
+    explicit TreeSnapshot(const Process& leader);
+
+    const Process& leader() const { return *_leader; }
+
+    /* Returns the snapshot of the process. An assertion will fail if it isn't
+     * one of the processes that were taken. */
+    const ProcessHistory& at(const Process& process) const;
 };
 
 #endif /* FORKTRACE_PROCESS_HPP */
@@ -0,0 +1,402 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  pruner
+ *
+ *      Every event that a tracee generates gets kept forever, which is fine
+ *      for a build but not for a server that forks a worker per request and
+ *      runs for a week. Once a worker has been reaped (and so has everything
+ *      that it forked), nothing that happens later can change its part of the
+ *      tree, so we can fold it into a few counters and let it go.
+ *
+ *      The only thing that links a subtree to the rest of the trees (other
+ *      than the fork and reap events in its parent) are KillEvents, which get
+ *      swapped for the unlinked RaiseEvents/SignalEvents on the other side.
+ */
+#include <algorithm>
+#include <unordered_set>
+#include <iostream>
+#include <stdexcept>
+#include <fmt/core.h>
+
+#include "pruner.hpp"
+#include "process.hpp"
+#include "epochs.hpp"
+#include "analysis.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::shared_ptr;
+using std::runtime_error;
+using fmt::format;
+
+/* What make_shared adds to everything that it allocates (the control block's
+ * vtable pointer, plus its two reference counts). */
+constexpr size_t CONTROL_BLOCK_SIZE = sizeof(void*) + 2 * sizeof(int);
+
+size_t estimate_memory(const Process& process)
+{
+    size_t bytes = sizeof(Process) + process.samples().size() * sizeof(Sample);
+    bytes += process.command_line(0).size();
+
+    // Our published snapshot (see Process::publish) shares the nodes of our
+    // lists, so it only costs the copy of the history itself
+    bytes += sizeof(ProcessHistory) + CONTROL_BLOCK_SIZE;
+
+    // The nodes of our lists, which hold a shared_ptr per event (or exec)
+    size_t nodes = process._events.node_count() + process._execs.node_count();
+    bytes += nodes * (PersistentSlots::NODE_SIZE + CONTROL_BLOCK_SIZE);
+
+    // The index of our execs (see ProcessHistory::command_line)
+    for (size_t i = 0; i < process._execs.size(); ++i)
+    {
+        bytes += sizeof(ProcessHistory::Exec) + CONTROL_BLOCK_SIZE
+            + process._execs[i].line.size();
+    }
+
+    for (size_t i = 0; i < process.event_count(); ++i)
+    {
+        const Event& event = process.event(i);
+        bytes += CONTROL_BLOCK_SIZE; // (its slot is in the nodes above)
+        if (event.location.has_value())
+        {
+            bytes += sizeof(SourceLocation) + event.location->file.size()
+                + event.location->func.size();
+        }
+        if (auto exec = dynamic_cast<const ExecEvent*>(&event))
+        {
+            bytes += sizeof(ExecEvent);
+            for (const ExecCall& call : exec->calls)
+            {
+                bytes += sizeof(ExecCall) + call.file.size();
+            }
+            for (const string& arg : exec->args)
+            {
+                bytes += sizeof(string) + arg.size();
+            }
+        }
+        else if (dynamic_cast<const ReapEvent*>(&event))
+        {
+            bytes += sizeof(ReapEvent) + sizeof(WaitEvent);
+        }
+        else if (dynamic_cast<const KillEvent*>(&event))
+        {
+            bytes += sizeof(KillEvent) + sizeof(KillInfo);
+        }
+        else
+        {
+            bytes += sizeof(SignalEvent); // about as big as the rest get
+        }
+    }
+    return bytes;
+}
+
+/* Roughly how much is taken up by the old snapshots that are waiting for
+ * readers to let go of them (see epochs.hpp). They share nearly everything
+ * with the newer ones, so each one only gets charged for its own copy of the
+ * history. (Collecting them first means that we don't count any that could
+ * have gone already.) */
+static size_t estimate_retired_memory()
+{
+    return collect_retired() * (sizeof(ProcessHistory) + CONTROL_BLOCK_SIZE);
+}
+
+void Pruner::set_spill_file(const string& path)
+{
+    if (_spill.is_open())
+    {
+        _spill.close();
+    }
+    _spillPath = path;
+    if (path.empty())
+    {
+        return;
+    }
+    _spill.open(path, std::ios::out | std::ios::trunc);
+    if (!_spill)
+    {
+        _spillPath.clear();
+        throw runtime_error(format("Couldn't open {} for writing.", path));
+    }
+}
+
+bool Pruner::maybe_prune(vector<shared_ptr<Process>>& trees)
+{
+    if (_budget == 0)
+    {
+        return false;
+    }
+    Timestamp now = get_monotonic_time();
+    if (now - _lastCheck < CHECK_INTERVAL)
+    {
+        return false;
+    }
+    _lastCheck = now;
+    return prune(trees);
+}
+
+/* Adds a single (dead) process to the summary for its program. */
+void Pruner::summarise(const Process& process)
+{
+    Summary& summary = _summaries[string(get_base_name(process.program()))];
+    summary.processes++;
+    summary.events += process.event_count();
+    if (process.killed())
+    {
+        summary.killed++;
+    }
+    else if (process.event_count() > 0)
+    {
+        auto exit = dynamic_cast<const ExitEvent*>(&process.death_event());
+        if (exit && exit->status != 0)
+        {
+            summary.failed++;
+        }
+    }
+    if (process.usage().has_value())
+    {
+        summary.cpuTime += self_usage(process).cpu_time();
+        summary.maxRss = std::max(summary.maxRss, process.usage()->maxRss);
+    }
+    if (process.event_count() > 0)
+    {
+        Timestamp died = process.death_event().time;
+        summary.lifetime += died - std::min(died, process.start_time());
+    }
+}
+
+/* Writes the subtree out to the spill file (if any) and adds everything in it
+ * to the summaries. Doesn't actually remove anything. */
+void Pruner::evict(const Process& root)
+{
+    if (_spill.is_open())
+    {
+        _spill << format("evicted {}\n", root.to_string());
+        root.print_tree(1, _spill);
+        _spill.flush();
+    }
+    vector<const Process*> stack = {&root};
+    while (!stack.empty())
+    {
+        const Process* process = stack.back();
+        stack.pop_back();
+        summarise(*process);
+        _evicted++;
+        for (size_t i = 0; i < process->event_count(); ++i)
+        {
+            if (auto fork = dynamic_cast<const ForkEvent*>(&process->event(i)))
+            {
+                stack.push_back(fork->child.get());
+            }
+        }
+    }
+}
+
+/* What prune() works out about each process in the trees. */
+struct Node
+{
+    shared_ptr<Process> process;
+    long parent; // index of the parent node (-1 for a leader)
+    bool settled; // is every process in our subtree dead and reaped?
+    Timestamp finished; // time of the last event in our subtree
+    size_t bytes; // just for this process (not the subtree)
+    size_t subtreeBytes;
+    bool covered; // will we go when an ancestor is evicted?
+};
+
+bool Pruner::prune(vector<shared_ptr<Process>>& trees)
+{
+    Timestamp now = get_monotonic_time();
+
+    // Number the processes so that parents come before their children, which
+    // lets us total up subtrees by going through the list backwards.
+    vector<Node> nodes;
+    vector<std::pair<shared_ptr<Process>, long>> stack;
+    for (auto it = trees.rbegin(); it != trees.rend(); ++it)
+    {
+        stack.emplace_back(*it, -1);
+    }
+    size_t total = 0;
+    while (!stack.empty())
+    {
+        auto [process, parent] = std::move(stack.back());
+        stack.pop_back();
+        long index = nodes.size();
+        // A leader never gets reaped by anyone (the tracer reaps it itself),
+        // so being dead is as settled as it gets for a leader.
+        bool settled = parent < 0 ? process->dead() : process->settled();
+        size_t n = process->event_count();
+        Timestamp finished = n == 0 ? process->start_time() :
+            process->event(n - 1).time;
+        size_t bytes = estimate_memory(*process);
+        total += bytes;
+        for (size_t i = 0; i < process->event_count(); ++i)
+        {
+            if (auto fork = dynamic_cast<const ForkEvent*>(&process->event(i)))
+            {
+                stack.emplace_back(fork->child, index);
+            }
+        }
+        nodes.push_back({std::move(process), parent, settled, finished,
+            bytes, bytes, false});
+    }
+    total += estimate_retired_memory();
+    for (size_t i = nodes.size(); i-- > 0; )
+    {
+        const Node& node = nodes[i];
+        if (node.parent >= 0)
+        {
+            Node& parent = nodes[node.parent];
+            parent.settled = parent.settled && node.settled;
+            parent.finished = std::max(parent.finished, node.finished);
+            parent.subtreeBytes += node.subtreeBytes;
+        }
+    }
+    if (total <= _budget)
+    {
+        return false;
+    }
+
+    // The roots of the subtrees that we could evict (leaving out any subtrees
+    // of those, since they'll go along with them).
+    auto eligible = [&](const Node& node) {
+        return node.settled && node.finished + _horizon <= now;
+    };
+    vector<size_t> candidates;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        Node& node = nodes[i];
+        if (node.parent >= 0)
+        {
+            const Node& parent = nodes[node.parent];
+            node.covered = parent.covered || eligible(parent);
+        }
+        if (!node.covered && eligible(node))
+        {
+            candidates.push_back(i);
+        }
+    }
+    std::stable_sort(candidates.begin(), candidates.end(),
+        [&](size_t a, size_t b) {
+            return nodes[a].finished < nodes[b].finished;
+        }
+    );
+
+    // Hang on to the evicted roots until we're done with the pointers in gone.
+    vector<shared_ptr<Process>> evicted;
+    std::unordered_set<const Process*> gone;
+    size_t count = _evicted;
+    for (size_t i : candidates)
+    {
+        if (total <= _budget)
+        {
+            break;
+        }
+        Node& node = nodes[i];
+        evict(*node.process);
+        if (node.parent >= 0)
+        {
+            nodes[node.parent].process->forget_child(*node.process);
+        }
+        else
+        {
+            trees.erase(std::find(trees.begin(), trees.end(), node.process));
+        }
+        total -= node.subtreeBytes;
+        _freed += node.subtreeBytes;
+        evicted.push_back(node.process);
+        gone.insert(node.process.get());
+    }
+    if (evicted.empty())
+    {
+        if (!_warned)
+        {
+            warning("The process trees are over the memory budget ({} > {}), "
+                "but there's nothing old enough to prune.",
+                format_kilobytes(total / 1024),
+                format_kilobytes(_budget / 1024));
+            _warned = true;
+        }
+        return false;
+    }
+
+    // Everything underneath an evicted root is gone too.
+    for (const Node& node : nodes)
+    {
+        if (node.parent >= 0 && gone.count(nodes[node.parent].process.get()))
+        {
+            gone.insert(node.process.get());
+        }
+    }
+    for (const Node& node : nodes)
+    {
+        if (!gone.count(node.process.get()))
+        {
+            node.process->unlink_kills(gone);
+        }
+    }
+    verbose("pruned {} processes, process trees now take up about {}",
+        _evicted - count, format_kilobytes(total / 1024));
+    _warned = false;
+    return true;
+}
+
+void Pruner::print_summary(std::ostream& os, 
+                           const vector<shared_ptr<Process>>& trees) const
+{
+    size_t total = 0;
+    vector<const Process*> stack;
+    for (const auto& tree : trees)
+    {
+        stack.push_back(tree.get());
+    }
+    while (!stack.empty())
+    {
+        const Process* process = stack.back();
+        stack.pop_back();
+        total += estimate_memory(*process);
+        for (size_t i = 0; i < process->event_count(); ++i)
+        {
+            if (auto fork = dynamic_cast<const ForkEvent*>(&process->event(i)))
+            {
+                stack.push_back(fork->child.get());
+            }
+        }
+    }
+    total += estimate_retired_memory();
+
+    os << format("Process trees take up about {}",
+        format_kilobytes(total / 1024));
+    if (_budget > 0)
+    {
+        os << format(" (budget {}, horizon {})",
+            format_kilobytes(_budget / 1024), format_duration(_horizon));
+    }
+    os << ".\n";
+    if (_summaries.empty())
+    {
+        os << "No processes have been pruned.\n";
+        return;
+    }
+    os << format("Pruned {} processes (about {})", _evicted,
+        format_kilobytes(_freed / 1024));
+    if (!_spillPath.empty())
+    {
+        os << format(", spilled to {}", _spillPath);
+    }
+    os << ":\n\n";
+    os << format("{:>6} {:>6} {:>6} {:>8} {:>10} {:>8} {:>10}  {}\n",
+        "PROCS", "KILLED", "FAILED", "EVENTS", "CPU", "MAXRSS", "ALIVE",
+        "PROGRAM");
+    for (const auto& [program, summary] : _summaries)
+    {
+        os << format(
+            "{:>6} {:>6} {:>6} {:>8} {:>10} {:>8} {:>10}  {}\n",
+            summary.processes, summary.killed, summary.failed, summary.events,
+            format_duration(summary.cpuTime),
+            format_kilobytes(summary.maxRss),
+            format_duration(summary.lifetime), program);
+    }
+}
@@ -0,0 +1,101 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  pruner
+ *
+ *      Keeps the process trees within a memory budget when tracing something
+ *      that runs for a long time (like a daemon that forks off workers), by
+ *      throwing away the oldest parts of the trees that are over and done.
+ */
+#ifndef FORKTRACE_PRUNER_HPP
+#define FORKTRACE_PRUNER_HPP
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <fstream>
+#include <iostream>
+
+#include "system.hpp"
+
+class Process; // defined in process.hpp
+
+/* Once the trees take up more than the budget, this evicts subtrees in which
+ * every process is dead and reaped (starting with whichever finished first),
+ * so long as they finished longer ago than the horizon. Live processes and
+ * their ancestors are never touched. Before a subtree goes, its processes are
+ * added to a summary of their program, and the subtree can also be written
+ * out to a spill file (in the same format as the "tree" command) so that the
+ * details aren't lost for good. */
+class Pruner
+{
+public:
+    /* Totals for all of the evicted processes running a particular program. */
+    struct Summary
+    {
+        size_t processes = 0;
+        size_t killed = 0; // killed by a signal
+        size_t failed = 0; // exited with a non-zero status
+        size_t events = 0;
+        Timestamp cpuTime = 0; // own CPU time (not counting children)
+        long maxRss = 0; // in kilobytes
+        Timestamp lifetime = 0; // total time spent alive
+    };
+
+private:
+    size_t _budget; // in bytes, 0 means we don't prune
+    Timestamp _horizon;
+    Timestamp _lastCheck;
+    std::ofstream _spill;
+    std::string _spillPath;
+    std::map<std::string, Summary, std::less<>> _summaries;
+    size_t _evicted; // total number of processes evicted
+    size_t _freed; // total number of bytes (estimated) freed
+    bool _warned; // have we complained about not being able to prune enough?
+
+    /* Private functions, see source file */
+    void evict(const Process& root);
+    void summarise(const Process& process);
+
+public:
+    /* Don't bother checking the trees more often than this (estimating the
+     * size of all of the trees means walking through every single event). */
+    static constexpr Timestamp CHECK_INTERVAL = 1000000000; // 1 second
+
+    Pruner() : _budget(0), _horizon(0), _lastCheck(0), _evicted(0),
+        _freed(0), _warned(false) { }
+
+    /* A budget of 0 turns pruning off. */
+    void set_budget(size_t bytes) { _budget = bytes; _warned = false; }
+    void set_horizon(Timestamp horizon) { _horizon = horizon; }
+    size_t budget() const { return _budget; }
+
+    /* Opens (and truncates) the file that evicted subtrees get written to, or
+     * stops spilling if the path is empty. Throws a runtime_error if the file
+     * couldn't be opened. */
+    void set_spill_file(const std::string& path);
+
+    /* Calls prune() if pruning is on and we haven't checked in a while. Cheap
+     * enough to call after every step of the tracer. */
+    bool maybe_prune(std::vector<std::shared_ptr<Process>>& trees);
+
+    /* Evicts old subtrees until the trees fit within the budget (or until we
+     * run out of subtrees that are old enough). A tree whose leader can be
+     * evicted gets removed from `trees` entirely. Returns true if anything
+     * was evicted (which means any Diagrams of the trees are out of date). */
+    bool prune(std::vector<std::shared_ptr<Process>>& trees);
+
+    /* Prints out the memory used by the trees and the summary of each program
+     * that has had processes evicted. */
+    void print_summary(std::ostream& os,
+                       const std::vector<std::shared_ptr<Process>>& trees)
+        const;
+};
+
+/* Gives a rough estimate of how many bytes the process (and its events, its
+ * execs and its published snapshot, but not its children) takes up. It
+ * doesn't need to be exact, it just needs to grow the way that the real
+ * thing grows. */
+size_t estimate_memory(const Process& process);
+
+#endif /* FORKTRACE_PRUNER_HPP */
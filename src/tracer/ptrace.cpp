@@ -136,13 +136,15 @@ bool set_syscall_arg(pid_t pid, size_t val, int argIndex)
 bool get_tracee_result_addr(pid_t pid, void*& result) 
 {
     // the stack pointer is a reasonable guess, as long as we aren't reading or
-    // writing too much. To give ourselves even more margin we could round the
-    // address down to the beginning of the page. I suppose if you wanted to be
-    // more thorough, you could look at the memory map for the tracee or map
-    // your own pages into the tracee's address space for this purpose...
+    // writing too much. The caller saves and restores whatever is there. We
+    // use the top of the stack itself rather than anything below it, since
+    // a signal handler could push its frame below it. (RBP isn't any good,
+    // since optimised code doesn't keep a frame pointer in it.) I suppose if
+    // you wanted to be more thorough, you could look at the memory map for
+    // the tracee or map your own pages into its address space for this...
     errno = 0;
-    size_t addr = ptrace(PTRACE_PEEKUSER, pid, 8 * RBP, 0); 
-    result = (void*)(addr & ~(SYS_PAGE_SIZE - 1));
+    size_t addr = ptrace(PTRACE_PEEKUSER, pid, 8 * RSP, 0); 
+    result = (void*)addr;
     if (errno == ESRCH) 
     {
         return false;
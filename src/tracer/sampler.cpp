@@ -0,0 +1,222 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  sampler
+ *
+ *      Ptrace only tells us about the lifecycle of each process, so a process
+ *      that sits there crunching numbers for ten seconds looks exactly the
+ *      same as one that sleeps for ten seconds. This fills in the gaps.
+ *
+ *      We keep the files open between samples since opening a file in /proc
+ *      is a good deal more expensive than reading it again. The sampler takes
+ *      the tracer's lock only for as long as it takes to copy out the list of
+ *      live tracees, and the rest happens without getting in anybody's way.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cstdlib>
+#include <unordered_set>
+#include <fmt/core.h>
+
+#include "sampler.hpp"
+#include "tracer.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::shared_ptr;
+using fmt::format;
+
+void Sampler::set_rate(unsigned rate)
+{
+    {
+        std::scoped_lock<std::mutex> guard(_lock);
+        _rate = rate;
+        _quit = rate == 0;
+    }
+    _wake.notify_all();
+    if (rate == 0 && _thread.joinable())
+    {
+        _thread.join();
+    }
+    else if (rate != 0 && !_thread.joinable())
+    {
+        _thread = std::thread(&Sampler::run, this);
+    }
+}
+
+unsigned Sampler::rate()
+{
+    std::scoped_lock<std::mutex> guard(_lock);
+    return _rate;
+}
+
+void Sampler::run()
+{
+    debug("sampler thread started");
+    auto next = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(_lock);
+    while (!_quit)
+    {
+        lock.unlock();
+        take_samples();
+        lock.lock();
+        // Rather than sleeping for a fixed time, aim for the next tick (so
+        // that the time spent sampling doesn't make us drift behind).
+        next += std::chrono::nanoseconds(1000000000 / std::max(_rate, 1U));
+        auto now = std::chrono::steady_clock::now();
+        if (next < now)
+        {
+            next = now; // we've fallen behind, so don't try to catch up
+        }
+        _wake.wait_until(lock, next, [&] { return _quit; });
+    }
+    lock.unlock();
+    for (auto& [pid, files] : _files)
+    {
+        close_files(files);
+    }
+    _files.clear();
+    debug("sampler thread stopped");
+}
+
+void Sampler::close_files(Files& files)
+{
+    if (files.stat != -1)
+    {
+        close(files.stat);
+    }
+    if (files.statm != -1)
+    {
+        close(files.statm);
+    }
+    files.stat = files.statm = -1;
+}
+
+/* Reads the whole of a (small) /proc file from the start into `buf`, which is
+ * null-terminated. Returns false if the read failed (e.g., if it died). */
+static bool read_proc_file(int fd, char* buf, size_t size)
+{
+    ssize_t n = pread(fd, buf, size - 1, 0);
+    if (n <= 0)
+    {
+        return false;
+    }
+    buf[n] = '\0';
+    return true;
+}
+
+/* Gets the utime and stime out of /proc/<pid>/stat. The second field is the
+ * command name in brackets, which could contain spaces or brackets of its own,
+ * so we skip past the *last* ')' and count the fields from there. utime and
+ * stime are fields 14 and 15 (counting from 1), i.e., the 12th and 13th after
+ * the ')' - see proc(5). */
+static bool parse_stat(const char* buf, uint32_t& cpuTicks)
+{
+    const char* p = strrchr(buf, ')');
+    if (!p)
+    {
+        return false;
+    }
+    p++;
+    for (int field = 3; field < 14; ++field)
+    {
+        p = strchr(p + 1, ' ');
+        if (!p)
+        {
+            return false;
+        }
+    }
+    char* end;
+    unsigned long utime = strtoul(p, &end, 10);
+    unsigned long stime = strtoul(end, &end, 10);
+    cpuTicks = utime + stime;
+    return true;
+}
+
+void Sampler::take_samples()
+{
+    vector<shared_ptr<Process>> processes = _tracer.live_processes();
+    std::unordered_set<pid_t> seen;
+    char buf[1024];
+
+    for (const shared_ptr<Process>& process : processes)
+    {
+        pid_t pid = process->pid();
+        seen.insert(pid);
+        Files& files = _files[pid];
+        if (files.process.lock() != process)
+        {
+            // Either it's a new tracee, or the PID got recycled.
+            close_files(files);
+            files.process = process;
+            files.stat = open(format("/proc/{}/stat", pid).c_str(), 
+                O_RDONLY | O_CLOEXEC);
+            files.statm = open(format("/proc/{}/statm", pid).c_str(),
+                O_RDONLY | O_CLOEXEC);
+        }
+        if (files.stat == -1 || files.statm == -1)
+        {
+            continue;
+        }
+
+        Sample sample;
+        sample.time = get_monotonic_time();
+        if (!read_proc_file(files.stat, buf, sizeof(buf)) 
+            || !parse_stat(buf, sample.cpuTicks))
+        {
+            continue;
+        }
+        // statm is "size resident shared ..." (all in pages)
+        if (!read_proc_file(files.statm, buf, sizeof(buf)))
+        {
+            continue;
+        }
+        char* end;
+        strtoul(buf, &end, 10);
+        sample.rssPages = strtoul(end, &end, 10);
+        process->add_sample(sample);
+    }
+
+    // Close the files of any tracees that have died since last time.
+    for (auto it = _files.begin(); it != _files.end(); )
+    {
+        if (seen.count(it->first))
+        {
+            ++it;
+            continue;
+        }
+        close_files(it->second);
+        it = _files.erase(it);
+    }
+}
+
+double get_cpu_percent(const Sample& prev, const Sample& cur)
+{
+    if (cur.time <= prev.time)
+    {
+        return 0.0;
+    }
+    static const long ticksPerSecond = sysconf(_SC_CLK_TCK);
+    double cpu = double(cur.cpuTicks - prev.cpuTicks) / ticksPerSecond;
+    return 100.0 * cpu / ((cur.time - prev.time) / 1e9);
+}
+
+uint64_t get_rss_kilobytes(const Sample& sample)
+{
+    static const long pageSize = sysconf(_SC_PAGESIZE);
+    return uint64_t(sample.rssPages) * pageSize / 1024;
+}
+
+string describe_samples(const Process& process, Timestamp time)
+{
+    Sample prev, cur;
+    if (!process.samples().find(time, prev, cur))
+    {
+        return "";
+    }
+    return format("cpu {:.0f}% rss {}", get_cpu_percent(prev, cur), 
+        format_kilobytes(get_rss_kilobytes(cur)));
+}
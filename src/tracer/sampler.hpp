@@ -0,0 +1,76 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  sampler
+ *
+ *      A background thread that samples the CPU and memory use of tracees
+ *      from /proc, so we can see what they get up to in between events.
+ */
+#ifndef FORKTRACE_SAMPLER_HPP
+#define FORKTRACE_SAMPLER_HPP
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <memory>
+
+#include "process.hpp"
+
+class Tracer; // defined in tracer.hpp
+
+/* Every so often, reads /proc/<pid>/stat and /proc/<pid>/statm for each live
+ * tracee and adds a Sample to its Process. This never stops the tracees (it's
+ * just reading files), so it doesn't change the timing of anything the way
+ * that a ptrace stop would. The thread only runs while the rate is non-zero. */
+class Sampler
+{
+private:
+    /* The files we keep open for each tracee so that taking a sample is just
+     * two preads. An fd for a /proc/<pid> file sticks to the process that it
+     * was opened for, so we can't accidentally read a recycled PID. */
+    struct Files
+    {
+        std::weak_ptr<Process> process;
+        int stat = -1;
+        int statm = -1;
+    };
+
+    Tracer& _tracer;
+    std::thread _thread;
+    std::mutex _lock; // protects _rate and _quit
+    std::condition_variable _wake;
+    unsigned _rate; // samples per second (0 means we aren't sampling)
+    bool _quit;
+    std::unordered_map<pid_t, Files> _files; // only used by the thread
+
+    /* Private functions, see source file */
+    void run();
+    void take_samples();
+    void close_files(Files& files);
+
+public:
+    Sampler(Tracer& tracer) : _tracer(tracer), _rate(0), _quit(false) { }
+    ~Sampler() { set_rate(0); }
+
+    Sampler(const Sampler&) = delete;
+    Sampler(Sampler&&) = delete;
+
+    /* Sets the number of samples taken per second. Starts the sampler thread
+     * if it wasn't running, or stops it (and waits for it) if rate is 0. */
+    void set_rate(unsigned rate);
+    unsigned rate();
+};
+
+/* Works out the CPU use (as a percentage of one CPU) in between two samples of
+ * the same process. Returns 0 if they were taken at the same time. */
+double get_cpu_percent(const Sample& prev, const Sample& cur);
+
+/* Converts the RSS of the sample into kilobytes. */
+uint64_t get_rss_kilobytes(const Sample& sample);
+
+/* Describes the CPU and memory use of the process at the specified time, e.g.,
+ * "cpu 45% rss 12.3M". Returns an empty string if there are no samples. */
+std::string describe_samples(const Process& process, Timestamp time);
+
+#endif /* FORKTRACE_SAMPLER_HPP */
@@ -6,15 +6,25 @@
  */
 #include <unistd.h>
 #include <cassert>
+#include <cctype>
+#include <climits>
+#include <algorithm>
 
 #include "terminal.hpp"
 #include "scroll-view.hpp"
 #include "util.hpp"
+#include "log.hpp"
 
 using std::string;
 using std::string_view;
 using std::runtime_error;
 
+/* Divides, rounding up instead of down. */
+static size_t ceil_div(size_t a, size_t b)
+{
+    return (a + b - 1) / b;
+}
+
 bool init_curses_colour() 
 {
     return start_color() != ERR
@@ -26,7 +36,8 @@ bool init_curses_colour()
         && init_pair(5, COLOR_RED, -1) != ERR
         && init_pair(6, COLOR_MAGENTA, -1) != ERR
         && init_pair(7, COLOR_WHITE, -1) != ERR
-        && init_pair(8, COLOR_RED, COLOR_WHITE) != ERR;
+        && init_pair(8, COLOR_RED, COLOR_WHITE) != ERR
+        && init_pair(9, COLOR_CYAN, -1) != ERR;
 }
 
 int get_message_colour() 
@@ -47,6 +58,7 @@ int get_colour(Colour c)
         case Colour::GREY:      return A_BOLD | COLOR_PAIR(1);
         case Colour::YELLOW:    return attr | COLOR_PAIR(2);
         case Colour::BLUE:      return attr | COLOR_PAIR(3);
+        case Colour::CYAN:      return attr | COLOR_PAIR(9);
         case Colour::GREEN:     return attr | COLOR_PAIR(4);
         case Colour::RED:       return attr | COLOR_PAIR(5);
         case Colour::MAGENTA:   return attr | COLOR_PAIR(6);
@@ -67,6 +79,7 @@ void ScrollView::draw_window(bool resized)
 
     if (resized) 
     {
+        _shown.clear();
         clear();
         attron(get_message_colour());
         mvaddstr(height - 1, 0, _helpMessage.c_str());
@@ -88,166 +101,416 @@ void ScrollView::draw_window(bool resized)
         }
     }
     
-    // Calculate the pad offset so that it is centered in the middle. The pad
-    // offset is the coordinates on the pad which will correspond to the top
-    // left corner of the section of the screen that we draw it on.
-    size_t padOffsetX = 0, padOffsetY = 0;
-    if (_cursorX > ((size_t)width / 2)) 
+    // Calculate the screen area available for the image, as well as the
+    // coords where we'll draw it. We need to account for the rows of info text.
+    size_t viewPosX = 0;
+    size_t viewPosY = 2; // 2 lines at top
+    size_t availableWidth = width;
+    size_t availableHeight = std::max(height, 3) - 3; // 2 at top, 1 at bottom
+
+    // Make room for the overview pane (a quarter of the screen, plus a column
+    // to separate it from the image), and draw it again if it needs it. The
+    // blocks are made big enough for the whole image to fit on the pane.
+    size_t imageWidth = availableWidth;
+    size_t paneWidth = 0;
+    if (_overviewShown && availableWidth >= 8 && availableHeight > 0)
     {
-        padOffsetX = _cursorX - (width / 2);
+        paneWidth = availableWidth / 4;
+        imageWidth = availableWidth - paneWidth - 1;
+        _paneLeft = viewPosX + imageWidth + 1;
+        size_t scaleX = std::max<size_t>(ceil_div(_width, paneWidth), 1);
+        size_t scaleY = std::max<size_t>(ceil_div(_height, availableHeight), 1);
+        if (_paneStale || scaleX != _scaleX || scaleY != _scaleY
+            || _pane->width() != paneWidth 
+            || _pane->height() != availableHeight)
+        {
+            _scaleX = scaleX;
+            _scaleY = scaleY;
+            _pane->resize(paneWidth, availableHeight);
+            _overview(*_pane, scaleX, scaleY);
+            _paneStale = false;
+        }
+    }
+
+    // Calculate the view offset so that the cursor is centered in the middle.
+    // The view offset is the coordinates on the image which will correspond
+    // to the top left corner of the section of the screen that we draw it on.
+    size_t viewOffsetX = 0, viewOffsetY = 0;
+    if (_cursorX > imageWidth / 2) 
+    {
+        viewOffsetX = _cursorX - (imageWidth / 2);
     }
     if (_cursorY > ((size_t)height / 2)) 
     {
-        padOffsetY = _cursorY - (height / 2);
+        viewOffsetY = _cursorY - (height / 2);
     }
 
-    // Calculate the screen area available for the pad, as well as the coords
-    // where we'll draw the pad. We need to account for the rows of info text.
-    size_t padPosX = 0;
-    size_t padPosY = 2; // 2 lines at top
-    size_t availableWidth = width;
-    size_t availableHeight = height - 3; // 2 lines at top, 1 at bottom
-
-    // Calculate how many rows/columns are visible off the edge of the pad.
-    // (which we'll call the "overhang").We'll need to clear these ourselves 
-    // since drawing the pad won't do it (since the pad doesn't extend to 
-    // those rows/columns).
-    //
-    // We'll zero out the overhang in two segments (if they exist) by looping
-    // through each line and clearing to the end of the line. The two sections
-    // (labelled BOTTOM and RIGHT) are illustrated in the below diagram:
-    //
-    //  +---------------------------------------------------+------------+
-    //  |                                                   |            |
-    //  |                                                   |            |
-    //  |                                                   |            |
-    //  |                                                   |   RIGHT    |
-    //  |                                                   |  OVERHANG  |
-    //  |                   PAD AREA                        |            |
-    //  |                                                   |            |
-    //  |                                                   |            |
-    //  |                                                   |            |
-    //  |                                                   |            |
-    //  +---------------------------------------------------+------------+
-    //  |                                                                |
-    //  |                                                                |
-    //  |                      BOTTOM OVERHANG                           |
-    //  |                                                                |
-    //  +----------------------------------------------------------------+
-    //
-    // Just remember - these overhang sections are only visible if the diagram
-    // is scrolled far enough to the right or bottom edges.
-
-    // Calculate the overhang.
-    size_t overhangX = std::max(0UL, padOffsetX + availableWidth - _padWidth);
-    size_t overhangY = std::max(0UL, padOffsetY + availableHeight - _padHeight);
-
-    // Zero out the BOTTOM section.
-    size_t yStart = padPosY + availableHeight - overhangY;
-    size_t yMax = padPosY + availableHeight;
-    for (size_t y = yStart; y < yMax; ++y) 
+    // The blocks of the overview that are on the screen, which get highlighted
+    size_t firstBlockX = 0, lastBlockX = 0, firstBlockY = 0, lastBlockY = 0;
+    if (paneWidth > 0)
     {
-        move(y, 0);
-        clrtoeol();
+        firstBlockX = viewOffsetX / _scaleX;
+        lastBlockX = (std::min(viewOffsetX + imageWidth, _width) - 1) / _scaleX;
+        firstBlockY = viewOffsetY / _scaleY;
+        lastBlockY = (std::min(viewOffsetY + availableHeight, _height) - 1) 
+            / _scaleY;
     }
 
-    // Zero out the RIGHT section.
-    if (overhangX > 0) 
+    // Hang on to enough tiles to cover the screen a couple of times over, so
+    // that we can scroll back and forth a bit without rendering them again.
+    _maxTiles = 2 * (availableWidth / TILE_WIDTH + 2) 
+        * (availableHeight / TILE_HEIGHT + 2);
+
+    // Copy the visible part of the image onto the screen, putting each row
+    // together from the tiles that it goes across and then handing the whole
+    // row to curses at once. We need to clear whatever is past the right or
+    // bottom edges of the image ourselves (the "overhang"), since we're only
+    // visible there if the image is scrolled far enough to the right/bottom.
+    _row.resize(availableWidth);
+    size_t shownRows = std::min(_shown.size(), availableHeight);
+    _shown.resize(availableHeight);
+    for (size_t row = 0; row < availableHeight; ++row)
     {
-        yStart = padPosY;
-        yMax = padPosY + availableHeight - overhangY;
-        for (size_t y = yStart; y < yMax; ++y) 
+        size_t y = viewOffsetY + row;
+        size_t col = 0;
+        while (y < _height && col < imageWidth)
+        {
+            size_t x = viewOffsetX + col;
+            if (x >= _width)
+            {
+                break;
+            }
+            const chtype* tile = get_tile(x / TILE_WIDTH, y / TILE_HEIGHT);
+            size_t tileX = x % TILE_WIDTH;
+            size_t count = std::min({TILE_WIDTH - tileX, imageWidth - col,
+                _width - x});
+            std::copy_n(tile + (y % TILE_HEIGHT) * TILE_WIDTH + tileX, count,
+                &_row[col]);
+            col += count;
+        }
+        if (paneWidth > 0)
+        {
+            // Blank out the rest of the image's part, then add on the pane
+            std::fill(&_row[col], &_row[imageWidth], ' ');
+            _row[imageWidth] = '|' | get_colour(Colour::GREY);
+            for (size_t x = 0; x < paneWidth; ++x)
+            {
+                Window::Cell cell = _pane->get_cell(x, row);
+                chtype attr = get_colour(cell.colour);
+                if (firstBlockX <= x && x <= lastBlockX 
+                    && firstBlockY <= row && row <= lastBlockY)
+                {
+                    attr |= A_REVERSE;
+                }
+                _row[_paneLeft - viewPosX + x] = (unsigned char)cell.ch | attr;
+            }
+            col = availableWidth;
+        }
+        // Leave the row alone if it's the same as what's already there
+        std::vector<chtype>& shown = _shown[row];
+        if (row < shownRows && shown.size() == col
+            && std::equal(shown.begin(), shown.end(), _row.begin()))
+        {
+            continue;
+        }
+        shown.assign(_row.begin(), _row.begin() + col);
+        if (col > 0)
+        {
+            mvaddchnstr(viewPosY + row, viewPosX, _row.data(), col);
+        }
+        if (col < availableWidth)
         {
-            move(y, padPosX + availableWidth - overhangX);
+            move(viewPosY + row, viewPosX + col);
             clrtoeol();
         }
     }
 
-    // Redraw the pad on the screen with the updated offset etc.
-    prefresh(_pad, padOffsetY, padOffsetX, padPosY, padPosX, 
-        height - 2, width - 1); // subtract 2 from height due to row at bottom
     // Set cursor position (relative to terminal screen).
-    move(_cursorY + padPosY - padOffsetY, _cursorX + padPosX - padOffsetX);
+    if (_overviewFocused && paneWidth > 0)
+    {
+        move(viewPosY + _paneY, _paneLeft + _paneX);
+    }
+    else
+    {
+        move(_cursorY + viewPosY - viewOffsetY, 
+            _cursorX + viewPosX - viewOffsetX);
+    }
+    refresh();
+}
+
+/* Waits for a key (or for the tick interval to go by, in which case it
+ * returns ERR). Then it ticks, so that the image is up to date for whatever
+ * happens next. */
+int ScrollView::wait_for_key()
+{
+    int c = getch();
+    if (_onTick)
+    {
+        _onTick(*this);
+    }
+    return c;
 }
 
 void ScrollView::run() 
 {
-    assert(_pad && _padWidth > 0 && _padHeight > 0);
+    assert(_width > 0 && _height > 0);
     draw_window(true);
+    timeout(_tickInterval);
     while (_running) 
     {
-        int c = getch();
-        if (c != KEY_RESIZE) 
+        int c = wait_for_key();
+        bool woken = (c == ERR && _onTick); // no key, it's just time to tick
+        if (c != KEY_RESIZE && !woken && !handle_overview_key(c)) 
         {
             _keyHandler(*this, c);
         }
         draw_window(c == KEY_RESIZE);
     }
+    timeout(-1);
+}
+
+void ScrollView::set_overview(OverviewCallback render, JumpCallback onJump)
+{
+    _overview = std::move(render);
+    _onJump = std::move(onJump);
+    _pane.reset(new Window(1, 1));
+    _paneStale = true;
 }
 
-void ScrollView::build_image(const Window& image) 
+bool ScrollView::toggle_overview()
 {
-    if (_pad) 
+    if (!_overview)
     {
-        delwin(_pad);
-        _pad = nullptr;
+        return false;
     }
+    _overviewShown = !_overviewShown;
+    _overviewFocused = false;
+    // Only take over the mouse while there's something to click on, since
+    // the terminal can't select text with it in the meantime
+    mousemask(_overviewShown ? BUTTON1_CLICKED | BUTTON1_PRESSED : 0, nullptr);
+    return true;
+}
+
+/* Calls the jump callback for the middle of a block of the overview. */
+void ScrollView::jump_to_block(size_t column, size_t row)
+{
+    size_t x = std::min(column * _scaleX + _scaleX / 2, _width - 1);
+    size_t y = std::min(row * _scaleY + _scaleY / 2, _height - 1);
+    _onJump(*this, x, y);
+}
 
-    _padWidth = image.width();
-    _padHeight = image.height();
-    _pad = newpad(_padHeight, _padWidth);
-    if (!_pad) 
+/* Handles the keys that have to do with the overview pane (including mouse
+ * clicks) and returns true, or returns false if the key is for someone else. */
+bool ScrollView::handle_overview_key(int key)
+{
+    if (!_overview || !(_overviewShown || key == KEY_MOUSE))
     {
-        throw runtime_error("Failed to create curses pad.");
+        return false;
     }
-    keypad(_pad, TRUE);
-
-    int attr = get_colour(Colour::RESET);
-    wattron(_pad, attr);
+    // The number of blocks that the image has been split up into
+    size_t columns = std::min(ceil_div(_width, _scaleX), _pane->width());
+    size_t rows = std::min(ceil_div(_height, _scaleY), _pane->height());
+    if (key == KEY_MOUSE)
+    {
+        MEVENT event;
+        if (_overviewShown && getmouse(&event) == OK 
+            && event.x >= 0 && size_t(event.x) >= _paneLeft 
+            && size_t(event.x) < _paneLeft + columns 
+            && event.y >= 2 && size_t(event.y) < 2 + rows)
+        {
+            _overviewFocused = false;
+            jump_to_block(event.x - _paneLeft, event.y - 2);
+        }
+        return true;
+    }
+    if (key == '\t')
+    {
+        // Start off from the block that the cursor is in
+        _overviewFocused = !_overviewFocused;
+        _paneX = std::min(_cursorX / _scaleX, columns - 1);
+        _paneY = std::min(_cursorY / _scaleY, rows - 1);
+        return true;
+    }
+    if (!_overviewFocused)
+    {
+        return false;
+    }
+    constexpr int ESCAPE = 27;
+    switch (key)
+    {
+        case KEY_LEFT:
+            _paneX = std::max<size_t>(_paneX, 1) - 1;
+            break;
+        case KEY_RIGHT:
+            _paneX = std::min(_paneX + 1, columns - 1);
+            break;
+        case KEY_UP:
+            _paneY = std::max<size_t>(_paneY, 1) - 1;
+            break;
+        case KEY_DOWN:
+            _paneY = std::min(_paneY + 1, rows - 1);
+            break;
+        case '\n':
+        case KEY_ENTER:
+            _overviewFocused = false;
+            jump_to_block(_paneX, _paneY);
+            break;
+        case ESCAPE:
+            _overviewFocused = false;
+            break;
+        default:
+            beep();
+            break;
+    }
+    return true;
+}
 
-    for (size_t y = 0; y < image.height(); ++y) 
+bool ScrollView::prompt(string_view question, string& answer)
+{
+    constexpr int ESCAPE = 27;
+    answer.clear();
+    while (_running)
     {
-        mvwin(_pad, y, 0);
-        for (size_t x = 0; x < image.width(); ++x) 
+        int width, height;
+        getmaxyx(stdscr, height, width); // macro
+        string text = string(question) + answer;
+        if (text.size() >= (size_t)width && width > 0)
+        {
+            text.erase(0, text.size() - width + 1); // show the end of it
+        }
+        move(height - 1, 0);
+        clrtoeol();
+        attron(get_message_colour());
+        addstr(text.c_str());
+        attroff(get_message_colour());
+        refresh();
+
+        int c = wait_for_key();
+        if (c == '\n' || c == KEY_ENTER)
+        {
+            break;
+        }
+        else if (c == ESCAPE)
+        {
+            answer.clear();
+            break;
+        }
+        else if (c == KEY_BACKSPACE || c == 127 || c == '\b')
         {
-            Window::Cell cell = image.get_cell(x, y);
-            int newAttr = get_colour(cell.colour);
-            if (newAttr != attr) 
+            if (!answer.empty())
             {
-                wattroff(_pad, attr);
-                wattron(_pad, newAttr);
-                attr = newAttr;
+                answer.pop_back();
             }
-            mvwaddch(_pad, y, x, cell.ch);
+        }
+        else if (c == KEY_RESIZE)
+        {
+            draw_window(true);
+        }
+        else if (c >= 0 && c <= UCHAR_MAX && isprint(c))
+        {
+            answer += char(c);
         }
     }
+
+    // Put the help message back where it was
+    int width, height;
+    getmaxyx(stdscr, height, width); // macro
+    move(height - 1, 0);
+    clrtoeol();
+    attron(get_message_colour());
+    addnstr(_helpMessage.c_str(), width);
+    attroff(get_message_colour());
+    return _running && !answer.empty();
 }
 
-void ScrollView::update(const Window& image) 
+void ScrollView::set_live(int interval, TickCallback onTick)
 {
-    build_image(image);
-    draw_window(true);
+    _tickInterval = interval;
+    _onTick = std::move(onTick);
 }
 
-void ScrollView::cleanup() 
+/* Returns the cells of the tile in the given column/row of tiles (as rows of
+ * TILE_WIDTH), rendering it if it isn't in the cache already. This can throw
+ * out the tile that was returned last time, so don't hang on to the result. */
+const chtype* ScrollView::get_tile(size_t column, size_t row)
 {
-    if (_pad) 
+    uint64_t key = (uint64_t(row) << 32) | column;
+    auto it = _tileIndex.find(key);
+    if (it != _tileIndex.end())
+    {
+        _tiles.splice(_tiles.begin(), _tiles, it->second); // most recent now
+        return _tiles.front().cells.data();
+    }
+
+    // Recycle the least recently used tile if we've got too many
+    std::vector<chtype> cells;
+    while (!_tiles.empty() && _tiles.size() >= _maxTiles)
     {
-        delwin(_pad);
-        _pad = nullptr;
+        const Tile& oldest = _tiles.back();
+        _tileIndex.erase((uint64_t(oldest.row) << 32) | oldest.column);
+        cells = std::move(_tiles.back().cells);
+        _tiles.pop_back();
+    }
+    cells.resize(TILE_WIDTH * TILE_HEIGHT);
+
+    // Turn the rendered tile into curses characters, only looking up the
+    // attributes for a colour when it changes.
+    _render(*_scratch, column * TILE_WIDTH, row * TILE_HEIGHT);
+    Colour colour = Colour::RESET;
+    chtype attr = get_colour(colour);
+    for (size_t y = 0; y < TILE_HEIGHT; ++y)
+    {
+        for (size_t x = 0; x < TILE_WIDTH; ++x)
+        {
+            Window::Cell cell = _scratch->get_cell(x, y);
+            if (cell.colour != colour)
+            {
+                colour = cell.colour;
+                attr = get_colour(colour);
+            }
+            cells[y * TILE_WIDTH + x] = (unsigned char)cell.ch | attr;
+        }
     }
+
+    _tiles.push_front({column, row, std::move(cells)});
+    _tileIndex[key] = _tiles.begin();
+    return _tiles.front().cells.data();
+}
+
+void ScrollView::update(size_t width, size_t height) 
+{
+    _width = width;
+    _height = height;
+    _tiles.clear();
+    _tileIndex.clear();
+    _paneStale = true;
+    draw_window(false);
+}
+
+void ScrollView::cleanup() 
+{
+    mousemask(0, nullptr);
     keypad(stdscr, FALSE);
     nocbreak();
     echo();
     endwin();
 }
 
-ScrollView::ScrollView(const Window& image, 
+ScrollView::ScrollView(size_t width,
+                       size_t height,
+                       RenderCallback render,
                        string_view helpMessage, 
                        KeyCallback onKey) 
-    : _pad(nullptr), _padWidth(0), _padHeight(0), _cursorX(0), _cursorY(0), 
-    _running(true), _helpMessage(helpMessage), _keyHandler(onKey)
+    : _width(0), _height(0), _cursorX(0), _cursorY(0), _running(true), 
+    _helpMessage(helpMessage), _keyHandler(onKey), _render(render), 
+    _tickInterval(-1), _maxTiles(1), 
+    _scratch(new Window(TILE_WIDTH, TILE_HEIGHT)), _overviewShown(false), 
+    _overviewFocused(false), _paneStale(true), _scaleX(1), _scaleY(1), 
+    _paneX(0), _paneY(0), _paneLeft(0)
 {
+    // Anything that's still waiting to be logged has to come out before
+    // curses takes over the terminal, or it'll get printed over the top.
+    flush_log();
     if (!initscr() || cbreak() == ERR || noecho() == ERR 
         || keypad(stdscr, TRUE) == ERR)
     {
@@ -273,7 +536,7 @@ ScrollView::ScrollView(const Window& image,
 
     try 
     {
-        update(image);
+        update(width, height);
     } 
     catch (const std::exception& e) 
     {
@@ -282,6 +545,11 @@ ScrollView::ScrollView(const Window& image,
     }
 }
 
+ScrollView::~ScrollView()
+{
+    cleanup();
+}
+
 void ScrollView::set_line(string_view line, size_t y) 
 {
     assert(y < ARRAY_SIZE(_lines));
@@ -290,7 +558,7 @@ void ScrollView::set_line(string_view line, size_t y)
 
 void ScrollView::set_cursor(size_t x, size_t y) 
 {
-    assert(x < _padWidth && y < _padHeight);
+    assert(x < _width && y < _height);
     _cursorX = x;
     _cursorY = y;
 }
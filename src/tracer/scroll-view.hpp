@@ -8,13 +8,36 @@
 #define FORKTRACE_SCROLL_VIEW_HPP
 
 #include <string>
+#include <cstdint>
 #include <functional>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <vector>
 #include <curses.h>
 
+class Window; // defined in terminal.hpp
+
 /* A scrollable curses view that enables the user to scroll around the diagram
  * and inspect certain nodes. The view allows two lines of info at the top. 
  * Note that coordinates work by: (0,0) at top-left, then x increases to the
- * right and y increases downwards. */
+ * right and y increases downwards.
+ *
+ * The image being shown can be much bigger than we could ever keep in memory
+ * (or in a curses pad), so we never ask for the whole thing. Instead, it gets
+ * split up into tiles, and we ask the RenderCallback for whichever tiles are
+ * on the screen. The tiles that were used most recently are kept around (a
+ * few screens' worth), so that scrolling back and forth doesn't need them to
+ * be rendered again each time. Tiles are kept as ready-made curses
+ * characters (with the attributes for their colours already in them), so
+ * drawing a row of the screen is just copying a few spans out of the tiles
+ * and handing them to curses in one go.
+ *
+ * There can also be an overview pane down the right-hand side, with a zoomed
+ * out picture of the whole image (see set_overview). The part of the image
+ * that's on the screen is highlighted on it. Clicking on the overview, or
+ * pressing tab to move around it with the arrow keys and then enter, jumps
+ * to that part of the image. */
 class ScrollView 
 {
 public:
@@ -22,40 +45,135 @@ public:
      * the curses getch() method (KEY_RESIZE is filtered out). */
     using KeyCallback = std::function<void(ScrollView&, int)>;
 
+    /* Should fill `tile` with the part of the image whose top-left corner is
+     * at (x, y), leaving anything that's past the edge of the image blank. */
+    using RenderCallback = 
+        std::function<void(Window& tile, size_t x, size_t y)>;
+
+    /* For images that change while they're being viewed (see set_live). It
+     * gets a chance to bring the image up to date (by calling update() etc.)
+     * each time the view wakes up. */
+    using TickCallback = std::function<void(ScrollView&)>;
+
+    /* Should fill `pane` with a zoomed-out picture of the image, where each
+     * cell of the pane sums up a block of scaleX by scaleY cells of it. */
+    using OverviewCallback = 
+        std::function<void(Window& pane, size_t scaleX, size_t scaleY)>;
+
+    /* Gets called when the user picks somewhere on the overview to jump to,
+     * with the (x, y) position on the image at the middle of that block. */
+    using JumpCallback = std::function<void(ScrollView&, size_t x, size_t y)>;
+
+    /* The size of each tile (in columns/rows). */
+    static constexpr size_t TILE_WIDTH = 128;
+    static constexpr size_t TILE_HEIGHT = 64;
+
 private:
-    WINDOW* _pad;
-    size_t _padWidth;
-    size_t _padHeight;
-    size_t _cursorX; // x position of cursor (relative to the pad, not screen)
-    size_t _cursorY; // y position of cursor (relative to the pad, not screen)
+    struct Tile
+    {
+        size_t column; // x / TILE_WIDTH
+        size_t row; // y / TILE_HEIGHT
+        std::vector<chtype> cells; // stored as a sequence of rows
+    };
+
+    size_t _width; // width of the whole image
+    size_t _height; // height of the whole image
+    size_t _cursorX; // x position of cursor (relative to the image)
+    size_t _cursorY; // y position of cursor (relative to the image)
     bool _running; // set to false when we want to quit.
     std::string _lines[2];
     std::string _helpMessage;
     KeyCallback _keyHandler;
+    RenderCallback _render;
+    TickCallback _onTick;
+    int _tickInterval; // in milliseconds, or -1 to wait for keys forever
+
+    /* The cached tiles, from most to least recently used, and where to find
+     * each of them in that list (by tile_key()). Once there are more than
+     * _maxTiles, the least recently used tile gets thrown out. */
+    std::list<Tile> _tiles;
+    std::unordered_map<uint64_t, std::list<Tile>::iterator> _tileIndex;
+    size_t _maxTiles;
+    std::unique_ptr<Window> _scratch; // tiles are rendered onto this first
+    std::vector<chtype> _row; // a row of the screen gets put together here
+
+    /* A copy of each row of the image that's currently on the screen. Rows
+     * that come out the same as last time don't get handed to curses again,
+     * so when only a few rows change (say, after update()), only those get
+     * repainted. Emptied whenever the screen is cleared (and rows past the
+     * end of it haven't been drawn since then). */
+    std::vector<std::vector<chtype>> _shown;
+
+    /* The overview pane (if set_overview has been called). _pane holds the
+     * picture as of the last time that it was drawn, for blocks of _scaleX
+     * by _scaleY cells of the image, and it's drawn again if it's stale (or
+     * the blocks have to change size). While it's focused, the arrow keys
+     * move the cursor around the pane (to block _paneX, _paneY) instead. */
+    OverviewCallback _overview;
+    JumpCallback _onJump;
+    bool _overviewShown;
+    bool _overviewFocused;
+    bool _paneStale;
+    std::unique_ptr<Window> _pane;
+    size_t _scaleX;
+    size_t _scaleY;
+    size_t _paneX;
+    size_t _paneY;
+    size_t _paneLeft; // the column of the screen that the pane starts on
 
     /* Private functions, see source file. */
     void draw_window(bool resized = true);
-    void build_image(const Window& image);
+    int wait_for_key();
+    bool handle_overview_key(int key);
+    void jump_to_block(size_t column, size_t row);
+    const chtype* get_tile(size_t column, size_t row);
     void cleanup();
 
 public:
-    /* The constructor brings up the curses view. */
-    ScrollView(const Window& window, 
+    /* The constructor brings up the curses view, showing an image of the
+     * given size that gets drawn by `render`. */
+    ScrollView(size_t width,
+               size_t height,
+               RenderCallback render,
                std::string_view helpMessage, 
                KeyCallback onKey);
-    ~ScrollView() { cleanup(); }
+    ~ScrollView();
 
     /* Allows the caller to set the messages stored at the two lines of text
      * at the top of the window. asserts that y == 0 || y == 1. */
     void set_line(std::string_view line, size_t y);
 
-    /* Highlights a position on the provided input window. An assertion will
-     * fail if the coordinates are outside the range of `window`. */
+    /* Highlights a position on the image. An assertion will fail if the
+     * coordinates are outside the range of the image. */
     void set_cursor(size_t x, size_t y);
 
+    /* Call this if the image has changed (which throws away all of the tiles
+     * that were rendered before). The image can change size too. Only the
+     * rows of the screen that actually look different get repainted. */
+    void update(size_t width, size_t height);
+
+    /* Makes run() wake up at least every `interval` milliseconds and call
+     * `onTick`, even if no keys are pressed. Before each key gets handled,
+     * there is a tick, so the key handler always sees the image up to date.
+     * The image itself mustn't change in between ticks. */
+    void set_live(int interval, TickCallback onTick);
+
+    /* Asks the user to type something in on the bottom line of the screen
+     * (where the help message usually is), which gets stored in `answer`.
+     * Returns false if they cancelled it (with escape) or typed nothing. For
+     * calling from within the key handler. In the meantime, a live view keeps
+     * on ticking as usual. */
+    bool prompt(std::string_view question, std::string& answer);
+
+    /* Gives the view an overview pane (hidden until toggle_overview). */
+    void set_overview(OverviewCallback render, JumpCallback onJump);
+
+    /* Shows the overview pane if it's hidden, or hides it if it's shown.
+     * Returns false if there isn't one (see set_overview). */
+    bool toggle_overview();
+
     void quit() { _running = false; }   // Call from within onKeyPress handler.
     void beep();                        // Get terminal to make a beep noise.
-    void update(const Window& window);  // Change the stuff being displayed.
     void run();                         // Starts drawing and does command loop
 };
 
@@ -0,0 +1,157 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  search-index
+ */
+#include <cassert>
+#include <algorithm>
+#include <cctype>
+
+#include "search-index.hpp"
+#include "process.hpp"
+#include "event.hpp"
+#include "parse.hpp"
+#include "util.hpp"
+
+using std::string;
+using std::string_view;
+
+/* The kinds of events that can be searched for (with a colon in front). */
+static const string_view KINDS[] = {
+    "fork",     // a fork
+    "exec",     // an exec that worked
+    "bad-exec", // an exec that failed
+    "exited",   // an exit (with any status)
+    "failed",   // an exit with a non-zero status
+    "killed",   // a death by signal
+    "signal",   // a signal that didn't kill
+    "send",     // a signal sent to someone (or to itself)
+    "reap",     // a reaped child
+    "bad-wait", // a wait that failed
+};
+
+/* Adds a position to the end of the list (unless it's already there). */
+static void append(SearchIndex::Positions& positions, DiagramPosition position)
+{
+    if (positions.empty() || !(positions.back() == position))
+    {
+        positions.push_back(position);
+    }
+}
+
+void SearchIndex::add_path(const Process& process, DiagramPosition start)
+{
+    _pids[process.pid()].push_back(start);
+}
+
+void SearchIndex::add_event(const Event& event, DiagramPosition position)
+{
+    // Works out which of the KINDS the event is, and puts it in the list for
+    // each one (an exit with a non-zero status is both "exited" and "failed")
+    auto add = [&](string_view kind) {
+        assert(std::find(std::begin(KINDS), std::end(KINDS), kind)
+            != std::end(KINDS));
+        append(_kinds[kind], position);
+    };
+    if (auto exec = dynamic_cast<const ExecEvent*>(&event))
+    {
+        add(exec->succeeded() ? "exec" : "bad-exec");
+        append(_programs[string(get_base_name(exec->call().file))], position);
+    }
+    else if (auto exit = dynamic_cast<const ExitEvent*>(&event))
+    {
+        add("exited");
+        if (exit->status != 0)
+        {
+            add("failed");
+        }
+    }
+    else if (auto signal = dynamic_cast<const SignalEvent*>(&event))
+    {
+        add(signal->killed ? "killed" : "signal");
+    }
+    else if (auto wait = dynamic_cast<const WaitEvent*>(&event))
+    {
+        if (wait->error != 0)
+        {
+            add("bad-wait");
+        }
+    }
+    else if (dynamic_cast<const ForkEvent*>(&event))
+    {
+        add("fork");
+    }
+    else if (dynamic_cast<const ReapEvent*>(&event))
+    {
+        add("reap");
+    }
+    else if (event.kinds() & SIGNAL_SEND_EVENT)
+    {
+        // Only the sender's half of a KillEvent counts as sending
+        auto kill = dynamic_cast<const KillEvent*>(&event);
+        if (!kill || kill->sender)
+        {
+            add("send");
+        }
+    }
+}
+
+const SearchIndex::Positions* SearchIndex::find(string_view query) const
+{
+    if (query.empty())
+    {
+        return nullptr;
+    }
+    if (query.front() == ':')
+    {
+        auto it = _kinds.find(query.substr(1));
+        return it == _kinds.end() ? nullptr : &it->second;
+    }
+    if (std::all_of(query.begin(), query.end(),
+        [](char ch) { return isdigit((unsigned char)ch); }))
+    {
+        try
+        {
+            auto it = _pids.find(parse_number<pid_t>(query));
+            return it == _pids.end() ? nullptr : &it->second;
+        }
+        catch (const ParseError&)
+        {
+            return nullptr; // too big to be a pid
+        }
+    }
+    auto it = _programs.find(string(query));
+    return it == _programs.end() ? nullptr : &it->second;
+}
+
+bool SearchIndex::next(const Positions& matches,
+                       DiagramPosition from,
+                       bool backwards,
+                       DiagramPosition& result)
+{
+    if (matches.empty())
+    {
+        return false;
+    }
+    if (backwards)
+    {
+        auto it = std::lower_bound(matches.begin(), matches.end(), from);
+        result = (it == matches.begin()) ? matches.back() : *(it - 1);
+    }
+    else
+    {
+        auto it = std::upper_bound(matches.begin(), matches.end(), from);
+        result = (it == matches.end()) ? matches.front() : *it;
+    }
+    return true;
+}
+
+string SearchIndex::kind_names()
+{
+    string names;
+    for (string_view kind : KINDS)
+    {
+        names += names.empty() ? "" : ", ";
+        names += kind;
+    }
+    return names;
+}
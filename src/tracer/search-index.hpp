@@ -0,0 +1,79 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  search-index
+ *
+ *      Lets the scroll view jump straight to things on a diagram (a pid, a
+ *      program that was execed, or a kind of event like a process getting
+ *      killed), instead of the user having to arrow key their way there.
+ */
+#ifndef FORKTRACE_SEARCH_INDEX_HPP
+#define FORKTRACE_SEARCH_INDEX_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <sys/types.h>
+
+class Process; // defined in process.hpp
+struct Event; // defined in event.hpp
+
+/* Where something is on a diagram, in lane/line coordinates (see Diagram). */
+struct DiagramPosition
+{
+    size_t line;
+    size_t lane;
+
+    /* Positions are ordered the way you'd read them: line by line, and from
+     * left to right along each line. */
+    bool operator<(const DiagramPosition& other) const
+    {
+        return line < other.line || (line == other.line && lane < other.lane);
+    }
+    bool operator==(const DiagramPosition& other) const
+    {
+        return line == other.line && lane == other.lane;
+    }
+};
+
+/* Everything that can be searched for on a diagram, each with a sorted list of
+ * the places where it can be found. Diagram::search_index() makes these.
+ *
+ * A query is either a pid (which finds where that process's path starts), the
+ * name of a kind of event with a colon in front (like ":killed", see KINDS in
+ * the source file), or else the base name of a program that was execed (like
+ * "ld" for an exec of /usr/bin/ld). Since the lists are sorted, finding the
+ * next or previous match from anywhere on the diagram is a binary search. */
+class SearchIndex
+{
+public:
+    using Positions = std::vector<DiagramPosition>;
+
+private:
+    std::unordered_map<pid_t, Positions> _pids;
+    std::unordered_map<std::string, Positions> _programs;
+    std::unordered_map<std::string_view, Positions> _kinds;
+
+public:
+    /* Each of these has to be called in order of position. */
+    void add_path(const Process& process, DiagramPosition start);
+    void add_event(const Event& event, DiagramPosition position);
+
+    /* Returns all of the places that match `query` (in order), or null if
+     * nothing matches. Only look at the result until the diagram changes. */
+    const Positions* find(std::string_view query) const;
+
+    /* Returns the first match that comes after `from`, wrapping around to the
+     * first one if `from` is past all of them. If `backwards` is true, then it
+     * returns the last one before `from` (wrapping around to the last match
+     * instead). Returns false if there are no matches at all. */
+    static bool next(const Positions& matches,
+                     DiagramPosition from,
+                     bool backwards,
+                     DiagramPosition& result);
+
+    /* The names of the kinds of events (without the colons), for help text. */
+    static std::string kind_names();
+};
+
+#endif /* FORKTRACE_SEARCH_INDEX_HPP */
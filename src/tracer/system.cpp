@@ -4,6 +4,7 @@
  *
  *      TODO
  */
+#include <time.h>
 #include <fmt/core.h>
 
 #include "system.hpp"
@@ -136,3 +137,10 @@ string diagnose_wait_status(int status)
     }
     return format("unknown status {}", status);
 }
+
+Timestamp get_monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts); // can't fail with a valid clock id
+    return Timestamp(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
@@ -8,6 +8,7 @@
 #define FORKTRACE_SYSTEM_HPP
 
 #include <string>
+#include <cstdint>
 
 /* Wouldn't be hard to port to other architectures as long as it's to Linux.
  * Main things you'd have to change would just be specific register stuff in
@@ -82,6 +83,14 @@ int get_syscall_arg_count(int syscall);
 /* Get the name corresponding to a signal number (or "?????" if none) */
 std::string_view get_signal_name(int signal);
 
+/* A point in time in nanoseconds, as measured by CLOCK_MONOTONIC. These are
+ * only meaningful relative to each other (e.g., the time between two events). */
+using Timestamp = uint64_t;
+
+/* Reads CLOCK_MONOTONIC. This goes through the vDSO so it doesn't cost us a
+ * real syscall, which means it's cheap enough to call on every ptrace stop. */
+Timestamp get_monotonic_time();
+
 /* Returns a string describing the provided wait(2) child status. This will
  * include events like ptrace(2) events (see ptrace.hpp). If the event was
  * unknown, a string describing the raw number is returned. */
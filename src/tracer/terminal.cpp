@@ -7,8 +7,10 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <cassert>
+#include <cstring>
 #include <limits>
 #include <atomic>
+#include <algorithm>
 #include <fmt/core.h>
 #include <fmt/color.h>
 
@@ -37,6 +39,7 @@ static fmt::text_style to_text_style(Colour c)
         case Colour::GREY:      style = fg(fmt::color::gray); break;
         case Colour::YELLOW:    style = fg(fmt::color::yellow); break;
         case Colour::BLUE:      style = fg(fmt::color::blue); break;
+        case Colour::CYAN:      style = fg(fmt::color::cyan); break;
         case Colour::GREEN:     style = fg(fmt::color::green); break;
         case Colour::RED:       style = fg(fmt::color::crimson); break;
         case Colour::MAGENTA:   style = fg(fmt::color::magenta); break;
@@ -67,6 +70,31 @@ Window::Window(size_t width, size_t height, Colour defaultColour)
     _buf = std::unique_ptr<Cell[]>(new Cell[width * height]);
 }
 
+void Window::resize(size_t width, size_t height)
+{
+    if (width == _width && height == _height)
+    {
+        return;
+    }
+    auto buf = std::unique_ptr<Cell[]>(new Cell[width * height]);
+    size_t copyWidth = std::min(width, _width);
+    for (size_t y = 0; y < std::min(height, _height); ++y)
+    {
+        std::copy_n(&at(0, y), copyWidth, &buf[y * width]);
+    }
+    _buf = std::move(buf);
+    _width = width;
+    _height = height;
+}
+
+void Window::clear_rows(size_t y)
+{
+    if (y < _height)
+    {
+        std::fill(&at(0, y), _buf.get() + _width * _height, Cell());
+    }
+}
+
 Colour Window::set_colour(Colour newColour) 
 {
     Colour old = _current;
@@ -75,22 +103,32 @@ Colour Window::set_colour(Colour newColour)
 }
 
 void Window::draw_char(size_t x, size_t y, char ch, size_t count) 
+{
+    draw_char(x, y, _current, ch, count);
+}
+
+void Window::draw_string(size_t x, size_t y, string_view str) 
+{
+    draw_string(x, y, _current, str);
+}
+
+void Window::draw_char(size_t x, size_t y, Colour c, char ch, size_t count) 
 {
     assert(y < _height);
     assert(x + count <= _width); // hopefully we made diagram wide enough
     for (size_t i = 0; i < count; ++i) 
     {
-        at(x + i, y) = Cell(_current, ch);
+        at(x + i, y) = Cell(c, ch);
     }
 }
 
-void Window::draw_string(size_t x, size_t y, string_view str) 
+void Window::draw_string(size_t x, size_t y, Colour c, string_view str) 
 {
     assert(y < _height);
     assert(x + str.size() <= _width); // hopefully we made diagram wide enough
     for (size_t i = 0; i < str.size(); ++i) 
     {
-        at(x + i, y) = Cell(_current, str[i]);
+        at(x + i, y) = Cell(c, str[i]);
     }
 }
 
@@ -105,26 +143,184 @@ bool Window::print(std::ostream& dest, bool useColour) const
         truncated = (width < _width);
         width = std::min(width, _width);
     }
+    print_rows(dest, 0, _height, width, useColour);
+    dest.flush();
+
+    return !truncated;
+}
 
-    for (size_t row = 0; row < _height; ++row) 
+/* Rows get built up in here and written out once it's at least this big, so
+ * that the stream is given a few large writes instead of lots of tiny ones. */
+constexpr size_t PRINT_BUFFER_SIZE = 1 << 16;
+
+/* The escape sequences that colour() puts before and after a string, for
+ * every possible Colour. Worked out once (by getting fmt to colour a marker
+ * character and splitting around it) so that printing a window doesn't have
+ * to build a text_style and a string for every single cell. */
+struct Escapes
+{
+    string before[256];
+    string after[256];
+
+    Escapes()
     {
-        for (size_t col = 0; col < width; ++col) 
+        for (size_t c = 0; c < 256; ++c)
+        {
+            string marked = fmt::format(to_text_style(Colour(c)), "{}", '\1');
+            size_t marker = marked.find('\1');
+            before[c] = marked.substr(0, marker);
+            after[c] = marked.substr(marker + 1);
+        }
+    }
+};
+
+static const Escapes& get_escapes()
+{
+    static const Escapes escapes; // thread-safe since C++11
+    return escapes;
+}
+
+void Window::print_rows(std::ostream& dest, 
+                        size_t from, 
+                        size_t to, 
+                        size_t width,
+                        bool useColour) const
+{
+    assert(from <= to && to <= _height && width <= _width);
+    useColour = useColour && gColourEnabled;
+    const Escapes& escapes = get_escapes();
+    string buffer;
+    buffer.reserve(PRINT_BUFFER_SIZE + 2 * width);
+    for (size_t row = from; row < to; ++row) 
+    {
+        const Cell* cells = &_buf[row * _width];
+
+        // Trailing blanks can't be seen (whatever colour they are), so they
+        // don't need printing.
+        size_t end = width;
+        while (end > 0 && cells[end - 1].ch == ' ')
+        {
+            --end;
+        }
+
+        size_t x = 0;
+        while (x < end)
         {
-            Cell cell = get_cell(col, row);
-            if (useColour)
+            if (!useColour || cells[x].ch == ' ')
+            {
+                buffer += cells[x++].ch;
+                continue;
+            }
+
+            // Blanks don't care what colour they are either, so a run of one
+            // colour carries on through them. It's cut back to the last
+            // non-blank though, so that blanks between runs aren't coloured.
+            Colour c = cells[x].colour;
+            size_t runEnd = x + 1;
+            while (runEnd < end && (cells[runEnd].colour == c 
+                || cells[runEnd].ch == ' '))
             {
-                dest << colour(cell.colour, string_view(&cell.ch, 1));
+                ++runEnd;
             }
-            else
+            while (cells[runEnd - 1].ch == ' ')
             {
-                dest << cell.ch;
+                --runEnd;
             }
+            buffer += escapes.before[uint8_t(c)];
+            for (; x < runEnd; ++x)
+            {
+                buffer += cells[x].ch;
+            }
+            buffer += escapes.after[uint8_t(c)];
+        }
+        buffer += '\n';
+
+        if (buffer.size() >= PRINT_BUFFER_SIZE)
+        {
+            dest.write(buffer.data(), buffer.size());
+            buffer.clear();
         }
-        dest << '\n';
     }
-    dest.flush();
+    dest.write(buffer.data(), buffer.size());
+}
 
-    return !truncated;
+size_t LivePrinter::print(const Window& window)
+{
+    size_t width = window.width(), height = 0;
+    bool terminal = get_terminal_size(width, height);
+    width = std::min(width, window.width());
+
+    // Keeps a copy of what we're about to print, for next time
+    auto remember = [&] {
+        _cells.resize(width * window.height());
+        for (size_t y = 0; y < window.height(); ++y)
+        {
+            std::copy_n(window.row(y), width, &_cells[y * width]);
+        }
+        _width = width;
+        _height = window.height();
+    };
+
+    // We can only get back up to the last version if it's all on the screen
+    // (we need a line for the cursor to sit on below it too).
+    if (!terminal || _height == 0 || _height >= height)
+    {
+        window.print_rows(_dest, 0, window.height(), width, _colour);
+        _dest.flush();
+        remember();
+        return window.height();
+    }
+
+    // The cursor starts off on the line below the last version. Go down the
+    // rows, moving up or down to each one that has changed and writing over
+    // it. Every row that we might move down to already exists on the screen
+    // (since the rows past the end of the last version all count as changed
+    // and get written in order), so the cursor never goes off the bottom.
+    size_t cursor = _height;
+    size_t written = 0;
+    string moves;
+    for (size_t y = 0; y < window.height(); ++y)
+    {
+        if (y < _height && width == _width && memcmp(window.row(y),
+            &_cells[y * width], width * sizeof(Window::Cell)) == 0)
+        {
+            continue;
+        }
+        if (y < cursor)
+        {
+            moves = fmt::format("\x1b[{}A\r", cursor - y); // up
+        }
+        else if (y > cursor)
+        {
+            moves = fmt::format("\x1b[{}B\r", y - cursor); // down
+        }
+        else
+        {
+            moves = "\r";
+        }
+        _dest << moves << "\x1b[2K"; // and clear the line out
+        window.print_rows(_dest, y, y + 1, width, _colour);
+        cursor = y + 1;
+        ++written;
+    }
+
+    // Get rid of anything from the last version that's past the end of this
+    // one, and then leave the cursor below this version.
+    if (cursor < window.height())
+    {
+        _dest << fmt::format("\x1b[{}B\r", window.height() - cursor);
+    }
+    else if (cursor > window.height())
+    {
+        _dest << fmt::format("\x1b[{}A\r", cursor - window.height());
+    }
+    if (_height > window.height())
+    {
+        _dest << "\x1b[J";
+    }
+    _dest.flush();
+    remember();
+    return written;
 }
 
 bool get_terminal_size(size_t& width, size_t& height)
@@ -10,6 +10,8 @@
 #include <string>
 #include <iostream>
 #include <memory>
+#include <vector>
+#include <cstdint>
 #include <fmt/color.h>
 #include <curses.h>
 
@@ -26,6 +28,7 @@ enum class Colour : uint8_t
     GREY    = 1,
     YELLOW  = 2,
     BLUE    = 3,
+    CYAN    = 4,
     GREEN   = 5,
     RED     = 6,
     MAGENTA = 7,
@@ -91,15 +94,68 @@ public:
     Colour reset_colour() { return set_colour(_default); }
     void draw_char(size_t x, size_t y, char ch, size_t count = 1);
     void draw_string(size_t x, size_t y, std::string_view str);
+
+    /* Same as above, but in colour `c` instead of the current colour. These
+     * don't touch any state besides the cells that they draw on, so several
+     * threads can draw on different parts of the same window at once. */
+    void draw_char(size_t x, size_t y, Colour c, char ch, size_t count = 1);
+    void draw_string(size_t x, size_t y, Colour c, std::string_view str);
     Cell get_cell(size_t x, size_t y) const { return _buf[y * _width + x]; }
     size_t width() const { return _width; }
     size_t height() const { return _height; }
 
+    /* Changes the size of the window, keeping whatever was drawn in the part
+     * that's still inside it. Any new space is left blank. */
+    void resize(size_t width, size_t height);
+
+    /* Blanks out every row from y downwards. */
+    void clear_rows(size_t y);
+
+    /* Returns the cells of row y (there are width() of them). */
+    const Cell* row(size_t y) const { return &_buf[y * _width]; }
+
     /* Prints this window to dest. If colour==true, then this will use ANSI 
      * escape sequences to achieve the desired colours. Before printing, the 
      * function will query the current width of the window and truncate the 
      * output to fit within it. Returns false if had to be truncated. */
     bool print(std::ostream& dest, bool colour = true) const;
+
+    /* Prints the first `width` columns of the rows from `from` up to `to`
+     * (exclusive) to dest, without looking at the terminal or flushing. Blanks
+     * at the end of a row are left off, and a run of cells of the same colour
+     * only gets one set of escape sequences. */
+    void print_rows(std::ostream& dest, size_t from, size_t to, size_t width,
+                    bool colour = true) const;
+};
+
+/* Prints a window to a terminal over and over as it changes (e.g., as a
+ * diagram grows), drawing each new version over the top of the last one. It
+ * keeps a copy of the rows that it printed last time, and only rewrites the
+ * rows that are different now, by moving the cursor back up to them with
+ * ANSI escape sequences. That only works if the last version is still all on
+ * the screen and nothing else got printed after it, so otherwise (or if
+ * stdout isn't a terminal), the new version just gets printed out in full
+ * underneath. */
+class LivePrinter
+{
+private:
+    std::ostream& _dest;
+    bool _colour;
+    size_t _width; // how many columns of each row were printed last time
+    size_t _height; // how many rows were printed last time
+    std::vector<Window::Cell> _cells; // those rows (_width cells in each)
+
+public:
+    LivePrinter(std::ostream& dest, bool colour = true) 
+        : _dest(dest), _colour(colour), _width(0), _height(0) { }
+
+    /* Prints the window (truncated to the width of the terminal), leaving the
+     * cursor on the line below it. Returns the number of rows written. */
+    size_t print(const Window& window);
+
+    /* Forgets about what was printed last time, so that the next version gets
+     * printed out in full (call this if something else has been printed). */
+    void reset() { _height = 0; }
 };
 
 /* Queries the size of the terminal (specifically, this function will query
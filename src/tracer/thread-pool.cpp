@@ -0,0 +1,139 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  thread-pool
+ *
+ *      The jobs that we give this are few and chunky (a whole diagram, or a
+ *      band of a few hundred lines), so handing out the indices under a plain
+ *      old mutex is plenty fast enough.
+ */
+#include <cassert>
+#include <algorithm>
+#include <utility>
+
+#include "thread-pool.hpp"
+
+using std::unique_lock;
+using std::mutex;
+
+/* Set on the threads that are currently in the middle of running a job, so
+ * that a job which calls run() itself doesn't wait on its own pool. */
+static thread_local bool t_inJob = false;
+
+ThreadPool::ThreadPool(size_t threads) : _job(nullptr), _next(0), _count(0),
+    _remaining(0), _quit(false)
+{
+    resize(threads);
+}
+
+void ThreadPool::resize(size_t threads)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (threads == size())
+    {
+        return;
+    }
+    stop();
+    _quit = false;
+    for (size_t i = 1; i < threads; ++i)
+    {
+        _workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+/* Tells the workers to finish up and waits for them. */
+void ThreadPool::stop()
+{
+    {
+        unique_lock<mutex> lock(_lock);
+        assert(_remaining == 0);
+        _quit = true;
+    }
+    _wake.notify_all();
+    for (std::thread& worker : _workers)
+    {
+        worker.join();
+    }
+    _workers.clear();
+}
+
+/* Takes the next index of the current job and runs it. The lock must be held
+ * (and there must be an index left) when this is called, and it'll be held
+ * again by the time that this returns. */
+void ThreadPool::do_index(unique_lock<mutex>& lock)
+{
+    assert(_next < _count);
+    size_t i = _next++;
+    const std::function<void(size_t)>& job = *_job;
+    lock.unlock();
+    std::exception_ptr error;
+    t_inJob = true;
+    try
+    {
+        job(i);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    t_inJob = false;
+    lock.lock();
+    if (error && !_error)
+    {
+        _error = error;
+    }
+    if (--_remaining == 0)
+    {
+        _done.notify_all();
+    }
+}
+
+/* The main loop of each worker thread. */
+void ThreadPool::work()
+{
+    unique_lock<mutex> lock(_lock);
+    while (true)
+    {
+        _wake.wait(lock, [this] { return _quit || _next < _count; });
+        if (_quit)
+        {
+            return;
+        }
+        do_index(lock);
+    }
+}
+
+void ThreadPool::run(size_t count, const std::function<void(size_t)>& job)
+{
+    if (t_inJob || _workers.empty() || count <= 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            job(i);
+        }
+        return;
+    }
+
+    unique_lock<mutex> lock(_lock);
+    assert(_remaining == 0);
+    _job = &job;
+    _next = 0;
+    _count = count;
+    _remaining = count;
+    _error = nullptr;
+    _wake.notify_all();
+    while (_next < _count)
+    {
+        do_index(lock);
+    }
+    _done.wait(lock, [this] { return _remaining == 0; });
+    _job = nullptr;
+    _count = 0;
+    _next = 0;
+    if (_error)
+    {
+        std::rethrow_exception(std::exchange(_error, nullptr));
+    }
+}
@@ -0,0 +1,64 @@
+/*  Copyright (C) 2020  Henry Harvey --- See LICENSE file
+ *
+ *  thread-pool
+ *
+ *      A handful of worker threads for splitting up big chunks of work, like
+ *      laying out lots of diagrams at once or rendering a really tall one.
+ */
+#ifndef FORKTRACE_THREAD_POOL_HPP
+#define FORKTRACE_THREAD_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+/* Runs a job (a function taking an index) for every index in a range, spread
+ * out over the threads in the pool. There's only ever one job on the go, and
+ * the thread that hands it over helps out and then waits for it to finish,
+ * so from the outside it looks just like a plain old for loop. */
+class ThreadPool
+{
+private:
+    std::vector<std::thread> _workers;
+    std::mutex _lock; // protects everything below
+    std::condition_variable _wake; // workers wait on this for a job
+    std::condition_variable _done; // run() waits on this for the job to end
+    const std::function<void(size_t)>* _job;
+    size_t _next; // the next index of the job that nobody has taken yet
+    size_t _count; // one past the last index of the job
+    size_t _remaining; // indices that haven't finished yet
+    std::exception_ptr _error; // the first exception thrown by the job
+    bool _quit;
+
+    /* Private functions, see source file */
+    void work();
+    void do_index(std::unique_lock<std::mutex>& lock);
+    void stop();
+
+public:
+    /* Makes a pool with `threads` threads in it (counting the one that calls
+     * run()). 0 means one per core. */
+    ThreadPool(size_t threads = 0);
+    ~ThreadPool() { stop(); }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+
+    /* Changes the number of threads (same meaning as for the constructor).
+     * Mustn't be called while a job is running. */
+    void resize(size_t threads);
+
+    /* The number of threads that work on a job (counting the caller's). */
+    size_t size() const { return _workers.size() + 1; }
+
+    /* Calls job(i) for each i from 0 up to count (in no particular order)
+     * and returns once they've all finished. If any of them threw, then the
+     * first exception gets rethrown here (after everything has finished). If
+     * called from inside a job, it just loops through them on this thread. */
+    void run(size_t count, const std::function<void(size_t)>& job);
+};
+
+#endif /* FORKTRACE_THREAD_POOL_HPP */
@@ -5,6 +5,7 @@
 #include <cstring>
 #include <fmt/core.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 #include "tracer.hpp"
 #include "process.hpp"
@@ -229,6 +230,7 @@ bool WaitCall<Result, ZeroTheResult, ResultArgIndex>
             }
             _oldData.reset();
             _result = nullptr;
+            tracee.process->notify_waiting(_waitedId, _nohang);
             return true;
         }
         // Now change the syscall argument to point to this block of memory.
@@ -573,14 +575,15 @@ void Tracer::handle_kill(Tracee& tracee,
     // we won't use the wait_for_stop helper function here, since we need a bit
     // more manual control to handle the case where the tracee SIGKILLs itself.
     int status;
-    if (waitpid(tracee.pid, &status, 0) == -1) 
+    struct rusage usage;
+    if (wait4(tracee.pid, &status, 0, &usage) == -1) 
     {
         if (errno == ECHILD)
         {
             throw BadTraceError(tracee.pid, "Waited for tracee "
                 "(after it called kill et al), but it doesn't exist.");
         }
-        throw SystemError(errno, "waitpid");
+        throw SystemError(errno, "wait4");
     }
     if (!WIFSTOPPED(status)) 
     {
@@ -602,7 +605,7 @@ void Tracer::handle_kill(Tracee& tracee,
             // of no use here, since it can't track SIGKILL'ed processes. TODO
             on_sent_signal(tracee, target, signal, toThread);
         }
-        handle_wait_notification(tracee, status);
+        handle_wait_notification(tracee, status, usage);
         assert(tracee.state == Tracee::DEAD);
         return;
     }
@@ -829,15 +832,42 @@ void Tracer::handle_stopped(Tracee& tracee, int status)
     }
 }
 
-void Tracer::handle_wait_notification(Tracee& tracee, int status)
+/* Converts the rusage from wait4 into our own (smaller) representation. */
+static ResourceUsage to_resource_usage(const struct rusage& usage)
+{
+    auto nanoseconds = [](const struct timeval& tv) {
+        return Timestamp(tv.tv_sec) * 1000000000 
+            + Timestamp(tv.tv_usec) * 1000;
+    };
+    ResourceUsage result;
+    result.userTime = nanoseconds(usage.ru_utime);
+    result.systemTime = nanoseconds(usage.ru_stime);
+    result.maxRss = usage.ru_maxrss;
+    result.voluntarySwitches = usage.ru_nvcsw;
+    result.involuntarySwitches = usage.ru_nivcsw;
+    result.blocksIn = usage.ru_inblock;
+    result.blocksOut = usage.ru_oublock;
+    return result;
+}
+
+/* `usage` is whatever wait4 gave back with the status. It only means anything
+ * if the status says that the tracee ended. The kernel fills it in for ptrace
+ * exit notifications too, so we get it for every tracee (not just leaders),
+ * and there's no need to ask the reaper about the usage of orphans. */
+void Tracer::handle_wait_notification(Tracee& tracee, 
+                                      int status, 
+                                      const struct rusage& usage)
 {
     if (tracee.state == Tracee::DEAD)
     {
         throw diagnose_bad_event(tracee, status, "Got event for dead tracee.");
     }
+    // Any events that result from handling this notification will be stamped
+    // with this time (including events for children that we fork).
+    tracee.process->update_time(get_monotonic_time());
     if (WIFEXITED(status) || WIFSIGNALED(status))
     {
-        tracee.process->notify_ended(status);
+        tracee.process->notify_ended(status, to_resource_usage(usage));
         if (_leaders.find(tracee.pid) != _leaders.end())
         {
             log("leader {} ended", tracee.pid);
@@ -872,21 +902,22 @@ void Tracer::handle_wait_notification(Tracee& tracee, int status)
 
 bool Tracer::wait_for_stop(Tracee& tracee, int& status)
 {
-    if (waitpid(tracee.pid, &status, 0) == -1) 
+    struct rusage usage;
+    if (wait4(tracee.pid, &status, 0, &usage) == -1) 
     {
         if (errno == ECHILD)
         {
             throw BadTraceError(tracee.pid, 
                 "Waited for tracee to stop but it doesn't exist.");
         }
-        throw SystemError(errno, "waitpid");
+        throw SystemError(errno, "wait4");
     }
     if (WIFSTOPPED(status)) 
     {
         tracee.state = Tracee::STOPPED;
         return true;
     }
-    handle_wait_notification(tracee, status);
+    handle_wait_notification(tracee, status, usage);
     return false;
 }
 
@@ -912,7 +943,7 @@ bool Tracer::resume(Tracee& tracee)
 }
 
 
-/* Calls waitpid on the tracee and makes sure that it's either exited or been
+/* Calls wait4 on the tracee and makes sure that it's either exited or been
  * killed, then handles the exit/kill event with handle_wait_notification. 
  * If the tracee hasn't ended, then a BadTraceError is thrown. */
 void Tracer::expect_ended(Tracee& tracee)
@@ -922,14 +953,15 @@ void Tracer::expect_ended(Tracee& tracee)
     // depends on me know the precise behaviour of Linux and sometimes the only
     // solution is to either test it or read the source code.
     int status;
-    if (waitpid(tracee.pid, &status, 0) == -1)
+    struct rusage usage;
+    if (wait4(tracee.pid, &status, 0, &usage) == -1)
     {
         if (errno == ECHILD)
         {
             throw BadTraceError(tracee.pid, 
                 "Expected tracee to have ended but it doesn't exist.");
         }
-        throw SystemError(errno, "waitpid");
+        throw SystemError(errno, "wait4");
     }
     if (!WIFEXITED(status) && !WIFSIGNALED(status))
     {
@@ -938,7 +970,7 @@ void Tracer::expect_ended(Tracee& tracee)
     }
 
     // this will handle the event for us and set tracee's state to DEAD
-    handle_wait_notification(tracee, status);
+    handle_wait_notification(tracee, status, usage);
 }
 
 /******************************************************************************
@@ -1000,11 +1032,12 @@ shared_ptr<Process> Tracer::start(string_view program, vector<string> argv)
             throw std::runtime_error("Tracee failed to exec.");
         }
         int status;
-        if (waitpid(pid, &status, 0) == -1)
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) == -1)
         {
-            throw SystemError(errno, "waitpid");
+            throw SystemError(errno, "wait4");
         }
-        handle_wait_notification(it->second, status);
+        handle_wait_notification(it->second, status, usage);
     }
 
     return process;
@@ -1034,6 +1067,25 @@ bool Tracer::are_tracees_running() const
     return false;
 }
 
+/* Returns true if some tracees are stopped and all of the running tracees are
+ * blocked inside of a wait call. Those waits might never return unless we go
+ * and resume the stopped tracees (e.g., a parent waiting on a child that has
+ * stopped because it's waiting on a grandchild that just exited). */
+bool Tracer::are_only_waiters_running() const
+{
+    bool stopped = false;
+    for (auto& pair : _tracees)
+    {
+        const Tracee& tracee = pair.second;
+        if (tracee.state == Tracee::RUNNING && !tracee.blockingCall)
+        {
+            return false;
+        }
+        stopped |= tracee.state == Tracee::STOPPED;
+    }
+    return stopped;
+}
+
 Tracee& Tracer::add_tracee(pid_t pid, shared_ptr<Process> process)
 {
     auto old = _tracees.find(pid);
@@ -1073,8 +1125,9 @@ bool Tracer::step()
     if (are_tracees_running())
     {
         int status;
+        struct rusage usage;
         pid_t pid;
-        while ((pid = wait(&status)) != -1) 
+        while ((pid = wait4(-1, &status, 0, &usage)) != -1) 
         {
             std::scoped_lock<std::mutex> guard(_lock);
 
@@ -1086,14 +1139,14 @@ bool Tracer::step()
                 continue;
             }
 
-            handle_wait_notification(it->second, status);
+            handle_wait_notification(it->second, status, usage);
             collect_orphans();
 
             if (all_tracees_dead())
             {
                 break;
             }
-            if (!are_tracees_running())
+            if (!are_tracees_running() || are_only_waiters_running())
             {
                 return true;
             }
@@ -1134,15 +1187,41 @@ void Tracer::nuke()
     //assert(_recycledPIDs.empty()); // TODO ??
 }
 
-void Tracer::print_list() const 
+void Tracer::print_list(std::ostream& os) const 
 {
     std::scoped_lock<std::mutex> guard(_lock);
     for (auto& [pid, tracee] : _tracees) 
     {
-        std::cerr << format("{} {} {}\n", 
+        os << format("{} {} {}\n", 
             pid, tracee.process->state(), tracee.process->command_line());
     }
-    std::cerr << "total: " << _tracees.size() << '\n';
+    os << "total: " << _tracees.size() << '\n';
+}
+
+vector<shared_ptr<Process>> Tracer::live_processes() const
+{
+    std::scoped_lock<std::mutex> guard(_lock);
+    vector<shared_ptr<Process>> result;
+    for (auto& [pid, tracee] : _tracees)
+    {
+        if (tracee.state != Tracee::DEAD)
+        {
+            result.push_back(tracee.process);
+        }
+    }
+    return result;
+}
+
+vector<shared_ptr<Process>> Tracer::processes() const
+{
+    std::scoped_lock<std::mutex> guard(_lock);
+    vector<shared_ptr<Process>> result;
+    result.reserve(_tracees.size());
+    for (auto& [pid, tracee] : _tracees)
+    {
+        result.push_back(tracee.process);
+    }
+    return result;
 }
 
 bool Tracer::tracees_alive() const
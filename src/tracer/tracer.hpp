@@ -13,11 +13,13 @@
 #include <mutex>
 #include <queue>
 #include <functional>
+#include <iostream>
 
 class Process; // defined in process.hpp
 struct Tracee;
 class Tracer;
 class BlockingCall; // defined in tracer.cpp
+struct rusage; // defined in <sys/resource.h>
 
 /* The tracer will raise this exception when an event appears to occur out-of-
  * order or at a strange time. If this exception is raised, the tracer will
@@ -121,11 +123,12 @@ private:
     /* Private functions, see source file */
     void collect_orphans();
     bool are_tracees_running() const;
+    bool are_only_waiters_running() const;
     bool all_tracees_dead() const;
     bool resume(Tracee&);
     bool wait_for_stop(Tracee&, int&);
     void handle_wait_notification(pid_t, int);
-    void handle_wait_notification(Tracee&, int);
+    void handle_wait_notification(Tracee&, int, const struct rusage&);
     void handle_syscall_entry(Tracee&, int, size_t[]);
     void handle_syscall_exit(Tracee&);
     void handle_fork(Tracee&);
@@ -175,12 +178,30 @@ public:
     /* Will forcibly kill everything. Safe to call from separate thread. */
     void nuke();
 
-    /* Prints a list of all the active processes to std::cerr. */
-    void print_list() const;
+    /* Prints out a list of all the active processes. */
+    void print_list(std::ostream& os) const;
 
     /* Return true if any tracees are still alive (zombies aren't counted). */
     bool tracees_alive() const;
 
+    /* Returns the processes of all the tracees that haven't died yet. Safe to
+     * call from a separate thread (the sampler uses this). */
+    std::vector<std::shared_ptr<Process>> live_processes() const;
+
+    /* Same as above, but includes the tracees that are dead (i.e., the ones
+     * that print_list would show). */
+    std::vector<std::shared_ptr<Process>> processes() const;
+
+    /* Stops the process trees from being changed by the tracer until the lock
+     * that this returns is let go of, so that another thread can look at the
+     * trees while step() is running (step() only touches them while holding
+     * our lock, and waits on the tracees without it). Don't call any of our
+     * other functions while holding it, or you'll deadlock. */
+    std::unique_lock<std::mutex> freeze() const
+    {
+        return std::unique_lock<std::mutex>(_lock);
+    }
+
     /* Return true if any tracees still exist (zombies are counted). */
     bool tracees_exist() const { return !_tracees.empty(); }
 };
@@ -213,3 +213,61 @@ string escaped_string(string_view str)
     str2 += '"';
     return str2;
 }
+
+string json_string(string_view str)
+{
+    string result;
+    result.reserve(str.size() + 2);
+    result += '"';
+    for (char c : str)
+    {
+        switch (c)
+        {
+            case '"':   result += "\\\""; continue;
+            case '\\':  result += "\\\\"; continue;
+            case '\n':  result += "\\n";  continue;
+            case '\r':  result += "\\r";  continue;
+            case '\t':  result += "\\t";  continue;
+        }
+        if (iscntrl((unsigned char)c))
+        {
+            result += fmt::format("\\u{:04x}", (unsigned char)c);
+        }
+        else
+        {
+            result += c;
+        }
+    }
+    result += '"';
+    return result;
+}
+
+string format_duration(uint64_t ns)
+{
+    if (ns < 1000)
+    {
+        return fmt::format("{}ns", ns);
+    }
+    else if (ns < 1000000)
+    {
+        return fmt::format("{:.1f}us", ns / 1e3);
+    }
+    else if (ns < 1000000000)
+    {
+        return fmt::format("{:.2f}ms", ns / 1e6);
+    }
+    return fmt::format("{:.3f}s", ns / 1e9);
+}
+
+string format_kilobytes(uint64_t kb)
+{
+    if (kb < 1024)
+    {
+        return fmt::format("{}K", kb);
+    }
+    else if (kb < 1024 * 1024)
+    {
+        return fmt::format("{:.1f}M", kb / 1024.0);
+    }
+    return fmt::format("{:.2f}G", kb / (1024.0 * 1024.0));
+}
@@ -10,6 +10,7 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
@@ -58,4 +59,15 @@ std::string_view get_base_name(std::string_view path);
  * into "\\n"). Otherwise, an unchanged string is returned. */
 std::string escaped_string(std::string_view str);
 
+/* Returns `str` as a double-quoted JSON string, with everything escaped that
+ * needs to be (Graphviz's DOT language is happy with this too). */
+std::string json_string(std::string_view str);
+
+/* Formats a duration given in nanoseconds in a human-friendly unit, e.g.,
+ * "850ns", "12.3us", "4.56ms" or "1.234s". */
+std::string format_duration(uint64_t nanoseconds);
+
+/* Formats a size given in kilobytes, e.g., "812K", "45.2M" or "1.50G". */
+std::string format_kilobytes(uint64_t kilobytes);
+
 #endif /* FORKTRACE_UTIL_HPP */